@@ -0,0 +1,145 @@
+/**
+ * @file  boot.c
+ * @brief resident bootloader: picks the image slot to start from the boot records and jumps to it
+ *
+ * the newest valid boot record decides (see flash.h for the layout):
+ *
+ * TRIAL    a fresh image from the updater. it's marked TRYING and started once
+ * TRYING   it was started but never confirmed: it reset or hung before the application marked it GOOD. roll back to
+ *          the newest GOOD image and write that record again, so the rollback sticks
+ * GOOD     started as is
+ *
+ * every image is checked against its CRC before it's started. a unit without records (flashed with a debugger) starts
+ * slot A if its vectors look sane
+ *
+ * runs on the reset HSI16 clock without interrupts, and its stack stays well clear of the application's .noinit
+ * block, so the crash record survives the trip through here
+ */
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <stm32g0xx.h>
+#include <stm32g0xx_ll_bus.h>
+
+#include "flash.h"
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define RAM_START 0x20000000UL
+#define RAM_END   (RAM_START + (36 * 1024))
+
+//=====================================================================================================================
+// Static protos
+//=====================================================================================================================
+
+static bool factoryImage(EFlashSlot_t);
+static void startImage(EFlashSlot_t) __attribute__((noreturn));
+
+void NMI_Handler(void); // proto to placate the compiler
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+/**
+ * @brief entry point, called by Reset_Handler
+ *
+ */
+int main(void)
+{
+    SBootRecord_t newest;
+    SBootRecord_t good;
+
+    flashUnlock();
+
+    // a record torn by a power loss raises an ECC error when read: drop it before the application ever sees it
+    bool found = bootRecordNewest(&newest, false);
+
+    if (flashEccErrors() > 0)
+    {
+        (void)bootRecordCompact();
+        found = bootRecordNewest(&newest, false);
+    }
+
+    if (found && (newest.state == BOOT_STATE_TRIAL) && flashImageValid(&newest))
+    {
+        newest.state = BOOT_STATE_TRYING;
+        if (bootRecordAppend(&newest)) startImage((EFlashSlot_t)newest.slot);
+    }
+    else if (found && (newest.state == BOOT_STATE_GOOD) && flashImageValid(&newest))
+    {
+        startImage((EFlashSlot_t)newest.slot);
+    }
+
+    if (bootRecordNewest(&good, true) && flashImageValid(&good))
+    {
+        // the rolled back record becomes the newest one; a write error only means rolling back again next time
+        if (!found || (good.seq != newest.seq)) (void)bootRecordAppend(&good);
+        startImage((EFlashSlot_t)good.slot);
+    }
+
+    if (factoryImage(FLASH_SLOT_A)) startImage(FLASH_SLOT_A);
+    if (factoryImage(FLASH_SLOT_B)) startImage(FLASH_SLOT_B);
+
+    // nothing to start: wait for a debugger
+    flashLock();
+    while (true) {}
+}
+
+/**
+ * @brief acknowledge double ECC errors while reading flash, reset on anything else
+ *
+ */
+void NMI_Handler(void)
+{
+    if (!flashHandleEccNmi()) NVIC_SystemReset();
+}
+
+//=====================================================================================================================
+// Statics
+//=====================================================================================================================
+
+/**
+ * @brief check a slot without a record for plausible vectors: stack pointer in RAM, reset handler in the slot
+ *
+ */
+static bool factoryImage(EFlashSlot_t slot)
+{
+    uint32_t        start    = flashSlotAddress(slot);
+    const uint32_t *pVectors = (const uint32_t *)start;
+
+    return (pVectors[0] > RAM_START) && (pVectors[0] <= RAM_END) && (pVectors[1] >= start) &&
+           (pVectors[1] < (start + FLASH_SLOT_BYTES));
+}
+
+/**
+ * @brief hand over to an image: the peripherals go back the way reset left them, the vector table and the stack
+ * pointer are the image's own
+ *
+ */
+static void startImage(EFlashSlot_t slot)
+{
+    uint32_t        start    = flashSlotAddress(slot);
+    const uint32_t *pVectors = (const uint32_t *)start;
+    void (*reset)(void)      = (void (*)(void))pVectors[1];
+
+    flashLock();
+    LL_AHB1_GRP1_DisableClock(LL_AHB1_GRP1_PERIPH_CRC);
+
+    // SystemInit() leaves VTOR alone, the image relies on it being set here
+    SCB->VTOR = start;
+    __DSB();
+    __ISB();
+    __set_MSP(pVectors[0]);
+
+    reset();
+
+    while (true) {}
+}
@@ -0,0 +1,69 @@
+/**
+ * @file  batch.h
+ * @brief batch printing: a queue of prints for editioning, one footswitch press per sheet
+ *
+ *        a batch is a list of programs, each with a number of copies. while it runs the next print is kept armed on
+ *        the start inputs, and the exposure task advances the batch as soon as a print has finished, so the next
+ *        press fires the next sheet straight away. the print counter and the print time are shown as two widgets
+ *        that only redraw when their text changes
+ */
+
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "program.h"
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+/** @brief one program of the batch */
+typedef struct
+{
+    const SExposureProgram_t *pProgram; //< must stay valid while the batch is queued
+    uint16_t                  copies;
+} SBatchEntry_t;
+
+/** @brief batch progress */
+typedef struct
+{
+    bool     active;
+    uint16_t printed; //< completed prints, aborted ones are repeated and not counted
+    uint16_t total;
+    uint32_t printMs; //< nominal lamp time of the next print
+} SBatchStatus_t;
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define BATCH_MAX_ENTRIES 8
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+void initBatch(void);
+void batchPoll(void);
+bool batchAdd(const SExposureProgram_t *, uint16_t);
+void batchClear(void);
+bool batchStart(uint32_t);
+void batchStop(void);
+void batchGetStatus(SBatchStatus_t *);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //!_BATCH_H_
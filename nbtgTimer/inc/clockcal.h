@@ -0,0 +1,71 @@
+/**
+ * @file  clockcal.h
+ * @brief HSI calibration against the LSE crystal or the mains frequency
+ *
+ *        the HSI (and with it every timer) drifts with temperature. the calibration measures it against the best
+ *        available reference, steps HSITRIM when the error is larger than a trim step and corrects lamp durations for
+ *        the remainder
+ */
+
+#ifndef _CLOCKCAL_H_
+#define _CLOCKCAL_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+typedef enum
+{
+    CLOCKCAL_REF_NONE,
+    CLOCKCAL_REF_LSE,
+    CLOCKCAL_REF_MAINS,
+} EClockCalRef_t;
+
+/** @brief calibration statistics, reported on the console */
+typedef struct
+{
+    EClockCalRef_t reference;     //< reference of the last measurement
+    uint32_t       samples;       //< measurements since boot or the last reset
+    int32_t        lastPpm;       //< last measured HSI error, positive is fast
+    int32_t        minPpm;
+    int32_t        maxPpm;
+    int32_t        meanPpm;
+    int32_t        correctionPpm; //< correction currently applied to lamp durations
+    uint8_t        trim;          //< current HSITRIM
+    uint8_t        factoryTrim;   //< HSITRIM at boot
+} SClockCalStats_t;
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define CLOCKCAL_POLL_MS            1000   // clockCalPoll() period
+#define CLOCKCAL_TRIM_THRESHOLD_PPM 2000   // errors above this are trimmed out, the rest is corrected in software
+#define CLOCKCAL_MAX_ERROR_PPM      30000  // measurements beyond the HSI spec are treated as a bad reference
+#define CLOCKCAL_MAINS_HALF_CYCLES  6000   // mains window: 60s at 50Hz, averages out short-term grid deviation
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+void     initClockCal(void);
+void     clockCalPoll(void);
+uint32_t clockCalCorrectMs(uint32_t);
+void     clockCalGetStats(SClockCalStats_t *);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //!_CLOCKCAL_H_
@@ -0,0 +1,76 @@
+/**
+ * @file  console.h
+ * @brief line-based service console on the debug USART
+ *
+ *        modules register their commands at init; the console task reads a line, splits it on spaces and hands the
+ *        arguments to the matching handler. handlers run in the console task and print with the helpers below
+ */
+
+#ifndef _CONSOLE_H_
+#define _CONSOLE_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+typedef void (*fnConsoleCommand)(int argc, char *argv[]);
+typedef void (*fnConsoleLineHook)(const char *pLine, void *userCtx);
+
+/** @brief console command, must stay valid after registration */
+typedef struct
+{
+    const char      *pName;
+    const char      *pHelp;     //< one-line usage shown by "help"
+    fnConsoleCommand fnHandler; //< argv[0] is the command name
+} SConsoleCommand_t;
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define CONSOLE_MAX_COMMANDS 16
+#define CONSOLE_LINE_LENGTH  64
+#define CONSOLE_MAX_ARGS     6
+#define CONSOLE_FRAME_SIZE   64 // block size of g_consoleFramePool: a binary frame including its checksum
+
+//=====================================================================================================================
+// Globals
+//=====================================================================================================================
+
+/** @brief buffers for binary frames sent with consoleWrite(). take one per frame and free it once it's written */
+POOL_DECLARE(g_consoleFramePool);
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+void initConsole(void);
+bool consoleRegisterCommand(const SConsoleCommand_t *);
+void consoleSetLineHook(fnConsoleLineHook, void *);
+bool consoleInject(const char *);
+
+void consolePuts(const char *);
+void consolePutDec(int32_t);
+void consolePutHex(uint32_t, uint8_t);
+void consoleWrite(const uint8_t *, size_t);
+bool consoleParseInt(const char *, int32_t *);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //!_CONSOLE_H_
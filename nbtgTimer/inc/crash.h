@@ -0,0 +1,83 @@
+/**
+ * @file  crash.h
+ * @brief post-mortem crash capture and event trace
+ *
+ *        faults, failed asserts and stack overflows are recorded in no-init RAM together with the last events from an
+ *        always-on trace ring. the record survives the reset that follows, is moved to EEPROM at the next boot and can
+ *        be dumped on the console ("crash") for scripts/crash_decode.py
+ */
+
+#ifndef _CRASH_H_
+#define _CRASH_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "faults.h"
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+typedef enum
+{
+    CRASH_CAUSE_NONE,
+    CRASH_CAUSE_HARDFAULT,
+    CRASH_CAUSE_ASSERT,
+    CRASH_CAUSE_STACK_OVERFLOW,
+    CRASH_CAUSE_WATCHDOG,       //< watchdog reset without a capture: only the trace ring is known
+} ECrashCause_t;
+
+/** @brief trace events. scripts/crash_decode.py has the same list */
+typedef enum
+{
+    TRACE_BOOT,           //< arg: RCC_CSR reset flags >> 24
+    TRACE_CLOCK_LEVEL,    //< arg: new SYSCLK in MHz
+    TRACE_EXPOSURE_START, //< arg: request mode
+    TRACE_EXPOSURE_END,
+    TRACE_EXPOSURE_ABORT,
+    TRACE_MAINS_LOST,
+    TRACE_CLOCK_CAL,      //< arg: measured HSI error in ppm, int16
+} ETraceEvent_t;
+
+/** @brief trace ring entry */
+typedef struct __attribute__((packed))
+{
+    uint32_t tick;  //< RTOS tick count, ms
+    uint8_t  event; //< ETraceEvent_t
+    uint8_t  ipsr;  //< exception number the event was traced from, 0 for task context
+    uint16_t arg;
+} STraceEntry_t;
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define CRASH_TRACE_EVENTS 32     // trace ring size, power of two
+#define CRASH_NAME_LEN     12     // task and file names are truncated to this
+#define CRASH_EEPROM_ADDR  0x0100 // page-aligned, after the session snapshot
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+void initCrash(void);
+void crashTrace(ETraceEvent_t, uint16_t);
+
+void crashCaptureFault(const sContextStateFrame *, uint32_t);
+void crashCaptureAssert(const char *, uint32_t, uint32_t);
+void crashCaptureStackOverflow(const char *);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //!_CRASH_H_
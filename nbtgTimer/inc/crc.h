@@ -0,0 +1,30 @@
+/**
+ * @file  crc.h
+ * @brief CRC-16/CCITT-FALSE for records kept in EEPROM or no-init RAM
+ */
+
+#ifndef _CRC_H_
+#define _CRC_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include <stddef.h>
+#include <stdint.h>
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+uint16_t crc16(const uint8_t *, size_t);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //!_CRC_H_
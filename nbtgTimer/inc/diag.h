@@ -0,0 +1,67 @@
+/**
+ * @file  diag.h
+ * @brief run-time health: per-task CPU load, stack headroom and ISR load
+ *
+ *        sampled over fixed windows from the kernel's run-time stats. the last window is available to the firmware,
+ *        on the console ("diag"), on a hidden display screen and as a binary stream for logging on production units
+ */
+
+#ifndef _DIAG_H_
+#define _DIAG_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define DIAG_WINDOW_MS   1000 // sampling window, diagPoll() must run at least this often
+#define DIAG_MAX_TASKS   8
+#define DIAG_NAME_LEN    8    // task names are truncated to this
+
+#define DIAG_FRAME_SYNC0 0xD1 // binary stream frame: sync, sync, payload length, sequence, payload, CRC-16 LE
+#define DIAG_FRAME_SYNC1 0xA6
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+typedef struct
+{
+    char     name[DIAG_NAME_LEN];
+    uint8_t  number;         //< kernel task number, stable for the task's lifetime
+    uint16_t cpuPermille;    //< share of the window, includes the ISRs that interrupted the task
+    uint16_t stackFreeBytes; //< stack high-water mark: the least headroom seen since the task started
+} SDiagTask_t;
+
+/** @brief one sampling window */
+typedef struct
+{
+    uint32_t    windowUs;
+    uint16_t    isrPermille; //< share of the window spent in the BSP interrupt handlers
+    uint8_t     numTasks;
+    SDiagTask_t tasks[DIAG_MAX_TASKS];
+} SDiagSnapshot_t;
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+void initDiag(void);
+void diagPoll(void);
+bool diagGetSnapshot(SDiagSnapshot_t *);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //!_DIAG_H_
@@ -89,6 +89,12 @@ typedef enum
     COLOR_WHITE
 } EColor_t;
 
+typedef enum
+{
+    LAYER_SCENE,
+    LAYER_OVERLAY
+} EDisplayLayer_t;
+
 typedef struct
 {
     uint8_t x;
@@ -116,6 +122,11 @@ void initDisplay(EDisplayMode_t);
 void toggleDisplay(bool);
 void dispDrawPixel(SPixel_t);
 
+void dispSetLayer(EDisplayLayer_t);
+void dispShowOverlay(bool);
+void dispClearOverlay(void);
+void dispPopup(const char *, FontDef);
+
 void dispWriteSymbol(SymbolID_t Symbol, uint8_t x, uint8_t y);
 char dispWriteChar(char ch, FontDef Font, EColor_t color);
 char dispWriteString(const char *str, FontDef Font, EColor_t color);
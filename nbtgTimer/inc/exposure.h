@@ -0,0 +1,85 @@
+/**
+ * @file  exposure.h
+ * @brief exposure task: runs exposure programs and drives the enlarger lamp
+ */
+
+#ifndef _EXPOSURE_H_
+#define _EXPOSURE_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pool.h"
+#include "program.h"
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define EXPOSURE_BEEP_MS            150 // buzzer on-time for PROG_OP_BEEP_WAIT
+#define EXPOSURE_SAFELIGHT_LEAD_MS  100 // default safelight-off lead before each lamp-on edge
+#define EXPOSURE_INTEGRATE_LIMIT    4   // closed-loop exposures are cut off at this multiple of the nominal time
+#define EXPOSURE_SATURATION_LEVEL   0xFC0 // AWD threshold (top 12 bits of a sample) treated as a saturated probe
+#define EXPOSURE_TRIGGER_HOLDOFF_MS 50  // start input edges closer than this to the last one are contact bounce
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+/** @brief picks the program to arm after an armed run, see exposureSetArmAdvance() */
+typedef const SExposureProgram_t *(*fnArmAdvance)(const SExposureProgram_t *, bool, void *);
+
+//=====================================================================================================================
+// Globals
+//=====================================================================================================================
+
+/** @brief buffers for programs built at run time. a buffer accepted by exposureRunProgram() is freed by the task */
+POOL_DECLARE(g_progBufferPool);
+
+/** @brief a single lamp step of the base time, the program exposureArm() arms */
+extern const SExposureProgram_t g_baseStepProgram;
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+void initExposure(void);
+
+bool exposureArm(uint32_t);
+bool exposureArmProgram(const SExposureProgram_t *, uint32_t);
+void exposureSetArmAdvance(fnArmAdvance, void *);
+bool exposureRunProgram(const SExposureProgram_t *, uint32_t);
+bool exposureRunChannels(const uint32_t *, uint8_t);
+bool exposureRunIntegrated(uint32_t);
+bool exposureIntegratedResult(uint32_t *);
+void exposureAbort(void);
+bool exposureIsBusy(void);
+bool exposureIsArmed(void);
+
+bool exposureSetSafelightLead(uint32_t);
+bool exposureSetLampModel(uint16_t, uint16_t);
+void exposureSetPaperModel(SPaperModel_t const *);
+bool exposureSetLampDimming(uint32_t);
+
+void    exposureSetZeroCrossSync(bool);
+bool    exposureZeroCrossLocked(void);
+int32_t exposureQuantisationErrorUs(void);
+void    exposureTakeMainsPeriods(uint32_t *, uint32_t *);
+void    exposureSuspendMains(bool);
+
+void exposureOperatorContinue(void);
+void exposureOperatorContinueFromISR(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //!_EXPOSURE_H_
@@ -16,10 +16,27 @@ extern "C"
 // Includes
 //=====================================================================================================================
 
+#include <stdint.h>
+
 //=====================================================================================================================
 // Types
 //=====================================================================================================================
 
+/** @brief struct which corresponds to the order in which the Cortex core's register values are dumped onto the stack
+ *         in case of a fault. can be used to quickly evaluate the system context at the time of the fault
+ */
+typedef struct __attribute__((packed)) ContextStateFrame
+{
+    uint32_t r0;
+    uint32_t r1;
+    uint32_t r2;
+    uint32_t r3;
+    uint32_t r12;
+    uint32_t lr;
+    uint32_t return_address;
+    uint32_t xpsr;
+} sContextStateFrame;
+
 //=====================================================================================================================
 // Defines
 //=====================================================================================================================
@@ -20,6 +20,55 @@ typedef enum
     FSTOP_SIXTH
 } EFStop_t;
 
+#define LAMP_MODEL_POINTS    17   // on-time samples over 0..5 rise time constants
+#define LAMP_MODEL_MAX_TAU_MS 2000
+
+/**
+ * @brief lamp response model: first-order rise and fall. built once per enlarger from the calibrated time constants;
+ *        the table maps on-time to the nominal (ideal lamp) time it delivers
+ */
+typedef struct
+{
+    uint16_t riseMs;                        //< rise time constant, 0 disables compensation
+    uint16_t fallMs;                        //< fall time constant
+    uint16_t onMs[LAMP_MODEL_POINTS];       //< lamp on-time samples
+    uint16_t nominalMs[LAMP_MODEL_POINTS];  //< integrated light of each sample, in milliseconds of an ideal lamp
+} SLampModel_t;
+
+#define PAPER_GRADES         6    // filter grades 0..5
+#define PAPER_RECIP_POINTS   9    // reciprocity samples: the knee and 8 doublings beyond it
+#define PAPER_MAX_RECIP_CSTOPS 100 // reciprocity slope limit, 1 stop per doubling
+
+#define INTENSITY_FULL       65536 // lamp intensity scale, Q16 of full power
+#define INTENSITY_MAX_STOPS  6     // dimming limit: 1/64 of full power, LED drivers get non-linear further down
+
+#define STOP_Q16             65536 // one stop in the Q16 exponents of fstopExp2() and fstopLog2()
+
+/** @brief paper/developer characteristics as stored in a profile, integer units to keep the record small */
+typedef struct __attribute__((packed))
+{
+    uint16_t gradeBase10Ms[PAPER_GRADES]; //< base time per filter grade, in 10ms units
+    uint8_t  dryDownPermille;             //< exposure reduction for dry-down, 0.1% units
+    uint8_t  recipKneeS;                  //< reciprocity failure starts at this exposure time, 0 for none
+    uint8_t  recipCentiStops;             //< extra exposure per doubling of time beyond the knee, 0.01 stop units
+    int8_t   splitSoftSixths;             //< split-grade soft (grade 00) exposure relative to the base, 1/6 stops
+    int8_t   splitHardSixths;             //< split-grade hard (grade 5) exposure relative to the base, 1/6 stops
+} SPaperParams_t;
+
+/**
+ * @brief paper constants precomputed from SPaperParams_t, so applying them is a multiply or a table interpolation.
+ *        factors are Q10
+ */
+typedef struct
+{
+    uint32_t gradeBaseMs[PAPER_GRADES];
+    uint16_t dryDownQ10;
+    uint16_t splitSoftQ10;
+    uint16_t splitHardQ10;
+    uint32_t recipMs[PAPER_RECIP_POINTS];  //< exposure time samples, recipMs[0] is the knee, 0 for none
+    uint32_t recipQ10[PAPER_RECIP_POINTS]; //< time factor at each sample
+} SPaperModel_t;
+
 /**
  * @brief calculate single adjusted time
  * @param startTime start time in milliseconds
@@ -28,7 +77,110 @@ typedef enum
  * 
  * @return adjusted time, rounded to nearest 100ms interval
  */
-uint32_t calculateNextFStop(uint32_t startTime, bool reverse, EFStop_t resolution)
+uint32_t calculateNextFStop(uint32_t startTime, bool reverse, EFStop_t resolution);
+
+/**
+ * @brief apply a signed number of f-stop steps to a time
+ * @param baseTime start time in milliseconds
+ * @param steps number of steps to apply; negative values reduce the time
+ * @param resolution f-stop resolution
+ * 
+ * @return adjusted time, rounded to nearest 100ms interval
+ */
+uint32_t calculateFStopOffset(uint32_t baseTime, int8_t steps, EFStop_t resolution);
+
+/**
+ * @brief scale a value by a power of two. the firmware's only 2^x: metering, the paper model and the
+ *        dimming readout share it
+ * @param value value to scale
+ * @param stopsQ16 exponent in stops, Q16, may be negative
+ * 
+ * @return value * 2^stops, rounded, saturated at UINT32_MAX
+ */
+uint32_t fstopExp2(uint32_t value, int32_t stopsQ16);
+
+/**
+ * @brief log2, the inverse of fstopExp2()
+ * @param value input, must be > 0
+ * 
+ * @return log2(value) in stops, Q16. INT32_MIN for 0
+ */
+int32_t fstopLog2(uint32_t value);
+
+/**
+ * @brief build the lamp compensation table. the only place that evaluates the exponential model
+ * @param[out] pModel model to fill
+ * @param riseMs rise time constant in milliseconds, 0 disables compensation
+ * @param fallMs fall time constant in milliseconds
+ * 
+ * @return false if a time constant exceeds LAMP_MODEL_MAX_TAU_MS; pModel is then set to no compensation
+ */
+bool lampModelInit(SLampModel_t *pModel, uint16_t riseMs, uint16_t fallMs);
+
+/**
+ * @brief stretch (or shorten) a nominal time so the lamp integrates to the nominal amount of light
+ * @param pModel lamp model, NULL for none
+ * @param nominalMs time an ideal lamp would need, in milliseconds
+ * 
+ * @return on-time in milliseconds
+ */
+uint32_t lampModelCompensate(SLampModel_t const *pModel, uint32_t nominalMs);
+
+/**
+ * @brief precompute the paper constants. the only place that evaluates powers of two for the paper
+ * @param[out] pModel model to fill
+ * @param pParams stored paper characteristics
+ * 
+ * @return false if a parameter is out of range; pModel is then set to no correction
+ */
+bool paperModelInit(SPaperModel_t *pModel, SPaperParams_t const *pParams);
+
+/**
+ * @brief apply dry-down and reciprocity correction to a nominal print time
+ * @param pModel paper model, NULL for none
+ * @param nominalMs exposure time the print calls for, in milliseconds
+ * 
+ * @return corrected exposure time in milliseconds
+ */
+uint32_t paperCorrect(SPaperModel_t const *pModel, uint32_t nominalMs);
+
+/**
+ * @brief split-grade exposure for one filter
+ * @param pModel paper model, NULL for none
+ * @param baseMs base time in milliseconds
+ * @param hard true for the hard (grade 5) exposure, false for the soft (grade 00) one
+ * 
+ * @return exposure time in milliseconds, baseMs without a model
+ */
+uint32_t paperSplitMs(SPaperModel_t const *pModel, uint32_t baseMs, bool hard);
+
+/**
+ * @brief intensity that stretches a short exposure to a minimum on-time. a stop less light is a stop more time, so
+ *        on-time times intensity stays the nominal exposure
+ * @param nominalMs exposure time at full intensity
+ * @param minOnMs shortest on-time wanted, 0 for no dimming
+ * 
+ * @return intensity, Q16 of full power. INTENSITY_FULL if nominalMs is long enough, never more than
+ *         INTENSITY_MAX_STOPS below it
+ */
+uint32_t intensityForMinTime(uint32_t nominalMs, uint32_t minOnMs);
+
+/**
+ * @brief on-time that delivers a nominal exposure at reduced intensity
+ * @param nominalMs exposure time at full intensity
+ * @param intensity Q16 of full power, as actually set on the lamp
+ * 
+ * @return on-time in milliseconds
+ */
+uint32_t intensityOnMs(uint32_t nominalMs, uint32_t intensity);
+
+/**
+ * @brief express a reduced intensity in stops
+ * @param intensity Q16 of full power
+ * 
+ * @return stops below full power, in thousandths. 0 for full power or more
+ */
+uint32_t intensityMilliStops(uint32_t intensity);
 
 /**
  * @brief returns table of times for a given start time and number of steps
@@ -0,0 +1,81 @@
+/**
+ * @file  journal.h
+ * @brief exposure history in EEPROM
+ *
+ *        every finished exposure is appended as a compact record. records are collected in RAM page images and only
+ *        written out by journalPoll() while no exposure is running or queued, so the exposure path never waits for
+ *        the EEPROM. the newest entries can be read back page by page, newest page first
+ */
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "eeprom.h"
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+typedef enum
+{
+    JOURNAL_MODE_PROGRAM,
+    JOURNAL_MODE_CHANNELS,
+    JOURNAL_MODE_INTEGRATED,
+    JOURNAL_MODE_ARMED,
+} EJournalMode_t;
+
+/** @brief one exposure */
+typedef struct
+{
+    uint32_t sequence;    //< exposure number, continues across power cycles
+    uint32_t requestedMs; //< lamp on-time asked for: program lamp steps, longest channel or nominal time
+    uint32_t deliveredMs; //< lamp on-time measured between the lamp edges
+    int8_t   stopOffset;  //< final program stop offset, in the program's resolution
+    uint8_t  programId;   //< SExposureProgram_t::id, 0 outside program and armed mode
+    uint8_t  mode;        //< EJournalMode_t
+    bool     aborted;
+} SJournalEntry_t;
+
+/** @brief read position for journalReadPage() */
+typedef struct
+{
+    uint16_t slot;      //< EEPROM page to read next
+    uint16_t pagesLeft;
+    uint32_t endSeq;    //< sequence number following the last record of that page
+} SJournalCursor_t;
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define JOURNAL_EEPROM_ADDR   0x0500 // page-aligned, after the paper profiles, up to the end of the EEPROM
+#define JOURNAL_EEPROM_PAGES  ((EEPROM_SIZE - JOURNAL_EEPROM_ADDR) / EEPROM_PAGE_SIZE)
+#define JOURNAL_PAGE_RECORDS  8      // most records a page can hold, size entry buffers for journalReadPage() with it
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+void    initJournal(void);
+void    journalAppend(const SJournalEntry_t *);
+void    journalPoll(void);
+void    journalBeginRead(SJournalCursor_t *);
+uint8_t journalReadPage(SJournalCursor_t *, SJournalEntry_t *);
+uint8_t journalReadRecent(SJournalEntry_t *, uint8_t);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //!_JOURNAL_H_
@@ -0,0 +1,61 @@
+/**
+ * @file  mains.h
+ * @brief mains zero-cross tracking and half-cycle quantisation
+ *
+ *        pure integer math, no hardware or RTOS calls: the zero-cross ISR feeds it capture timestamps and the exposure
+ *        engine asks it how many half-cycles a requested duration maps to
+ */
+
+#ifndef _MAINS_H_
+#define _MAINS_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+/** @brief zero-cross tracker state */
+typedef struct
+{
+    uint32_t halfCycleUs;   //< filtered half-cycle period, 0 until locked
+    uint16_t lastCapture;   //< 1MHz capture timestamp of the last accepted edge
+    uint8_t  goodEdges;     //< consecutive in-range periods, saturates at MAINS_LOCK_EDGES
+    bool     hasEdge;       //< lastCapture is valid
+    uint32_t sumUs;         //< time covered by accepted edges while locked, for clock calibration
+    uint32_t sumHalfCycles; //< half-cycles covered by sumUs
+} SMainsTracker_t;
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define MAINS_HALF_CYCLE_MIN_US 7000  // 71Hz
+#define MAINS_HALF_CYCLE_MAX_US 12500 // 40Hz
+#define MAINS_LOCK_EDGES        8     // in-range periods needed before the tracker reports lock
+#define MAINS_MAX_SKIPPED       2     // half-cycles an edge may be late by (missed detector pulse) while locked
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+void     mainsInit(SMainsTracker_t *);
+uint8_t  mainsEdge(SMainsTracker_t *, uint16_t);
+bool     mainsLocked(SMainsTracker_t const *);
+uint32_t mainsQuantise(uint32_t, uint32_t, int32_t *);
+void     mainsTakeSum(SMainsTracker_t *, uint32_t *, uint32_t *);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //!_MAINS_H_
@@ -0,0 +1,78 @@
+/**
+ * @file  meter.h
+ * @brief easel photometer: log-domain readings, contrast range and base time/grade suggestion
+ *
+ *        readings are log2 of the oversampled ADC value in Q8, i.e. 1/256 stop per LSB. everything past the ADC is
+ *        integer math
+ */
+
+#ifndef _METER_H_
+#define _METER_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+/** @brief result of a multi-point reading */
+typedef struct
+{
+    int32_t  highlightQ8;  //< darkest easel point (densest negative area), log2 Q8
+    int32_t  shadowQ8;     //< brightest easel point, log2 Q8
+    int32_t  rangeQ8;      //< contrast range in stops, Q8
+    uint32_t baseTimeMs;   //< exposure that places the highlight at the calibrated density
+    uint8_t  halfGrades;   //< suggested grade * 2 (5 = grade 2.5)
+} SMeterResult_t;
+
+/** @brief running light integral for closed-loop exposures, in ADC counts x samples */
+typedef struct
+{
+    uint64_t target;
+    uint64_t accum;
+    uint32_t samples;  //< samples integrated so far
+} SLightIntegral_t;
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define METER_NO_READING    INT32_MIN
+#define METER_MIN_ADC       16 // below this the probe is considered dark
+#define METER_MAX_POINTS    8
+#define METER_LEFT_UNKNOWN  UINT32_MAX // no light on the probe, can't predict the end
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+int32_t  meterLog2Q8(uint32_t);
+uint32_t meterExp2Q8(uint32_t, int32_t);
+
+void     meterSetCalibration(int32_t, uint32_t);
+int32_t  meterSpot(void);
+uint32_t meterTimeForReading(int32_t);
+uint32_t meterReferenceLevel(void);
+
+void     meterClearPoints(void);
+bool     meterAddPoint(void);
+uint8_t  meterPointCount(void);
+bool     meterAnalyse(SMeterResult_t *);
+
+void     integralStart(SLightIntegral_t *, uint64_t);
+uint32_t integralAddBlock(SLightIntegral_t *, const volatile uint16_t *, uint8_t);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //!_METER_H_
@@ -0,0 +1,67 @@
+/**
+ * @file  profile.h
+ * @brief paper and chemistry profiles in EEPROM
+ *
+ *        a profile holds what a paper/developer combination needs: base times per filter grade, dry-down, split-grade
+ *        offsets, reciprocity failure and the lamp time constants. profiles are fixed-size records, one EEPROM page
+ *        each, addressed by slot number; a RAM index of the valid slots and their names is built once at boot, so
+ *        selecting a profile reads a single page and never scans
+ */
+
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "eeprom.h"
+#include "fstop.h"
+#include "session.h"
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define PROFILE_SLOTS        16
+#define PROFILE_NAME_LENGTH  10 // including the terminator
+#define PROFILE_NONE         SESSION_NO_PROFILE
+
+#define PROFILE_EEPROM_ADDR  0x0300 // page-aligned, after the crash dump, one page per slot
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+/** @brief one paper/developer combination, stored as-is in its slot */
+typedef struct __attribute__((packed))
+{
+    char           name[PROFILE_NAME_LENGTH]; //< zero-terminated
+    SPaperParams_t paper;
+    uint8_t        lampRise10Ms;              //< lamp time constants in 10ms units, both 0 to keep the current ones
+    uint8_t        lampFall10Ms;
+} SProfile_t;
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+void    initProfile(void);
+bool    profileSelect(uint8_t);
+uint8_t profileActive(void);
+bool    profileRead(uint8_t, SProfile_t *);
+bool    profileWrite(uint8_t, const SProfile_t *);
+bool    profileErase(uint8_t);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //!_PROFILE_H_
@@ -0,0 +1,124 @@
+/**
+ * @file  program.h
+ * @brief precompiled exposure programs for dodge/burn sequences
+ *
+ *        a program is a flat, const array of 4-byte steps. the interpreter is free of hardware and RTOS calls: it
+ *        walks the program and returns the next blocking action (lamp, operator wait) to the exposure task
+ */
+
+#ifndef _PROGRAM_H_
+#define _PROGRAM_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fstop.h"
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+/** @brief program opcodes */
+typedef enum
+{
+    PROG_OP_END,         //< end of program
+    PROG_OP_LAMP_MS,     //< lamp on for value milliseconds
+    PROG_OP_LAMP,        //< lamp on for the base time with the current stop offset and the paper correction applied
+    PROG_OP_STOP_OFFSET, //< add param (signed) steps at the program resolution to the current stop offset
+    PROG_OP_PAUSE,       //< wait for the operator (start button or footswitch)
+    PROG_OP_BEEP_WAIT,   //< beep, then wait for the operator
+    PROG_OP_LOOP,        //< jump back to step value, param more times. loops do not nest
+} EProgOpcode_t;
+
+/** @brief single program step */
+typedef struct __attribute__((packed))
+{
+    uint8_t  opcode; //< EProgOpcode_t
+    int8_t   param;  //< stop steps or loop count
+    uint16_t value;  //< milliseconds or jump target
+} SProgStep_t;
+
+/** @brief exposure program */
+typedef struct
+{
+    const SProgStep_t *pSteps;
+    uint8_t            numSteps;
+    EFStop_t           resolution; //< resolution for PROG_OP_STOP_OFFSET
+    uint8_t            id;         //< recorded in the exposure journal, 0 for ad-hoc programs
+} SExposureProgram_t;
+
+#define PROG_BUFFER_STEPS 32 // capacity of an SProgBuffer_t
+
+/** @brief program built at run time, the steps live next to the header. pSteps points at steps */
+typedef struct
+{
+    SExposureProgram_t program; //< first, so the buffer can be passed as a program
+    SProgStep_t        steps[PROG_BUFFER_STEPS];
+} SProgBuffer_t;
+
+/** @brief blocking actions returned by the interpreter */
+typedef enum
+{
+    PROG_ACTION_DONE,
+    PROG_ACTION_LAMP,
+    PROG_ACTION_WAIT_OPERATOR,
+    PROG_ACTION_BEEP_WAIT,
+    PROG_ACTION_ERROR,
+} EProgAction_t;
+
+typedef struct
+{
+    EProgAction_t action;
+    uint32_t      durationMs; //< lamp on-time for PROG_ACTION_LAMP
+} SProgAction_t;
+
+/** @brief interpreter state */
+typedef struct
+{
+    const SExposureProgram_t *pProgram;
+    SLampModel_t const       *pLampModel;   //< lamp compensation, NULL for none
+    SPaperModel_t const      *pPaperModel;  //< paper correction of PROG_OP_LAMP steps, NULL for none
+    uint32_t                  baseTime;     //< base exposure in milliseconds
+    uint32_t                  workingTime;  //< lamp on-time for base time + stopOffset, cached on every offset change
+    int8_t                    stopOffset;
+    uint8_t                   pc;
+    uint8_t                   loopRemaining;
+    bool                      loopActive;
+} SProgContext_t;
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define PROG_STEP_END()              ((SProgStep_t){ PROG_OP_END, 0, 0 })
+#define PROG_STEP_LAMP_MS(ms)        ((SProgStep_t){ PROG_OP_LAMP_MS, 0, (ms) })
+#define PROG_STEP_LAMP()             ((SProgStep_t){ PROG_OP_LAMP, 0, 0 })
+#define PROG_STEP_STOP_OFFSET(steps) ((SProgStep_t){ PROG_OP_STOP_OFFSET, (steps), 0 })
+#define PROG_STEP_PAUSE()            ((SProgStep_t){ PROG_OP_PAUSE, 0, 0 })
+#define PROG_STEP_BEEP_WAIT()        ((SProgStep_t){ PROG_OP_BEEP_WAIT, 0, 0 })
+#define PROG_STEP_LOOP(target, reps) ((SProgStep_t){ PROG_OP_LOOP, (reps), (target) })
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+bool          progValidate(const SExposureProgram_t *);
+void          progInit(SProgContext_t *, const SExposureProgram_t *, SLampModel_t const *, SPaperModel_t const *,
+                       uint32_t);
+SProgAction_t progNext(SProgContext_t *);
+uint32_t      progTotalMs(const SExposureProgram_t *, uint32_t);
+bool          progParse(SProgBuffer_t *, const char *, EFStop_t);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //!_PROGRAM_H_
@@ -0,0 +1,63 @@
+/**
+ * @file  replay.h
+ * @brief operator input recording and replay
+ *
+ *        records the start input presses and console lines of a session with their times, and plays them back into
+ *        the same entry points: presses through the EXTI handler, lines through the console input queue. a recorded
+ *        session can be dumped, loaded again on another firmware build and replayed to compare its behaviour and load
+ *        on real operator input, see scripts/input_replay.py
+ */
+
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+typedef enum
+{
+    REPLAY_IDLE,
+    REPLAY_RECORDING,
+    REPLAY_PLAYING,
+} EReplayState_t;
+
+typedef enum
+{
+    REPLAY_EVENT_PRESS, //< footswitch or start button, both start the same action
+    REPLAY_EVENT_LINE,  //< console line
+} EReplayEvent_t;
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define REPLAY_BUFFER_SIZE 1024 // event storage: 6 bytes per press, 6 + length per console line
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+void           initReplay(void);
+void           replayPressFromISR(void);
+bool           replayRecord(void);
+bool           replayPlay(void);
+void           replayStop(void);
+EReplayState_t replayState(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //!_REPLAY_H_
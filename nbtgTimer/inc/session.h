@@ -0,0 +1,78 @@
+/**
+ * @file  session.h
+ * @brief darkroom session state, saved to EEPROM on mains loss and restored at boot
+ *
+ *        the state is kept as a ready-to-send EEPROM page image in RAM: every setter updates its field and the CRC, so
+ *        the power-fail path only has to start a single DMA burst
+ */
+
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fstop.h"
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+/** @brief session state, stored as-is in the snapshot */
+typedef struct __attribute__((packed))
+{
+    uint32_t baseTimeMs;      //< base exposure
+    int8_t   stripStep;       //< test-strip position, in stripResolution steps from the base time
+    uint8_t  stripResolution; //< EFStop_t
+    uint16_t safelightLeadMs;
+    uint16_t lampRiseMs;      //< lamp model time constants, 0 for none
+    uint16_t lampFallMs;
+    uint8_t  flags;           //< SESSION_FLAG_*
+    uint8_t  profile;         //< selected paper profile slot, SESSION_NO_PROFILE for none
+    uint16_t dimMinOnMs;      //< shortest on-time an LED head is dimmed to, 0 for none
+} SSessionState_t;
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define SESSION_FLAG_ZERO_CROSS_SYNC 0x01 // lamp steps aligned to mains zero crossings
+#define SESSION_FLAG_EXPOSING        0x02 // an exposure was running when the snapshot was taken
+
+#define SESSION_NO_PROFILE           0xFF
+
+#define SESSION_EEPROM_ADDR          0x0000 // page-aligned, the snapshot fits a single page
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+void initSession(void);
+bool sessionResumed(void);
+bool sessionInterrupted(void);
+void sessionGetState(SSessionState_t *);
+
+void sessionSetBaseTime(uint32_t);
+void sessionSetTestStrip(int8_t, EFStop_t);
+bool sessionSetSafelightLead(uint16_t);
+bool sessionSetLampModel(uint16_t, uint16_t);
+void sessionSetZeroCrossSync(bool);
+void sessionSetProfile(uint8_t);
+bool sessionSetLampDimming(uint16_t);
+void sessionSetExposing(bool);
+
+void sessionPowerFailFromISR(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //!_SESSION_H_
@@ -0,0 +1,60 @@
+/**
+ * @file  sync.h
+ * @brief multi-unit time sync and lockstep exposures over the sync link
+ *
+ *        one unit is the master and broadcasts its TIM17 time base on a shared single-wire UART; the slaves estimate
+ *        their offset and drift against it (see syncclock.h). "sync fire" on the master then has every armed unit on
+ *        the wire start its exposure at the same master time, each through its own start input path. see
+ *        scripts/sync_sim.py for a host simulation of several units
+ */
+
+#ifndef _SYNC_H_
+#define _SYNC_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+typedef enum
+{
+    SYNC_OFF,
+    SYNC_MASTER,
+    SYNC_SLAVE,
+} ESyncMode_t;
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define SYNC_PERIOD_MS        250   // master time broadcast period
+#define SYNC_TIMEOUT_MS       2000  // a slave without a broadcast for this long has lost the master and relocks
+#define SYNC_FIRE_LEAD_MS     200   // default time between "sync fire" and the lamp-on instant
+#define SYNC_FIRE_MAX_LEAD_MS 10000
+#define SYNC_FIRE_MIN_LEAD_MS 50    // the fire frame and its repeat must reach every slave ahead of the instant
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+void        initSync(void);
+bool        syncSetMode(ESyncMode_t);
+ESyncMode_t syncMode(void);
+bool        syncLocked(void);
+bool        syncFire(uint32_t);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //!_SYNC_H_
@@ -0,0 +1,66 @@
+/**
+ * @file  syncclock.h
+ * @brief offset and drift of a master time base, estimated from timestamp pairs
+ *
+ *        pure integer math, no hardware or RTOS calls: the sync link feeds it (master time, local time) pairs of the
+ *        same event and asks it where a master time falls on the local time base. also built for the host by
+ *        scripts/sync_sim.py
+ */
+
+#ifndef _SYNCCLOCK_H_
+#define _SYNCCLOCK_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define SYNC_CLOCK_WINDOW      8     // samples in the fit, the estimator reports lock once it's full
+#define SYNC_CLOCK_OUTLIER_US  200   // samples this far off the fit are rejected while locked
+#define SYNC_CLOCK_MAX_REJECTS 3     // consecutive rejected samples that restart the fit (e.g. an HSITRIM step)
+#define SYNC_CLOCK_MAX_PPM     60000 // two HSIs at the ends of their spec, anything further apart is a bad sample
+#define SYNC_CLOCK_RATE_ONE    (1L << 24) // rate scale
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+/** @brief estimator state. the fit is local = refLocalUs + dx + dx * rate, dx = master - refMasterUs */
+typedef struct
+{
+    uint32_t masterUs[SYNC_CLOCK_WINDOW]; //< sample ring
+    uint32_t localUs[SYNC_CLOCK_WINDOW];
+    uint8_t  count;                       //< samples in the ring
+    uint8_t  next;                        //< ring slot the next sample goes to
+    uint8_t  rejects;                     //< consecutive rejected samples
+    uint32_t refMasterUs;                 //< fit centroid
+    uint32_t refLocalUs;
+    int32_t  rate;                        //< local rate relative to the master, minus one, in SYNC_CLOCK_RATE_ONE
+    uint32_t spreadUs;                    //< largest residual in the window
+} SSyncClock_t;
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+void     syncClockInit(SSyncClock_t *);
+bool     syncClockSample(SSyncClock_t *, uint32_t, uint32_t);
+bool     syncClockLocked(SSyncClock_t const *);
+uint32_t syncClockToLocal(SSyncClock_t const *, uint32_t);
+int32_t  syncClockPpm(SSyncClock_t const *);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //!_SYNCCLOCK_H_
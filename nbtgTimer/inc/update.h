@@ -0,0 +1,43 @@
+/**
+ * @file  update.h
+ * @brief streaming firmware update over the console UART into the inactive image slot
+ *
+ *        "update <a|b> <length> <crc32> [baud]" takes a new image in blocks at a higher baudrate and programs it
+ *        into the slot that isn't running; the bootloader (nbtgBoot) tries it on the next reset and falls back to
+ *        the running image unless the new one confirms itself with updatePoll(). see scripts/fw_update.py
+ */
+
+#ifndef _UPDATE_H_
+#define _UPDATE_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define UPDATE_BLOCK_BYTES    1024    // image bytes per frame, flash is programmed a block at a time
+#define UPDATE_DEFAULT_BAUD   1000000 // HSI16 / 16, exact
+#define UPDATE_CONFIRM_MS     10000   // uptime after which a freshly updated image marks itself good
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+void initUpdate(void);
+void updatePoll(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //!_UPDATE_H_
@@ -0,0 +1,367 @@
+/**
+ * @file  batch.c
+ * @brief batch printing
+ *
+ * the batch arms its first print with exposureArmProgram() and registers itself as the exposure task's advance hook.
+ * after every armed run the hook counts a completed print and hands back the program of the next one, which the task
+ * loads before it goes idle again; an aborted print is armed again and not counted. once the last copy is done the
+ * hook returns NULL and the start inputs are disarmed
+ *
+ * the widgets are redrawn from batchPoll(), never from the exposure task, so nothing between two prints waits on the
+ * display. each widget remembers the text it shows and is left alone while that doesn't change: with the same
+ * program throughout, only the counter is redrawn between prints
+ */
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include "batch.h"
+
+#include <FreeRTOS.h>
+#include <task.h>
+
+#include <stddef.h>
+#include <string.h>
+
+#include "clock.h"
+#include "console.h"
+#include "display.h"
+#include "exposure.h"
+#include "session.h"
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define BATCH_WIDGET_CHARS 7  // "999/999", "999.9s"
+#define BATCH_WIDGET_Y     54 // bottom text line
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+/** @brief text field on the display, redrawn only when its text changes */
+typedef struct
+{
+    SPoint_t pos;
+    char     shown[BATCH_WIDGET_CHARS + 1];
+} SBatchWidget_t;
+
+//=====================================================================================================================
+// Globals
+//=====================================================================================================================
+
+static SBatchEntry_t   g_entries[BATCH_MAX_ENTRIES];
+static uint8_t         g_numEntries = 0;
+static uint8_t         g_entry      = 0; //< entry of the next print
+static uint16_t        g_copy       = 0; //< copies of that entry done
+static uint16_t        g_printed    = 0;
+static uint16_t        g_total      = 0;
+static uint32_t        g_baseMs     = 0;
+static uint32_t        g_printMs    = 0;
+static volatile bool   g_active     = false;
+
+static SBatchWidget_t  g_counterWidget = { { 1, BATCH_WIDGET_Y }, "" };
+// right edge, 7px font
+static SBatchWidget_t  g_timeWidget    = { { 128 - (BATCH_WIDGET_CHARS * 7), BATCH_WIDGET_Y }, "" };
+
+//=====================================================================================================================
+// Static protos
+//=====================================================================================================================
+
+static const SExposureProgram_t *batchAdvance(const SExposureProgram_t *, bool, void *);
+static void                      drawWidget(SBatchWidget_t *, const char *);
+static char                     *putDec(char *, uint32_t);
+static void                      batchCommand(int, char *[]);
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+/**
+ * @brief hook the batch into the exposure task and register the "batch" console command
+ *
+ */
+void initBatch(void)
+{
+    static const SConsoleCommand_t batchCmd = { "batch", "batch printing, 'batch add <copies>|start [ms]|stop|clear'",
+                                                batchCommand };
+
+    exposureSetArmAdvance(batchAdvance, NULL);
+
+    (void)consoleRegisterCommand(&batchCmd);
+}
+
+/**
+ * @brief bring the widgets up to date. call periodically from task context
+ *
+ */
+void batchPoll(void)
+{
+    SBatchStatus_t status;
+    char           counter[BATCH_WIDGET_CHARS + 1] = "";
+    char           time[BATCH_WIDGET_CHARS + 1]    = "";
+
+    batchGetStatus(&status);
+
+    if (status.active)
+    {
+        char *p = putDec(counter, (uint32_t)status.printed + 1);
+
+        *p++ = '/';
+        *putDec(p, status.total) = '\0';
+
+        p    = putDec(time, status.printMs / 1000);
+        *p++ = '.';
+        *p++ = (char)('0' + ((status.printMs / 100) % 10));
+        *p++ = 's';
+        *p   = '\0';
+    }
+
+    drawWidget(&g_counterWidget, counter);
+    drawWidget(&g_timeWidget, time);
+}
+
+/**
+ * @brief append copies of a program to the batch. only while the batch is not running
+ *
+ * @param pProgram program to print, must stay valid until the batch is cleared
+ * @param copies number of prints
+ * @return false if the batch is running or full, or the program is invalid
+ */
+bool batchAdd(const SExposureProgram_t *pProgram, uint16_t copies)
+{
+    if (g_active || (g_numEntries >= BATCH_MAX_ENTRIES) || (copies == 0) || !progValidate(pProgram)) return false;
+
+    g_entries[g_numEntries].pProgram = pProgram;
+    g_entries[g_numEntries].copies   = copies;
+    g_numEntries++;
+
+    return true;
+}
+
+/**
+ * @brief stop the batch and drop all entries
+ *
+ */
+void batchClear(void)
+{
+    batchStop();
+
+    g_numEntries = 0;
+}
+
+/**
+ * @brief start the batch from its first print, arming it on the start inputs
+ *
+ * @param baseMs base exposure for every program of the batch, in milliseconds
+ * @return false if the batch is empty or the first print couldn't be armed
+ */
+bool batchStart(uint32_t baseMs)
+{
+    uint16_t total   = 0;
+    uint32_t printMs;
+
+    if ((g_numEntries == 0) || (baseMs == 0)) return false;
+
+    for (uint8_t i = 0; i < g_numEntries; i++)
+    {
+        total += g_entries[i].copies;
+    }
+
+    printMs = progTotalMs(g_entries[0].pProgram, baseMs);
+
+    taskENTER_CRITICAL();
+    g_entry   = 0;
+    g_copy    = 0;
+    g_printed = 0;
+    g_total   = total;
+    g_baseMs  = baseMs;
+    g_printMs = printMs;
+    g_active  = true;
+    taskEXIT_CRITICAL();
+
+    if (!exposureArmProgram(g_entries[0].pProgram, baseMs))
+    {
+        g_active = false;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief stop the batch and disarm the start inputs. a print that is running finishes normally
+ *
+ */
+void batchStop(void)
+{
+    if (!g_active) return;
+
+    g_active = false;
+    (void)exposureArmProgram(NULL, 0);
+}
+
+/**
+ * @brief read the batch progress
+ *
+ * @param[out] pStatus progress
+ */
+void batchGetStatus(SBatchStatus_t *pStatus)
+{
+    taskENTER_CRITICAL();
+    pStatus->active  = g_active;
+    pStatus->printed = g_printed;
+    pStatus->total   = g_total;
+    pStatus->printMs = g_printMs;
+    taskEXIT_CRITICAL();
+}
+
+//=====================================================================================================================
+// Statics
+//=====================================================================================================================
+
+/**
+ * @brief exposure task hook after an armed run: count the print and pick the next one. runs in the exposure task
+ *
+ * @param pArmed program that ran
+ * @param completed false if the print was aborted
+ * @return program to arm next, NULL once the batch is done
+ */
+static const SExposureProgram_t *batchAdvance(const SExposureProgram_t *pArmed, bool completed, void *pCtx)
+{
+    const SExposureProgram_t *pNext;
+
+    // armed from elsewhere, e.g. the "arm" command: not a print of this batch
+    if (!g_active || (pArmed != g_entries[g_entry].pProgram)) return pArmed;
+
+    if (!completed) return pArmed;
+
+    taskENTER_CRITICAL();
+
+    g_printed++;
+
+    if (++g_copy >= g_entries[g_entry].copies)
+    {
+        g_copy = 0;
+        g_entry++;
+    }
+
+    pNext    = (g_entry < g_numEntries) ? g_entries[g_entry].pProgram : NULL;
+    g_active = (pNext != NULL);
+
+    taskEXIT_CRITICAL();
+
+    // only changes with the program, and the programs are validated, so this is short
+    if ((pNext != NULL) && (pNext != pArmed)) g_printMs = progTotalMs(pNext, g_baseMs);
+
+    return pNext;
+}
+
+/**
+ * @brief show a text in a widget, if it differs from what the widget shows already
+ *
+ * @param pWidget widget
+ * @param pText text, at most BATCH_WIDGET_CHARS long. empty clears the widget
+ */
+static void drawWidget(SBatchWidget_t *pWidget, const char *pText)
+{
+    if (strcmp(pWidget->shown, pText) == 0) return;
+
+    clockRequestActive(); // a render burst, the text goes out with the next frame
+
+    dispDrawFilledRectangle(pWidget->pos,
+                            (SPoint_t){ pWidget->pos.x + (BATCH_WIDGET_CHARS * Font_7x10.FontWidth) - 1,
+                                        pWidget->pos.y + Font_7x10.FontHeight - 1 },
+                            COLOR_BLACK);
+    dispSetCursor(pWidget->pos.x, pWidget->pos.y);
+    (void)dispWriteString(pText, Font_7x10, COLOR_WHITE);
+
+    clockReleaseActive();
+
+    strncpy(pWidget->shown, pText, BATCH_WIDGET_CHARS);
+    pWidget->shown[BATCH_WIDGET_CHARS] = '\0';
+}
+
+/**
+ * @brief write a decimal number without terminator
+ *
+ * @param p destination
+ * @param value number
+ * @return char* position after the last digit
+ */
+static char *putDec(char *p, uint32_t value)
+{
+    char    buf[10];
+    uint8_t len = 0;
+
+    do
+    {
+        buf[len++] = (char)('0' + (value % 10));
+        value /= 10;
+    }
+    while (value != 0);
+
+    while (len > 0) *p++ = buf[--len];
+
+    return p;
+}
+
+/**
+ * @brief "batch" console command: status, or build and run a batch of plain base time prints
+ *
+ */
+static void batchCommand(int argc, char *argv[])
+{
+    SBatchStatus_t  status;
+    SSessionState_t session;
+    int32_t         value = 0;
+
+    if (argc < 2)
+    {
+        batchGetStatus(&status);
+        consolePuts(status.active ? "running, printed " : "stopped, printed ");
+        consolePutDec(status.printed);
+        consolePuts("/");
+        consolePutDec(status.total);
+        consolePuts(", next ");
+        consolePutDec((int32_t)status.printMs);
+        consolePuts("ms, ");
+        consolePutDec(g_numEntries);
+        consolePuts(" entries\n");
+        return;
+    }
+
+    if ((strcmp(argv[1], "add") == 0) && (argc > 2) && consoleParseInt(argv[2], &value) && (value > 0) &&
+        (value <= UINT16_MAX))
+    {
+        if (!batchAdd(&g_baseStepProgram, (uint16_t)value)) consolePuts("batch running or full\n");
+    }
+    else if (strcmp(argv[1], "start") == 0)
+    {
+        sessionGetState(&session);
+        value = (int32_t)session.baseTimeMs;
+
+        if ((argc > 2) && (!consoleParseInt(argv[2], &value) || (value <= 0)))
+        {
+            consolePuts("usage: batch start [ms]\n");
+        }
+        else if (!batchStart((uint32_t)value))
+        {
+            consolePuts("empty batch or busy\n");
+        }
+    }
+    else if (strcmp(argv[1], "stop") == 0)
+    {
+        batchStop();
+    }
+    else if (strcmp(argv[1], "clear") == 0)
+    {
+        batchClear();
+    }
+    else
+    {
+        consolePuts("usage: batch [add <copies>|start [ms]|stop|clear]\n");
+    }
+}
@@ -0,0 +1,248 @@
+/**
+ * @file  clockcal.c
+ * @brief HSI calibration against the LSE crystal or the mains frequency
+ *
+ * the LSE is preferred: a TIM16 window of CLOCK_LSE_MEASURE_PERIODS is measured on every poll. without a crystal the
+ * zero-cross tracker sums the time between accepted mains edges on the HSI-derived capture clock, and a measurement
+ * is taken once CLOCKCAL_MAINS_HALF_CYCLES have been collected. 50 or 60Hz is picked from the measured period
+ *
+ * HSITRIM is moved one step per measurement while the error is above CLOCKCAL_TRIM_THRESHOLD_PPM. the step size
+ * varies from part to part, so no correction is applied after a trim change until the next measurement has seen the
+ * new frequency. below the threshold the measured error is applied to lamp durations instead
+ */
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include "clockcal.h"
+
+#include <FreeRTOS.h>
+#include <task.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "board.h"
+#include "console.h"
+#include "crash.h"
+#include "exposure.h"
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define PPM                     1000000
+#define MAINS_60HZ_THRESHOLD_US 9167 // half-cycle between 50Hz (10000us) and 60Hz (8333us)
+
+//=====================================================================================================================
+// Globals
+//=====================================================================================================================
+
+static SClockCalStats_t g_stats           = {0};
+static int64_t          g_sumPpm          = 0;
+static volatile int32_t g_correctionPpm   = 0;
+
+static uint32_t         g_mainsUs         = 0;
+static uint32_t         g_mainsHalfCycles = 0;
+
+//=====================================================================================================================
+// Static protos
+//=====================================================================================================================
+
+static void processMeasurement(int32_t, EClockCalRef_t);
+static void resetStats(void);
+static void clockCommand(int, char *[]);
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+/**
+ * @brief reset the statistics and register the "clk" console command
+ *
+ */
+void initClockCal(void)
+{
+    static const SConsoleCommand_t clkCmd = { "clk", "clock calibration stats, 'clk reset' clears them",
+                                              clockCommand };
+
+    g_stats.factoryTrim = clockGetHSITrim();
+    resetStats();
+
+    (void)consoleRegisterCommand(&clkCmd);
+}
+
+/**
+ * @brief collect reference measurements and update trim and correction. call every CLOCKCAL_POLL_MS from task context
+ *
+ */
+void clockCalPoll(void)
+{
+    uint32_t elapsedUs;
+    uint32_t halfCycles;
+    uint32_t ticks;
+    uint32_t expected;
+
+    // always drained, so a mains window never spans a period where the LSE was in use
+    exposureTakeMainsPeriods(&elapsedUs, &halfCycles);
+
+    if (clockLSEReady())
+    {
+        if (clockLSEMeasurement(&ticks, &expected))
+        {
+            processMeasurement((int32_t)((((int64_t)ticks - expected) * PPM) / expected), CLOCKCAL_REF_LSE);
+        }
+
+        (void)clockMeasureLSE(); // no-op while one is still running
+        return;
+    }
+
+    g_mainsUs         += elapsedUs;
+    g_mainsHalfCycles += halfCycles;
+
+    if (g_mainsHalfCycles < CLOCKCAL_MAINS_HALF_CYCLES) return;
+
+    uint32_t mainsHz = ((g_mainsUs / g_mainsHalfCycles) < MAINS_60HZ_THRESHOLD_US) ? 60 : 50;
+
+    expected = (uint32_t)(((uint64_t)g_mainsHalfCycles * (PPM / 2)) / mainsHz);
+
+    processMeasurement((int32_t)((((int64_t)g_mainsUs - expected) * PPM) / expected), CLOCKCAL_REF_MAINS);
+
+    g_mainsUs         = 0;
+    g_mainsHalfCycles = 0;
+}
+
+/**
+ * @brief convert a duration to HSI-derived timer milliseconds using the current correction
+ *
+ * @param durationMs duration in real milliseconds
+ * @return uint32_t duration to program into an HSI-clocked timer
+ */
+uint32_t clockCalCorrectMs(uint32_t durationMs)
+{
+    int32_t correction = g_correctionPpm;
+
+    return (uint32_t)((((uint64_t)durationMs * (uint32_t)(PPM + correction)) + (PPM / 2)) / PPM);
+}
+
+/**
+ * @brief copy the calibration statistics
+ *
+ * @param[out] pStats statistics
+ */
+void clockCalGetStats(SClockCalStats_t *pStats)
+{
+    taskENTER_CRITICAL();
+    *pStats               = g_stats;
+    taskEXIT_CRITICAL();
+
+    pStats->trim          = clockGetHSITrim();
+    pStats->correctionPpm = g_correctionPpm;
+}
+
+//=====================================================================================================================
+// Statics
+//=====================================================================================================================
+
+/**
+ * @brief fold a measurement into the statistics, then trim or correct for it
+ *
+ * @param errorPpm measured HSI error, positive is fast
+ * @param reference where the measurement came from
+ */
+static void processMeasurement(int32_t errorPpm, EClockCalRef_t reference)
+{
+    if (abs(errorPpm) > CLOCKCAL_MAX_ERROR_PPM) return;
+
+    crashTrace(TRACE_CLOCK_CAL, (uint16_t)(int16_t)errorPpm);
+
+    taskENTER_CRITICAL(); // the console may read or reset the statistics
+    g_stats.reference = reference;
+    g_stats.lastPpm   = errorPpm;
+    g_stats.minPpm    = ((g_stats.samples == 0) || (errorPpm < g_stats.minPpm)) ? errorPpm : g_stats.minPpm;
+    g_stats.maxPpm    = ((g_stats.samples == 0) || (errorPpm > g_stats.maxPpm)) ? errorPpm : g_stats.maxPpm;
+    g_sumPpm         += errorPpm;
+    g_stats.samples++;
+    g_stats.meanPpm   = (int32_t)(g_sumPpm / (int32_t)g_stats.samples);
+    taskEXIT_CRITICAL();
+
+    uint8_t trim = clockGetHSITrim();
+
+    if ((errorPpm > CLOCKCAL_TRIM_THRESHOLD_PPM) && (trim > 0))
+    {
+        trim--;
+    }
+    else if ((errorPpm < -CLOCKCAL_TRIM_THRESHOLD_PPM) && (trim < CLOCK_HSI_TRIM_MAX))
+    {
+        trim++;
+    }
+    else
+    {
+        // within a trim step, or the trim range is exhausted
+        g_correctionPpm = errorPpm;
+        return;
+    }
+
+    clockSetHSITrim(trim);
+    g_correctionPpm = 0;
+
+    // a mains window straddling the trim change would average both frequencies
+    g_mainsUs         = 0;
+    g_mainsHalfCycles = 0;
+}
+
+/**
+ * @brief clear the min/max/mean statistics
+ *
+ */
+static void resetStats(void)
+{
+    taskENTER_CRITICAL();
+    g_stats.reference = CLOCKCAL_REF_NONE;
+    g_stats.samples   = 0;
+    g_stats.lastPpm   = 0;
+    g_stats.minPpm    = 0;
+    g_stats.maxPpm    = 0;
+    g_stats.meanPpm   = 0;
+    g_sumPpm          = 0;
+    taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief "clk [reset]": print the calibration statistics
+ *
+ */
+static void clockCommand(int argc, char *argv[])
+{
+    static const char *const refNames[] = { "none", "lse", "mains" };
+    SClockCalStats_t         stats;
+
+    if ((argc > 1) && (strcmp(argv[1], "reset") == 0))
+    {
+        resetStats();
+        return;
+    }
+
+    clockCalGetStats(&stats);
+
+    consolePuts("ref   ");
+    consolePuts(refNames[stats.reference]);
+    consolePuts("\ntrim  ");
+    consolePutDec(stats.trim);
+    consolePuts(" (factory ");
+    consolePutDec(stats.factoryTrim);
+    consolePuts(")\nerror ");
+    consolePutDec(stats.lastPpm);
+    consolePuts("ppm, min ");
+    consolePutDec(stats.minPpm);
+    consolePuts(" max ");
+    consolePutDec(stats.maxPpm);
+    consolePuts(" mean ");
+    consolePutDec(stats.meanPpm);
+    consolePuts(" n ");
+    consolePutDec((int32_t)stats.samples);
+    consolePuts("\ncorr  ");
+    consolePutDec(stats.correctionPpm);
+    consolePuts("ppm\n");
+}
@@ -0,0 +1,349 @@
+/**
+ * @file console.c
+ *
+ * @brief service console task
+ *
+ * the USART ISR posts every received character to the RX queue; the task echoes it and collects a line. output is
+ * written with the blocking consolePutchar(), so it's only meant for the console task itself: at 115200 baud a full
+ * line costs about 5ms, which the low priority of the task absorbs
+ */
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include "console.h"
+
+#include <FreeRTOS.h>
+#include <queue.h>
+#include <task.h>
+
+#include <string.h>
+
+#include "board.h"
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define CONSOLE_TASK_STACK_SIZE 256
+#define CONSOLE_TASK_PRIORITY   (tskIDLE_PRIORITY + 1)
+#define CONSOLE_RX_QUEUE_LENGTH 32
+#define CONSOLE_FRAME_BLOCKS    2
+#define CONSOLE_INJECT_WAIT_MS  10 // per character, the task drains the queue as fast as it echoes
+
+#define CONSOLE_PROMPT          "> "
+
+//=====================================================================================================================
+// Globals
+//=====================================================================================================================
+
+static StaticTask_t  g_consoleTaskBuf;
+static StackType_t   g_consoleTaskStack[CONSOLE_TASK_STACK_SIZE];
+
+static StaticQueue_t g_consoleQueueBuf;
+static uint8_t       g_consoleQueueStorage[CONSOLE_RX_QUEUE_LENGTH];
+static QueueHandle_t g_consoleQueue = NULL;
+
+static const SConsoleCommand_t *g_pCommands[CONSOLE_MAX_COMMANDS] = {0};
+static uint8_t                  g_numCommands                     = 0;
+
+static char                     g_line[CONSOLE_LINE_LENGTH];
+
+static fnConsoleLineHook        g_fnLineHook                      = NULL;
+static void                    *g_pLineHookCtx                    = NULL;
+
+POOL_DEFINE(g_consoleFramePool, uint8_t[CONSOLE_FRAME_SIZE], CONSOLE_FRAME_BLOCKS);
+
+//=====================================================================================================================
+// Static protos
+//=====================================================================================================================
+
+static void consoleTask(void *);
+static void executeLine(char *);
+static void helpCommand(int, char *[]);
+static void poolCommand(int, char *[]);
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+/**
+ * @brief create the console task and hook its queue to the USART receiver
+ *
+ */
+void initConsole(void)
+{
+    static const SConsoleCommand_t helpCmd = { "help", "list commands", helpCommand };
+    static const SConsoleCommand_t poolCmd = { "pool", "memory pool usage", poolCommand };
+
+    g_consoleQueue = xQueueCreateStatic(CONSOLE_RX_QUEUE_LENGTH, sizeof(uint8_t), g_consoleQueueStorage,
+                                        &g_consoleQueueBuf);
+
+    (void)consoleRegisterCommand(&helpCmd);
+    (void)consoleRegisterCommand(&poolCmd);
+
+    (void)xTaskCreateStatic(consoleTask, "con", CONSOLE_TASK_STACK_SIZE, NULL, CONSOLE_TASK_PRIORITY,
+                            &g_consoleTaskStack[0], &g_consoleTaskBuf);
+
+    setConsoleInputQueue(&g_consoleQueue);
+    toggleUsartRX(true);
+}
+
+/**
+ * @brief add a command to the console. call before the scheduler starts
+ *
+ * @param pCommand command definition, must stay valid
+ * @return false if the table is full
+ */
+bool consoleRegisterCommand(const SConsoleCommand_t *pCommand)
+{
+    if (g_numCommands >= CONSOLE_MAX_COMMANDS) return false;
+
+    g_pCommands[g_numCommands++] = pCommand;
+
+    return true;
+}
+
+/**
+ * @brief set the hook that sees every entered line before it runs. runs in the console task
+ *
+ * @param fnCb called with the complete line, NULL for none
+ * @param pUserCtx passed to fnCb
+ */
+void consoleSetLineHook(fnConsoleLineHook fnCb, void *pUserCtx)
+{
+    g_pLineHookCtx = pUserCtx;
+    g_fnLineHook   = fnCb;
+}
+
+/**
+ * @brief type a line into the console as if it came from the USART. task context, not the console task itself
+ *
+ * @param pLine zero-terminated line without line end
+ * @return false if the console didn't take it in time, the rest of the line is dropped
+ */
+bool consoleInject(const char *pLine)
+{
+    uint8_t c;
+
+    do
+    {
+        c = (*pLine != '\0') ? (uint8_t)*pLine++ : (uint8_t)'\r';
+
+        if (xQueueSendToBack(g_consoleQueue, &c, pdMS_TO_TICKS(CONSOLE_INJECT_WAIT_MS)) != pdPASS) return false;
+    }
+    while (c != '\r');
+
+    return true;
+}
+
+/**
+ * @brief print a string, "\n" is expanded to CRLF
+ *
+ * @param pStr zero-terminated string
+ */
+void consolePuts(const char *pStr)
+{
+    while (*pStr != '\0')
+    {
+        if (*pStr == '\n') consolePutchar('\r');
+        consolePutchar(*pStr++);
+    }
+}
+
+/**
+ * @brief print a signed decimal number
+ *
+ * @param value number to print
+ */
+void consolePutDec(int32_t value)
+{
+    char     buf[11];
+    uint8_t  len       = 0;
+    uint32_t magnitude = (value < 0) ? (0u - (uint32_t)value) : (uint32_t)value;
+
+    if (value < 0) consolePutchar('-');
+
+    do
+    {
+        buf[len++] = (char)('0' + (magnitude % 10));
+        magnitude /= 10;
+    }
+    while (magnitude != 0);
+
+    while (len > 0) consolePutchar(buf[--len]);
+}
+
+/**
+ * @brief print a number as fixed-width hex, without prefix
+ *
+ * @param value number to print
+ * @param digits number of hex digits, 1..8
+ */
+void consolePutHex(uint32_t value, uint8_t digits)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    while (digits > 0)
+    {
+        digits--;
+        consolePutchar(hex[(value >> (digits * 4)) & 0xF]);
+    }
+}
+
+/**
+ * @brief write raw bytes, no translation
+ *
+ * @param pData bytes to send
+ * @param len number of bytes
+ */
+void consoleWrite(const uint8_t *pData, size_t len)
+{
+    while (len--) consolePutchar((char)*pData++);
+}
+
+/**
+ * @brief parse a signed decimal argument
+ *
+ * @param pStr argument string
+ * @param[out] pValue parsed value
+ * @return false if the string isn't a complete decimal number
+ */
+bool consoleParseInt(const char *pStr, int32_t *pValue)
+{
+    bool    negative = (*pStr == '-');
+    int32_t value    = 0;
+
+    if (negative) pStr++;
+    if (*pStr == '\0') return false;
+
+    while (*pStr != '\0')
+    {
+        int32_t digit = *pStr++ - '0';
+
+        if ((digit < 0) || (digit > 9) || (value > ((INT32_MAX - digit) / 10))) return false;
+        value = (value * 10) + digit;
+    }
+
+    *pValue = negative ? -value : value;
+
+    return true;
+}
+
+//=====================================================================================================================
+// Statics
+//=====================================================================================================================
+
+/**
+ * @brief console task main loop: collect a line with echo and basic editing, then run it
+ *
+ */
+static void consoleTask(void *pParam)
+{
+    uint8_t len = 0;
+    uint8_t c;
+
+    consolePuts("\nnbtgTimer\n" CONSOLE_PROMPT);
+
+    while (true)
+    {
+        if (xQueueReceive(g_consoleQueue, &c, portMAX_DELAY) != pdPASS) continue;
+
+        if ((c == '\r') || (c == '\n'))
+        {
+            consolePuts("\n");
+            g_line[len] = '\0';
+            if ((len > 0) && (g_fnLineHook != NULL)) g_fnLineHook(g_line, g_pLineHookCtx);
+            if (len > 0) executeLine(g_line);
+            len = 0;
+            consolePuts(CONSOLE_PROMPT);
+        }
+        else if ((c == '\b') || (c == 0x7F))
+        {
+            if (len > 0)
+            {
+                len--;
+                consolePuts("\b \b");
+            }
+        }
+        else if ((c >= ' ') && (len < (CONSOLE_LINE_LENGTH - 1)))
+        {
+            g_line[len++] = (char)c;
+            consolePutchar((char)c);
+        }
+    }
+}
+
+/**
+ * @brief split a line into arguments in place and dispatch it
+ *
+ * @param pLine zero-terminated line, modified
+ */
+static void executeLine(char *pLine)
+{
+    char *argv[CONSOLE_MAX_ARGS];
+    int   argc = 0;
+
+    while ((*pLine != '\0') && (argc < CONSOLE_MAX_ARGS))
+    {
+        while (*pLine == ' ') *pLine++ = '\0';
+        if (*pLine == '\0') break;
+
+        argv[argc++] = pLine;
+        while ((*pLine != ' ') && (*pLine != '\0')) pLine++;
+    }
+
+    if (argc == 0) return;
+
+    for (uint8_t i = 0; i < g_numCommands; i++)
+    {
+        if (strcmp(argv[0], g_pCommands[i]->pName) == 0)
+        {
+            g_pCommands[i]->fnHandler(argc, argv);
+            return;
+        }
+    }
+
+    consolePuts("unknown command, try help\n");
+}
+
+/**
+ * @brief "help": list all registered commands
+ *
+ */
+static void helpCommand(int argc, char *argv[])
+{
+    for (uint8_t i = 0; i < g_numCommands; i++)
+    {
+        consolePuts(g_pCommands[i]->pName);
+        consolePuts("\t");
+        consolePuts(g_pCommands[i]->pHelp);
+        consolePuts("\n");
+    }
+}
+
+/**
+ * @brief "pool": list every memory pool with its block size, blocks in use, high-water mark and refused allocations
+ *
+ */
+static void poolCommand(int argc, char *argv[])
+{
+    SPoolStats_t stats;
+
+    for (uint8_t i = 0; poolGetStats(i, &stats); i++)
+    {
+        consolePuts(stats.pName);
+        consolePuts("\t");
+        consolePutDec(stats.blockSize);
+        consolePuts("B used ");
+        consolePutDec(stats.numUsed);
+        consolePuts("/");
+        consolePutDec(stats.numBlocks);
+        consolePuts(" max ");
+        consolePutDec(stats.highWater);
+        consolePuts(" failed ");
+        consolePutDec(stats.numFailed);
+        consolePuts("\n");
+    }
+}
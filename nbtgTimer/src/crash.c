@@ -0,0 +1,346 @@
+/**
+ * @file  crash.c
+ * @brief post-mortem crash capture and event trace
+ *
+ * everything lives in one .noinit block, which the startup code neither copies nor zeroes: the trace ring, its write
+ * index and the crash record around it. tracing an event is a handful of stores with interrupts masked, so it's left
+ * on in release builds
+ *
+ * the capture paths only fill in the record and seal it with a CRC; they don't touch any peripheral, so they still
+ * work from a HardFault. the record is checked at the next boot, stamped with the reset flags, written to EEPROM at
+ * CRASH_EEPROM_ADDR and invalidated in RAM. a watchdog reset without a capture still stores the trace ring
+ *
+ * the Cortex-M0+ has no fault status registers (CFSR/HFSR/MMFAR): ICSR and SHCSR are recorded instead, and the
+ * stacked PC/LR plus the trace are what the post-mortem has to go on
+ */
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include "crash.h"
+
+#include <FreeRTOS.h>
+#include <task.h>
+
+#include <stddef.h>
+#include <string.h>
+
+#include "board.h"
+#include "console.h"
+#include "crc.h"
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define CRASH_MAGIC      0x48535243 // "CRSH"
+#define TRACE_MAGIC      0x43415254 // "TRAC"
+#define CRASH_VERSION    1
+
+#define CRASH_RESET_MASK (RCC_CSR_OBLRSTF | RCC_CSR_PINRSTF | RCC_CSR_PWRRSTF | RCC_CSR_SFTRSTF | RCC_CSR_IWDGRSTF | \
+                          RCC_CSR_WWDGRSTF | RCC_CSR_LPWRRSTF)
+
+#define CRASH_DUMP_BYTES_PER_LINE 16
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+/** @brief crash record, stored as-is in EEPROM. scripts/crash_decode.py unpacks the same layout */
+typedef struct __attribute__((packed))
+{
+    uint32_t           magic;
+    uint8_t            version;
+    uint8_t            cause;      //< ECrashCause_t
+    uint8_t            newest;     //< ring index of the newest event
+    uint8_t            numEvents;  //< valid ring entries
+    uint32_t           resetFlags; //< RCC_CSR of the reset that followed
+    uint32_t           line;       //< assert line
+    uint32_t           sp;         //< stack pointer the frame was read from
+    uint32_t           excReturn;  //< EXC_RETURN of the HardFault
+    uint32_t           icsr;       //< SCB_ICSR: active and pending exception
+    uint32_t           shcsr;      //< SCB_SHCSR: SVCall pending
+    sContextStateFrame frame;      //< stacked registers. asserts only have return_address: the failing call site
+    char               task[CRASH_NAME_LEN];
+    char               file[CRASH_NAME_LEN];
+    STraceEntry_t      events[CRASH_TRACE_EVENTS];
+    uint16_t           crc;
+} SCrashDump_t;
+
+typedef struct
+{
+    uint32_t     traceMagic; //< the ring has survived a warm reset
+    uint32_t     next;       //< next ring slot
+    SCrashDump_t dump;       //< dump.events is the live trace ring
+} SCrashNoInit_t;
+
+//=====================================================================================================================
+// Globals
+//=====================================================================================================================
+
+extern uint32_t _estack; // linker script: top of RAM
+
+static SCrashNoInit_t g_noInit __attribute__((section(".noinit")));
+
+static SCrashDump_t   g_stored; // EEPROM copy for the console, too big for its stack
+
+//=====================================================================================================================
+// Static protos
+//=====================================================================================================================
+
+static void beginCapture(ECrashCause_t, const char *);
+static void sealDump(void);
+static void copyName(char *, const char *);
+static void clockTraceNotifier(uint32_t, void *);
+static void crashCommand(int, char *[]);
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+/**
+ * @brief move a crash record from the last run to EEPROM and start the trace. call right after initBoard(), before
+ *        anything is traced
+ *
+ */
+void initCrash(void)
+{
+    static const SConsoleCommand_t crashCmd = { "crash", "show the stored crash dump, 'crash clear' erases it",
+                                                crashCommand };
+    SCrashDump_t *pDump      = &g_noInit.dump;
+    uint32_t      resetFlags = RCC->CSR & CRASH_RESET_MASK;
+    bool          captured   = (pDump->magic == CRASH_MAGIC) &&
+                               (pDump->crc == crc16((const uint8_t *)pDump, offsetof(SCrashDump_t, crc)));
+
+    RCC->CSR |= RCC_CSR_RMVF; // clear the reset flags for the next boot
+
+    if (g_noInit.traceMagic != TRACE_MAGIC)
+    {
+        // power-on: the no-init RAM is random
+        memset(&g_noInit, 0, sizeof(g_noInit));
+        g_noInit.traceMagic = TRACE_MAGIC;
+        captured            = false;
+    }
+    else if (!captured && ((resetFlags & (RCC_CSR_IWDGRSTF | RCC_CSR_WWDGRSTF)) != 0))
+    {
+        beginCapture(CRASH_CAUSE_WATCHDOG, NULL);
+        captured = true;
+    }
+
+    if (captured)
+    {
+        pDump->resetFlags = resetFlags;
+        sealDump();
+        (void)eepromWrite(CRASH_EEPROM_ADDR, (const uint8_t *)pDump, sizeof(SCrashDump_t));
+    }
+
+    pDump->magic = 0;
+
+    crashTrace(TRACE_BOOT, (uint16_t)(resetFlags >> 24));
+
+    (void)clockRegisterNotifier(clockTraceNotifier, NULL);
+    (void)consoleRegisterCommand(&crashCmd);
+}
+
+/**
+ * @brief add an event to the trace ring. safe from any context
+ *
+ * @param event event id
+ * @param arg event-specific argument
+ */
+void crashTrace(ETraceEvent_t event, uint16_t arg)
+{
+    uint32_t       primask = __get_PRIMASK();
+    STraceEntry_t *pEntry;
+
+    __disable_irq();
+
+    pEntry        = &g_noInit.dump.events[g_noInit.next & (CRASH_TRACE_EVENTS - 1)];
+    pEntry->tick  = xTaskGetTickCount();
+    pEntry->event = (uint8_t)event;
+    pEntry->ipsr  = (uint8_t)__get_IPSR();
+    pEntry->arg   = arg;
+
+    g_noInit.next = (g_noInit.next + 1) & (CRASH_TRACE_EVENTS - 1);
+    if (g_noInit.dump.numEvents < CRASH_TRACE_EVENTS) g_noInit.dump.numEvents++;
+
+    __set_PRIMASK(primask);
+}
+
+/**
+ * @brief record a HardFault. called from the fault handler
+ *
+ * @param pFrame stacked registers
+ * @param excReturn EXC_RETURN the handler was entered with
+ */
+void crashCaptureFault(const sContextStateFrame *pFrame, uint32_t excReturn)
+{
+    uint32_t sp = (uint32_t)pFrame;
+
+    __disable_irq(); // the reset follows, nothing gets to run after this
+    beginCapture(CRASH_CAUSE_HARDFAULT, NULL);
+
+    g_noInit.dump.sp        = sp;
+    g_noInit.dump.excReturn = excReturn;
+
+    // a corrupted stack pointer may be what faulted: don't fault again reading the frame
+    if (((sp & 3) == 0) && (sp >= SRAM_BASE) && ((sp + sizeof(sContextStateFrame)) <= (uint32_t)&_estack))
+    {
+        g_noInit.dump.frame = *pFrame;
+    }
+
+    sealDump();
+}
+
+/**
+ * @brief record a failed assert. called from vAssertCalled()
+ *
+ * @param pFile source file of the assert
+ * @param line source line of the assert
+ * @param caller return address into the failing function
+ */
+void crashCaptureAssert(const char *pFile, uint32_t line, uint32_t caller)
+{
+    const char *pBase = pFile;
+
+    for (const char *p = pFile; *p != '\0'; p++)
+    {
+        if ((*p == '/') || (*p == '\\')) pBase = p + 1;
+    }
+
+    __disable_irq();
+    beginCapture(CRASH_CAUSE_ASSERT, NULL);
+
+    g_noInit.dump.line                 = line;
+    g_noInit.dump.frame.return_address = caller;
+    copyName(g_noInit.dump.file, pBase);
+
+    sealDump();
+}
+
+/**
+ * @brief record a stack overflow. called from vApplicationStackOverflowHook()
+ *
+ * @param pTaskName task that overflowed
+ */
+void crashCaptureStackOverflow(const char *pTaskName)
+{
+    __disable_irq();
+    beginCapture(CRASH_CAUSE_STACK_OVERFLOW, pTaskName);
+    sealDump();
+}
+
+//=====================================================================================================================
+// Statics
+//=====================================================================================================================
+
+/**
+ * @brief fill in the parts every record has. the trace ring and its count are kept
+ *
+ * @param cause what happened
+ * @param pTaskName task to record, NULL for the running one
+ */
+static void beginCapture(ECrashCause_t cause, const char *pTaskName)
+{
+    SCrashDump_t *pDump     = &g_noInit.dump;
+    uint8_t       numEvents = pDump->numEvents; // counts the ring, which isn't cleared
+
+    memset(pDump, 0, offsetof(SCrashDump_t, events));
+
+    pDump->cause     = (uint8_t)cause;
+    pDump->newest    = (uint8_t)((g_noInit.next - 1) & (CRASH_TRACE_EVENTS - 1));
+    pDump->numEvents = numEvents;
+    pDump->icsr      = SCB->ICSR;
+    pDump->shcsr     = SCB->SHCSR;
+
+    if ((pTaskName == NULL) && (xTaskGetSchedulerState() != taskSCHEDULER_NOT_STARTED))
+    {
+        pTaskName = pcTaskGetName(NULL);
+    }
+
+    if (pTaskName != NULL) copyName(pDump->task, pTaskName);
+}
+
+/**
+ * @brief mark the record valid
+ *
+ */
+static void sealDump(void)
+{
+    g_noInit.dump.magic   = CRASH_MAGIC;
+    g_noInit.dump.version = CRASH_VERSION;
+    g_noInit.dump.crc     = crc16((const uint8_t *)&g_noInit.dump, offsetof(SCrashDump_t, crc));
+}
+
+/**
+ * @brief copy a name, truncated to CRASH_NAME_LEN and zero-padded
+ *
+ */
+static void copyName(char *pDst, const char *pSrc)
+{
+    for (uint8_t i = 0; i < CRASH_NAME_LEN; i++)
+    {
+        pDst[i] = *pSrc;
+        if (*pSrc != '\0') pSrc++;
+    }
+}
+
+/**
+ * @brief trace SYSCLK level changes. runs with interrupts masked
+ *
+ */
+static void clockTraceNotifier(uint32_t coreHz, void *pCtx)
+{
+    crashTrace(TRACE_CLOCK_LEVEL, (uint16_t)(coreHz / 1000000));
+}
+
+/**
+ * @brief "crash [clear]": print the crash record stored in EEPROM. the hex block is what scripts/crash_decode.py reads
+ *
+ */
+static void crashCommand(int argc, char *argv[])
+{
+    static const char *const causeNames[] = { "none", "hardfault", "assert", "stack overflow", "watchdog" };
+    const uint8_t           *pBytes       = (const uint8_t *)&g_stored;
+
+    if ((argc > 1) && (strcmp(argv[1], "clear") == 0))
+    {
+        uint32_t blank = 0;
+
+        if (!eepromWrite(CRASH_EEPROM_ADDR, (const uint8_t *)&blank, sizeof(blank))) consolePuts("eeprom error\n");
+        return;
+    }
+
+    if (!eepromRead(CRASH_EEPROM_ADDR, (uint8_t *)&g_stored, sizeof(g_stored)))
+    {
+        consolePuts("eeprom error\n");
+        return;
+    }
+
+    if ((g_stored.magic != CRASH_MAGIC) || (g_stored.version != CRASH_VERSION) ||
+        (g_stored.crc != crc16(pBytes, offsetof(SCrashDump_t, crc))) || (g_stored.cause > CRASH_CAUSE_WATCHDOG))
+    {
+        consolePuts("no crash stored\n");
+        return;
+    }
+
+    consolePuts(causeNames[g_stored.cause]);
+    consolePuts(" in ");
+    consoleWrite((const uint8_t *)g_stored.task, strnlen(g_stored.task, CRASH_NAME_LEN));
+    consolePuts(", pc ");
+    consolePutHex(g_stored.frame.return_address, 8);
+    consolePuts(" lr ");
+    consolePutHex(g_stored.frame.lr, 8);
+    consolePuts(", reset flags ");
+    consolePutHex(g_stored.resetFlags >> 24, 2);
+    consolePuts("\n-- crash dump --\n");
+
+    for (size_t i = 0; i < sizeof(g_stored); i++)
+    {
+        consolePutHex(pBytes[i], 2);
+        if (((i + 1) % CRASH_DUMP_BYTES_PER_LINE) == 0) consolePuts("\n");
+    }
+
+    consolePuts("\n-- end --\n");
+}
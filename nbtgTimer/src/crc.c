@@ -0,0 +1,40 @@
+/**
+ * @file  crc.c
+ * @brief CRC-16/CCITT-FALSE for records kept in EEPROM or no-init RAM
+ *
+ * bitwise rather than table-driven: the records are small and only rehashed when they change
+ */
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include "crc.h"
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+/**
+ * @brief CRC-16/CCITT-FALSE: polynomial 0x1021, initial value 0xFFFF, no reflection
+ *
+ * @param pData data to hash
+ * @param len number of bytes
+ * @return uint16_t CRC
+ */
+uint16_t crc16(const uint8_t *pData, size_t len)
+{
+    uint16_t crc = 0xFFFF;
+
+    while (len--)
+    {
+        crc ^= (uint16_t)(*pData++ << 8);
+
+        for (uint8_t i = 0; i < 8; i++)
+        {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+
+    return crc;
+}
@@ -0,0 +1,518 @@
+/**
+ * @file  diag.c
+ * @brief run-time health: per-task CPU load, stack headroom and ISR load
+ *
+ * the kernel keeps a run-time counter per task (TIM17, 1us) and the stack high-water marks. every DIAG_WINDOW_MS
+ * diagPoll() reads them with uxTaskGetSystemState() and turns the counter deltas into shares of the window. the BSP
+ * interrupt handlers time themselves (rtosIsrEnter/Exit), which gives the ISR share; that time is also part of the
+ * share of whichever task they interrupted. SysTick and PendSV are not timed
+ *
+ * outputs, all off the same snapshot:
+ * - "diag" prints the last window on the console, "diag stream on" sends it as a binary frame after every window
+ *   (~40 bytes: sync, length, sequence, payload, CRC-16 over length..payload). text from other tasks can interleave,
+ *   the sync bytes and the CRC let the host resynchronise
+ * - "diag screen on" replaces the display contents with the figures. there is no menu entry for it
+ *
+ * "diag bench" times the f-stop math on the target, in core cycles per call at the active clock. each function runs
+ * in batches timed on the run-time counter with interrupts enabled; the fastest batch counts, slower ones were
+ * interrupted. the accuracy of the same functions is checked on the host, see scripts/fstop_bench.py
+ */
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include "diag.h"
+
+#include <FreeRTOS.h>
+#include <task.h>
+
+#include <stddef.h>
+#include <string.h>
+
+#include "board.h"
+#include "console.h"
+#include "crc.h"
+#include "display.h"
+#include "fstop.h"
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define DIAG_PERMILLE       1000
+
+#define DIAG_SCREEN_LINE_H  10 // Font_7x10
+#define DIAG_SCREEN_LINES   6
+#define DIAG_SCREEN_CHARS   18 // 128 / 7
+
+#define DIAG_BENCH_CALLS    64 // calls per timed batch
+#define DIAG_BENCH_BATCHES  16
+#define DIAG_BENCH_STEPS    6  // test strip steps each side, the time table gets twice as many
+#define DIAG_BENCH_STRIDE   977 // ms between the times of successive calls, walks 100ms..~1min
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+typedef struct __attribute__((packed))
+{
+    uint8_t  number;
+    uint16_t cpuPermille;
+    uint16_t stackFreeBytes;
+} SDiagFrameTask_t;
+
+/** @brief binary stream frame, little endian. only numTasks entries and the CRC after them are sent */
+typedef struct __attribute__((packed))
+{
+    uint8_t          sync[2];
+    uint8_t          len;      //< payload bytes: windowUs..tasks[numTasks - 1]
+    uint8_t          sequence; //< increments per window, gaps are dropped frames
+    uint32_t         windowUs;
+    uint16_t         isrPermille;
+    uint8_t          numTasks;
+    SDiagFrameTask_t tasks[DIAG_MAX_TASKS];
+} SDiagFrame_t;
+
+_Static_assert(sizeof(SDiagFrame_t) + sizeof(uint16_t) <= CONSOLE_FRAME_SIZE, "diag frame exceeds a console frame");
+
+/** @brief one benchmarked call */
+typedef void (*fnBench)(uint32_t timeMs, EFStop_t resolution);
+
+/** @brief run-time counter at the start of the window */
+typedef struct
+{
+    UBaseType_t number;
+    uint32_t    runTimeUs;
+} SDiagBaseline_t;
+
+//=====================================================================================================================
+// Globals
+//=====================================================================================================================
+
+static TaskStatus_t    g_status[DIAG_MAX_TASKS];
+static SDiagBaseline_t g_baseline[DIAG_MAX_TASKS];
+static UBaseType_t     g_numBaseline  = 0;
+static uint32_t        g_baseTotalUs  = 0;
+static uint32_t        g_baseIsrUs    = 0;
+static TickType_t      g_windowStart  = 0;
+static bool            g_primed       = false; //< baselines taken, the next poll completes a window
+
+static SDiagSnapshot_t g_snapshot;
+static bool            g_snapshotValid = false;
+
+static uint8_t         g_sequence = 0;
+static volatile bool   g_stream = false;
+static volatile bool   g_screen = false;
+
+static volatile uint32_t g_benchSink; //< keeps the results of the timed calls alive
+static uint32_t          g_benchTable[(DIAG_BENCH_STEPS * 2) + 1];
+
+//=====================================================================================================================
+// Static protos
+//=====================================================================================================================
+
+static uint32_t baselineOf(UBaseType_t);
+static uint16_t permilleOf(uint32_t, uint32_t);
+static void     streamSnapshot(const SDiagSnapshot_t *);
+static void     drawSnapshot(const SDiagSnapshot_t *);
+static char    *formatPermille(char *, uint16_t);
+static char    *formatDec(char *, uint32_t);
+static void     printPermille(uint16_t);
+static void     benchFstop(void);
+static uint32_t benchCycles(fnBench, EFStop_t);
+static void     benchNextFStop(uint32_t, EFStop_t);
+static void     benchTimeTable(uint32_t, EFStop_t);
+static void     benchTestStrip(uint32_t, EFStop_t);
+static void     diagCommand(int, char *[]);
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+/**
+ * @brief register the "diag" console command
+ *
+ */
+void initDiag(void)
+{
+    static const SConsoleCommand_t diagCmd = { "diag", "task load and stack, 'diag stream|screen on|off|bench'",
+                                               diagCommand };
+
+    (void)consoleRegisterCommand(&diagCmd);
+}
+
+/**
+ * @brief close the sampling window once DIAG_WINDOW_MS have passed. call periodically from task context
+ *
+ */
+void diagPoll(void)
+{
+    TickType_t      now = xTaskGetTickCount();
+    SDiagSnapshot_t snapshot;
+    uint32_t        totalUs;
+    uint32_t        isrUs;
+    UBaseType_t     numTasks;
+
+    if (g_primed && ((now - g_windowStart) < pdMS_TO_TICKS(DIAG_WINDOW_MS))) return;
+
+    numTasks = uxTaskGetSystemState(g_status, DIAG_MAX_TASKS, &totalUs);
+    isrUs    = rtosIsrTimeUs();
+
+    if (g_primed && (numTasks != 0))
+    {
+        snapshot.windowUs    = totalUs - g_baseTotalUs;
+        snapshot.isrPermille = permilleOf(isrUs - g_baseIsrUs, snapshot.windowUs);
+        snapshot.numTasks    = 0;
+
+        // kernel task numbers follow creation order: list them that way
+        for (UBaseType_t number = 0; snapshot.numTasks < numTasks; number++)
+        {
+            for (UBaseType_t i = 0; i < numTasks; i++)
+            {
+                if (g_status[i].xTaskNumber != number) continue;
+
+                SDiagTask_t *pTask  = &snapshot.tasks[snapshot.numTasks++];
+                uint32_t     taskUs = g_status[i].ulRunTimeCounter - baselineOf(number);
+
+                strncpy(pTask->name, g_status[i].pcTaskName, DIAG_NAME_LEN);
+                pTask->number         = (uint8_t)number;
+                pTask->cpuPermille    = permilleOf(taskUs, snapshot.windowUs);
+                pTask->stackFreeBytes = (uint16_t)(g_status[i].usStackHighWaterMark * sizeof(StackType_t));
+            }
+        }
+
+        taskENTER_CRITICAL(); // the console may copy the snapshot
+        g_snapshot      = snapshot;
+        g_snapshotValid = true;
+        taskEXIT_CRITICAL();
+
+        if (g_stream) streamSnapshot(&snapshot);
+        if (g_screen) drawSnapshot(&snapshot);
+    }
+
+    for (UBaseType_t i = 0; i < numTasks; i++)
+    {
+        g_baseline[i].number    = g_status[i].xTaskNumber;
+        g_baseline[i].runTimeUs = g_status[i].ulRunTimeCounter;
+    }
+
+    g_numBaseline = numTasks;
+    g_baseTotalUs = totalUs;
+    g_baseIsrUs   = isrUs;
+    g_windowStart = now;
+    g_primed      = (numTasks != 0); // 0: more tasks than DIAG_MAX_TASKS
+}
+
+/**
+ * @brief copy the last completed window
+ *
+ * @param[out] pSnapshot window figures
+ * @return false if no window has completed yet
+ */
+bool diagGetSnapshot(SDiagSnapshot_t *pSnapshot)
+{
+    bool valid;
+
+    taskENTER_CRITICAL();
+    *pSnapshot = g_snapshot;
+    valid      = g_snapshotValid;
+    taskEXIT_CRITICAL();
+
+    return valid;
+}
+
+//=====================================================================================================================
+// Statics
+//=====================================================================================================================
+
+/**
+ * @brief run-time counter of a task at the start of the window
+ *
+ * @return 0 for a task created during the window
+ */
+static uint32_t baselineOf(UBaseType_t number)
+{
+    for (UBaseType_t i = 0; i < g_numBaseline; i++)
+    {
+        if (g_baseline[i].number == number) return g_baseline[i].runTimeUs;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief share of the window, clamped to 100%
+ *
+ */
+static uint16_t permilleOf(uint32_t partUs, uint32_t windowUs)
+{
+    if ((windowUs == 0) || (partUs >= windowUs)) return DIAG_PERMILLE;
+
+    return (uint16_t)(((uint64_t)partUs * DIAG_PERMILLE) / windowUs);
+}
+
+/**
+ * @brief send the window as a binary frame
+ *
+ */
+static void streamSnapshot(const SDiagSnapshot_t *pSnapshot)
+{
+    size_t        frameLen = offsetof(SDiagFrame_t, tasks) + (pSnapshot->numTasks * sizeof(SDiagFrameTask_t));
+    uint8_t      *pBuf     = poolAlloc(&g_consoleFramePool);
+    SDiagFrame_t *pFrame   = (SDiagFrame_t *)pBuf;
+    uint16_t      crc;
+
+    g_sequence++;
+    if (pBuf == NULL) return; // shows up as a sequence gap
+
+    pFrame->sync[0]     = DIAG_FRAME_SYNC0;
+    pFrame->sync[1]     = DIAG_FRAME_SYNC1;
+    pFrame->len         = (uint8_t)(frameLen - offsetof(SDiagFrame_t, windowUs));
+    pFrame->sequence    = g_sequence;
+    pFrame->windowUs    = pSnapshot->windowUs;
+    pFrame->isrPermille = pSnapshot->isrPermille;
+    pFrame->numTasks    = pSnapshot->numTasks;
+
+    for (uint8_t i = 0; i < pSnapshot->numTasks; i++)
+    {
+        pFrame->tasks[i].number         = pSnapshot->tasks[i].number;
+        pFrame->tasks[i].cpuPermille    = pSnapshot->tasks[i].cpuPermille;
+        pFrame->tasks[i].stackFreeBytes = pSnapshot->tasks[i].stackFreeBytes;
+    }
+
+    crc = crc16(&pFrame->len, frameLen - offsetof(SDiagFrame_t, len));
+    memcpy(&pBuf[frameLen], &crc, sizeof(crc));
+
+    consoleWrite(pBuf, frameLen + sizeof(crc));
+    poolFree(&g_consoleFramePool, pBuf);
+}
+
+/**
+ * @brief draw the window on the display: ISR load, then one line per task with name, load and stack headroom. a
+ *        render burst, held at the active clock level
+ *
+ */
+static void drawSnapshot(const SDiagSnapshot_t *pSnapshot)
+{
+    char  line[DIAG_SCREEN_CHARS + 1];
+    char *p;
+
+    clockRequestActive();
+
+    dispDrawFilledRectangle((SPoint_t){ 0, 0 }, (SPoint_t){ 127, 63 }, COLOR_BLACK);
+
+    memcpy(line, "isr  ", 5);
+    p  = formatPermille(&line[5], pSnapshot->isrPermille);
+    *p = '\0';
+
+    dispSetCursor(0, 0);
+    dispWriteString(line, Font_7x10, COLOR_WHITE);
+
+    for (uint8_t i = 0; (i < pSnapshot->numTasks) && (i < (DIAG_SCREEN_LINES - 1)); i++)
+    {
+        const SDiagTask_t *pTask = &pSnapshot->tasks[i];
+
+        memset(line, ' ', 5);
+        memcpy(line, pTask->name, strnlen(pTask->name, 4));
+        p    = formatPermille(&line[5], pTask->cpuPermille);
+        *p++ = ' ';
+        p    = formatDec(p, pTask->stackFreeBytes);
+        *p++ = 'B';
+        *p   = '\0';
+
+        dispSetCursor(0, (uint8_t)((i + 1) * DIAG_SCREEN_LINE_H));
+        dispWriteString(line, Font_7x10, COLOR_WHITE);
+    }
+
+    clockReleaseActive();
+}
+
+/**
+ * @brief format a share as "xx.x%", right-aligned to 5 digits
+ *
+ * @return end of the written text
+ */
+static char *formatPermille(char *p, uint16_t permille)
+{
+    if (permille < 100) *p++ = ' ';
+    p    = formatDec(p, permille / 10);
+    *p++ = '.';
+    *p++ = (char)('0' + (permille % 10));
+    *p++ = '%';
+
+    return p;
+}
+
+/**
+ * @brief format an unsigned decimal number
+ *
+ * @return end of the written text
+ */
+static char *formatDec(char *p, uint32_t value)
+{
+    char    digits[10];
+    uint8_t len = 0;
+
+    do
+    {
+        digits[len++] = (char)('0' + (value % 10));
+        value /= 10;
+    }
+    while (value != 0);
+
+    while (len > 0) *p++ = digits[--len];
+
+    return p;
+}
+
+/**
+ * @brief print a share as "x.x%"
+ *
+ */
+static void printPermille(uint16_t permille)
+{
+    consolePutDec(permille / 10);
+    consolePuts(".");
+    consolePutDec(permille % 10);
+    consolePuts("%");
+}
+
+/**
+ * @brief time the f-stop functions at every resolution and print cycles per call as CSV
+ *
+ * @note the times include the call through the benchmark wrapper, a few cycles
+ */
+static void benchFstop(void)
+{
+    static const char *const resolutionNames[] = { "full", "half", "third", "sixth" };
+
+    clockRequestActive();
+
+    consolePuts("resolution,next,table,strip\n");
+
+    for (EFStop_t resolution = FSTOP_FULL; resolution <= FSTOP_SIXTH; resolution++)
+    {
+        consolePuts(resolutionNames[resolution]);
+        consolePuts(",");
+        consolePutDec((int32_t)benchCycles(benchNextFStop, resolution));
+        consolePuts(",");
+        consolePutDec((int32_t)benchCycles(benchTimeTable, resolution));
+        consolePuts(",");
+        consolePutDec((int32_t)benchCycles(benchTestStrip, resolution));
+        consolePuts("\n");
+    }
+
+    clockReleaseActive();
+}
+
+/**
+ * @brief run a benchmark in batches of DIAG_BENCH_CALLS calls
+ *
+ * @param fnCall benchmarked call
+ * @param resolution passed to fnCall
+ * @return uint32_t core cycles per call in the fastest batch
+ */
+static uint32_t benchCycles(fnBench fnCall, EFStop_t resolution)
+{
+    uint32_t fastestUs = UINT32_MAX;
+
+    for (uint8_t batch = 0; batch < DIAG_BENCH_BATCHES; batch++)
+    {
+        uint32_t startUs = rtosTimerGetValue();
+
+        for (uint32_t i = 0; i < DIAG_BENCH_CALLS; i++)
+        {
+            fnCall(100 + (i * DIAG_BENCH_STRIDE), resolution);
+        }
+
+        uint32_t elapsedUs = rtosTimerGetValue() - startUs;
+
+        if (elapsedUs < fastestUs) fastestUs = elapsedUs;
+    }
+
+    return (fastestUs * (SystemCoreClock / 1000000)) / DIAG_BENCH_CALLS;
+}
+
+static void benchNextFStop(uint32_t timeMs, EFStop_t resolution)
+{
+    g_benchSink = calculateNextFStop(timeMs, (timeMs & 1) != 0, resolution); // both directions
+}
+
+static void benchTimeTable(uint32_t timeMs, EFStop_t resolution)
+{
+    getTimeTable(timeMs, false, DIAG_BENCH_STEPS * 2, resolution, &g_benchTable[0]);
+    g_benchSink = g_benchTable[0];
+}
+
+static void benchTestStrip(uint32_t timeMs, EFStop_t resolution)
+{
+    genererateTestStrip(timeMs, DIAG_BENCH_STEPS, resolution, &g_benchTable[0]);
+    g_benchSink = g_benchTable[0];
+}
+
+/**
+ * @brief "diag [stream|screen on|off|bench]": print the last window, switch the stream or the screen, or time the
+ *        f-stop math
+ *
+ */
+static void diagCommand(int argc, char *argv[])
+{
+    static SDiagSnapshot_t snapshot; // too big for the console stack
+
+    if ((argc == 2) && (strcmp(argv[1], "bench") == 0))
+    {
+        benchFstop();
+        return;
+    }
+
+    if (argc == 3)
+    {
+        bool enable = (strcmp(argv[2], "on") == 0);
+
+        if (!enable && (strcmp(argv[2], "off") != 0))
+        {
+            consolePuts("usage: diag [stream|screen on|off|bench]\n");
+        }
+        else if (strcmp(argv[1], "stream") == 0)
+        {
+            g_stream = enable;
+        }
+        else if (strcmp(argv[1], "screen") == 0)
+        {
+            g_screen = enable;
+        }
+        else
+        {
+            consolePuts("usage: diag [stream|screen on|off|bench]\n");
+        }
+        return;
+    }
+
+    if (!diagGetSnapshot(&snapshot))
+    {
+        consolePuts("no window yet\n");
+        return;
+    }
+
+    consolePuts("window ");
+    consolePutDec((int32_t)(snapshot.windowUs / 1000));
+    consolePuts("ms, isr ");
+    printPermille(snapshot.isrPermille);
+    consolePuts("\n  # name             cpu  stack free\n");
+
+    for (uint8_t i = 0; i < snapshot.numTasks; i++)
+    {
+        const SDiagTask_t *pTask = &snapshot.tasks[i];
+
+        consolePuts("  ");
+        consolePutDec(pTask->number);
+        consolePuts(" ");
+        consoleWrite((const uint8_t *)pTask->name, strnlen(pTask->name, DIAG_NAME_LEN));
+        for (size_t pad = strnlen(pTask->name, DIAG_NAME_LEN); pad < 16; pad++) consolePuts(" ");
+        printPermille(pTask->cpuPermille);
+        consolePuts("  ");
+        consolePutDec(pTask->stackFreeBytes);
+        consolePuts("B\n");
+    }
+}
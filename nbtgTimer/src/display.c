@@ -11,7 +11,13 @@
  * - double buffering
  * - horizontal addressing mode, allows for DMA'ing the full framebuffer in 1 chunk
  * - removed dependency on floating point math, fixed-point implementations
+ * - overlay layer for popups
  *
+ * the draw routines paint the scene buffer, or the overlay while it's selected with dispSetLayer(). drawing marks the
+ * pages it touches dirty; the frame timer composes only the dirty pages into the outgoing buffer and sends that, so
+ * the scene can be drawn on while DMA runs. the overlay keeps a mask of every pixel drawn on it, black ones included,
+ * and a covered page goes out as (scene AND NOT mask) OR overlay, a word at a time. showing or hiding a popup marks
+ * just the pages it covers, nothing underneath is redrawn
  */
 
 //=====================================================================================================================
@@ -40,6 +46,8 @@
 #define SSD1309_ROW_SIZE_BYTES        16
 #define SSD1309_GDDRAM_SIZE_BYTES     1024
 #define SSD1309_NUM_PAGES             8
+#define SSD1309_PAGE_SIZE_WORDS       (SSD1309_PAGE_SIZE_BYTES / sizeof(uint32_t))
+#define ALL_PAGES                     0xFF
 
 #define SSD1309_I2C_ADDR              0x78
 
@@ -64,19 +72,20 @@ static const int16_t g_cosLUT[72] = { 1024,  1020,  1008,  989,  962,  928,  887
 // Types
 //=====================================================================================================================
 
-/** @brief page/row union type. allows accessing pages in full or per-row */
+/** @brief page/row union type. allows accessing pages in full, per-row or per-word when compositing */
 typedef union
 {
-    uint8_t page[SSD1309_PAGE_SIZE_BYTES];
-    uint8_t rows[8][SSD1309_ROW_SIZE_BYTES];
-} __attribute__((packed)) UPageRow_t;
+    uint8_t  page[SSD1309_PAGE_SIZE_BYTES];
+    uint8_t  rows[8][SSD1309_ROW_SIZE_BYTES];
+    uint32_t words[SSD1309_PAGE_SIZE_WORDS];
+} UPageRow_t;
 
 /** @brief framebuffer union type. full buffer consists of 8 pages. */
 typedef union
 {
     uint8_t    buffer[SSD1309_GDDRAM_SIZE_BYTES];
     UPageRow_t pages[8];
-} __attribute__((packed)) UFrameBuffer_t;
+} UFrameBuffer_t;
 
 /** @brief main framebuffer struct. this implementation is double-buffered so we have 2 buffers of 1K */
 typedef struct
@@ -85,6 +94,13 @@ typedef struct
     __attribute__((aligned(4))) UFrameBuffer_t buffer2;
 } SFrameBuffer_t;
 
+/** @brief overlay layer: its pixels and a mask of the pixels it covers, 1K each */
+typedef struct
+{
+    __attribute__((aligned(4))) UFrameBuffer_t image;
+    __attribute__((aligned(4))) UFrameBuffer_t mask;
+} SOverlay_t;
+
 /** @brief display command struct. allows passing in optional parameters */
 typedef struct
 {
@@ -111,9 +127,12 @@ typedef struct
     bool                 DMAIsEnabled;
     bool                 DMAInProgress;
 
-    UFrameBuffer_t      *pFrontBuffer;
-    UFrameBuffer_t      *pBackBuffer;
-    bool                 fbModified;
+    UFrameBuffer_t      *pSceneBuffer; //< drawn on
+    UFrameBuffer_t      *pOutBuffer;   //< composed from the layers and sent
+    volatile uint8_t     dirtyPages;   //< bit per page to compose into the outgoing buffer
+    EDisplayLayer_t      layer;
+    bool                 overlayVisible;
+    uint8_t              overlayPages; //< bit per page with overlay pixels
     uint8_t              currentX;
     uint8_t              currentY;
 } SDisplayContext_t;
@@ -124,6 +143,7 @@ typedef struct
 
 SFrameBuffer_t           g_framebuffers;
 static SDisplayContext_t g_displayContext = { 0 };
+static SOverlay_t        g_overlay;
 
 /** @brief initialization sequence for SSD1309 in Mode 5 */
 SDisplayCommand_t SSD1309_INIT_SEQ[] = {
@@ -171,6 +191,7 @@ static void           dispWriteCommand(SDisplayCommand_t);
 static void           dispSyncFramebuffer(void *);
 
 static void           dispDMACallback(bool);
+static void           composePages(uint8_t);
 
 static void           drawArc(SPoint_t, uint8_t, uint16_t, uint16_t, uint16_t, uint16_t, uint16_t, uint8_t, EColor_t);
 
@@ -192,20 +213,24 @@ void initDisplay(EDisplayMode_t displayMode)
     g_displayContext.DMAInProgress = false;
     g_displayContext.DMAIsEnabled  = false;
     g_displayContext.isEnabled     = false;
-    g_displayContext.fbModified    = false;
+    g_displayContext.dirtyPages    = 0;
+    g_displayContext.layer         = LAYER_SCENE;
     g_displayContext.currentX      = 0;
     g_displayContext.currentY      = 0;
 
     memset(&g_framebuffers.buffer1.buffer, 0, SSD1309_GDDRAM_SIZE_BYTES);
     memset(&g_framebuffers.buffer2.buffer, 0, SSD1309_GDDRAM_SIZE_BYTES);
+    g_displayContext.overlayVisible = false;
+    g_displayContext.overlayPages   = ALL_PAGES;
+    dispClearOverlay();
 
-    g_displayContext.pFrontBuffer = &g_framebuffers.buffer1;
-    g_displayContext.pBackBuffer  = &g_framebuffers.buffer2;
+    g_displayContext.pSceneBuffer = &g_framebuffers.buffer1;
+    g_displayContext.pOutBuffer   = &g_framebuffers.buffer2;
 
     memset(&g_displayContext.dmaTransferContext, 0, sizeof(SDMATranferContext_t));
 
     g_displayContext.dmaTransferContext.address     = SSD1309_I2C_ADDR;
-    g_displayContext.dmaTransferContext.pBuffer     = g_displayContext.pFrontBuffer->buffer;
+    g_displayContext.dmaTransferContext.pBuffer     = g_displayContext.pOutBuffer->buffer;
     g_displayContext.dmaTransferContext.len         = SSD1309_GDDRAM_SIZE_BYTES;
     g_displayContext.dmaTransferContext.transferred = 0;
 
@@ -256,7 +281,87 @@ void toggleDisplay(bool enable)
 }
 
 /**
- * @brief draw a pixel in the backbuffer
+ * @brief select the layer the draw routines paint
+ *
+ * @param layer LAYER_SCENE, or LAYER_OVERLAY for popups
+ */
+void dispSetLayer(EDisplayLayer_t layer)
+{
+    g_displayContext.layer = layer;
+}
+
+/**
+ * @brief show or hide the overlay. only the pages it covers are composed again
+ *
+ * @param show true to show
+ */
+void dispShowOverlay(bool show)
+{
+    if (show == g_displayContext.overlayVisible) return;
+
+    g_displayContext.overlayVisible = show;
+    g_displayContext.dirtyPages |= g_displayContext.overlayPages;
+}
+
+/**
+ * @brief erase the overlay and its mask, uncovering the scene where it was visible
+ *
+ */
+void dispClearOverlay(void)
+{
+    for (uint8_t page = 0; page < SSD1309_NUM_PAGES; page++)
+    {
+        if (!(g_displayContext.overlayPages & (1 << page))) continue;
+
+        memset(g_overlay.image.pages[page].page, 0, SSD1309_PAGE_SIZE_BYTES);
+        memset(g_overlay.mask.pages[page].page, 0, SSD1309_PAGE_SIZE_BYTES);
+    }
+
+    if (g_displayContext.overlayVisible) g_displayContext.dirtyPages |= g_displayContext.overlayPages;
+    g_displayContext.overlayPages = 0;
+}
+
+/**
+ * @brief show a popup: a framed box with a line of text, centered on the overlay. replaces what the overlay held;
+ * dispShowOverlay(false) dismisses it
+ *
+ * @param pText text, cut after the last character that fits inside the frame
+ * @param font font to use
+ */
+void dispPopup(const char *pText, FontDef font)
+{
+    size_t  length   = strlen(pText);
+    size_t  maxChars = (SSD1309_WIDTH - 8) / font.FontWidth; // the frame takes 4 pixels on each side
+
+    if (length > maxChars) length = maxChars;
+
+    int16_t width = (int16_t)(length * font.FontWidth);
+    int16_t x     = (int16_t)((SSD1309_WIDTH - width) / 2);
+    int16_t y     = (int16_t)((SSD1309_HEIGHT - font.FontHeight) / 2);
+
+    dispClearOverlay();
+    dispSetLayer(LAYER_OVERLAY);
+
+    int16_t right  = x + width;
+    int16_t bottom = y + font.FontHeight;
+
+    dispDrawFilledRectangle((SPoint_t){ (uint8_t)(x - 4), (uint8_t)(y - 4) },
+                            (SPoint_t){ (uint8_t)(right + 3), (uint8_t)(bottom + 3) }, COLOR_BLACK);
+    dispDrawRectangle((SPoint_t){ (uint8_t)(x - 3), (uint8_t)(y - 3) },
+                      (SPoint_t){ (uint8_t)(right + 2), (uint8_t)(bottom + 2) }, COLOR_WHITE);
+    dispSetCursor((uint8_t)x, (uint8_t)y);
+
+    for (size_t i = 0; i < length; i++)
+    {
+        (void)dispWriteChar(pText[i], font, COLOR_WHITE);
+    }
+
+    dispSetLayer(LAYER_SCENE);
+    dispShowOverlay(true);
+}
+
+/**
+ * @brief draw a pixel on the selected layer
  *
  * @param pixel pixel to draw {x, y}. pixels are based on a 1,1 offset
  */
@@ -289,17 +394,32 @@ void dispDrawPixel(SPixel_t pixel)
     // Compute the correct bit position
     uint8_t bitPosition = y % 8;
 
+    UFrameBuffer_t *pBuffer = g_displayContext.pSceneBuffer;
+
+    if (g_displayContext.layer == LAYER_OVERLAY)
+    {
+        // black overlay pixels cover the scene too
+        pBuffer                             = &g_overlay.image;
+        g_overlay.mask.pages[page].page[x] |= (1 << bitPosition);
+        g_displayContext.overlayPages      |= (1 << page);
+    }
+
     // Set the pixel in the framebuffer
     if (pixel.color == COLOR_WHITE)
     {
-        g_displayContext.pFrontBuffer->pages[page].page[x] |= (1 << bitPosition);
+        pBuffer->pages[page].page[x] |= (1 << bitPosition);
     }
     else
     {
-        g_displayContext.pFrontBuffer->pages[page].page[x] &= ~(1 << bitPosition);
+        pBuffer->pages[page].page[x] &= ~(1 << bitPosition);
     }
 
-    g_displayContext.fbModified = true;
+    // after the pixel: the frame timer may compose this page in between, then it's simply composed again
+    __COMPILER_BARRIER();
+    if ((g_displayContext.layer == LAYER_SCENE) || g_displayContext.overlayVisible)
+    {
+        g_displayContext.dirtyPages |= (1 << page);
+    }
 }
 
 /**
@@ -722,10 +842,21 @@ static void dispWriteCommand(SDisplayCommand_t cmd)
 /**
  * @brief yeet the framebuffer to the display using DMA
  *
+ * @note runs from the TIM14 ISR, so it can't request the active clock level: it composes and sends at whatever level
+ *       is set. SCK doesn't depend on it (spiClockNotifier()); the drawing code brackets its render bursts instead
  */
 static void dispSyncFramebuffer(void *pCtx)
 {
-    if (!g_displayContext.isEnabled || !g_displayContext.DMAIsEnabled || !g_displayContext.fbModified || g_displayContext.DMAInProgress) return;
+    if (!g_displayContext.isEnabled || !g_displayContext.DMAIsEnabled || (g_displayContext.dirtyPages == 0) ||
+        g_displayContext.DMAInProgress)
+    {
+        return;
+    }
+
+    uint8_t dirtyPages = g_displayContext.dirtyPages;
+
+    g_displayContext.dirtyPages = 0;
+    composePages(dirtyPages);
 
     g_displayContext.DMAInProgress                  = true;
     g_displayContext.dmaTransferContext.transferred = 0;
@@ -747,15 +878,41 @@ static void dispSyncFramebuffer(void *pCtx)
  */
 static void dispDMACallback(bool isComplete)
 {
-    (void)isComplete;
-    // swap buffers for vsync
-    memcpy(g_displayContext.pBackBuffer->buffer, g_displayContext.pFrontBuffer->buffer, SSD1309_GDDRAM_SIZE_BYTES);
-    UFrameBuffer_t *pTmp                        = g_displayContext.pFrontBuffer;
-    g_displayContext.pFrontBuffer               = g_displayContext.pBackBuffer;
-    g_displayContext.pBackBuffer                = pTmp;
-    g_displayContext.dmaTransferContext.pBuffer = g_displayContext.pFrontBuffer->buffer;
-    g_displayContext.DMAInProgress              = false;
-    g_displayContext.fbModified                 = false;
+    // the outgoing buffer is only composed again once the transfer is over, no swap needed
+    if (!isComplete) g_displayContext.dirtyPages = ALL_PAGES;
+    g_displayContext.DMAInProgress = false;
+}
+
+/**
+ * @brief bring pages of the outgoing buffer up to date: a copy of the scene, or the scene with the overlay merged in
+ * where the overlay is shown and covers the page
+ *
+ * @param pages bit per page
+ */
+static void composePages(uint8_t pages)
+{
+    for (uint8_t page = 0; page < SSD1309_NUM_PAGES; page++)
+    {
+        if (!(pages & (1 << page))) continue;
+
+        const uint32_t *pScene = g_displayContext.pSceneBuffer->pages[page].words;
+        uint32_t       *pOut   = g_displayContext.pOutBuffer->pages[page].words;
+
+        if (!g_displayContext.overlayVisible || !(g_displayContext.overlayPages & (1 << page)))
+        {
+            memcpy(pOut, pScene, SSD1309_PAGE_SIZE_BYTES);
+            continue;
+        }
+
+        // overlay pixels are only ever set under the mask, so OR-ing the image in is enough
+        const uint32_t *pImage = g_overlay.image.pages[page].words;
+        const uint32_t *pMask  = g_overlay.mask.pages[page].words;
+
+        for (size_t i = 0; i < SSD1309_PAGE_SIZE_WORDS; i++)
+        {
+            pOut[i] = (pScene[i] & ~pMask[i]) | pImage[i];
+        }
+    }
 }
 
 //=====================================================================================================================
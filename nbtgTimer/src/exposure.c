@@ -0,0 +1,1542 @@
+/**
+ * @file exposure.c
+ *
+ * @brief exposure task
+ *
+ * the task owns the enlarger lamp. programs are handed over through a queue and run to completion by the
+ * interpreter in program.c; consecutive lamp steps are armed on TIM15 straight from the task as soon as the previous
+ * exposure has ended, without any UI involvement. the lamp is switched off from the timer ISR
+ *
+ * besides timed steps it runs multi-channel, closed-loop and zero-cross aligned exposures, and keeps the first step of
+ * an armed program loaded for the start inputs. every run is recorded in the journal once it has ended
+ */
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include "exposure.h"
+
+#include <FreeRTOS.h>
+#include <queue.h>
+#include <task.h>
+
+#include <stddef.h>
+#include <string.h>
+
+#include "board.h"
+#include "clockcal.h"
+#include "console.h"
+#include "crash.h"
+#include "journal.h"
+#include "mains.h"
+#include "meter.h"
+#include "replay.h"
+#include "session.h"
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define EXPOSURE_TASK_STACK_SIZE 160
+#define EXPOSURE_TASK_PRIORITY   (tskIDLE_PRIORITY + 3)
+#define EXPOSURE_QUEUE_LENGTH    2
+#define EXPOSURE_REQUEST_BLOCKS  (EXPOSURE_QUEUE_LENGTH + 1) // queued plus the one running
+#define EXPOSURE_PROGRAM_BLOCKS  2
+
+#define NOTIFY_IDX_TIMER         0 // lamp segment elapsed
+#define NOTIFY_IDX_OPERATOR      1 // operator pressed start/footswitch
+
+#define ZERO_CROSS_TIMEOUT_EDGES 4  // missing half-cycles tolerated before a zero-cross exposure is forced off
+#define MAINS_LOSS_HALF_CYCLES   2  // missing half-cycles (plus a quarter) that count as a power failure
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+typedef enum
+{
+    EXPOSURE_MODE_PROGRAM,
+    EXPOSURE_MODE_CHANNELS,
+    EXPOSURE_MODE_INTEGRATED,
+    EXPOSURE_MODE_ARMED, //< armed step, already started by the trigger ISR
+    EXPOSURE_MODE_ARM,   //< load the armed step for a new base time, not journaled
+} EExposureMode_t;
+
+/** @brief request posted to the exposure task */
+typedef struct
+{
+    EExposureMode_t mode;
+    union
+    {
+        struct
+        {
+            const SExposureProgram_t *pProgram;
+            uint32_t                  baseTime;
+        } program;
+        struct
+        {
+            uint32_t durationsMs[LAMP_CHANNEL_COUNT];
+            uint8_t  numChannels;
+        } channels;
+        struct
+        {
+            uint32_t nominalMs;
+        } integrated;
+        struct
+        {
+            const SExposureProgram_t *pProgram; //< NULL disarms
+            uint32_t                  baseMs;
+        } arm;
+    };
+} SExposureRequest_t;
+
+/** @brief zero-cross switching state, advanced from the zero-cross ISR */
+typedef enum
+{
+    ZC_IDLE,
+    ZC_LEAD, //< safelight off, counting down to the lamp-on crossing
+    ZC_ON,   //< lamp on, counting down to the lamp-off crossing
+} EZeroCrossState_t;
+
+_Static_assert(INTENSITY_FULL == LAMP_PWM_FULL, "intensity and PWM level scales differ");
+
+//=====================================================================================================================
+// Globals
+//=====================================================================================================================
+
+static StaticTask_t  g_exposureTaskBuf;
+static StackType_t   g_exposureTaskStack[EXPOSURE_TASK_STACK_SIZE];
+static TaskHandle_t  g_exposureTask = NULL;
+
+static StaticQueue_t g_exposureQueueBuf;
+static uint8_t       g_exposureQueueStorage[EXPOSURE_QUEUE_LENGTH * sizeof(SExposureRequest_t *)];
+static QueueHandle_t g_exposureQueue = NULL;
+
+POOL_DEFINE(g_exposureRequestPool, SExposureRequest_t, EXPOSURE_REQUEST_BLOCKS);
+POOL_DEFINE(g_progBufferPool, SProgBuffer_t, EXPOSURE_PROGRAM_BLOCKS);
+
+static volatile bool g_abortRequested = false;
+static volatile bool g_isBusy         = false;
+
+static volatile bool     g_lampLit     = false; //< lamp edges seen by lampEdge()
+static volatile uint32_t g_lampOnUs    = 0;
+static volatile uint32_t g_lampTotalUs = 0;     //< on-time of the current run, full-power equivalent
+static volatile uint32_t g_lampLevel   = INTENSITY_FULL; //< of the current step, scales g_lampTotalUs
+
+static uint32_t      g_dimMinOnMs      = 0; //< lamp steps shorter than this are dimmed, 0 for none
+static uint32_t      g_lastDimLevel    = INTENSITY_FULL;
+
+static uint32_t      g_safelightLeadMs = EXPOSURE_SAFELIGHT_LEAD_MS;
+
+static SLampModel_t         g_lampModel   = {0};
+static SPaperModel_t        g_paperModel;
+static SPaperModel_t const *g_pPaperModel = NULL; //< &g_paperModel while a paper model is set
+
+static SLightIntegral_t    g_integral;
+static volatile bool       g_integrating        = false; //< lamp is on in an integrated exposure
+static volatile bool       g_integralScheduled  = false; //< end already handed to TIM15
+static volatile bool       g_integralSaturated  = false;
+static uint32_t            g_integralNominalMs  = 0;
+static uint32_t            g_integralReference  = 0;
+
+static const SProgStep_t  g_baseStepSteps[] = { PROG_STEP_LAMP(), PROG_STEP_END() };
+const SExposureProgram_t g_baseStepProgram = { g_baseStepSteps, 2, FSTOP_FULL, 0 };
+
+static const SExposureProgram_t *g_pArmProgram    = NULL;  //< armed program, NULL if none. set by the task
+static uint32_t                  g_armBaseMs      = 0;
+static SProgContext_t            g_armCtx;                 //< armed program, past its first action
+static SProgAction_t             g_armAction;              //< first action, on TIM15 if it's a lamp step
+static volatile bool             g_armed          = false; //< the next start edge starts the armed program
+static volatile bool             g_armLoaded      = false; //< g_armAction is loaded on TIM15
+static volatile bool             g_levelHeld      = false; //< a fired armed step holds the SYSCLK level
+static volatile bool             g_rearmOnRelock  = false; //< a mains dropout disarmed, re-arm once it is back
+static volatile uint32_t         g_lastTriggerUs  = 0;
+static volatile uint32_t         g_droppedPresses = 0;     //< presses that never reached the task
+static fnArmAdvance              g_fnArmAdvance   = NULL;
+static void                     *g_pArmAdvanceCtx = NULL;
+
+static SMainsTracker_t            g_mains;
+static volatile bool              g_mainsSuspended      = false; //< edges ignored, see exposureSuspendMains()
+static bool                       g_zeroCrossSync       = false;
+static volatile EZeroCrossState_t g_zcState             = ZC_IDLE;
+static volatile uint32_t          g_zcEdgesLeft         = 0;
+static uint32_t                   g_zcHalfCycles        = 0;
+static int32_t                    g_quantisationErrorUs = 0;
+
+//=====================================================================================================================
+// Static protos
+//=====================================================================================================================
+
+static void exposureTask(void *);
+static bool queueRequest(SExposureRequest_t *);
+static void runProgram(const SExposureRequest_t *, SJournalEntry_t *);
+static void runChannels(const SExposureRequest_t *, SJournalEntry_t *);
+static void runIntegrated(const SExposureRequest_t *, SJournalEntry_t *);
+static void runSteps(SProgContext_t *, SProgAction_t, SJournalEntry_t *);
+static void runArmed(SJournalEntry_t *);
+static void armTimer(void);
+static void disarmTimer(void);
+static bool cancelArm(void);
+static void releaseLevelHold(void);
+static void lampEdge(bool);
+static uint32_t dimLamp(uint32_t);
+static void undimLamp(void);
+static bool runLamp(uint32_t);
+static bool runLampZeroCross(uint32_t);
+static bool waitOperator(void);
+static void lampOnCallback(void *);
+static void lampOffCallback(void *);
+static void channelsDoneCallback(void *);
+static void startTriggerCallback(void *);
+static void zeroCrossCallback(void *);
+static void mainsLostCallback(void *);
+static void rearmFromISR(void);
+static uint32_t mainsLossTimeoutUs(void);
+static void integrateBlockCallback(const volatile uint16_t *, void *);
+static void saturationCallback(void *);
+static void clockChangedCallback(uint32_t, void *);
+static void armCommand(int, char *[]);
+static void dimCommand(int, char *[]);
+static void exposeCommand(int, char *[]);
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+/**
+ * @brief create the exposure task and its request queue
+ *
+ */
+void initExposure(void)
+{
+    static const SConsoleCommand_t armCmd = { "arm", "pre-arm the start inputs, 'arm <ms>' or 'arm off'", armCommand };
+    static const SConsoleCommand_t dimCmd = { "dim", "LED head dimming, 'dim <min on-time ms>' or 'dim off'",
+                                              dimCommand };
+    static const SConsoleCommand_t exposeCmd = { "expose",
+                                                 "run an exposure, "
+                                                 "'expose prog <ms> <steps> [res]|ch <ms>..|int <ms>|go|stop'",
+                                                 exposeCommand };
+
+    g_exposureQueue = xQueueCreateStatic(EXPOSURE_QUEUE_LENGTH, sizeof(SExposureRequest_t *), g_exposureQueueStorage,
+                                         &g_exposureQueueBuf);
+
+    registerTimerCallback(TIMER_ENLARGER_LAMP_ON, lampOnCallback, NULL);
+    registerTimerCallback(TIMER_ENLARGER_LAMP_ENABLE, lampOffCallback, NULL);
+    registerTimerCallback(TIMER_LAMP_CHANNELS, channelsDoneCallback, NULL);
+    registerStartTriggerCallback(startTriggerCallback, NULL);
+
+    mainsInit(&g_mains);
+    registerZeroCrossCallback(zeroCrossCallback, NULL);
+    registerTimerCallback(TIMER_MAINS_LOST, mainsLostCallback, NULL);
+    (void)clockRegisterNotifier(clockChangedCallback, NULL);
+
+    g_exposureTask = xTaskCreateStatic(exposureTask, "exp", EXPOSURE_TASK_STACK_SIZE, NULL, EXPOSURE_TASK_PRIORITY,
+                                       &g_exposureTaskStack[0], &g_exposureTaskBuf);
+
+    toggleSafelight(true);
+
+    (void)consoleRegisterCommand(&armCmd);
+    (void)consoleRegisterCommand(&dimCmd);
+    (void)consoleRegisterCommand(&exposeCmd);
+}
+
+/**
+ * @brief keep a single lamp step of baseMs loaded, so the next footswitch or start button press starts it without
+ *        the task in the path. the step is reloaded after every run; call again whenever the base time changes
+ *
+ * @param baseMs nominal on-time in milliseconds, 0 disarms
+ * @return false if the queue is full
+ */
+bool exposureArm(uint32_t baseMs)
+{
+    return exposureArmProgram(&g_baseStepProgram, baseMs);
+}
+
+/**
+ * @brief arm a program for the start inputs, see exposureArm(). a leading lamp step is loaded on TIM15 and starts on
+ *        the press; the rest of the program runs from the task as usual
+ *
+ * @param pProgram program to arm, NULL disarms. must stay valid while armed, pool buffers are not freed
+ * @param baseMs base exposure in milliseconds, 0 disarms
+ * @return false if the program is invalid or the queue is full
+ */
+bool exposureArmProgram(const SExposureProgram_t *pProgram, uint32_t baseMs)
+{
+    if ((pProgram != NULL) && !progValidate(pProgram)) return false;
+
+    SExposureRequest_t *pReq = poolAlloc(&g_exposureRequestPool);
+
+    if (pReq == NULL) return false;
+
+    pReq->mode         = EXPOSURE_MODE_ARM;
+    pReq->arm.pProgram = pProgram;
+    pReq->arm.baseMs   = baseMs;
+
+    return queueRequest(pReq);
+}
+
+/**
+ * @brief set the hook that picks the program to arm after each armed run. runs in the exposure task, keep it short
+ *
+ * @param fnCb returns the next program given the one that ran and whether it completed, NULL disarms. NULL for no
+ *        hook, the same program is armed again
+ * @param pUserCtx passed to fnCb
+ */
+void exposureSetArmAdvance(fnArmAdvance fnCb, void *pUserCtx)
+{
+    g_pArmAdvanceCtx = pUserCtx;
+    g_fnArmAdvance   = fnCb;
+}
+
+/**
+ * @brief queue a program for execution
+ *
+ * @param pProgram program to run. must stay valid until the run has finished; an SProgBuffer_t from g_progBufferPool
+ *        is handed over on success and freed by the task
+ * @param baseTime base exposure in milliseconds
+ * @return true if the program was valid and queued
+ */
+bool exposureRunProgram(const SExposureProgram_t *pProgram, uint32_t baseTime)
+{
+    if (!progValidate(pProgram)) return false;
+
+    SExposureRequest_t *pReq = poolAlloc(&g_exposureRequestPool);
+
+    if (pReq == NULL) return false;
+
+    pReq->mode             = EXPOSURE_MODE_PROGRAM;
+    pReq->program.pProgram = pProgram;
+    pReq->program.baseTime = baseTime;
+
+    return queueRequest(pReq);
+}
+
+/**
+ * @brief queue a synchronized multi-channel exposure on the TIM1 lamp outputs
+ *
+ * @param pDurationsMs on-time per channel in milliseconds (CH1 first), 0 leaves a channel off
+ * @param numChannels number of entries, at most LAMP_CHANNEL_COUNT
+ * @return true if the durations are in range and the exposure was queued. false while TIM1 dims the head, see
+ *         exposureSetLampDimming()
+ */
+bool exposureRunChannels(const uint32_t *pDurationsMs, uint8_t numChannels)
+{
+    uint32_t durationsMs[LAMP_CHANNEL_COUNT];
+
+    if ((numChannels == 0) || (numChannels > LAMP_CHANNEL_COUNT) || (g_dimMinOnMs != 0)) return false;
+
+    for (uint8_t i = 0; i < numChannels; i++)
+    {
+        durationsMs[i] =
+            (pDurationsMs[i] == 0) ? 0 : clockCalCorrectMs(lampModelCompensate(&g_lampModel, pDurationsMs[i]));
+        if (durationsMs[i] > LAMP_CHANNEL_MAX_MS) return false;
+    }
+
+    SExposureRequest_t *pReq = poolAlloc(&g_exposureRequestPool);
+
+    if (pReq == NULL) return false;
+
+    pReq->mode                 = EXPOSURE_MODE_CHANNELS;
+    pReq->channels.numChannels = numChannels;
+    for (uint8_t i = 0; i < numChannels; i++)
+    {
+        pReq->channels.durationsMs[i] = durationsMs[i];
+    }
+
+    return queueRequest(pReq);
+}
+
+/**
+ * @brief queue a closed-loop exposure that ends when the easel probe has integrated the light of nominalMs at the
+ *        metering calibration level
+ *
+ * @param nominalMs exposure time at the calibration level, in milliseconds
+ * @return false if the photometer is not calibrated or the queue is full
+ */
+bool exposureRunIntegrated(uint32_t nominalMs)
+{
+    if ((nominalMs == 0) || (meterReferenceLevel() == 0)) return false;
+
+    SExposureRequest_t *pReq = poolAlloc(&g_exposureRequestPool);
+
+    if (pReq == NULL) return false;
+
+    pReq->mode                 = EXPOSURE_MODE_INTEGRATED;
+    pReq->integrated.nominalMs = nominalMs;
+
+    return queueRequest(pReq);
+}
+
+/**
+ * @brief result of the last closed-loop exposure
+ *
+ * @param[out] pDeliveredMs delivered light, in milliseconds at the calibration level
+ * @return false if the probe saturated and the exposure fell back to the nominal time
+ */
+bool exposureIntegratedResult(uint32_t *pDeliveredMs)
+{
+    *pDeliveredMs = (g_integralReference == 0) ? 0 : (uint32_t)(g_integral.accum / g_integralReference);
+
+    return !g_integralSaturated;
+}
+
+/**
+ * @brief abort the running program. the lamp is switched off immediately
+ *
+ */
+void exposureAbort(void)
+{
+    bool wasArmed = cancelArm(); // nothing is running then, the step is loaded again below
+
+    crashTrace(TRACE_EXPOSURE_ABORT, 0);
+
+    g_abortRequested = true;
+    g_zcState        = ZC_IDLE;
+
+    stopEnlargerTimer();
+    stopLampChannels();
+    toggleOptocoupler(false);
+    toggleSafelight(true);
+
+    taskENTER_CRITICAL();
+    lampEdge(false);
+    taskEXIT_CRITICAL();
+
+    xTaskNotifyGiveIndexed(g_exposureTask, NOTIFY_IDX_TIMER);
+    xTaskNotifyGiveIndexed(g_exposureTask, NOTIFY_IDX_OPERATOR);
+
+    if (wasArmed) (void)exposureArmProgram(g_pArmProgram, g_armBaseMs);
+}
+
+/**
+ * @brief check whether the exposure task has work
+ *
+ * @return true if a request is running or queued
+ */
+bool exposureIsBusy(void)
+{
+    return g_isBusy || (uxQueueMessagesWaiting(g_exposureQueue) != 0);
+}
+
+/**
+ * @brief check whether the start inputs would fire an armed program now. safe from any context
+ *
+ * @return true while armed
+ */
+bool exposureIsArmed(void)
+{
+    return g_armed;
+}
+
+/**
+ * @brief set the time the safelight is switched off ahead of each lamp-on edge. takes effect from the next lamp step
+ *
+ * @param leadMs lead time in milliseconds, 0 switches safelight and lamp over together
+ * @return false if leadMs exceeds ENLARGER_MAX_LEAD_MS
+ */
+bool exposureSetSafelightLead(uint32_t leadMs)
+{
+    if (leadMs > ENLARGER_MAX_LEAD_MS) return false;
+
+    g_safelightLeadMs = leadMs;
+
+    return true;
+}
+
+/**
+ * @brief set the calibrated lamp time constants. lamp on-times are stretched so the integrated light matches the
+ *        nominal time; takes effect from the next queued request. the compensation is applied when channels are queued
+ *        or a program's working time is computed, never at the lamp-on edge
+ *
+ * @param riseMs rise time constant in milliseconds, 0 disables compensation
+ * @param fallMs fall time constant in milliseconds
+ * @return false if a time constant exceeds LAMP_MODEL_MAX_TAU_MS
+ */
+bool exposureSetLampModel(uint16_t riseMs, uint16_t fallMs)
+{
+    SLampModel_t model;
+    bool         valid = lampModelInit(&model, riseMs, fallMs);
+
+    if (valid)
+    {
+        taskENTER_CRITICAL();
+        g_lampModel = model;
+        taskEXIT_CRITICAL();
+    }
+
+    return valid;
+}
+
+/**
+ * @brief set the paper correction for base time program steps, see paperCorrect(). takes effect from the next queued
+ *        request; an armed program is loaded again with it
+ *
+ * @param pModel precomputed paper constants, copied. NULL for no correction
+ */
+void exposureSetPaperModel(SPaperModel_t const *pModel)
+{
+    taskENTER_CRITICAL();
+    if (pModel != NULL) g_paperModel = *pModel;
+    g_pPaperModel = (pModel != NULL) ? &g_paperModel : NULL;
+    taskEXIT_CRITICAL();
+
+    if (g_pArmProgram != NULL) (void)exposureArmProgram(g_pArmProgram, g_armBaseMs);
+}
+
+/**
+ * @brief dim an LED head for short lamp steps, see intensityForMinTime(). switches TIM1 between the dimming output
+ *        and the multi-channel outputs, so multi-channel runs are refused while dimming is set
+ *
+ * @param minOnMs shortest on-time, shorter steps run dimmed for this long. 0 for a head without a dimming input
+ * @return false while the exposure task is busy or a step is armed, the armed step may already hold a dimmed level
+ */
+bool exposureSetLampDimming(uint32_t minOnMs)
+{
+    if (exposureIsBusy() || g_armLoaded) return false;
+
+    setLampPwmMode(minOnMs != 0);
+    g_dimMinOnMs = minOnMs;
+
+    return true;
+}
+
+/**
+ * @brief align lamp steps to mains zero crossings. only takes effect while the zero-cross detector is locked; without
+ *        it, lamp steps fall back to TIM15
+ *
+ * @param enable true to switch on zero crossings
+ */
+void exposureSetZeroCrossSync(bool enable)
+{
+    g_zeroCrossSync = enable;
+}
+
+/**
+ * @brief check whether the zero-cross detector delivers a stable mains frequency
+ *
+ * @return true if lamp steps would currently be zero-cross aligned
+ */
+bool exposureZeroCrossLocked(void)
+{
+    return mainsLocked(&g_mains);
+}
+
+/**
+ * @brief quantisation error of the last zero-cross aligned lamp step
+ *
+ * @return int32_t delivered minus requested on-time in microseconds
+ */
+int32_t exposureQuantisationErrorUs(void)
+{
+    return g_quantisationErrorUs;
+}
+
+/**
+ * @brief fetch and clear the mains time measured by the zero-cross tracker, for clock calibration
+ *
+ * @param[out] pElapsedUs time covered by accepted edges, on the HSI-derived capture clock
+ * @param[out] pHalfCycles mains half-cycles in pElapsedUs, 0 while the detector is not locked
+ */
+void exposureTakeMainsPeriods(uint32_t *pElapsedUs, uint32_t *pHalfCycles)
+{
+    taskENTER_CRITICAL();
+    mainsTakeSum(&g_mains, pElapsedUs, pHalfCycles);
+    taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief stop or restart the mains tracker around work that stalls flash fetches (and so the zero-cross ISR) for
+ *        longer than the mains-loss timeout, e.g. page erases. while stopped a supply failure goes unnoticed
+ *
+ * @param suspend true to ignore zero-cross edges and disarm the mains-loss watchdog, false to relock from scratch
+ */
+void exposureSuspendMains(bool suspend)
+{
+    taskENTER_CRITICAL();
+    g_mainsSuspended = suspend;
+    disarmMainsWatchdog();
+    mainsInit(&g_mains);
+    taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief release a PROG_OP_PAUSE or PROG_OP_BEEP_WAIT step from task context
+ *
+ */
+void exposureOperatorContinue(void)
+{
+    xTaskNotifyGiveIndexed(g_exposureTask, NOTIFY_IDX_OPERATOR);
+}
+
+/**
+ * @brief release a PROG_OP_PAUSE or PROG_OP_BEEP_WAIT step from a button or footswitch ISR
+ *
+ */
+void exposureOperatorContinueFromISR(void)
+{
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveIndexedFromISR(g_exposureTask, NOTIFY_IDX_OPERATOR, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+//=====================================================================================================================
+// Statics
+//=====================================================================================================================
+
+/**
+ * @brief exposure task main loop
+ *
+ * @note every lamp phase holds SYSCLK at the active level, except a fired armed step: that one counts at whatever
+ *       level it was pressed at, frozen there until it ends. operator pauses and an armed step waiting for the press
+ *       don't hold it
+ */
+static void exposureTask(void *pParam)
+{
+    SExposureRequest_t *pReq;
+
+    while (true)
+    {
+        if (xQueueReceive(g_exposureQueue, &pReq, portMAX_DELAY) == pdPASS)
+        {
+            if (pReq->mode == EXPOSURE_MODE_ARM)
+            {
+                g_pArmProgram = pReq->arm.pProgram;
+                g_armBaseMs   = pReq->arm.baseMs;
+                poolFree(&g_exposureRequestPool, pReq);
+                armTimer();
+                continue;
+            }
+
+            SJournalEntry_t entry = { .mode = (uint8_t)pReq->mode }; // EExposureMode_t follows EJournalMode_t
+
+            g_isBusy = true;
+            sessionSetExposing(true);
+            crashTrace(TRACE_EXPOSURE_START, (uint16_t)pReq->mode);
+
+            if (pReq->mode == EXPOSURE_MODE_ARMED)
+            {
+                // started by startTriggerCallback(), which already cleared the abort flag and the lamp time
+                (void)ulTaskNotifyTakeIndexed(NOTIFY_IDX_OPERATOR, pdTRUE, 0);
+                runArmed(&entry);
+            }
+            else
+            {
+                disarmTimer();
+
+                // drop stale operator presses and aborts from before this run
+                g_abortRequested = false;
+                (void)ulTaskNotifyTakeIndexed(NOTIFY_IDX_TIMER, pdTRUE, 0);
+                (void)ulTaskNotifyTakeIndexed(NOTIFY_IDX_OPERATOR, pdTRUE, 0);
+                g_lampTotalUs = 0;
+
+                if (pReq->mode == EXPOSURE_MODE_CHANNELS)
+                {
+                    runChannels(pReq, &entry);
+                }
+                else if (pReq->mode == EXPOSURE_MODE_INTEGRATED)
+                {
+                    runIntegrated(pReq, &entry);
+                }
+                else
+                {
+                    runProgram(pReq, &entry);
+
+                    // a buffer from the pool was handed over with the request, see exposureRunProgram()
+                    if (poolContains(&g_progBufferPool, pReq->program.pProgram))
+                    {
+                        poolFree(&g_progBufferPool, (void *)(uintptr_t)pReq->program.pProgram);
+                    }
+                }
+            }
+
+            poolFree(&g_exposureRequestPool, pReq);
+
+            entry.deliveredMs = (g_lampTotalUs + 500) / 1000;
+            entry.aborted     = g_abortRequested;
+            journalAppend(&entry);
+
+            crashTrace(TRACE_EXPOSURE_END, 0);
+            sessionSetExposing(false);
+            g_isBusy = false;
+
+            if ((entry.mode == JOURNAL_MODE_ARMED) && (g_fnArmAdvance != NULL))
+            {
+                g_pArmProgram = g_fnArmAdvance(g_pArmProgram, !entry.aborted, g_pArmAdvanceCtx);
+            }
+
+            armTimer();
+        }
+    }
+}
+
+/**
+ * @brief hand a request to the task, ownership passes with the pointer. the task frees the block when the run ends,
+ *        together with the program buffer if the program was built in one from g_progBufferPool
+ *
+ * @param pReq request from g_exposureRequestPool, freed here if the queue is full
+ * @return true if queued
+ */
+static bool queueRequest(SExposureRequest_t *pReq)
+{
+    // nothing may start ahead of a queued request. if the step has fired already, its request is queued first. a
+    // re-arm pending from a mains dropout is superseded, the task arms again after any run
+    g_rearmOnRelock = false;
+    (void)cancelArm();
+
+    if (xQueueSendToBack(g_exposureQueue, &pReq, 0) == pdPASS) return true;
+
+    poolFree(&g_exposureRequestPool, pReq);
+
+    return false;
+}
+
+/**
+ * @brief interpret a single program until it finishes or is aborted
+ *
+ * @param pReq program + base time
+ * @param[out] pEntry journal record: requested time, stop offset, program id
+ */
+static void runProgram(const SExposureRequest_t *pReq, SJournalEntry_t *pEntry)
+{
+    SProgContext_t ctx;
+
+    progInit(&ctx, pReq->program.pProgram, &g_lampModel, g_pPaperModel, pReq->program.baseTime);
+
+    runSteps(&ctx, progNext(&ctx), pEntry);
+}
+
+/**
+ * @brief carry out program actions, starting with next, until the program finishes or is aborted
+ *
+ * @param pCtx interpreter context
+ * @param next first action, already taken from the interpreter
+ * @param[out] pEntry journal record: adds to the requested time, sets stop offset and program id
+ */
+static void runSteps(SProgContext_t *pCtx, SProgAction_t next, SJournalEntry_t *pEntry)
+{
+    bool proceed = true;
+
+    while (proceed)
+    {
+        switch (next.action)
+        {
+            case PROG_ACTION_LAMP:
+                pEntry->requestedMs += next.durationMs;
+                proceed              = runLamp(next.durationMs);
+                break;
+            case PROG_ACTION_WAIT_OPERATOR:
+                proceed = waitOperator();
+                break;
+            case PROG_ACTION_BEEP_WAIT:
+                toggleBuzzer(true);
+                vTaskDelay(pdMS_TO_TICKS(EXPOSURE_BEEP_MS));
+                toggleBuzzer(false);
+                proceed = waitOperator();
+                break;
+            case PROG_ACTION_DONE:
+            case PROG_ACTION_ERROR:
+            default:
+                proceed = false;
+                break;
+        }
+
+        if (proceed) next = progNext(pCtx);
+    }
+
+    pEntry->stopOffset = pCtx->stopOffset;
+    pEntry->programId  = pCtx->pProgram->id;
+}
+
+/**
+ * @brief run a synchronized multi-channel exposure and block until the last channel has switched off. all channels
+ *        start together and end on their own compare edge in hardware, the task only waits for the completion callback
+ *
+ * @param pReq channel durations
+ * @param[out] pEntry journal record: the longest channel is the requested time
+ */
+static void runChannels(const SExposureRequest_t *pReq, SJournalEntry_t *pEntry)
+{
+    for (uint8_t i = 0; i < pReq->channels.numChannels; i++)
+    {
+        if (pReq->channels.durationsMs[i] > pEntry->requestedMs) pEntry->requestedMs = pReq->channels.durationsMs[i];
+    }
+
+    clockRequestActive();
+
+    if (!armLampChannels(pReq->channels.durationsMs, pReq->channels.numChannels))
+    {
+        clockReleaseActive();
+        return;
+    }
+
+    // TIM1 has no spare compare for the lead, so it is a minimum here rather than an exact interval
+    toggleSafelight(false);
+    vTaskDelay(pdMS_TO_TICKS(g_safelightLeadMs));
+
+    if (!g_abortRequested)
+    {
+        lampEdge(true);
+        startLampChannels();
+    }
+
+    (void)ulTaskNotifyTakeIndexed(NOTIFY_IDX_TIMER, pdTRUE, portMAX_DELAY);
+
+    toggleSafelight(true);
+    clockReleaseActive();
+}
+
+/**
+ * @brief run a closed-loop exposure and block until TIM15 has switched the lamp off
+ *
+ * TIM15 is started with a multiple of the nominal time as the hard limit. the ADC block ISR integrates the easel probe
+ * and, once the end is less than one block away, schedules it on the running TIM15, so the lamp-off edge is still
+ * timed in hardware. a saturated probe falls back to the nominal time
+ *
+ * @param pReq nominal time
+ * @param[out] pEntry journal record: the nominal time is the requested time
+ */
+static void runIntegrated(const SExposureRequest_t *pReq, SJournalEntry_t *pEntry)
+{
+    uint32_t nominalMs = pReq->integrated.nominalMs;
+    uint32_t samples   = (uint32_t)(((uint64_t)nominalMs * ADC_SAMPLE_RATE_HZ) / 1000);
+
+    pEntry->requestedMs = nominalMs;
+
+    g_integralNominalMs = nominalMs;
+    g_integralReference = meterReferenceLevel() * ADC_SAMPLE_RATE_HZ / 1000; // light of 1ms at reference level
+    g_integralScheduled = false;
+    g_integralSaturated = false;
+    g_integrating       = false;
+    integralStart(&g_integral, (uint64_t)samples * meterReferenceLevel());
+
+    adcSetWatchdog(EXPOSURE_SATURATION_LEVEL, saturationCallback, NULL);
+    adcSetBlockCallback(integrateBlockCallback, NULL);
+
+    clockRequestActive();
+    toggleSafelight(false);
+    startEnlargerTimer(nominalMs * EXPOSURE_INTEGRATE_LIMIT, g_safelightLeadMs);
+
+    (void)ulTaskNotifyTakeIndexed(NOTIFY_IDX_TIMER, pdTRUE, portMAX_DELAY);
+
+    g_integrating = false;
+    adcSetBlockCallback(NULL, NULL);
+    adcSetWatchdog(0, NULL, NULL);
+    clockReleaseActive();
+}
+
+/**
+ * @brief run the armed program started by startTriggerCallback(): wait for the lamp step already running on TIM15,
+ *        then carry on with the rest of the program
+ *
+ * @param[out] pEntry journal record, as for runProgram()
+ */
+static void runArmed(SJournalEntry_t *pEntry)
+{
+    SProgAction_t next = g_armAction;
+
+    if (next.action == PROG_ACTION_LAMP)
+    {
+        pEntry->requestedMs = next.durationMs;
+
+        // the step counts at the level it was pressed at, startTriggerCallback() froze it there
+        (void)ulTaskNotifyTakeIndexed(NOTIFY_IDX_TIMER, pdTRUE, portMAX_DELAY);
+        undimLamp();
+        releaseLevelHold();
+
+        next = g_abortRequested ? (SProgAction_t){ PROG_ACTION_DONE, 0 } : progNext(&g_armCtx);
+    }
+
+    runSteps(&g_armCtx, next, pEntry);
+}
+
+/**
+ * @brief arm g_pArmProgram, replacing the program armed before, and load its first lamp step into TIM15. the step
+ *        stays loaded at the idle clock level, the timer notifier latches the prescaler if the level changes
+ *
+ * a press starts the step from the EXTI ISR with one counter-enable write and only then tells the task. the armed step
+ * is always timed on TIM15, a zero-cross wait would put software back between the press and the lamp. the press also
+ * takes a level hold, so no switch rescales TIM15 while the step counts (that would lose the prescaler phase)
+ */
+static void armTimer(void)
+{
+    disarmTimer();
+
+    if ((g_pArmProgram == NULL) || (g_armBaseMs == 0)) return;
+
+    progInit(&g_armCtx, g_pArmProgram, &g_lampModel, g_pPaperModel, g_armBaseMs);
+
+    do
+    {
+        g_armAction = progNext(&g_armCtx);
+    }
+    while ((g_armAction.action == PROG_ACTION_LAMP) && (g_armAction.durationMs == 0)); // nothing to load
+
+    if ((g_armAction.action == PROG_ACTION_DONE) || (g_armAction.action == PROG_ACTION_ERROR)) return;
+
+    if (g_armAction.action != PROG_ACTION_LAMP)
+    {
+        g_armed = true; // starts with an operator step, the press only hands the program to the task
+        return;
+    }
+
+    (void)ulTaskNotifyTakeIndexed(NOTIFY_IDX_TIMER, pdTRUE, 0);
+
+    uint32_t durationMs = clockCalCorrectMs(dimLamp(g_armAction.durationMs));
+
+    taskENTER_CRITICAL();
+    armEnlargerTimer(durationMs, g_safelightLeadMs);
+    g_armLoaded = true;
+    g_armed     = true;
+    taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief unload the armed step, if it hasn't fired. task only
+ *
+ */
+static void disarmTimer(void)
+{
+    (void)cancelArm();
+    undimLamp();
+    releaseLevelHold(); // left behind by a fired step whose press never reached the task
+}
+
+/**
+ * @brief unload the armed step unless the trigger got to it first. safe from any task
+ *
+ * @return true if a step was armed
+ */
+static bool cancelArm(void)
+{
+    bool wasArmed;
+
+    taskENTER_CRITICAL();
+    wasArmed = g_armed;
+    if (wasArmed)
+    {
+        g_armed     = false;
+        g_armLoaded = false;
+        stopEnlargerTimer();
+    }
+    taskEXIT_CRITICAL();
+
+    return wasArmed;
+}
+
+/**
+ * @brief drop the level hold a press took for the armed step, if it is still held. task only
+ *
+ */
+static void releaseLevelHold(void)
+{
+    bool held;
+
+    taskENTER_CRITICAL();
+    held        = g_levelHeld;
+    g_levelHeld = false;
+    taskEXIT_CRITICAL();
+
+    if (held) clockReleaseLevel();
+}
+
+/**
+ * @brief run one lamp step on TIM15 and block until it has switched the lamp off again. the duration is converted to
+ *        HSI-derived timer milliseconds with the clock calibration correction right before it's handed to TIM15
+ *
+ * @param durationMs on-time in milliseconds
+ * @return false if the run was aborted
+ */
+static bool runLamp(uint32_t durationMs)
+{
+    bool completed;
+
+    if (g_abortRequested) return false;
+    if (durationMs == 0) return true;
+
+    clockRequestActive();
+
+    durationMs = dimLamp(durationMs);
+
+    if (g_zeroCrossSync && mainsLocked(&g_mains))
+    {
+        completed = runLampZeroCross(durationMs);
+    }
+    else
+    {
+        toggleSafelight(false);
+        startEnlargerTimer(clockCalCorrectMs(durationMs), g_safelightLeadMs);
+
+        (void)ulTaskNotifyTakeIndexed(NOTIFY_IDX_TIMER, pdTRUE, portMAX_DELAY);
+
+        completed = !g_abortRequested;
+    }
+
+    undimLamp();
+    clockReleaseActive();
+
+    return completed;
+}
+
+/**
+ * @brief run one lamp step switched on mains zero crossings. the step is rounded to whole half-cycles and both edges
+ *        are switched from the zero-cross ISR; counting half-cycles needs no clock correction. the timeout catches a
+ *        detector that stops delivering edges mid-exposure
+ *
+ * @param durationMs requested on-time in milliseconds, rounded to whole half-cycles
+ * @return false if the run was aborted or the detector stopped delivering edges
+ */
+static bool runLampZeroCross(uint32_t durationMs)
+{
+    uint32_t halfCycleUs = g_mains.halfCycleUs;
+    uint32_t leadEdges   = ((g_safelightLeadMs * 1000) + halfCycleUs - 1) / halfCycleUs;
+    uint32_t halfCycles  = mainsQuantise(durationMs, halfCycleUs, &g_quantisationErrorUs);
+
+    // the lamp-on edge is always a crossing, so wait at least for the next one
+    leadEdges = (leadEdges == 0) ? 1 : leadEdges;
+
+    toggleSafelight(false);
+
+    taskENTER_CRITICAL();
+    g_zcHalfCycles = halfCycles;
+    g_zcEdgesLeft  = leadEdges;
+    g_zcState      = ZC_LEAD;
+    taskEXIT_CRITICAL();
+
+    uint32_t timeoutMs = (((leadEdges + halfCycles + ZERO_CROSS_TIMEOUT_EDGES) * (uint64_t)halfCycleUs) / 1000) + 1;
+
+    if (ulTaskNotifyTakeIndexed(NOTIFY_IDX_TIMER, pdTRUE, pdMS_TO_TICKS(timeoutMs)) == 0)
+    {
+        // detector lost mid-exposure: the delivered time is unknown, so stop the program
+        taskENTER_CRITICAL();
+        g_zcState = ZC_IDLE;
+        toggleOptocoupler(false);
+        lampEdge(false);
+        toggleSafelight(true);
+        mainsInit(&g_mains);
+        taskEXIT_CRITICAL();
+        return false;
+    }
+
+    return !g_abortRequested;
+}
+
+/**
+ * @brief block until the operator continues the program
+ *
+ * @return false if the run was aborted
+ */
+static bool waitOperator(void)
+{
+    if (g_abortRequested) return false;
+
+    (void)ulTaskNotifyTakeIndexed(NOTIFY_IDX_OPERATOR, pdTRUE, portMAX_DELAY);
+
+    return !g_abortRequested;
+}
+
+/**
+ * @brief account lamp on-time for the journal. call wherever the lamp is switched, from the ISR or with the task
+ *        locked; repeated edges in the same direction are ignored. the time comes from the run-time stats timer and is
+ *        scaled to full power, so the journal compares delivered with requested time at any intensity
+ *
+ * @param on true for the lamp-on edge
+ */
+static void lampEdge(bool on)
+{
+    uint32_t nowUs = rtosTimerGetValue();
+
+    if (on && !g_lampLit)
+    {
+        g_lampOnUs = nowUs;
+        g_lampLit  = true;
+    }
+    else if (!on && g_lampLit)
+    {
+        g_lampTotalUs += (uint32_t)(((uint64_t)(nowUs - g_lampOnUs) * g_lampLevel) / INTENSITY_FULL);
+        g_lampLit      = false;
+    }
+}
+
+/**
+ * @brief set the intensity for a lamp step, dimmed if it's shorter than the minimum on-time. task only, with the lamp
+ *        off. the on-time is worked out from the level the hardware actually set; TIM15 still times the step
+ *
+ * @param durationMs nominal on-time at full power
+ * @return uint32_t on-time at the intensity set
+ */
+static uint32_t dimLamp(uint32_t durationMs)
+{
+    uint32_t level = startLampPwm(intensityForMinTime(durationMs, g_dimMinOnMs));
+
+    g_lampLevel = level;
+    if (level < INTENSITY_FULL) g_lastDimLevel = level;
+
+    return intensityOnMs(durationMs, level);
+}
+
+/**
+ * @brief back to full power after a step. task only, with the lamp off
+ *
+ */
+static void undimLamp(void)
+{
+    stopLampPwm();
+    g_lampLevel = INTENSITY_FULL;
+}
+
+/**
+ * @brief TIM15 CC1 callback: safelight lead elapsed. runs in ISR context, or from triggerEnlargerTimer() without a lead
+ *
+ * @note the safelight went off when the step was armed, it comes back on in lampOffCallback()
+ */
+static void lampOnCallback(void *pCtx)
+{
+    toggleOptocoupler(true);
+    lampEdge(true);
+    g_integrating = true;
+}
+
+/**
+ * @brief TIM15 callback: exposure elapsed. runs in ISR context
+ *
+ */
+static void lampOffCallback(void *pCtx)
+{
+    BaseType_t woken = pdFALSE;
+
+    toggleOptocoupler(false);
+    lampEdge(false);
+    toggleSafelight(true);
+    g_integrating = false;
+
+    vTaskNotifyGiveIndexedFromISR(g_exposureTask, NOTIFY_IDX_TIMER, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+/**
+ * @brief TIM1 callback: all lamp channels have switched off. runs in ISR context
+ *
+ */
+static void channelsDoneCallback(void *pCtx)
+{
+    BaseType_t woken = pdFALSE;
+
+    lampEdge(false);
+
+    vTaskNotifyGiveIndexedFromISR(g_exposureTask, NOTIFY_IDX_TIMER, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+/**
+ * @brief footswitch or start button edge: fire the armed step, otherwise release an operator wait. runs in ISR
+ *        context at the highest priority
+ *
+ */
+static void startTriggerCallback(void *pCtx)
+{
+    BaseType_t woken = pdFALSE;
+    uint32_t   nowUs = rtosTimerGetValue();
+
+    if ((nowUs - g_lastTriggerUs) < (EXPOSURE_TRIGGER_HOLDOFF_MS * 1000)) return; // contact bounce
+
+    g_lastTriggerUs = nowUs;
+    replayPressFromISR();
+
+    if (g_armed)
+    {
+        g_armed          = false;
+        g_abortRequested = false;
+        g_lampTotalUs    = 0;
+
+        if (g_armLoaded)
+        {
+            // TIM15 is fully loaded, this is the whole path to the lamp (or the lead)
+            g_armLoaded = false;
+            clockHoldLevel();
+            g_levelHeld = true;
+            toggleSafelight(false);
+            triggerEnlargerTimer();
+        }
+
+        // every block is free while armed, see queueRequest()
+        SExposureRequest_t *pReq = poolAlloc(&g_exposureRequestPool);
+
+        if (pReq != NULL)
+        {
+            pReq->mode = EXPOSURE_MODE_ARMED;
+
+            if (xQueueSendToBackFromISR(g_exposureQueue, &pReq, &woken) != pdTRUE)
+            {
+                poolFree(&g_exposureRequestPool, pReq);
+                pReq = NULL;
+            }
+        }
+
+        if (pReq == NULL)
+        {
+            // a fired step still ends on TIM15, but the rest of the program is lost. one that starts with an operator
+            // step hasn't done anything yet and stays armed for the next press
+            g_droppedPresses++;
+            g_armed = (g_armAction.action != PROG_ACTION_LAMP);
+        }
+    }
+    else if (g_isBusy)
+    {
+        vTaskNotifyGiveIndexedFromISR(g_exposureTask, NOTIFY_IDX_OPERATOR, &woken);
+    }
+
+    portYIELD_FROM_ISR(woken);
+}
+
+/**
+ * @brief zero-cross edge: track the mains period and advance a zero-cross aligned lamp step. runs in ISR context
+ *
+ */
+static void zeroCrossCallback(void *pCtx)
+{
+    if (g_mainsSuspended) return;
+
+    uint8_t halfCycles = mainsEdge(&g_mains, zeroCrossCaptureValue());
+
+    if (halfCycles != 0)
+    {
+        armMainsWatchdog((uint16_t)(g_mains.lastCapture + mainsLossTimeoutUs()));
+    }
+    else if (!mainsLocked(&g_mains))
+    {
+        disarmMainsWatchdog();
+    }
+
+    if (g_rearmOnRelock && (halfCycles != 0) && mainsLocked(&g_mains)) rearmFromISR();
+
+    if ((halfCycles == 0) || (g_zcState == ZC_IDLE)) return;
+
+    g_zcEdgesLeft = (halfCycles >= g_zcEdgesLeft) ? 0 : (g_zcEdgesLeft - halfCycles);
+
+    if (g_zcEdgesLeft != 0) return;
+
+    if (g_zcState == ZC_LEAD)
+    {
+        toggleOptocoupler(true);
+        lampEdge(true);
+        g_zcEdgesLeft = g_zcHalfCycles;
+        g_zcState     = ZC_ON;
+    }
+    else
+    {
+        BaseType_t woken = pdFALSE;
+
+        toggleOptocoupler(false);
+        lampEdge(false);
+        toggleSafelight(true);
+        g_zcState = ZC_IDLE;
+
+        vTaskNotifyGiveIndexedFromISR(g_exposureTask, NOTIFY_IDX_TIMER, &woken);
+        portYIELD_FROM_ISR(woken);
+    }
+}
+
+/**
+ * @brief TIM3 CC1: the zero-cross edges stopped while locked, the supply is going. switch the lamp off and save the
+ *        session before the hold-up runs out. runs in ISR context
+ *
+ * @note if the mains returns this was a dropout: the run is aborted like from the UI and the tracker relocks. an armed
+ *       program is disarmed meanwhile, so a press can't start it without mains, and armed again on the relock
+ */
+static void mainsLostCallback(void *pCtx)
+{
+    BaseType_t woken = pdFALSE;
+
+    crashTrace(TRACE_MAINS_LOST, 0);
+
+    g_rearmOnRelock  = g_rearmOnRelock || g_armed; // zeroCrossCallback() arms it again once the tracker relocks
+    g_armed          = false;
+    g_armLoaded      = false;
+    g_abortRequested = true;
+    g_zcState        = ZC_IDLE;
+
+    stopEnlargerTimer();
+    stopLampChannels();
+    toggleOptocoupler(false);
+    lampEdge(false);
+    toggleSafelight(true);
+
+    mainsInit(&g_mains);
+    sessionPowerFailFromISR();
+
+    vTaskNotifyGiveIndexedFromISR(g_exposureTask, NOTIFY_IDX_TIMER, &woken);
+    vTaskNotifyGiveIndexedFromISR(g_exposureTask, NOTIFY_IDX_OPERATOR, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+/**
+ * @brief queue the program a mains dropout disarmed, see mainsLostCallback(). runs in ISR context; if no request can
+ *        be queued, the next zero-cross edge tries again
+ *
+ */
+static void rearmFromISR(void)
+{
+    BaseType_t          woken = pdFALSE;
+    SExposureRequest_t *pReq  = poolAlloc(&g_exposureRequestPool);
+
+    if (pReq == NULL) return;
+
+    pReq->mode         = EXPOSURE_MODE_ARM;
+    pReq->arm.pProgram = g_pArmProgram;
+    pReq->arm.baseMs   = g_armBaseMs;
+
+    if (xQueueSendToBackFromISR(g_exposureQueue, &pReq, &woken) != pdTRUE)
+    {
+        poolFree(&g_exposureRequestPool, pReq);
+        return;
+    }
+
+    g_rearmOnRelock = false;
+    portYIELD_FROM_ISR(woken);
+}
+
+/**
+ * @brief mains-loss watchdog timeout for the tracked period
+ *
+ * @return uint32_t microseconds without an accepted edge that count as a power failure
+ */
+static uint32_t mainsLossTimeoutUs(void)
+{
+    uint32_t half = g_mains.halfCycleUs;
+
+    return (MAINS_LOSS_HALF_CYCLES * half) + (half / 4);
+}
+
+/**
+ * @brief ADC block: integrate while the lamp is on and hand the predicted end to TIM15. runs in ISR context at the
+ *        TIM15 priority, so it can't race the lamp-off update
+ *
+ */
+static void integrateBlockCallback(const volatile uint16_t *pBlock, void *pCtx)
+{
+    if (!g_integrating) return;
+
+    uint32_t left = integralAddBlock(&g_integral, pBlock, ADC_BLOCK_SAMPLES);
+
+    if (g_integralScheduled || (left > ADC_BLOCK_SAMPLES)) return;
+
+    // sample periods -> TIM15 milliseconds
+    shortenEnlargerTimer((left * 1000) / ADC_SAMPLE_RATE_HZ);
+    g_integralScheduled = true;
+}
+
+/**
+ * @brief ADC watchdog: the probe saturated, so the integral under-reads. finish on the nominal time instead
+ *
+ */
+static void saturationCallback(void *pCtx)
+{
+    adcSetWatchdog(0, NULL, NULL);
+
+    g_integralSaturated = true;
+
+    if (!g_integrating || g_integralScheduled) return;
+
+    uint32_t elapsedMs = (g_integral.samples * 1000) / ADC_SAMPLE_RATE_HZ;
+
+    shortenEnlargerTimer((elapsedMs < g_integralNominalMs) ? (g_integralNominalMs - elapsedMs) : 1);
+    g_integralScheduled = true;
+}
+
+/**
+ * @brief SYSCLK level changed: TIM3 was restarted, so the last edge timestamp is stale and the mains-loss watchdog is
+ *        restarted. the tracker stays locked and measures from the next edge. runs with interrupts masked
+ *
+ */
+static void clockChangedCallback(uint32_t coreHz, void *pCtx)
+{
+    g_mains.hasEdge = false;
+
+    // the counter restarted from 0, so time the watchdog from here
+    if (mainsLocked(&g_mains)) armMainsWatchdog((uint16_t)mainsLossTimeoutUs());
+}
+
+/**
+ * @brief "arm" console command: show the armed step, or arm the start inputs for a base time and record it in the
+ *        session
+ *
+ */
+static void armCommand(int argc, char *argv[])
+{
+    int32_t baseMs = 0;
+
+    if (argc < 2)
+    {
+        consolePuts(g_armed ? "armed, base " : "not armed, base ");
+        consolePutDec((int32_t)g_armBaseMs);
+        consolePuts("ms");
+
+        if (g_rearmOnRelock) consolePuts(", disarmed by a mains dropout until it relocks");
+
+        if (g_droppedPresses != 0)
+        {
+            consolePuts(", dropped presses ");
+            consolePutDec((int32_t)g_droppedPresses);
+        }
+
+        consolePuts("\n");
+        return;
+    }
+
+    if ((strcmp(argv[1], "off") != 0) && (!consoleParseInt(argv[1], &baseMs) || (baseMs <= 0)))
+    {
+        consolePuts("usage: arm [ms|off]\n");
+        return;
+    }
+
+    if (baseMs != 0) sessionSetBaseTime((uint32_t)baseMs);
+
+    if (!exposureArm((uint32_t)baseMs)) consolePuts("busy\n");
+}
+
+/**
+ * @brief "dim [ms|off]": show or set the minimum on-time an LED head is dimmed to
+ *
+ */
+static void dimCommand(int argc, char *argv[])
+{
+    int32_t minOnMs = 0;
+
+    if (argc < 2)
+    {
+        uint32_t milliStops = intensityMilliStops(g_lastDimLevel);
+
+        if (g_dimMinOnMs == 0)
+        {
+            consolePuts("off\n");
+            return;
+        }
+
+        consolePuts("steps under ");
+        consolePutDec((int32_t)g_dimMinOnMs);
+        consolePuts("ms dimmed, last -");
+        consolePutDec((int32_t)(milliStops / 1000));
+        consolePuts(".");
+        consolePutDec((int32_t)((milliStops % 1000) / 100));
+        consolePutDec((int32_t)((milliStops % 100) / 10));
+        consolePuts(" stops\n");
+        return;
+    }
+
+    if ((strcmp(argv[1], "off") != 0) &&
+        (!consoleParseInt(argv[1], &minOnMs) || (minOnMs <= 0) || (minOnMs > UINT16_MAX)))
+    {
+        consolePuts("usage: dim [ms|off]\n");
+        return;
+    }
+
+    if (!sessionSetLampDimming((uint16_t)minOnMs)) consolePuts("busy\n");
+}
+
+/**
+ * @brief "expose" console command: show whether an exposure is running and the result of the last closed-loop one,
+ *        run a program given in its text form (see progParse()) at a base time, a multi-channel exposure with an
+ *        on-time per TIM1 output or a closed-loop exposure, release an operator step or abort the run
+ *
+ */
+static void exposeCommand(int argc, char *argv[])
+{
+    static const char *const resolutionNames[] = { "1", "2", "3", "6" }; // EFStop_t order, steps per stop
+
+    int32_t        baseMs     = 0;
+    EFStop_t       resolution = FSTOP_THIRD;
+    SProgBuffer_t *pBuf;
+    uint32_t       durationsMs[LAMP_CHANNEL_COUNT];
+    int32_t        ms;
+
+    if (argc < 2)
+    {
+        consolePuts(exposureIsBusy() ? "running" : "idle");
+
+        if (g_integralReference != 0)
+        {
+            bool integrated = exposureIntegratedResult(&durationsMs[0]);
+
+            consolePuts(", last closed-loop ");
+            consolePutDec((int32_t)durationsMs[0]);
+            consolePuts(integrated ? "ms delivered" : "ms delivered, probe saturated: ran the nominal time");
+        }
+
+        consolePuts("\n");
+        return;
+    }
+
+    if (strcmp(argv[1], "go") == 0)
+    {
+        exposureOperatorContinue();
+        return;
+    }
+
+    if (strcmp(argv[1], "stop") == 0)
+    {
+        exposureAbort();
+        return;
+    }
+
+    if ((strcmp(argv[1], "ch") == 0) && (argc > 2) && ((argc - 2) <= LAMP_CHANNEL_COUNT))
+    {
+        for (int i = 2; i < argc; i++)
+        {
+            if (!consoleParseInt(argv[i], &ms) || (ms < 0))
+            {
+                consolePuts("usage: expose ch <ms> [ms] [ms] [ms], one per output from CH1, 0 leaves it off\n");
+                return;
+            }
+            durationsMs[i - 2] = (uint32_t)ms;
+        }
+
+        if (!exposureRunChannels(durationsMs, (uint8_t)(argc - 2))) consolePuts("out of range, dimming or busy\n");
+        return;
+    }
+
+    if (strcmp(argv[1], "int") == 0)
+    {
+        if ((argc < 3) || !consoleParseInt(argv[2], &ms) || (ms <= 0))
+        {
+            consolePuts("usage: expose int <ms at the metering calibration level>\n");
+        }
+        else if (!exposureRunIntegrated((uint32_t)ms))
+        {
+            consolePuts("photometer not calibrated or busy\n");
+        }
+        return;
+    }
+
+    if (argc > 4)
+    {
+        for (resolution = FSTOP_FULL; resolution <= FSTOP_SIXTH; resolution++)
+        {
+            if (strcmp(argv[4], resolutionNames[resolution]) == 0) break;
+        }
+    }
+
+    if ((strcmp(argv[1], "prog") != 0) || (argc < 4) || !consoleParseInt(argv[2], &baseMs) || (baseMs <= 0) ||
+        (resolution > FSTOP_SIXTH))
+    {
+        consolePuts("usage: expose [prog <ms> <steps> [1|2|3|6]|ch <ms> [ms] [ms] [ms]|int <ms>|go|stop]\n");
+        return;
+    }
+
+    pBuf = poolAlloc(&g_progBufferPool);
+
+    if (pBuf == NULL)
+    {
+        consolePuts("busy\n");
+    }
+    else if (!progParse(pBuf, argv[3], resolution))
+    {
+        poolFree(&g_progBufferPool, pBuf);
+        consolePuts("bad program, steps are l[ms] +n -n p b r<step>x<n> separated by commas\n");
+    }
+    else if (!exposureRunProgram(&pBuf->program, (uint32_t)baseMs)) // the task frees the buffer after the run
+    {
+        poolFree(&g_progBufferPool, pBuf);
+        consolePuts("busy\n");
+    }
+}
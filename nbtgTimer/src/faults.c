@@ -11,26 +11,9 @@
 #include <task.h>
 
 #include "board.h"
+#include "crash.h"
 
-//=====================================================================================================================
-// Typedefs
-//=====================================================================================================================
-/** @brief struct which corresponds to the order in which the Cortex core's register values are dumped onto the stack
- *         in case of a fault. can be used to quickly evaluate the system context at the time of the fault
- */
-typedef struct __attribute__((packed)) ContextStateFrame
-{
-    uint32_t r0;
-    uint32_t r1;
-    uint32_t r2;
-    uint32_t r3;
-    uint32_t r12;
-    uint32_t lr;
-    uint32_t return_address;
-    uint32_t xpsr;
-} sContextStateFrame;
-
-void faultHandler(const sContextStateFrame *); // proto to placate the compiler
+void faultHandler(const sContextStateFrame *, uint32_t); // proto to placate the compiler
 void unwindStack(void);
 
 //=====================================================================================================================
@@ -38,13 +21,17 @@ void unwindStack(void);
 //=====================================================================================================================
 
 /**
- * @brief fault handler
+ * @brief fault handler: record the fault for the post-mortem, then reset
  *
  * @param pFrame current stack frame. this works because R0 contains the value the stack pointer had before the fault
  * occured and we look from the stack downwards to obtain the context frame
+ * @param excReturn EXC_RETURN value the handler was entered with
  */
-void faultHandler(const sContextStateFrame *pFrame)
+void faultHandler(const sContextStateFrame *pFrame, uint32_t excReturn)
 {
+    crashCaptureFault(pFrame, excReturn);
+
+#ifdef DEBUG
     do
     {
         asm volatile("bkpt");
@@ -52,18 +39,22 @@ void faultHandler(const sContextStateFrame *pFrame)
     while (0);
 
     // we break here; use GDB to analyze pFrame.
+#endif
+
+    NVIC_SystemReset();
 }
 
 /**
  * @brief a smidge of Thumb16 assembler to check which stack pointer was in use. will branch unconditionally to the
- * fault handler
+ * fault handler. naked, so LR still holds EXC_RETURN
  *
  */
-void unwindStack(void)
+__attribute__((naked)) void unwindStack(void)
 {
-    // check whether MSP or PSP was in use, push value to R0
+    // check whether MSP or PSP was in use, push value to R0. EXC_RETURN goes to R1
     // note: we're in Thumb16, so we can't TST on LR or immediates, we need an unshifted reg
     asm volatile("mov r0, lr \n"
+                 "mov r1, lr \n"
                  "ldr r4, =4 \n"
                  "tst r0, r4 \n"
                  "beq use_msp \n" // Branch if equal (bit 2 of LR is clear); MSP was in use
@@ -75,12 +66,12 @@ void unwindStack(void)
 }
 
 /**
- * @brief handle hardfaults
+ * @brief handle hardfaults. naked and a plain branch: a call would overwrite EXC_RETURN in LR
  *
  */
-void HardFault_Handler(void)
+__attribute__((naked)) void HardFault_Handler(void)
 {
-    unwindStack();
+    asm volatile("b unwindStack \n");
 }
 
 #pragma GCC diagnostic push
@@ -90,6 +81,8 @@ void vAssertCalled(unsigned long ulLine, const char *const pcFileName)
 {
     volatile uint32_t  ulSetToNonZeroInDebuggerToContinue = 0;
 
+    crashCaptureAssert(pcFileName, ulLine, (uint32_t)__builtin_return_address(0));
+
 #ifdef DEBUG
     taskENTER_CRITICAL();
 
@@ -111,6 +104,8 @@ void vApplicationStackOverflowHook(TaskHandle_t pxTask, char *pcTaskName)
 {
     volatile uint32_t  ulSetToNonZeroInDebuggerToContinue = 0;
 
+    crashCaptureStackOverflow(pcTaskName);
+
 #ifdef DEBUG
     taskENTER_CRITICAL();
 
@@ -5,6 +5,14 @@
  *        avoids using floats
  * 
  * TODO: test strip mode, either 1/6th or 1/3rd : -1, -2/3, -1/3, B, etc
+ *
+ * lamp model: output rises as 1 - e^(-t/rise) and decays as e^(-t/fall) after switch-off, so an on-time T delivers
+ * T - (rise - fall) * (1 - e^(-T/rise)) of ideal-lamp light. lampModelInit() samples that curve once; compensating a
+ * time is then a table interpolation, and beyond 5 rise constants the lamp is at full output so the offset is constant
+ *
+ * intensity: a head with a dimming input delivers on-time times intensity, so dimming by a stop is the same as
+ * doubling the time. the dimming for a short exposure is the plain ratio of the two times; the on-time is worked out
+ * again from the intensity the hardware could actually set
  */
 
  //=====================================================================================================================
@@ -33,10 +41,35 @@
 #define MINUS_HALF 724         // 0.7071 × 1024 ≈ 724.1
 #define MINUS_FULL 512         // 0.5 × 1024 = 512
 
+#define EXP_TABLE_SHIFT 3      // e^-x table step: 1/8
+#define EXP_TABLE_SIZE  41     // covers x = 0..5
+#define LAMP_MODEL_SPAN 5      // table spans 5 rise time constants
+
+#define EXP2_TABLE_SHIFT 4     // 2^x table step: 1/16
+#define EXP2_STEP_SHIFT  (16 - EXP2_TABLE_SHIFT)
+#define MILLI_STOPS      1000
+
 //=====================================================================================================================
 // Constants
 //=====================================================================================================================
 
+// e^(-k/8) in Q16, k = 0..40
+static const uint16_t g_expNegTable[EXP_TABLE_SIZE] = {
+    65535, 57835, 51039, 45042, 39750, 35079, 30957, 27319,
+    24109, 21276, 18776, 16570, 14623, 12905, 11388, 10050,
+     8869,  7827,  6907,  6096,  5380,  4747,  4190,  3697,
+     3263,  2879,  2541,  2243,  1979,  1746,  1541,  1360,
+     1200,  1059,   935,   825,   728,   642,   567,   500,
+      442,
+};
+
+// 2^(k/16) in Q16, k = 0..16
+static const uint32_t g_exp2Table[(1 << EXP2_TABLE_SHIFT) + 1] = {
+    65536,  68438,  71468,  74632,  77936,  81386,  84990,  88752,
+    92682,  96785, 101070, 105545, 110218, 115098, 120194, 125515,
+    131072,
+};
+
 //=====================================================================================================================
 // Types
 //=====================================================================================================================
@@ -50,6 +83,7 @@
 //=====================================================================================================================
 
 static void reverseArray(uint32_t *, size_t);
+static uint32_t expNegQ16(uint32_t);
 
 //=====================================================================================================================
 // Functions
@@ -91,6 +125,211 @@ uint32_t calculateNextFStop(uint32_t startTime, bool reverse, EFStop_t resolutio
     return newTime;
 }
 
+uint32_t calculateFStopOffset(uint32_t baseTime, int8_t steps, EFStop_t resolution)
+{
+    uint32_t currentTime = baseTime;
+    bool     reverse     = (steps < 0);
+    uint8_t  count       = reverse ? -steps : steps;
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        currentTime = calculateNextFStop(currentTime, reverse, resolution);
+    }
+
+    return currentTime;
+}
+
+uint32_t fstopExp2(uint32_t value, int32_t stopsQ16)
+{
+    int32_t  whole   = stopsQ16 >> 16; // floor, also for negative exponents
+    uint32_t frac    = (uint32_t)stopsQ16 & 0xFFFF;
+    uint32_t idx     = frac >> EXP2_STEP_SHIFT;
+    uint32_t rem     = frac & ((1u << EXP2_STEP_SHIFT) - 1);
+    uint32_t mulQ16  = g_exp2Table[idx] + (((g_exp2Table[idx + 1] - g_exp2Table[idx]) * rem) >> EXP2_STEP_SHIFT);
+    uint64_t product = (uint64_t)value * mulQ16; // Q16, at most 49 bits
+    int32_t  shift   = whole - 16;               // one shift after the multiply keeps the fraction for small values
+
+    if (shift >= 0)
+    {
+        if (product == 0) return 0;
+        if ((shift > 31) || (product > (UINT32_MAX >> shift))) return UINT32_MAX;
+        return (uint32_t)(product << shift);
+    }
+
+    if (-shift > 49) return 0;
+
+    product = (product + (1ull << (-shift - 1))) >> -shift; // rounded
+
+    return (product > UINT32_MAX) ? UINT32_MAX : (uint32_t)product;
+}
+
+int32_t fstopLog2(uint32_t value)
+{
+    uint32_t idx = 0;
+
+    if (value == 0) return INT32_MIN;
+
+    // mantissa in [1, 2), Q16, then the fraction of a stop is looked up backwards in the 2^x table
+    int32_t  whole    = 31 - __builtin_clz(value);
+    uint32_t mantissa = (whole > 16) ? (value >> (whole - 16)) : (value << (16 - whole));
+
+    while ((idx < ((1 << EXP2_TABLE_SHIFT) - 1)) && (g_exp2Table[idx + 1] <= mantissa)) idx++;
+
+    uint32_t frac = (idx << EXP2_STEP_SHIFT) +
+                    (((mantissa - g_exp2Table[idx]) << EXP2_STEP_SHIFT) / (g_exp2Table[idx + 1] - g_exp2Table[idx]));
+
+    return (whole * STOP_Q16) + (int32_t)frac;
+}
+
+bool lampModelInit(SLampModel_t *pModel, uint16_t riseMs, uint16_t fallMs)
+{
+    memset(pModel, 0, sizeof(SLampModel_t));
+
+    if ((riseMs > LAMP_MODEL_MAX_TAU_MS) || (fallMs > LAMP_MODEL_MAX_TAU_MS)) return false;
+    if (riseMs == 0) return true;
+
+    pModel->riseMs = riseMs;
+    pModel->fallMs = fallMs;
+
+    int32_t offset = (int32_t)riseMs - (int32_t)fallMs;
+
+    for (uint8_t i = 0; i < LAMP_MODEL_POINTS; i++)
+    {
+        uint32_t onMs     = ((uint32_t)riseMs * LAMP_MODEL_SPAN * i) / (LAMP_MODEL_POINTS - 1);
+        uint32_t xQ16     = (onMs << 16) / riseMs;
+        int32_t  lossMs   = (offset * (int32_t)(65536 - expNegQ16(xQ16))) / 65536;
+        int32_t  nominal  = (int32_t)onMs - lossMs;
+
+        pModel->onMs[i]      = onMs;
+        pModel->nominalMs[i] = (nominal < 0) ? 0 : nominal;
+    }
+
+    return true;
+}
+
+uint32_t lampModelCompensate(SLampModel_t const *pModel, uint32_t nominalMs)
+{
+    if ((pModel == NULL) || (pModel->riseMs == 0) || (nominalMs == 0)) return nominalMs;
+
+    const uint8_t last = LAMP_MODEL_POINTS - 1;
+
+    if (nominalMs >= pModel->nominalMs[last])
+    {
+        // lamp at full output: constant offset, may be negative for a slow fall
+        int32_t onMs = (int32_t)nominalMs + (int32_t)pModel->onMs[last] - (int32_t)pModel->nominalMs[last];
+        return (onMs < 1) ? 1 : (uint32_t)onMs;
+    }
+
+    uint8_t i = 1;
+    while (nominalMs > pModel->nominalMs[i]) i++;
+
+    uint32_t nomSpan = pModel->nominalMs[i] - pModel->nominalMs[i - 1];
+    uint32_t onSpan  = pModel->onMs[i] - pModel->onMs[i - 1];
+    uint32_t onMs    = pModel->onMs[i - 1];
+
+    if (nomSpan != 0) onMs += ((nominalMs - pModel->nominalMs[i - 1]) * onSpan + (nomSpan / 2)) / nomSpan;
+
+    return (onMs < 1) ? 1 : onMs;
+}
+
+bool paperModelInit(SPaperModel_t *pModel, SPaperParams_t const *pParams)
+{
+    memset(pModel, 0, sizeof(SPaperModel_t));
+    pModel->dryDownQ10   = SCALE_FACTOR;
+    pModel->splitSoftQ10 = SCALE_FACTOR;
+    pModel->splitHardQ10 = SCALE_FACTOR;
+
+    if ((pParams->recipCentiStops > PAPER_MAX_RECIP_CSTOPS) || (pParams->splitSoftSixths < -18) ||
+        (pParams->splitSoftSixths > 18) || (pParams->splitHardSixths < -18) || (pParams->splitHardSixths > 18))
+    {
+        return false;
+    }
+
+    for (uint8_t i = 0; i < PAPER_GRADES; i++)
+    {
+        pModel->gradeBaseMs[i] = (uint32_t)pParams->gradeBase10Ms[i] * 10;
+    }
+
+    pModel->dryDownQ10   = (uint16_t)(((SCALE_FACTOR * (1000 - (uint32_t)pParams->dryDownPermille)) + 500) / 1000);
+    pModel->splitSoftQ10 = (uint16_t)fstopExp2(SCALE_FACTOR, (pParams->splitSoftSixths * STOP_Q16) / 6);
+    pModel->splitHardQ10 = (uint16_t)fstopExp2(SCALE_FACTOR, (pParams->splitHardSixths * STOP_Q16) / 6);
+
+    if ((pParams->recipKneeS != 0) && (pParams->recipCentiStops != 0))
+    {
+        for (uint8_t i = 0; i < PAPER_RECIP_POINTS; i++)
+        {
+            pModel->recipMs[i]  = ((uint32_t)pParams->recipKneeS * 1000) << i;
+            pModel->recipQ10[i] = fstopExp2(SCALE_FACTOR, ((int32_t)pParams->recipCentiStops * STOP_Q16 * i) / 100);
+        }
+    }
+
+    return true;
+}
+
+uint32_t paperCorrect(SPaperModel_t const *pModel, uint32_t nominalMs)
+{
+    if (pModel == NULL) return nominalMs;
+
+    uint32_t ms = (uint32_t)(((uint64_t)nominalMs * pModel->dryDownQ10 + (SCALE_FACTOR / 2)) >> 10);
+
+    if ((pModel->recipMs[0] == 0) || (ms <= pModel->recipMs[0])) return ms;
+
+    const uint8_t last = PAPER_RECIP_POINTS - 1;
+    uint32_t      factorQ10;
+
+    if (ms >= pModel->recipMs[last])
+    {
+        factorQ10 = pModel->recipQ10[last];
+    }
+    else
+    {
+        uint8_t i = 1;
+        while (ms > pModel->recipMs[i]) i++;
+
+        uint32_t span = pModel->recipMs[i] - pModel->recipMs[i - 1];
+
+        factorQ10 = pModel->recipQ10[i - 1] +
+                    (uint32_t)(((uint64_t)(pModel->recipQ10[i] - pModel->recipQ10[i - 1]) *
+                                (ms - pModel->recipMs[i - 1])) / span);
+    }
+
+    return (uint32_t)(((uint64_t)ms * factorQ10 + (SCALE_FACTOR / 2)) >> 10);
+}
+
+uint32_t paperSplitMs(SPaperModel_t const *pModel, uint32_t baseMs, bool hard)
+{
+    if (pModel == NULL) return baseMs;
+
+    uint32_t factorQ10 = hard ? pModel->splitHardQ10 : pModel->splitSoftQ10;
+
+    return (uint32_t)(((uint64_t)baseMs * factorQ10 + (SCALE_FACTOR / 2)) >> 10);
+}
+
+uint32_t intensityForMinTime(uint32_t nominalMs, uint32_t minOnMs)
+{
+    if ((minOnMs == 0) || (nominalMs >= minOnMs)) return INTENSITY_FULL;
+
+    uint32_t intensity = (uint32_t)(((uint64_t)nominalMs * INTENSITY_FULL) / minOnMs);
+
+    return (intensity < (INTENSITY_FULL >> INTENSITY_MAX_STOPS)) ? (INTENSITY_FULL >> INTENSITY_MAX_STOPS) : intensity;
+}
+
+uint32_t intensityOnMs(uint32_t nominalMs, uint32_t intensity)
+{
+    if ((intensity == 0) || (intensity >= INTENSITY_FULL)) return nominalMs;
+
+    return (uint32_t)((((uint64_t)nominalMs * INTENSITY_FULL) + (intensity / 2)) / intensity);
+}
+
+uint32_t intensityMilliStops(uint32_t intensity)
+{
+    if ((intensity == 0) || (intensity >= INTENSITY_FULL)) return 0;
+
+    uint32_t belowQ16 = (uint32_t)(fstopLog2(INTENSITY_FULL) - fstopLog2(intensity));
+
+    return ((belowQ16 * MILLI_STOPS) + (STOP_Q16 / 2)) / STOP_Q16;
+}
+
 void getTimeTable(uint32_t startTime, bool reverse, size_t steps, EFStop_t resolution, uint32_t *pRes)
 {
     uint32_t currentTime = startTime;
@@ -133,4 +372,23 @@ static void reverseArray(uint32_t *array, size_t size)
         array[i] = array[size - 1 - i];
         array[size - 1 - i] = temp;
     }
-}
\ No newline at end of file
+}
+
+/**
+ * @brief e^-x for x >= 0, linearly interpolated from g_expNegTable
+ * 
+ * @param xQ16 x in Q16
+ * @return uint32_t e^-x in Q16, 0 beyond the table
+ */
+static uint32_t expNegQ16(uint32_t xQ16)
+{
+    uint32_t idx  = xQ16 >> (16 - EXP_TABLE_SHIFT);
+    uint32_t frac = xQ16 & ((1u << (16 - EXP_TABLE_SHIFT)) - 1);
+
+    if (idx >= (EXP_TABLE_SIZE - 1)) return 0;
+
+    uint32_t hi = g_expNegTable[idx];
+    uint32_t lo = g_expNegTable[idx + 1];
+
+    return hi - (((hi - lo) * frac) >> (16 - EXP_TABLE_SHIFT));
+}
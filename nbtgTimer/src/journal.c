@@ -0,0 +1,597 @@
+/**
+ * @file  journal.c
+ * @brief exposure history in EEPROM
+ *
+ * the journal is a ring of EEPROM pages. a page is self-contained: the sequence number of its first record, the
+ * record count, the records and a CRC. records within a page are numbered consecutively, so the sequence number is
+ * not stored per record. a record is a flags byte (mode, aborted, program fields present) followed by varints:
+ * requested time as a zigzag delta to the previous record of the page, delivered time as a zigzag delta to the
+ * requested time and, for programs, the zigzag stop offset and the program id. a typical print takes 4-6 bytes
+ *
+ * appends only touch the RAM copy of the open page; a full page stays in RAM until it has been written, and the
+ * next one is opened behind it. journalPoll() writes dirty pages whole, one EEPROM page each, while the exposure task
+ * is idle. if JOURNAL_RAM_PAGES fill up before that, further records are dropped and counted
+ *
+ * at boot the page headers are scanned for the highest sequence number. the newest page is reopened when it still has
+ * room, so a power cycle doesn't waste a page
+ */
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include "journal.h"
+
+#include <FreeRTOS.h>
+#include <task.h>
+
+#include <stddef.h>
+#include <string.h>
+
+#include "board.h"
+#include "console.h"
+#include "crc.h"
+#include "exposure.h"
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define JOURNAL_RAM_PAGES      4  // open page plus full pages waiting for journalPoll()
+#define JOURNAL_RECORD_MAX     15 // flags, requested and delivered varints (5 each), stop offset and program id
+#define JOURNAL_DEFAULT_LIST   8  // "journal" without a count
+
+#define JOURNAL_FLAG_MODE      0x03 // EJournalMode_t
+#define JOURNAL_FLAG_ABORTED   0x04
+#define JOURNAL_FLAG_PROGRAM   0x08 // stop offset and program id follow
+
+#define JOURNAL_SLOT_ADDR(s)   ((uint16_t)(JOURNAL_EEPROM_ADDR + ((s) * EEPROM_PAGE_SIZE)))
+#define JOURNAL_PREV_SLOT(s)   (((s) == 0) ? (JOURNAL_EEPROM_PAGES - 1) : ((s) - 1))
+#define JOURNAL_NEXT_SLOT(s)   ((((s) + 1) == JOURNAL_EEPROM_PAGES) ? 0 : ((s) + 1))
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+/** @brief EEPROM page image */
+typedef struct __attribute__((packed))
+{
+    uint32_t firstSeq;   //< sequence number of the first record
+    uint8_t  numRecords;
+    uint8_t  data[EEPROM_PAGE_SIZE - 7];
+    uint16_t crc;        //< CRC-16/CCITT over firstSeq..data
+} SJournalPage_t;
+
+/** @brief page held in RAM */
+typedef struct
+{
+    SJournalPage_t image;
+    uint16_t       slot;            //< EEPROM page the image is written to
+    uint8_t        used;            //< data bytes in use
+    uint32_t       lastRequestedMs; //< delta base for the next record
+    bool           dirty;           //< changed since the last write
+} SJournalRamPage_t;
+
+//=====================================================================================================================
+// Globals
+//=====================================================================================================================
+
+static SJournalRamPage_t g_ram[JOURNAL_RAM_PAGES];
+static uint8_t           g_ramFirst   = 0; // oldest page, the open page is the last one
+static uint8_t           g_ramCount   = 0;
+static uint32_t          g_nextSeq    = 1;
+static uint32_t          g_numDropped = 0;
+
+//=====================================================================================================================
+// Static protos
+//=====================================================================================================================
+
+static SJournalRamPage_t *openPage(void);
+static SJournalRamPage_t *startPage(uint16_t, uint32_t);
+static bool               findNewest(uint16_t *, SJournalPage_t *);
+static bool               pageValid(const SJournalPage_t *);
+static uint8_t            encodeRecord(const SJournalEntry_t *, uint32_t, uint8_t *);
+static uint8_t            decodePage(const SJournalPage_t *, SJournalEntry_t *, uint8_t *, uint32_t *);
+static uint8_t            putVarint(uint8_t *, uint32_t);
+static bool               getVarint(const uint8_t *, uint8_t, uint8_t *, uint32_t *);
+static void               journalCommand(int, char *[]);
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+/**
+ * @brief find the end of the journal and open a page for new records. call before the scheduler starts
+ *
+ */
+void initJournal(void)
+{
+    static const SConsoleCommand_t journalCmd = { "journal", "recent exposures as CSV, 'journal <n>|all'",
+                                                  journalCommand };
+    SJournalPage_t newest;
+    uint16_t       slot;
+
+    if (!findNewest(&slot, &newest))
+    {
+        (void)startPage(0, 1);
+    }
+    else if (newest.numRecords < JOURNAL_PAGE_RECORDS)
+    {
+        SJournalRamPage_t *pPage = startPage(slot, newest.firstSeq);
+
+        pPage->image = newest;
+        (void)decodePage(&newest, NULL, &pPage->used, &pPage->lastRequestedMs);
+        pPage->dirty = false;
+    }
+    else
+    {
+        (void)startPage(JOURNAL_NEXT_SLOT(slot), newest.firstSeq + newest.numRecords);
+    }
+
+    g_nextSeq = openPage()->image.firstSeq + openPage()->image.numRecords;
+
+    (void)consoleRegisterCommand(&journalCmd);
+}
+
+/**
+ * @brief record a finished exposure. only touches RAM, safe to call from the exposure task right after a run
+ *
+ * @param pEntry exposure; the sequence number is assigned here
+ */
+void journalAppend(const SJournalEntry_t *pEntry)
+{
+    uint8_t            record[JOURNAL_RECORD_MAX];
+    SJournalRamPage_t *pPage;
+    uint8_t            len;
+
+    taskENTER_CRITICAL();
+
+    pPage = openPage();
+    len   = encodeRecord(pEntry, pPage->lastRequestedMs, record);
+
+    if (((pPage->used + len) > sizeof(pPage->image.data)) || (pPage->image.numRecords >= JOURNAL_PAGE_RECORDS))
+    {
+        pPage = (g_ramCount < JOURNAL_RAM_PAGES) ? startPage(JOURNAL_NEXT_SLOT(pPage->slot), g_nextSeq) : NULL;
+        if (pPage != NULL) len = encodeRecord(pEntry, 0, record);
+    }
+
+    if (pPage != NULL)
+    {
+        memcpy(&pPage->image.data[pPage->used], record, len);
+        pPage->used += len;
+        pPage->image.numRecords++;
+        pPage->lastRequestedMs = pEntry->requestedMs;
+        pPage->dirty           = true;
+        g_nextSeq++;
+    }
+    else
+    {
+        g_numDropped++;
+    }
+
+    taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief write pending pages to the EEPROM. does nothing while an exposure is running or queued. call periodically
+ *        from a low priority task
+ *
+ */
+void journalPoll(void)
+{
+    for (uint8_t i = 0; i < JOURNAL_RAM_PAGES; i++)
+    {
+        SJournalRamPage_t *pPage = NULL;
+        SJournalPage_t     image;
+        uint16_t           slot  = 0;
+
+        if (exposureIsBusy()) return;
+
+        taskENTER_CRITICAL();
+        for (uint8_t n = 0; (n < g_ramCount) && (pPage == NULL); n++)
+        {
+            SJournalRamPage_t *pCandidate = &g_ram[(g_ramFirst + n) % JOURNAL_RAM_PAGES];
+
+            if (pCandidate->dirty)
+            {
+                pPage = pCandidate;
+                image = pCandidate->image;
+                slot  = pCandidate->slot;
+            }
+        }
+        taskEXIT_CRITICAL();
+
+        if (pPage == NULL) break;
+
+        image.crc = crc16((const uint8_t *)&image, offsetof(SJournalPage_t, crc));
+
+        if (!eepromWrite(JOURNAL_SLOT_ADDR(slot), (const uint8_t *)&image, sizeof(image))) return;
+
+        // a record appended meanwhile keeps the page dirty for the next round
+        taskENTER_CRITICAL();
+        if ((pPage->slot == slot) && (pPage->image.numRecords == image.numRecords)) pPage->dirty = false;
+        taskEXIT_CRITICAL();
+    }
+
+    // written pages behind the open one are only needed in the EEPROM from now on
+    taskENTER_CRITICAL();
+    while ((g_ramCount > 1) && !g_ram[g_ramFirst].dirty)
+    {
+        g_ramFirst = (g_ramFirst + 1) % JOURNAL_RAM_PAGES;
+        g_ramCount--;
+    }
+    taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief start reading the journal from the newest page
+ *
+ * @param[out] pCursor read position
+ */
+void journalBeginRead(SJournalCursor_t *pCursor)
+{
+    taskENTER_CRITICAL();
+    pCursor->slot   = openPage()->slot;
+    pCursor->endSeq = g_nextSeq;
+    taskEXIT_CRITICAL();
+
+    pCursor->pagesLeft = JOURNAL_EEPROM_PAGES;
+}
+
+/**
+ * @brief read the page at the cursor and move it to the previous page. pages still in RAM are read from there, the
+ *        rest from the EEPROM
+ *
+ * @param pCursor read position from journalBeginRead()
+ * @param[out] pEntries records of the page, oldest first. room for JOURNAL_PAGE_RECORDS
+ * @return number of records, 0 at the start of the journal
+ */
+uint8_t journalReadPage(SJournalCursor_t *pCursor, SJournalEntry_t *pEntries)
+{
+    while (pCursor->pagesLeft > 0)
+    {
+        SJournalPage_t page;
+        bool           inRam = false;
+        uint8_t        count;
+
+        taskENTER_CRITICAL();
+        for (uint8_t n = 0; (n < g_ramCount) && !inRam; n++)
+        {
+            const SJournalRamPage_t *pPage = &g_ram[(g_ramFirst + n) % JOURNAL_RAM_PAGES];
+
+            if (pPage->slot == pCursor->slot)
+            {
+                page  = pPage->image;
+                inRam = true;
+            }
+        }
+        taskEXIT_CRITICAL();
+
+        if (!inRam)
+        {
+            if (!eepromRead(JOURNAL_SLOT_ADDR(pCursor->slot), (uint8_t *)&page, sizeof(page))) break;
+            if (!pageValid(&page)) break;
+        }
+
+        pCursor->pagesLeft--;
+        pCursor->slot = JOURNAL_PREV_SLOT(pCursor->slot);
+
+        // the open page may be empty, or have grown since journalBeginRead()
+        if (inRam && (page.numRecords == 0)) continue;
+        if ((page.firstSeq >= pCursor->endSeq) || ((page.firstSeq + page.numRecords) < pCursor->endSeq)) break;
+
+        count = decodePage(&page, pEntries, NULL, NULL);
+        if (count < (pCursor->endSeq - page.firstSeq)) break;
+
+        count           = (uint8_t)(pCursor->endSeq - page.firstSeq);
+        pCursor->endSeq = page.firstSeq;
+
+        return count;
+    }
+
+    pCursor->pagesLeft = 0;
+
+    return 0;
+}
+
+/**
+ * @brief read the newest entries, e.g. for a recent prints list
+ *
+ * @param[out] pEntries entries, newest first
+ * @param maxEntries size of pEntries
+ * @return number of entries read
+ */
+uint8_t journalReadRecent(SJournalEntry_t *pEntries, uint8_t maxEntries)
+{
+    SJournalCursor_t cursor;
+    SJournalEntry_t  page[JOURNAL_PAGE_RECORDS];
+    uint8_t          count = 0;
+    uint8_t          n;
+
+    journalBeginRead(&cursor);
+
+    while ((count < maxEntries) && ((n = journalReadPage(&cursor, page)) > 0))
+    {
+        while ((n > 0) && (count < maxEntries))
+        {
+            pEntries[count++] = page[--n];
+        }
+    }
+
+    return count;
+}
+
+//=====================================================================================================================
+// Statics
+//=====================================================================================================================
+
+/**
+ * @brief page records are appended to. call with the journal locked
+ *
+ */
+static SJournalRamPage_t *openPage(void)
+{
+    return &g_ram[(g_ramFirst + g_ramCount - 1) % JOURNAL_RAM_PAGES];
+}
+
+/**
+ * @brief open an empty page behind the current one. call with the journal locked and a free RAM page
+ *
+ * @param slot EEPROM page
+ * @param firstSeq sequence number of its first record
+ * @return the new open page
+ */
+static SJournalRamPage_t *startPage(uint16_t slot, uint32_t firstSeq)
+{
+    SJournalRamPage_t *pPage;
+
+    g_ramCount++;
+    pPage = openPage();
+
+    memset(pPage, 0, sizeof(*pPage));
+    memset(pPage->image.data, 0xFF, sizeof(pPage->image.data));
+    pPage->slot           = slot;
+    pPage->image.firstSeq = firstSeq;
+
+    return pPage;
+}
+
+/**
+ * @brief find the page with the newest records. only the headers are read, the CRC is checked on the winner
+ *
+ * @param[out] pSlot EEPROM page
+ * @param[out] pPage its contents
+ * @return false if the journal is empty
+ */
+static bool findNewest(uint16_t *pSlot, SJournalPage_t *pPage)
+{
+    uint32_t bestEnd = 0;
+    uint32_t limit   = UINT32_MAX; // pages ending at or above this failed the CRC
+
+    for (uint16_t attempt = 0; attempt < JOURNAL_EEPROM_PAGES; attempt++)
+    {
+        bestEnd = 0;
+
+        for (uint16_t slot = 0; slot < JOURNAL_EEPROM_PAGES; slot++)
+        {
+            SJournalPage_t header;
+            uint32_t       end;
+
+            if (!eepromRead(JOURNAL_SLOT_ADDR(slot), (uint8_t *)&header, offsetof(SJournalPage_t, data))) return false;
+            if ((header.numRecords == 0) || (header.numRecords > JOURNAL_PAGE_RECORDS)) continue;
+
+            end = header.firstSeq + header.numRecords;
+            if ((header.firstSeq != 0) && (end > header.firstSeq) && (end < limit) && (end > bestEnd))
+            {
+                bestEnd = end;
+                *pSlot  = slot;
+            }
+        }
+
+        if (bestEnd == 0) return false;
+        if (!eepromRead(JOURNAL_SLOT_ADDR(*pSlot), (uint8_t *)pPage, sizeof(*pPage))) return false;
+        if (pageValid(pPage)) return true;
+
+        limit = bestEnd; // torn write, fall back to the page before it
+    }
+
+    return false;
+}
+
+/**
+ * @brief check a page read from the EEPROM
+ *
+ */
+static bool pageValid(const SJournalPage_t *pPage)
+{
+    if ((pPage->numRecords == 0) || (pPage->numRecords > JOURNAL_PAGE_RECORDS)) return false;
+
+    return crc16((const uint8_t *)pPage, offsetof(SJournalPage_t, crc)) == pPage->crc;
+}
+
+/**
+ * @brief encode one record
+ *
+ * @param pEntry exposure
+ * @param lastRequestedMs requested time of the previous record in the page, 0 for the first
+ * @param[out] pOut record, JOURNAL_RECORD_MAX bytes
+ * @return record length
+ */
+static uint8_t encodeRecord(const SJournalEntry_t *pEntry, uint32_t lastRequestedMs, uint8_t *pOut)
+{
+    int32_t requestedDelta = (int32_t)(pEntry->requestedMs - lastRequestedMs);
+    int32_t deliveredDelta = (int32_t)(pEntry->deliveredMs - pEntry->requestedMs);
+    bool    program        = (pEntry->mode == JOURNAL_MODE_PROGRAM) || (pEntry->mode == JOURNAL_MODE_ARMED);
+    uint8_t len            = 0;
+
+    pOut[len++] = (uint8_t)((pEntry->mode & JOURNAL_FLAG_MODE) | (pEntry->aborted ? JOURNAL_FLAG_ABORTED : 0) |
+                            (program ? JOURNAL_FLAG_PROGRAM : 0));
+
+    len += putVarint(&pOut[len], ((uint32_t)requestedDelta << 1) ^ (uint32_t)(requestedDelta >> 31));
+    len += putVarint(&pOut[len], ((uint32_t)deliveredDelta << 1) ^ (uint32_t)(deliveredDelta >> 31));
+
+    if (program)
+    {
+        len += putVarint(&pOut[len], ((uint32_t)pEntry->stopOffset << 1) ^ (uint32_t)(pEntry->stopOffset >> 31));
+        len += putVarint(&pOut[len], pEntry->programId);
+    }
+
+    return len;
+}
+
+/**
+ * @brief decode the records of a page
+ *
+ * @param pPage page image
+ * @param[out] pEntries records, oldest first. NULL to only measure the page
+ * @param[out] pUsed data bytes in use, or NULL
+ * @param[out] pLastRequestedMs requested time of the last record, or NULL
+ * @return number of records decoded, less than numRecords if the data is corrupt
+ */
+static uint8_t decodePage(const SJournalPage_t *pPage, SJournalEntry_t *pEntries, uint8_t *pUsed,
+                          uint32_t *pLastRequestedMs)
+{
+    uint8_t  pos         = 0;
+    uint8_t  count       = 0;
+    uint32_t requestedMs = 0;
+
+    for (; count < pPage->numRecords; count++)
+    {
+        SJournalEntry_t entry = {0};
+        uint32_t        value;
+        uint8_t         flags;
+
+        if (pos >= sizeof(pPage->data)) break;
+        flags = pPage->data[pos++];
+
+        if (!getVarint(pPage->data, sizeof(pPage->data), &pos, &value)) break;
+        requestedMs += (uint32_t)((int32_t)(value >> 1) ^ -(int32_t)(value & 1));
+
+        if (!getVarint(pPage->data, sizeof(pPage->data), &pos, &value)) break;
+        entry.deliveredMs = requestedMs + (uint32_t)((int32_t)(value >> 1) ^ -(int32_t)(value & 1));
+
+        if ((flags & JOURNAL_FLAG_PROGRAM) != 0)
+        {
+            if (!getVarint(pPage->data, sizeof(pPage->data), &pos, &value)) break;
+            entry.stopOffset = (int8_t)((int32_t)(value >> 1) ^ -(int32_t)(value & 1));
+
+            if (!getVarint(pPage->data, sizeof(pPage->data), &pos, &value)) break;
+            entry.programId = (uint8_t)value;
+        }
+
+        entry.sequence    = pPage->firstSeq + count;
+        entry.requestedMs = requestedMs;
+        entry.mode        = flags & JOURNAL_FLAG_MODE;
+        entry.aborted     = (flags & JOURNAL_FLAG_ABORTED) != 0;
+
+        if (pEntries != NULL) pEntries[count] = entry;
+    }
+
+    if (pUsed != NULL) *pUsed = pos;
+    if (pLastRequestedMs != NULL) *pLastRequestedMs = requestedMs;
+
+    return count;
+}
+
+/**
+ * @brief write an unsigned LEB128 varint
+ *
+ * @return bytes written, 1..5
+ */
+static uint8_t putVarint(uint8_t *pOut, uint32_t value)
+{
+    uint8_t len = 0;
+
+    while (value >= 0x80)
+    {
+        pOut[len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    pOut[len++] = (uint8_t)value;
+
+    return len;
+}
+
+/**
+ * @brief read an unsigned LEB128 varint
+ *
+ * @param pData buffer
+ * @param size buffer size
+ * @param[in,out] pPos read position
+ * @param[out] pValue value
+ * @return false if the varint runs past the buffer or is longer than 5 bytes
+ */
+static bool getVarint(const uint8_t *pData, uint8_t size, uint8_t *pPos, uint32_t *pValue)
+{
+    uint32_t value = 0;
+
+    for (uint8_t shift = 0; (shift < 35) && (*pPos < size); shift += 7)
+    {
+        uint8_t byte = pData[(*pPos)++];
+
+        value |= (uint32_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            *pValue = value;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief "journal [n|all]": print the newest exposures as CSV, newest first
+ *
+ */
+static void journalCommand(int argc, char *argv[])
+{
+    static const char *const modeNames[] = { "program", "channels", "integrated", "armed" };
+    SJournalEntry_t          page[JOURNAL_PAGE_RECORDS];
+    SJournalCursor_t         cursor;
+    int32_t                  limit = JOURNAL_DEFAULT_LIST;
+    uint8_t                  n;
+
+    if ((argc > 1) && (strcmp(argv[1], "all") == 0))
+    {
+        limit = INT32_MAX;
+    }
+    else if ((argc > 1) && (!consoleParseInt(argv[1], &limit) || (limit <= 0)))
+    {
+        consolePuts("usage: journal [count|all]\n");
+        return;
+    }
+
+    consolePuts("seq,mode,requested_ms,delivered_ms,stop_offset,program,aborted\n");
+
+    journalBeginRead(&cursor);
+
+    while ((limit > 0) && ((n = journalReadPage(&cursor, page)) > 0))
+    {
+        while ((n > 0) && (limit > 0))
+        {
+            const SJournalEntry_t *pEntry = &page[--n];
+
+            consolePutDec((int32_t)pEntry->sequence);
+            consolePuts(",");
+            consolePuts((pEntry->mode <= JOURNAL_MODE_ARMED) ? modeNames[pEntry->mode] : "?");
+            consolePuts(",");
+            consolePutDec((int32_t)pEntry->requestedMs);
+            consolePuts(",");
+            consolePutDec((int32_t)pEntry->deliveredMs);
+            consolePuts(",");
+            consolePutDec(pEntry->stopOffset);
+            consolePuts(",");
+            consolePutDec(pEntry->programId);
+            consolePuts(pEntry->aborted ? ",1\n" : ",0\n");
+            limit--;
+        }
+    }
+
+    if (g_numDropped != 0)
+    {
+        consolePuts("# dropped ");
+        consolePutDec((int32_t)g_numDropped);
+        consolePuts("\n");
+    }
+}
@@ -15,32 +15,53 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "batch.h"
 #include "board.h"
+#include "clockcal.h"
+#include "console.h"
+#include "crash.h"
+#include "diag.h"
 #include "display.h"
+#include "exposure.h"
 #include "fstop.h"
+#include "journal.h"
+#include "profile.h"
+#include "replay.h"
+#include "session.h"
+#include "sync.h"
+#include "update.h"
 
 //=====================================================================================================================
 // Defines
 //=====================================================================================================================
 
-#define TASKMGR_TASK_STACK_SIZE 128
+#define TASKMGR_TASK_STACK_SIZE 192 // words, diagPoll() and journalPoll() are the deep paths
 
 //=====================================================================================================================
 // Globals
 //=====================================================================================================================
 
 static StaticTask_t tskMgrBuf;
-static StackType_t  tskMgrStack[TASKMGR_TASK_STACK_SIZE * sizeof(StackType_t)];
+static StackType_t  tskMgrStack[TASKMGR_TASK_STACK_SIZE];
 
 //=====================================================================================================================
 // Functions
 //=====================================================================================================================
 
+/**
+ * @brief low priority housekeeping loop
+ *
+ */
 void infinitelp(void *param)
 {
     while(true)
     {
-        vTaskDelay(1000);
+        vTaskDelay(pdMS_TO_TICKS(CLOCKCAL_POLL_MS));
+        clockCalPoll();
+        diagPoll();
+        journalPoll(); // flushes between exposures only
+        batchPoll();
+        updatePoll(); // confirms a freshly updated image once it has run a while
     }
 }
 
@@ -48,9 +69,25 @@ void infinitelp(void *param)
 int main(void)
 {
     initBoard();
+    initCrash(); // stores the record of the last crash, if any
 
     initDisplay(MODE_SPI);
 
+    initExposure();
+    initSession(); // restores the settings saved on the last power failure
+    initProfile();
+    initJournal();
+    initBatch();
+    initReplay();
+    initSync();
+    initUpdate();
+
+    initConsole();
+    initClockCal();
+    initDiag();
+
+    clockReleaseActive(); // drop to the idle clock until something needs full speed
+
     (void)xTaskCreateStatic(infinitelp, "inf", TASKMGR_TASK_STACK_SIZE, NULL, tskIDLE_PRIORITY + 1,
         &tskMgrStack[0], &tskMgrBuf);
 
@@ -0,0 +1,161 @@
+/**
+ * @file  mains.c
+ * @brief mains zero-cross tracking and half-cycle quantisation
+ *
+ * edges are timestamped by a 1MHz 16-bit input capture, so the period math works on wrapping uint16 differences. once
+ * locked, an edge is accepted only near a whole multiple of the tracked half-cycle; anything else is detector noise
+ *
+ * the raw (unfiltered) time between accepted edges is also summed up. over a long window the grid frequency is tightly
+ * regulated, which makes it a usable reference for the HSI when no LSE crystal is fitted
+ */
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include "mains.h"
+
+#include <stdlib.h>
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define MAINS_FILTER_SHIFT 3 // IIR weight of a new period: 1/8
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+/**
+ * @brief reset the tracker, e.g. after the detector was unplugged
+ *
+ * @param pTracker tracker state
+ */
+void mainsInit(SMainsTracker_t *pTracker)
+{
+    pTracker->halfCycleUs   = 0;
+    pTracker->lastCapture   = 0;
+    pTracker->goodEdges     = 0;
+    pTracker->hasEdge       = false;
+    pTracker->sumUs         = 0;
+    pTracker->sumHalfCycles = 0;
+}
+
+/**
+ * @brief feed a zero-cross edge to the tracker
+ *
+ * @param pTracker tracker state
+ * @param capture 1MHz timestamp of the edge
+ * @return uint8_t number of half-cycles since the previous accepted edge; 0 if the edge is rejected or the tracker is
+ *         not locked yet
+ */
+uint8_t mainsEdge(SMainsTracker_t *pTracker, uint16_t capture)
+{
+    uint32_t delta = (uint16_t)(capture - pTracker->lastCapture);
+
+    if (!pTracker->hasEdge)
+    {
+        pTracker->lastCapture = capture;
+        pTracker->hasEdge     = true;
+        return 0;
+    }
+
+    if (mainsLocked(pTracker))
+    {
+        uint32_t half       = pTracker->halfCycleUs;
+        uint32_t halfCycles = (delta + (half / 2)) / half;
+        int32_t  residual   = (int32_t)delta - (int32_t)(halfCycles * half);
+
+        // glitch: not within a quarter half-cycle of an expected crossing. keep waiting for the real one
+        if ((halfCycles == 0) || (abs(residual) > (int32_t)(half / 4))) return 0;
+
+        pTracker->lastCapture = capture;
+
+        if (halfCycles > MAINS_MAX_SKIPPED)
+        {
+            pTracker->goodEdges = 0; // lost track, relock from here
+            return 0;
+        }
+
+        if (halfCycles == 1)
+        {
+            pTracker->halfCycleUs = half + (residual >> MAINS_FILTER_SHIFT);
+        }
+
+        pTracker->sumUs         += delta;
+        pTracker->sumHalfCycles += halfCycles;
+
+        return (uint8_t)halfCycles;
+    }
+
+    if (delta < MAINS_HALF_CYCLE_MIN_US) return 0; // bounce or noise, measure from the previous edge
+
+    pTracker->lastCapture = capture;
+
+    if (delta > MAINS_HALF_CYCLE_MAX_US)
+    {
+        pTracker->goodEdges = 0;
+        return 0;
+    }
+
+    if (pTracker->goodEdges == 0)
+    {
+        pTracker->halfCycleUs = delta;
+    }
+    else
+    {
+        pTracker->halfCycleUs += ((int32_t)delta - (int32_t)pTracker->halfCycleUs) >> MAINS_FILTER_SHIFT;
+    }
+
+    pTracker->goodEdges++;
+
+    return mainsLocked(pTracker) ? 1 : 0;
+}
+
+/**
+ * @brief check whether the tracker has a stable mains period
+ *
+ * @param pTracker tracker state
+ * @return true once MAINS_LOCK_EDGES consecutive in-range periods were seen
+ */
+bool mainsLocked(SMainsTracker_t const *pTracker)
+{
+    return pTracker->goodEdges >= MAINS_LOCK_EDGES;
+}
+
+/**
+ * @brief round a duration to a whole number of mains half-cycles
+ *
+ * @param durationMs requested on-time in milliseconds
+ * @param halfCycleUs half-cycle period in microseconds
+ * @param[out] pErrorUs delivered minus requested on-time in microseconds, may be NULL
+ * @return uint32_t number of half-cycles, at least 1
+ */
+uint32_t mainsQuantise(uint32_t durationMs, uint32_t halfCycleUs, int32_t *pErrorUs)
+{
+    uint64_t durationUs = (uint64_t)durationMs * 1000;
+    uint32_t halfCycles = (uint32_t)((durationUs + (halfCycleUs / 2)) / halfCycleUs);
+
+    halfCycles = (halfCycles == 0) ? 1 : halfCycles;
+
+    if (pErrorUs != NULL) *pErrorUs = (int32_t)((int64_t)halfCycles * halfCycleUs - (int64_t)durationUs);
+
+    return halfCycles;
+}
+
+/**
+ * @brief fetch and clear the time summed up over accepted edges since the last call
+ *
+ * @param pTracker tracker state
+ * @param[out] pElapsedUs microseconds between the accepted edges, on the HSI-derived capture clock
+ * @param[out] pHalfCycles mains half-cycles covered by pElapsedUs
+ */
+void mainsTakeSum(SMainsTracker_t *pTracker, uint32_t *pElapsedUs, uint32_t *pHalfCycles)
+{
+    *pElapsedUs  = pTracker->sumUs;
+    *pHalfCycles = pTracker->sumHalfCycles;
+
+    pTracker->sumUs         = 0;
+    pTracker->sumHalfCycles = 0;
+}
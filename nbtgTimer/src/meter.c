@@ -0,0 +1,255 @@
+/**
+ * @file  meter.c
+ * @brief easel photometer
+ *
+ * the ADC is sampled continuously by TIM6 + DMA; a spot reading is just the ring average taken to the log domain.
+ * calibration ties one reading to the exposure that gave a correct highlight on a reference print, so a suggested time
+ * is that reference time scaled by 2^(stops of difference). the grade comes from matching the measured contrast range
+ * against the exposure range (ISO R) of each paper grade
+ *
+ * the same calibration defines the target of a closed-loop exposure: nominal time x the linear ADC level of the
+ * reference reading. the integral is fed one DMA block at a time and predicts how many samples are still needed at
+ * the current level
+ */
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include "meter.h"
+
+#include <stddef.h>
+
+#include "adc.h"
+#include "fstop.h"
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define LOG2_FRAC_BITS 8
+
+#define METER_GRADES   6   // 0..5
+
+//=====================================================================================================================
+// Constants
+//=====================================================================================================================
+
+// exposure range (ISO R) of grades 0..5 of a generic VC paper in stops, Q8: R 140, 120, 100, 80, 60, 50
+static const int16_t g_gradeRangeQ8[METER_GRADES] = { 1191, 1020, 850, 680, 510, 425 };
+
+//=====================================================================================================================
+// Globals
+//=====================================================================================================================
+
+static int32_t  g_refLog2Q8  = 0;
+static uint32_t g_refTimeMs  = 0;
+
+static int32_t  g_points[METER_MAX_POINTS];
+static uint8_t  g_numPoints = 0;
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+/**
+ * @brief fixed-point log2, fstopLog2() at the meter's resolution
+ *
+ * @param value input, must be > 0
+ * @return int32_t log2(value) in Q8, truncated
+ */
+int32_t meterLog2Q8(uint32_t value)
+{
+    if (value == 0) return METER_NO_READING;
+
+    return fstopLog2(value) >> (16 - LOG2_FRAC_BITS);
+}
+
+/**
+ * @brief scale a value by a power of two given in stops
+ *
+ * @param value value to scale
+ * @param stopsQ8 exponent in Q8, may be negative
+ * @return uint32_t value * 2^(stopsQ8 / 256), saturated
+ */
+uint32_t meterExp2Q8(uint32_t value, int32_t stopsQ8)
+{
+    return fstopExp2(value, stopsQ8 * (STOP_Q16 >> LOG2_FRAC_BITS));
+}
+
+/**
+ * @brief set the metering calibration
+ *
+ * @param refLog2Q8 spot reading on the highlight of the reference print
+ * @param refTimeMs exposure that gave the correct highlight density on that print
+ */
+void meterSetCalibration(int32_t refLog2Q8, uint32_t refTimeMs)
+{
+    g_refLog2Q8 = refLog2Q8;
+    g_refTimeMs = refTimeMs;
+}
+
+/**
+ * @brief take a spot reading
+ *
+ * @return int32_t reading in log2 Q8, METER_NO_READING if the probe is dark
+ */
+int32_t meterSpot(void)
+{
+    uint16_t raw = adcGetAverage();
+
+    return (raw < METER_MIN_ADC) ? METER_NO_READING : meterLog2Q8(raw);
+}
+
+/**
+ * @brief exposure that gives the calibrated density for a reading
+ *
+ * @param readingQ8 spot reading, log2 Q8
+ * @return uint32_t time in milliseconds, 0 if uncalibrated or no reading
+ */
+uint32_t meterTimeForReading(int32_t readingQ8)
+{
+    if ((g_refTimeMs == 0) || (readingQ8 == METER_NO_READING)) return 0;
+
+    // one stop less light doubles the time
+    return meterExp2Q8(g_refTimeMs, g_refLog2Q8 - readingQ8);
+}
+
+/**
+ * @brief linear ADC level of the calibration reading
+ *
+ * @return uint32_t level in ADC counts, 0 if uncalibrated
+ */
+uint32_t meterReferenceLevel(void)
+{
+    return (g_refTimeMs == 0) ? 0 : meterExp2Q8(1, g_refLog2Q8);
+}
+
+/**
+ * @brief discard collected multi-point readings
+ *
+ */
+void meterClearPoints(void)
+{
+    g_numPoints = 0;
+}
+
+/**
+ * @brief add a spot reading to the multi-point set
+ *
+ * @return false if the set is full or the probe is dark
+ */
+bool meterAddPoint(void)
+{
+    int32_t reading = meterSpot();
+
+    if ((g_numPoints >= METER_MAX_POINTS) || (reading == METER_NO_READING)) return false;
+
+    g_points[g_numPoints++] = reading;
+
+    return true;
+}
+
+/**
+ * @brief number of collected multi-point readings
+ *
+ * @return uint8_t count
+ */
+uint8_t meterPointCount(void)
+{
+    return g_numPoints;
+}
+
+/**
+ * @brief evaluate the multi-point set: contrast range, base time for the highlight, and grade
+ *
+ * @param[out] pResult analysis
+ * @return false if fewer than two points were taken
+ */
+bool meterAnalyse(SMeterResult_t *pResult)
+{
+    if (g_numPoints < 2) return false;
+
+    int32_t lo = g_points[0];
+    int32_t hi = g_points[0];
+
+    for (uint8_t i = 1; i < g_numPoints; i++)
+    {
+        lo = (g_points[i] < lo) ? g_points[i] : lo;
+        hi = (g_points[i] > hi) ? g_points[i] : hi;
+    }
+
+    pResult->highlightQ8 = lo;
+    pResult->shadowQ8    = hi;
+    pResult->rangeQ8     = hi - lo;
+    pResult->baseTimeMs  = meterTimeForReading(lo);
+
+    // walk the grade table (descending ranges) and interpolate to the nearest half grade
+    int32_t range = pResult->rangeQ8;
+
+    if (range >= g_gradeRangeQ8[0])
+    {
+        pResult->halfGrades = 0;
+    }
+    else if (range <= g_gradeRangeQ8[METER_GRADES - 1])
+    {
+        pResult->halfGrades = (METER_GRADES - 1) * 2;
+    }
+    else
+    {
+        uint8_t g = 0;
+        while (range < g_gradeRangeQ8[g + 1]) g++;
+
+        int32_t span = g_gradeRangeQ8[g] - g_gradeRangeQ8[g + 1];
+        int32_t pos  = g_gradeRangeQ8[g] - range; // 0..span
+
+        pResult->halfGrades = (g * 2) + (((pos * 4) + span) / (2 * span)); // round(pos / span * 2)
+    }
+
+    return true;
+}
+
+/**
+ * @brief reset a light integral
+ *
+ * @param pIntegral integral state
+ * @param target light to deliver, ADC counts x samples
+ */
+void integralStart(SLightIntegral_t *pIntegral, uint64_t target)
+{
+    pIntegral->target  = target;
+    pIntegral->accum   = 0;
+    pIntegral->samples = 0;
+}
+
+/**
+ * @brief integrate a block of samples and predict the remaining exposure
+ *
+ * @param pIntegral integral state
+ * @param pSamples ADC samples, one per sample period
+ * @param count number of samples
+ * @return uint32_t sample periods left at the level of this block; 0 once the target is reached,
+ *         METER_LEFT_UNKNOWN if the block was dark
+ */
+uint32_t integralAddBlock(SLightIntegral_t *pIntegral, const volatile uint16_t *pSamples, uint8_t count)
+{
+    uint32_t sum = 0;
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        sum += pSamples[i];
+    }
+
+    pIntegral->accum   += sum;
+    pIntegral->samples += count;
+
+    if (pIntegral->accum >= pIntegral->target) return 0;
+    if (sum == 0) return METER_LEFT_UNKNOWN;
+
+    uint64_t remaining = pIntegral->target - pIntegral->accum;
+
+    // remaining / (sum / count), rounded up so the prediction never cuts the exposure short
+    uint64_t left = ((remaining * count) + sum - 1) / sum;
+
+    return (left >= METER_LEFT_UNKNOWN) ? (METER_LEFT_UNKNOWN - 1) : (uint32_t)left;
+}
@@ -0,0 +1,393 @@
+/**
+ * @file  profile.c
+ * @brief paper and chemistry profiles in EEPROM
+ *
+ * Rev1 has no SPI flash, the SPI bus drives the display, so the profiles share the EEPROM with the session snapshot,
+ * the crash dump and the journal. each slot is one EEPROM page holding a magic byte, the SProfile_t and a CRC, so a
+ * profile is written in a single page write and can't be left half-updated
+ *
+ * at boot every slot is read once to build the index: a bit per valid slot and the names for the console. selecting
+ * reads just the one page, checks its CRC and turns the stored parameters into an SPaperModel_t; the powers of two and
+ * the reciprocity table are worked out there, and the exposure math only multiplies with the precomputed factors
+ *
+ * like the journal, profiles are only written and selected while the exposure task is idle: the EEPROM stays off the
+ * exposure path, and a program never sees its constants change part way
+ */
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include "profile.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "console.h"
+#include "crc.h"
+#include "exposure.h"
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define PROFILE_MAGIC          0xB7
+#define PROFILE_SLOT_ADDR(n)   (PROFILE_EEPROM_ADDR + ((n) * EEPROM_PAGE_SIZE))
+#define PROFILE_CRC_SIZE       (offsetof(SProfileRecord_t, crc))
+
+#define PROFILE_MAX_LAMP_10MS  (LAMP_MODEL_MAX_TAU_MS / 10)
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+/** @brief slot contents */
+typedef struct __attribute__((packed))
+{
+    uint8_t    magic;
+    SProfile_t profile;
+    uint16_t   crc;     //< CRC-16/CCITT over magic..profile
+} SProfileRecord_t;
+
+_Static_assert(sizeof(SProfileRecord_t) <= EEPROM_PAGE_SIZE, "profile record exceeds an EEPROM page");
+
+//=====================================================================================================================
+// Globals
+//=====================================================================================================================
+
+static uint16_t g_validSlots = 0; //< bit n set if slot n holds a profile
+static char     g_names[PROFILE_SLOTS][PROFILE_NAME_LENGTH];
+static uint8_t  g_active     = PROFILE_NONE;
+
+//=====================================================================================================================
+// Static protos
+//=====================================================================================================================
+
+static bool readRecord(uint8_t, SProfileRecord_t *);
+static bool setField(SProfile_t *, const char *, int32_t);
+static void printProfile(uint8_t, const SProfile_t *);
+static void profileCommand(int, char *[]);
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+/**
+ * @brief build the slot index and select the profile of the restored session. call before the scheduler starts,
+ *        after initSession()
+ *
+ */
+void initProfile(void)
+{
+    static const SConsoleCommand_t profileCmd = { "profile", "paper profiles, 'profile help' for the subcommands",
+                                                  profileCommand };
+    SProfileRecord_t record;
+    SSessionState_t  session;
+
+    for (uint8_t slot = 0; slot < PROFILE_SLOTS; slot++)
+    {
+        if (readRecord(slot, &record))
+        {
+            g_validSlots |= (uint16_t)(1u << slot);
+            memcpy(g_names[slot], record.profile.name, PROFILE_NAME_LENGTH);
+        }
+    }
+
+    sessionGetState(&session);
+
+    if ((session.profile != PROFILE_NONE) && !profileSelect(session.profile)) sessionSetProfile(PROFILE_NONE);
+
+    (void)consoleRegisterCommand(&profileCmd);
+}
+
+/**
+ * @brief make a profile the active one: its paper constants apply from the next exposure and its lamp time constants,
+ *        if set, replace the current ones. only while the exposure task is idle
+ *
+ * @param slot profile slot, PROFILE_NONE to go back to no paper correction
+ * @return false if the slot is empty or invalid, or an exposure is running or queued
+ */
+bool profileSelect(uint8_t slot)
+{
+    SProfileRecord_t record;
+    SPaperModel_t    model;
+
+    if (exposureIsBusy()) return false;
+
+    if (slot == PROFILE_NONE)
+    {
+        exposureSetPaperModel(NULL);
+    }
+    else
+    {
+        if ((slot >= PROFILE_SLOTS) || ((g_validSlots & (1u << slot)) == 0)) return false;
+
+        if (!readRecord(slot, &record) || !paperModelInit(&model, &record.profile.paper)) return false;
+
+        if (((record.profile.lampRise10Ms != 0) || (record.profile.lampFall10Ms != 0)) &&
+            !sessionSetLampModel((uint16_t)(record.profile.lampRise10Ms * 10),
+                                 (uint16_t)(record.profile.lampFall10Ms * 10)))
+        {
+            return false;
+        }
+
+        exposureSetPaperModel(&model);
+    }
+
+    g_active = slot;
+    sessionSetProfile(slot);
+
+    return true;
+}
+
+/**
+ * @brief slot of the active profile
+ *
+ * @return uint8_t slot, PROFILE_NONE if no profile is selected
+ */
+uint8_t profileActive(void)
+{
+    return g_active;
+}
+
+/**
+ * @brief read a profile
+ *
+ * @param slot profile slot
+ * @param[out] pProfile profile
+ * @return false if the slot is empty or doesn't validate
+ */
+bool profileRead(uint8_t slot, SProfile_t *pProfile)
+{
+    SProfileRecord_t record;
+
+    if ((slot >= PROFILE_SLOTS) || !readRecord(slot, &record)) return false;
+
+    *pProfile = record.profile;
+
+    return true;
+}
+
+/**
+ * @brief store a profile in a slot, replacing what was there. the active profile is applied again. only while the
+ *        exposure task is idle
+ *
+ * @param slot profile slot
+ * @param pProfile profile, the name is cut to fit
+ * @return false if the slot or the parameters are out of range, an exposure is running or queued, or the write failed
+ */
+bool profileWrite(uint8_t slot, const SProfile_t *pProfile)
+{
+    SProfileRecord_t record;
+    SPaperModel_t    model;
+
+    if ((slot >= PROFILE_SLOTS) || exposureIsBusy()) return false;
+    if ((pProfile->lampRise10Ms > PROFILE_MAX_LAMP_10MS) || (pProfile->lampFall10Ms > PROFILE_MAX_LAMP_10MS))
+    {
+        return false;
+    }
+    if (!paperModelInit(&model, &pProfile->paper)) return false;
+
+    record.magic                                 = PROFILE_MAGIC;
+    record.profile                               = *pProfile;
+    record.profile.name[PROFILE_NAME_LENGTH - 1] = '\0';
+    record.crc                                   = crc16(&record.magic, PROFILE_CRC_SIZE);
+
+    g_validSlots &= (uint16_t)~(1u << slot);
+
+    if (!eepromWrite(PROFILE_SLOT_ADDR(slot), (const uint8_t *)&record, sizeof(record))) return false;
+
+    g_validSlots |= (uint16_t)(1u << slot);
+    memcpy(g_names[slot], record.profile.name, PROFILE_NAME_LENGTH);
+
+    return (slot == g_active) ? profileSelect(slot) : true;
+}
+
+/**
+ * @brief empty a slot. erasing the active profile selects none. only while the exposure task is idle
+ *
+ * @param slot profile slot
+ * @return false if the slot is out of range, an exposure is running or queued, or the write failed
+ */
+bool profileErase(uint8_t slot)
+{
+    const uint8_t blank = 0xFF;
+
+    if ((slot >= PROFILE_SLOTS) || exposureIsBusy()) return false;
+
+    if (!eepromWrite(PROFILE_SLOT_ADDR(slot), &blank, sizeof(blank))) return false;
+
+    g_validSlots &= (uint16_t)~(1u << slot);
+
+    return (slot == g_active) ? profileSelect(PROFILE_NONE) : true;
+}
+
+//=====================================================================================================================
+// Statics
+//=====================================================================================================================
+
+/**
+ * @brief read a slot and check it
+ *
+ * @param slot profile slot
+ * @param[out] pRecord slot contents
+ * @return false if the read failed or the slot holds no valid profile
+ */
+static bool readRecord(uint8_t slot, SProfileRecord_t *pRecord)
+{
+    if (!eepromRead(PROFILE_SLOT_ADDR(slot), (uint8_t *)pRecord, sizeof(SProfileRecord_t))) return false;
+
+    return (pRecord->magic == PROFILE_MAGIC) && (pRecord->crc == crc16(&pRecord->magic, PROFILE_CRC_SIZE));
+}
+
+/**
+ * @brief set one profile parameter from its console name, in console units
+ *
+ * @param pProfile profile to change
+ * @param pField grade0..grade5 (ms), drydown (0.1%), knee (s), recip (0.01 stop per doubling), soft, hard (1/6 stop),
+ *        rise, fall (ms)
+ * @param value new value
+ * @return false if the field is unknown or the value doesn't fit it
+ */
+static bool setField(SProfile_t *pProfile, const char *pField, int32_t value)
+{
+    SPaperParams_t *pPaper = &pProfile->paper;
+
+    if ((strncmp(pField, "grade", 5) == 0) && (pField[5] >= '0') && (pField[5] < ('0' + PAPER_GRADES)) &&
+        (pField[6] == '\0'))
+    {
+        if ((value < 0) || (value > (UINT16_MAX * 10))) return false;
+        pPaper->gradeBase10Ms[pField[5] - '0'] = (uint16_t)((value + 5) / 10);
+    }
+    else if ((strcmp(pField, "soft") == 0) || (strcmp(pField, "hard") == 0))
+    {
+        if ((value < INT8_MIN) || (value > INT8_MAX)) return false;
+        *((pField[0] == 's') ? &pPaper->splitSoftSixths : &pPaper->splitHardSixths) = (int8_t)value;
+    }
+    else if ((strcmp(pField, "rise") == 0) || (strcmp(pField, "fall") == 0))
+    {
+        if ((value < 0) || (value > LAMP_MODEL_MAX_TAU_MS)) return false;
+        *((pField[0] == 'r') ? &pProfile->lampRise10Ms : &pProfile->lampFall10Ms) = (uint8_t)((value + 5) / 10);
+    }
+    else
+    {
+        uint8_t *pByte;
+
+        if (strcmp(pField, "drydown") == 0) pByte = &pPaper->dryDownPermille;
+        else if (strcmp(pField, "knee") == 0) pByte = &pPaper->recipKneeS;
+        else if (strcmp(pField, "recip") == 0) pByte = &pPaper->recipCentiStops;
+        else return false;
+
+        if ((value < 0) || (value > UINT8_MAX)) return false;
+        *pByte = (uint8_t)value;
+    }
+
+    return true;
+}
+
+/**
+ * @brief print a profile with the split-grade times for the session base time
+ *
+ */
+static void printProfile(uint8_t slot, const SProfile_t *pProfile)
+{
+    SPaperModel_t   model;
+    SSessionState_t session;
+
+    (void)paperModelInit(&model, &pProfile->paper);
+    sessionGetState(&session);
+
+    consolePutDec(slot);
+    consolePuts(" ");
+    consolePuts(pProfile->name);
+    consolePuts("\ngrades ms:");
+    for (uint8_t i = 0; i < PAPER_GRADES; i++)
+    {
+        consolePuts(" ");
+        consolePutDec((int32_t)model.gradeBaseMs[i]);
+    }
+    consolePuts("\ndrydown ");
+    consolePutDec(pProfile->paper.dryDownPermille);
+    consolePuts(" knee ");
+    consolePutDec(pProfile->paper.recipKneeS);
+    consolePuts(" recip ");
+    consolePutDec(pProfile->paper.recipCentiStops);
+    consolePuts(" rise ");
+    consolePutDec(pProfile->lampRise10Ms * 10);
+    consolePuts(" fall ");
+    consolePutDec(pProfile->lampFall10Ms * 10);
+    consolePuts("\nsplit at ");
+    consolePutDec((int32_t)session.baseTimeMs);
+    consolePuts("ms: soft ");
+    consolePutDec((int32_t)paperSplitMs(&model, session.baseTimeMs, false));
+    consolePuts(" hard ");
+    consolePutDec((int32_t)paperSplitMs(&model, session.baseTimeMs, true));
+    consolePuts("\n");
+}
+
+/**
+ * @brief "profile" console command: list, select, show and edit the paper profiles
+ *
+ */
+static void profileCommand(int argc, char *argv[])
+{
+    SProfile_t profile;
+    int32_t    slot  = 0;
+    int32_t    value = 0;
+
+    if (argc < 2)
+    {
+        for (uint8_t i = 0; i < PROFILE_SLOTS; i++)
+        {
+            if ((g_validSlots & (1u << i)) == 0) continue;
+
+            consolePuts((i == g_active) ? "* " : "  ");
+            consolePutDec(i);
+            consolePuts(" ");
+            consolePuts(g_names[i]);
+            consolePuts("\n");
+        }
+        return;
+    }
+
+    if (strcmp(argv[1], "off") == 0)
+    {
+        if (!profileSelect(PROFILE_NONE)) consolePuts("busy\n");
+    }
+    else if (consoleParseInt(argv[1], &slot))
+    {
+        if ((slot < 0) || (slot >= PROFILE_SLOTS) || !profileSelect((uint8_t)slot)) consolePuts("no profile or busy\n");
+    }
+    else if ((argc < 3) || !consoleParseInt(argv[2], &slot) || (slot < 0) || (slot >= PROFILE_SLOTS))
+    {
+        consolePuts("usage: profile [<n>|off|show <n>|new <n> <name>|set <n> <field> <value>|erase <n>]\n"
+                    "fields: grade0..grade5 ms, drydown 0.1%, knee s, recip 0.01 stop, soft/hard 1/6 stop, "
+                    "rise/fall ms\n");
+    }
+    else if (strcmp(argv[1], "show") == 0)
+    {
+        if (profileRead((uint8_t)slot, &profile)) printProfile((uint8_t)slot, &profile);
+        else consolePuts("no profile\n");
+    }
+    else if ((strcmp(argv[1], "new") == 0) && (argc > 3))
+    {
+        memset(&profile, 0, sizeof(profile));
+        strncpy(profile.name, argv[3], PROFILE_NAME_LENGTH - 1);
+
+        if (!profileWrite((uint8_t)slot, &profile)) consolePuts("busy or eeprom error\n");
+    }
+    else if ((strcmp(argv[1], "set") == 0) && (argc > 4) && consoleParseInt(argv[4], &value))
+    {
+        if (!profileRead((uint8_t)slot, &profile)) consolePuts("no profile\n");
+        else if (!setField(&profile, argv[3], value)) consolePuts("unknown field or out of range\n");
+        else if (!profileWrite((uint8_t)slot, &profile)) consolePuts("invalid, busy or eeprom error\n");
+    }
+    else if (strcmp(argv[1], "erase") == 0)
+    {
+        if (!profileErase((uint8_t)slot)) consolePuts("busy or eeprom error\n");
+    }
+    else
+    {
+        consolePuts("usage: profile help\n");
+    }
+}
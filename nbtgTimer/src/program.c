@@ -0,0 +1,289 @@
+/**
+ * @file  program.c
+ * @brief exposure program interpreter
+ *
+ * non-blocking steps (stop offsets, loops) are executed inline by progNext(); it only returns once a step needs the
+ * lamp or the operator. the stop offset is resolved against the base time as soon as it changes, so arming a lamp
+ * step costs nothing beyond reading the cached working time. lamp rise/fall compensation is folded into that cached
+ * value as well
+ */
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include "program.h"
+
+#include <stddef.h>
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+//=====================================================================================================================
+// Static protos
+//=====================================================================================================================
+
+static bool parseNumber(const char **, uint32_t, uint32_t *);
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+/**
+ * @brief sanity check a program before running it
+ *
+ * @param pProgram program to check
+ * @return true if all opcodes are known, loop targets point backwards and the program is terminated
+ */
+bool progValidate(const SExposureProgram_t *pProgram)
+{
+    if ((pProgram == NULL) || (pProgram->pSteps == NULL) || (pProgram->numSteps == 0)) return false;
+
+    for (uint8_t i = 0; i < pProgram->numSteps; i++)
+    {
+        const SProgStep_t *pStep = &pProgram->pSteps[i];
+
+        switch (pStep->opcode)
+        {
+            case PROG_OP_END:
+                return true;
+            case PROG_OP_LAMP_MS:
+                if (pStep->value == 0) return false;
+                break;
+            case PROG_OP_LOOP:
+                if ((pStep->value >= i) || (pStep->param <= 0)) return false;
+                break;
+            case PROG_OP_LAMP:
+            case PROG_OP_STOP_OFFSET:
+            case PROG_OP_PAUSE:
+            case PROG_OP_BEEP_WAIT:
+                break;
+            default:
+                return false;
+        }
+    }
+
+    return false; // no PROG_OP_END
+}
+
+/**
+ * @brief reset interpreter state for a new run
+ *
+ * @param pCtx interpreter context
+ * @param pProgram program to run
+ * @param pLampModel lamp compensation, NULL for none
+ * @param pPaperModel paper dry-down and reciprocity correction of the base time steps, NULL for none
+ * @param baseTime base exposure in milliseconds
+ */
+void progInit(SProgContext_t *pCtx, const SExposureProgram_t *pProgram, SLampModel_t const *pLampModel,
+              SPaperModel_t const *pPaperModel, uint32_t baseTime)
+{
+    pCtx->pProgram      = pProgram;
+    pCtx->pLampModel    = pLampModel;
+    pCtx->pPaperModel   = pPaperModel;
+    pCtx->baseTime      = baseTime;
+    pCtx->workingTime   = lampModelCompensate(pLampModel, paperCorrect(pPaperModel, baseTime));
+    pCtx->stopOffset    = 0;
+    pCtx->pc            = 0;
+    pCtx->loopRemaining = 0;
+    pCtx->loopActive    = false;
+}
+
+/**
+ * @brief run the program up to the next blocking action
+ *
+ * @param pCtx interpreter context
+ * @return SProgAction_t action for the exposure task to carry out before calling progNext() again
+ */
+SProgAction_t progNext(SProgContext_t *pCtx)
+{
+    while (pCtx->pc < pCtx->pProgram->numSteps)
+    {
+        const SProgStep_t *pStep = &pCtx->pProgram->pSteps[pCtx->pc];
+
+        switch (pStep->opcode)
+        {
+            case PROG_OP_END:
+                return (SProgAction_t){ PROG_ACTION_DONE, 0 };
+            case PROG_OP_LAMP_MS:
+                pCtx->pc++;
+                return (SProgAction_t){ PROG_ACTION_LAMP, lampModelCompensate(pCtx->pLampModel, pStep->value) };
+            case PROG_OP_LAMP:
+                pCtx->pc++;
+                return (SProgAction_t){ PROG_ACTION_LAMP, pCtx->workingTime };
+            case PROG_OP_STOP_OFFSET:
+                pCtx->stopOffset += pStep->param;
+                pCtx->workingTime = lampModelCompensate(pCtx->pLampModel,
+                                                        paperCorrect(pCtx->pPaperModel,
+                                                                     calculateFStopOffset(pCtx->baseTime,
+                                                                                          pCtx->stopOffset,
+                                                                                          pCtx->pProgram->resolution)));
+                pCtx->pc++;
+                break;
+            case PROG_OP_PAUSE:
+                pCtx->pc++;
+                return (SProgAction_t){ PROG_ACTION_WAIT_OPERATOR, 0 };
+            case PROG_OP_BEEP_WAIT:
+                pCtx->pc++;
+                return (SProgAction_t){ PROG_ACTION_BEEP_WAIT, 0 };
+            case PROG_OP_LOOP:
+                if (!pCtx->loopActive)
+                {
+                    pCtx->loopActive    = true;
+                    pCtx->loopRemaining = pStep->param;
+                }
+
+                if (pCtx->loopRemaining > 0)
+                {
+                    pCtx->loopRemaining--;
+                    pCtx->pc = pStep->value;
+                }
+                else
+                {
+                    pCtx->loopActive = false;
+                    pCtx->pc++;
+                }
+                break;
+            default:
+                return (SProgAction_t){ PROG_ACTION_ERROR, 0 };
+        }
+    }
+
+    return (SProgAction_t){ PROG_ACTION_DONE, 0 };
+}
+
+/**
+ * @brief nominal lamp time of a whole program, without lamp or paper compensation
+ *
+ * @param pProgram valid program
+ * @param baseTime base exposure in milliseconds
+ * @return uint32_t sum of all lamp steps in milliseconds
+ */
+uint32_t progTotalMs(const SExposureProgram_t *pProgram, uint32_t baseTime)
+{
+    SProgContext_t ctx;
+    SProgAction_t  next;
+    uint32_t       totalMs = 0;
+
+    progInit(&ctx, pProgram, NULL, NULL, baseTime);
+
+    while (((next = progNext(&ctx)).action != PROG_ACTION_DONE) && (next.action != PROG_ACTION_ERROR))
+    {
+        totalMs += next.durationMs;
+    }
+
+    return totalMs;
+}
+
+/**
+ * @brief build a program from its text form, steps separated by commas:
+ *
+ *        l         lamp on for the base time (PROG_OP_LAMP)
+ *        l<ms>     lamp on for a fixed time (PROG_OP_LAMP_MS)
+ *        +<n> -<n> stop offset in steps of the resolution
+ *        p         pause for the operator
+ *        b         beep, then wait for the operator
+ *        r<i>x<n>  jump back to step i, n more times
+ *
+ *        e.g. "l,+3,l,p,-6,l" at thirds: the base exposure, a step one stop over it, a pause, a step one stop under
+ *
+ * @param[out] pBuf buffer for the program, pBuf->program is set up to run from it
+ * @param pText program text, zero-terminated
+ * @param resolution resolution of the stop offsets
+ * @return false if the text doesn't parse, doesn't fit or the program is invalid
+ */
+bool progParse(SProgBuffer_t *pBuf, const char *pText, EFStop_t resolution)
+{
+    uint8_t  numSteps = 0;
+    uint32_t value;
+    uint32_t count;
+
+    if (*pText == '\0') return false;
+
+    while (*pText != '\0')
+    {
+        SProgStep_t step;
+        char        op = *pText++;
+
+        if (numSteps >= (PROG_BUFFER_STEPS - 1)) return false; // room for the end step
+
+        switch (op)
+        {
+            case 'l':
+                step = PROG_STEP_LAMP();
+                if ((*pText >= '0') && (*pText <= '9'))
+                {
+                    if (!parseNumber(&pText, UINT16_MAX, &value)) return false;
+                    step = PROG_STEP_LAMP_MS((uint16_t)value);
+                }
+                break;
+            case '+':
+            case '-':
+                if (!parseNumber(&pText, INT8_MAX, &value)) return false;
+                step = PROG_STEP_STOP_OFFSET((int8_t)((op == '-') ? -(int32_t)value : (int32_t)value));
+                break;
+            case 'p':
+                step = PROG_STEP_PAUSE();
+                break;
+            case 'b':
+                step = PROG_STEP_BEEP_WAIT();
+                break;
+            case 'r':
+                if (!parseNumber(&pText, UINT8_MAX, &value) || (*pText++ != 'x') ||
+                    !parseNumber(&pText, INT8_MAX, &count))
+                {
+                    return false;
+                }
+                step = PROG_STEP_LOOP((uint16_t)value, (int8_t)count);
+                break;
+            default:
+                return false;
+        }
+
+        pBuf->steps[numSteps++] = step;
+
+        if ((*pText == ',') && (pText[1] != '\0')) pText++;
+        else if (*pText != '\0') return false;
+    }
+
+    pBuf->steps[numSteps++] = PROG_STEP_END();
+
+    pBuf->program.pSteps     = pBuf->steps;
+    pBuf->program.numSteps   = numSteps;
+    pBuf->program.resolution = resolution;
+    pBuf->program.id         = 0;
+
+    return progValidate(&pBuf->program);
+}
+
+//=====================================================================================================================
+// Statics
+//=====================================================================================================================
+
+/**
+ * @brief read a decimal number and move past it
+ *
+ * @param[in,out] ppText position in the text
+ * @param max largest value accepted
+ * @param[out] pValue number
+ * @return false if there are no digits or the number exceeds max
+ */
+static bool parseNumber(const char **ppText, uint32_t max, uint32_t *pValue)
+{
+    const char *p     = *ppText;
+    uint32_t    value = 0;
+
+    if ((*p < '0') || (*p > '9')) return false;
+
+    while ((*p >= '0') && (*p <= '9'))
+    {
+        value = (value * 10) + (uint32_t)(*p++ - '0');
+        if (value > max) return false;
+    }
+
+    *ppText = p;
+    *pValue = value;
+
+    return true;
+}
@@ -0,0 +1,381 @@
+/**
+ * @file  replay.c
+ * @brief operator input recording and replay
+ *
+ * the events are kept in one flat buffer, each a time in milliseconds from the start of the recording, a type and
+ * the console line for line events. recording stops taking events once the buffer is full and counts the rest
+ *
+ * presses are recorded by the exposure module after its contact bounce holdoff, so one event is one accepted press.
+ * they are replayed by raising the footswitch EXTI line in software: the press goes through the EXTI handler at its
+ * own priority and sees the same latency as a real one. console lines are typed into the console input queue, so
+ * they are echoed and executed by the console task like typed ones. "replay" commands themselves are not recorded
+ *
+ * the replay task waits for the tick of each event, counted from the start of the replay, so events land on the tick
+ * they were recorded on. the wait is a notification wait, which replayStop() cuts short. the task runs above the
+ * console and housekeeping tasks and below the exposure task
+ */
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include "replay.h"
+
+#include <FreeRTOS.h>
+#include <task.h>
+
+#include <string.h>
+
+#include "board.h"
+#include "console.h"
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define REPLAY_TASK_STACK_SIZE 128
+#define REPLAY_TASK_PRIORITY   (tskIDLE_PRIORITY + 2)
+
+#define REPLAY_COMMAND         "replay"
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+/** @brief stored event header, followed by len bytes of the line for REPLAY_EVENT_LINE */
+typedef struct __attribute__((packed))
+{
+    uint32_t timeMs; //< since the start of the recording
+    uint8_t  type;   //< EReplayEvent_t
+    uint8_t  len;
+} SReplayEvent_t;
+
+//=====================================================================================================================
+// Globals
+//=====================================================================================================================
+
+static StaticTask_t            g_replayTaskBuf;
+static StackType_t             g_replayTaskStack[REPLAY_TASK_STACK_SIZE];
+static TaskHandle_t            g_replayTask = NULL;
+
+static uint8_t                 g_buffer[REPLAY_BUFFER_SIZE];
+static uint16_t                g_used       = 0;
+static uint16_t                g_numEvents  = 0;
+static uint16_t                g_dropped    = 0;
+static volatile EReplayState_t g_state      = REPLAY_IDLE;
+static TickType_t              g_startTick  = 0;
+
+//=====================================================================================================================
+// Static protos
+//=====================================================================================================================
+
+static void replayTask(void *);
+static bool appendEvent(EReplayEvent_t, uint32_t, const char *, uint8_t);
+static void replayLineHook(const char *, void *);
+static void dumpEvents(void);
+static void replayCommand(int, char *[]);
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+/**
+ * @brief create the replay task, hook the console and register the "replay" console command
+ *
+ */
+void initReplay(void)
+{
+    static const SConsoleCommand_t replayCmd = { REPLAY_COMMAND,
+                                                 "record/replay input, 'replay rec|play|stop|dump|clear|at <ms> ...'",
+                                                 replayCommand };
+
+    g_replayTask = xTaskCreateStatic(replayTask, "rpl", REPLAY_TASK_STACK_SIZE, NULL, REPLAY_TASK_PRIORITY,
+                                     &g_replayTaskStack[0], &g_replayTaskBuf);
+
+    consoleSetLineHook(replayLineHook, NULL);
+    (void)consoleRegisterCommand(&replayCmd);
+}
+
+/**
+ * @brief record an accepted start input press while recording. runs in ISR context at the highest priority
+ *
+ */
+void replayPressFromISR(void)
+{
+    if (g_state != REPLAY_RECORDING) return;
+
+    (void)appendEvent(REPLAY_EVENT_PRESS, xTaskGetTickCountFromISR() - g_startTick, NULL, 0);
+}
+
+/**
+ * @brief drop the stored events and start recording, time 0 is now
+ *
+ * @return false while a replay runs
+ */
+bool replayRecord(void)
+{
+    if (g_state == REPLAY_PLAYING) return false;
+
+    taskENTER_CRITICAL();
+    g_used      = 0;
+    g_numEvents = 0;
+    g_dropped   = 0;
+    g_startTick = xTaskGetTickCount();
+    g_state     = REPLAY_RECORDING;
+    taskEXIT_CRITICAL();
+
+    return true;
+}
+
+/**
+ * @brief replay the stored events from the start, timed from now
+ *
+ * @return false if there are none, or a recording or replay is running
+ */
+bool replayPlay(void)
+{
+    if ((g_state != REPLAY_IDLE) || (g_numEvents == 0)) return false;
+
+    g_state = REPLAY_PLAYING;
+    xTaskNotifyGive(g_replayTask);
+
+    return true;
+}
+
+/**
+ * @brief end the recording or the replay
+ *
+ */
+void replayStop(void)
+{
+    if (g_state == REPLAY_PLAYING)
+    {
+        xTaskNotifyGive(g_replayTask); // the task goes back to REPLAY_IDLE
+    }
+    else
+    {
+        g_state = REPLAY_IDLE;
+    }
+}
+
+/**
+ * @brief what the recorder is doing
+ *
+ * @return EReplayState_t state
+ */
+EReplayState_t replayState(void)
+{
+    return g_state;
+}
+
+//=====================================================================================================================
+// Statics
+//=====================================================================================================================
+
+/**
+ * @brief replay task: wait for replayPlay(), then hand every stored event over at its time
+ *
+ */
+static void replayTask(void *pParam)
+{
+    SReplayEvent_t event;
+    char           line[CONSOLE_LINE_LENGTH];
+
+    while (true)
+    {
+        (void)ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        if (g_state != REPLAY_PLAYING) continue; // stop that came after the last event
+
+        TickType_t startTick = xTaskGetTickCount();
+        uint16_t   pos       = 0;
+
+        // the buffer isn't written while playing: the recorder and "replay at" only run from REPLAY_IDLE
+        while ((pos + sizeof(SReplayEvent_t)) <= g_used)
+        {
+            memcpy(&event, &g_buffer[pos], sizeof(event));
+            pos += sizeof(event);
+
+            TickType_t waitTicks = (startTick + pdMS_TO_TICKS(event.timeMs)) - xTaskGetTickCount();
+
+            // late events (loaded out of order, or a slow console) go out at once
+            if ((waitTicks > 0) && (waitTicks < portMAX_DELAY / 2) && (ulTaskNotifyTake(pdTRUE, waitTicks) != 0))
+            {
+                break; // replayStop()
+            }
+
+            if (event.type == REPLAY_EVENT_PRESS)
+            {
+                (void)injectStartTrigger();
+            }
+            else
+            {
+                memcpy(line, &g_buffer[pos], event.len);
+                line[event.len] = '\0';
+                (void)consoleInject(line);
+            }
+
+            pos += event.len;
+        }
+
+        g_state = REPLAY_IDLE;
+    }
+}
+
+/**
+ * @brief add an event to the buffer. safe from any context
+ *
+ * @param type event type
+ * @param timeMs event time
+ * @param pLine line for REPLAY_EVENT_LINE, NULL otherwise
+ * @param len line length, shorter than CONSOLE_LINE_LENGTH
+ * @return false if the buffer is full, the event is counted as dropped
+ */
+static bool appendEvent(EReplayEvent_t type, uint32_t timeMs, const char *pLine, uint8_t len)
+{
+    SReplayEvent_t event   = { timeMs, (uint8_t)type, len };
+    uint32_t       primask = __get_PRIMASK();
+    bool           stored  = false;
+
+    __disable_irq();
+
+    if ((g_used + sizeof(event) + len) <= REPLAY_BUFFER_SIZE)
+    {
+        memcpy(&g_buffer[g_used], &event, sizeof(event));
+        if (len > 0) memcpy(&g_buffer[g_used + sizeof(event)], pLine, len);
+
+        g_used = (uint16_t)(g_used + sizeof(event) + len);
+        g_numEvents++;
+        stored = true;
+    }
+    else
+    {
+        g_dropped++;
+    }
+
+    __set_PRIMASK(primask);
+
+    return stored;
+}
+
+/**
+ * @brief console hook: record entered lines while recording. runs in the console task
+ *
+ */
+static void replayLineHook(const char *pLine, void *pCtx)
+{
+    size_t len = strlen(REPLAY_COMMAND);
+
+    if (g_state != REPLAY_RECORDING) return;
+    if ((strncmp(pLine, REPLAY_COMMAND, len) == 0) && ((pLine[len] == ' ') || (pLine[len] == '\0'))) return;
+
+    (void)appendEvent(REPLAY_EVENT_LINE, xTaskGetTickCount() - g_startTick, pLine, (uint8_t)strlen(pLine));
+}
+
+/**
+ * @brief print the stored events as CSV: time, event, console line
+ *
+ */
+static void dumpEvents(void)
+{
+    SReplayEvent_t event;
+    char           line[CONSOLE_LINE_LENGTH];
+
+    consolePuts("time_ms,event,line\n");
+
+    for (uint16_t pos = 0; (pos + sizeof(SReplayEvent_t)) <= g_used; pos += event.len)
+    {
+        memcpy(&event, &g_buffer[pos], sizeof(event));
+        pos += sizeof(event);
+
+        memcpy(line, &g_buffer[pos], event.len);
+        line[event.len] = '\0';
+
+        consolePutDec((int32_t)event.timeMs);
+        consolePuts((event.type == REPLAY_EVENT_PRESS) ? ",press," : ",line,");
+        consolePuts(line);
+        consolePuts("\n");
+    }
+}
+
+/**
+ * @brief "replay" console command: record, replay, dump and load a session
+ *
+ * @note "replay at <ms> press" and "replay at <ms> line <text>" append an event, which is how a dumped session is
+ *       loaded again. events must be in time order
+ */
+static void replayCommand(int argc, char *argv[])
+{
+    static const char *const stateNames[] = { "idle", "recording", "playing" };
+    int32_t                  timeMs       = 0;
+
+    if (argc < 2)
+    {
+        consolePuts(stateNames[g_state]);
+        consolePuts(", ");
+        consolePutDec(g_numEvents);
+        consolePuts(" events, ");
+        consolePutDec(g_used);
+        consolePuts("/");
+        consolePutDec(REPLAY_BUFFER_SIZE);
+        consolePuts("B, dropped ");
+        consolePutDec(g_dropped);
+        consolePuts("\n");
+        return;
+    }
+
+    if (strcmp(argv[1], "rec") == 0)
+    {
+        if (!replayRecord()) consolePuts("replay running\n");
+    }
+    else if (strcmp(argv[1], "play") == 0)
+    {
+        if (!replayPlay()) consolePuts("nothing to replay or busy\n");
+    }
+    else if (strcmp(argv[1], "stop") == 0)
+    {
+        replayStop();
+    }
+    else if (strcmp(argv[1], "dump") == 0)
+    {
+        dumpEvents();
+    }
+    else if ((strcmp(argv[1], "clear") == 0) && (g_state == REPLAY_IDLE))
+    {
+        g_used      = 0;
+        g_numEvents = 0;
+        g_dropped   = 0;
+    }
+    else if ((strcmp(argv[1], "at") == 0) && (argc > 3) && consoleParseInt(argv[2], &timeMs) && (timeMs >= 0) &&
+             (g_state == REPLAY_IDLE))
+    {
+        if ((strcmp(argv[3], "press") == 0) && (argc == 4))
+        {
+            if (!appendEvent(REPLAY_EVENT_PRESS, (uint32_t)timeMs, NULL, 0)) consolePuts("buffer full\n");
+        }
+        else if ((strcmp(argv[3], "line") == 0) && (argc > 4))
+        {
+            // the console split the line in place, join the arguments after "line" again. past CONSOLE_MAX_ARGS the
+            // rest of the line is left in the last argument as it is
+            char *pEnd = argv[argc - 1] + strlen(argv[argc - 1]);
+
+            for (char *p = argv[4]; p < pEnd; p++)
+            {
+                if (*p == '\0') *p = ' ';
+            }
+
+            if (!appendEvent(REPLAY_EVENT_LINE, (uint32_t)timeMs, argv[4], (uint8_t)(pEnd - argv[4])))
+            {
+                consolePuts("buffer full\n");
+            }
+        }
+        else
+        {
+            consolePuts("usage: replay at <ms> press|line <text>\n");
+        }
+    }
+    else
+    {
+        consolePuts("usage: replay [rec|play|stop|dump|clear|at <ms> press|line <text>], not while busy\n");
+    }
+}
@@ -0,0 +1,325 @@
+/**
+ * @file  session.c
+ * @brief darkroom session state, saved to EEPROM on mains loss and restored at boot
+ *
+ * the G070 has no PVD, so a failing supply is detected upstream instead: the exposure module runs a watchdog on the
+ * mains zero-cross edges and calls sessionPowerFailFromISR() once they stop. at that point the bulk capacitor of the
+ * supply is still full, which leaves more hold-up time than a rail monitor would. without a zero-cross detector
+ * fitted there is no emergency save
+ *
+ * the snapshot lives in RAM as the complete I2C write (word address, header, state, CRC) and is updated by every
+ * setter. the emergency path copies it, releases WP and hands the copy to the I2C1 DMA in one burst: ~2ms on the bus
+ * at 100kHz plus the EEPROM_WRITE_MS write cycle, all of which runs without the CPU
+ *
+ * at boot the snapshot is read back before the scheduler starts. a valid one is restored and its settings applied
+ */
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include "session.h"
+
+#include <FreeRTOS.h>
+#include <task.h>
+
+#include <stddef.h>
+
+#include "board.h"
+#include "crc.h"
+#include "exposure.h"
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define SESSION_MAGIC         0x5E
+#define SESSION_VERSION       3 // 2: paper profile, 3: LED head dimming
+
+#define SESSION_DEFAULT_BASE_MS 10000
+
+// EEPROM payload: everything after the word address
+#define SESSION_PAYLOAD_SIZE  (sizeof(SSessionImage_t) - offsetof(SSessionImage_t, magic))
+#define SESSION_CRC_SIZE      (offsetof(SSessionImage_t, crc) - offsetof(SSessionImage_t, magic))
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+/** @brief complete EEPROM write, sent as-is. the payload must fit EEPROM_PAGE_SIZE */
+typedef struct __attribute__((packed))
+{
+    uint8_t         memAddr[2]; //< EEPROM word address, MSB first
+    uint8_t         magic;
+    uint8_t         version;
+    SSessionState_t state;
+    uint16_t        crc;        //< CRC-16/CCITT over magic..state
+} SSessionImage_t;
+
+//=====================================================================================================================
+// Globals
+//=====================================================================================================================
+
+static SSessionImage_t g_image = {
+    .memAddr = { (uint8_t)(SESSION_EEPROM_ADDR >> 8), (uint8_t)SESSION_EEPROM_ADDR },
+    .magic   = SESSION_MAGIC,
+    .version = SESSION_VERSION,
+    .state   = { .baseTimeMs      = SESSION_DEFAULT_BASE_MS,
+                 .safelightLeadMs = EXPOSURE_SAFELIGHT_LEAD_MS,
+                 .profile         = SESSION_NO_PROFILE },
+};
+
+static SSessionImage_t g_saveImage;   //< frozen copy for the DMA, setters may still run during the burst
+static SI2CTransfer_t  g_saveTransfer = { EEPROM_I2C_ADDR, (uint8_t *)&g_saveImage, sizeof(SSessionImage_t), 0 };
+
+static bool            g_resumed      = false;
+static bool            g_interrupted  = false; //< the restored snapshot was taken during an exposure
+
+//=====================================================================================================================
+// Static protos
+//=====================================================================================================================
+
+static void updateCrc(void);
+static bool restoreSnapshot(void);
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+/**
+ * @brief restore the last snapshot and apply its settings. call before the scheduler starts, after initExposure()
+ *
+ */
+void initSession(void)
+{
+    g_resumed = restoreSnapshot();
+
+    if (g_resumed)
+    {
+        SSessionState_t *pState = &g_image.state;
+
+        // settings that no longer validate fall back to the defaults
+        if (!exposureSetSafelightLead(pState->safelightLeadMs)) pState->safelightLeadMs = EXPOSURE_SAFELIGHT_LEAD_MS;
+        if (!exposureSetLampModel(pState->lampRiseMs, pState->lampFallMs))
+        {
+            pState->lampRiseMs = 0;
+            pState->lampFallMs = 0;
+        }
+        exposureSetZeroCrossSync((pState->flags & SESSION_FLAG_ZERO_CROSS_SYNC) != 0);
+        (void)exposureSetLampDimming(pState->dimMinOnMs);
+
+        g_interrupted = (pState->flags & SESSION_FLAG_EXPOSING) != 0;
+    }
+
+    g_image.state.flags &= (uint8_t)~SESSION_FLAG_EXPOSING;
+    updateCrc();
+
+    // write-protected until the emergency save releases it
+    toggleEepromWP(false);
+    i2cInitEepromDMA();
+}
+
+/**
+ * @brief check whether the state was restored from a snapshot at boot
+ *
+ * @return true if a valid snapshot was found
+ */
+bool sessionResumed(void)
+{
+    return g_resumed;
+}
+
+/**
+ * @brief check whether the power went while an exposure was running, so the print on the easel is spoilt
+ *
+ * @return true if the restored snapshot was taken during an exposure
+ */
+bool sessionInterrupted(void)
+{
+    return g_interrupted;
+}
+
+/**
+ * @brief copy the current session state
+ *
+ * @param[out] pState state
+ */
+void sessionGetState(SSessionState_t *pState)
+{
+    taskENTER_CRITICAL();
+    *pState = g_image.state;
+    taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief record the base exposure
+ *
+ * @param baseTimeMs base time in milliseconds
+ */
+void sessionSetBaseTime(uint32_t baseTimeMs)
+{
+    taskENTER_CRITICAL();
+    g_image.state.baseTimeMs = baseTimeMs;
+    updateCrc();
+    taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief record the test-strip position
+ *
+ * @param step strip in resolution steps from the base time
+ * @param resolution step size
+ */
+void sessionSetTestStrip(int8_t step, EFStop_t resolution)
+{
+    taskENTER_CRITICAL();
+    g_image.state.stripStep       = step;
+    g_image.state.stripResolution = (uint8_t)resolution;
+    updateCrc();
+    taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief apply and record the safelight lead, see exposureSetSafelightLead()
+ *
+ * @param leadMs lead time in milliseconds
+ * @return false if it's out of range, nothing is changed then
+ */
+bool sessionSetSafelightLead(uint16_t leadMs)
+{
+    if (!exposureSetSafelightLead(leadMs)) return false;
+
+    taskENTER_CRITICAL();
+    g_image.state.safelightLeadMs = leadMs;
+    updateCrc();
+    taskEXIT_CRITICAL();
+
+    return true;
+}
+
+/**
+ * @brief apply and record the lamp time constants, see exposureSetLampModel()
+ *
+ * @param riseMs rise time constant in milliseconds, 0 disables compensation
+ * @param fallMs fall time constant in milliseconds
+ * @return false if they're out of range, nothing is changed then
+ */
+bool sessionSetLampModel(uint16_t riseMs, uint16_t fallMs)
+{
+    if (!exposureSetLampModel(riseMs, fallMs)) return false;
+
+    taskENTER_CRITICAL();
+    g_image.state.lampRiseMs = riseMs;
+    g_image.state.lampFallMs = fallMs;
+    updateCrc();
+    taskEXIT_CRITICAL();
+
+    return true;
+}
+
+/**
+ * @brief apply and record zero-cross sync, see exposureSetZeroCrossSync()
+ *
+ * @param enable true to switch on zero crossings
+ */
+void sessionSetZeroCrossSync(bool enable)
+{
+    exposureSetZeroCrossSync(enable);
+
+    taskENTER_CRITICAL();
+    g_image.state.flags = enable ? (g_image.state.flags | SESSION_FLAG_ZERO_CROSS_SYNC) :
+                                   (g_image.state.flags & (uint8_t)~SESSION_FLAG_ZERO_CROSS_SYNC);
+    updateCrc();
+    taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief record the selected paper profile. the profile module applies it, see profileSelect()
+ *
+ * @param slot profile slot, SESSION_NO_PROFILE for none
+ */
+void sessionSetProfile(uint8_t slot)
+{
+    taskENTER_CRITICAL();
+    g_image.state.profile = slot;
+    updateCrc();
+    taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief apply and record LED head dimming, see exposureSetLampDimming()
+ *
+ * @param minOnMs shortest on-time in milliseconds, 0 for none
+ * @return false while the exposure task is busy, nothing is changed then
+ */
+bool sessionSetLampDimming(uint16_t minOnMs)
+{
+    if (!exposureSetLampDimming(minOnMs)) return false;
+
+    taskENTER_CRITICAL();
+    g_image.state.dimMinOnMs = minOnMs;
+    updateCrc();
+    taskEXIT_CRITICAL();
+
+    return true;
+}
+
+/**
+ * @brief mark the start and end of an exposure. called by the exposure task
+ *
+ * @param exposing true while an exposure request runs
+ */
+void sessionSetExposing(bool exposing)
+{
+    taskENTER_CRITICAL();
+    g_image.state.flags = exposing ? (g_image.state.flags | SESSION_FLAG_EXPOSING) :
+                                     (g_image.state.flags & (uint8_t)~SESSION_FLAG_EXPOSING);
+    updateCrc();
+    taskEXIT_CRITICAL();
+}
+
+/**
+ * @brief mains lost: write the snapshot. the lamp must already be off. runs in ISR context
+ *
+ * @note the setters update the image in a critical section, so it's never seen half-updated here
+ */
+void sessionPowerFailFromISR(void)
+{
+    g_saveImage = g_image;
+
+    toggleEepromWP(true);
+    i2cTransferEepromDMA(&g_saveTransfer);
+}
+
+//=====================================================================================================================
+// Statics
+//=====================================================================================================================
+
+/**
+ * @brief recompute the image CRC after a field has changed. call with the image locked
+ *
+ */
+static void updateCrc(void)
+{
+    g_image.crc = crc16(&g_image.magic, SESSION_CRC_SIZE);
+}
+
+/**
+ * @brief read the snapshot from EEPROM into the image
+ *
+ * @return false if there is none or it doesn't validate. the image keeps its defaults then
+ */
+static bool restoreSnapshot(void)
+{
+    SSessionImage_t stored;
+
+    if (!eepromRead(SESSION_EEPROM_ADDR, &stored.magic, SESSION_PAYLOAD_SIZE)) return false;
+
+    if ((stored.magic != SESSION_MAGIC) || (stored.version != SESSION_VERSION)) return false;
+    if (stored.crc != crc16(&stored.magic, SESSION_CRC_SIZE)) return false;
+    if (stored.state.stripResolution > FSTOP_SIXTH) return false;
+
+    g_image.state = stored.state;
+
+    return true;
+}
@@ -0,0 +1,600 @@
+/**
+ * @file  sync.c
+ * @brief multi-unit time sync and lockstep exposures over the sync link
+ *
+ * all units share one open-drain wire. only the master transmits, so there is no arbitration and any number of slaves
+ * can listen. every SYNC_PERIOD_MS the master sends a SYNC frame; every unit, the master included (a half-duplex
+ * receiver hears its own transmission), timestamps the end of its first byte on TIM17 in the receive interrupt. the
+ * master then sends its own timestamp in a FOLLOW_UP frame, and each slave feeds the pair to the estimator. both
+ * timestamps come from the same wire edge through the same handler, so the receive latency cancels and the wire delay
+ * is negligible next to a bit time; a slave never needs to answer to measure a round trip
+ *
+ * "sync fire" on the master picks a master time SYNC_FIRE_LEAD_MS ahead and sends it in a FIRE frame, twice. each unit
+ * maps it onto its own time base and, shortly before, loads a TIM17 compare for that instant. the compare interrupt
+ * raises the start input in software, so from there the press takes the armed path of a footswitch: the lamp is
+ * switched by TIM15 straight from the EXTI handler. units that aren't armed at that moment just count a miss
+ *
+ * only the lamp-on instant is shared. each unit then times its own exposure on its own calibrated clock
+ *
+ * an HSITRIM step from the clock calibration changes a slave's rate at once. the fit starts over on the next trim
+ * change instead of waiting for the rejects to pile up, and a lamp-on instant mapped with the old rate is dropped. a
+ * trim step on the master moves every slave off at once and is only caught by the rejects, so let the master's clock
+ * calibration settle before firing
+ *
+ * frames are fixed length. the receive interrupt collects them from the preamble on and hands complete frames to the
+ * sync task, which checks the CRC; an idle line or a receive error restarts the collection. requests from the console
+ * go through the same queue, so the wire and the state are only ever touched by the task
+ */
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include "sync.h"
+
+#include <FreeRTOS.h>
+#include <queue.h>
+#include <task.h>
+
+#include <stddef.h>
+#include <string.h>
+
+#include "board.h"
+#include "console.h"
+#include "crc.h"
+#include "exposure.h"
+#include "syncclock.h"
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define SYNC_TASK_STACK_SIZE    160
+#define SYNC_TASK_PRIORITY      (tskIDLE_PRIORITY + 2)
+#define SYNC_QUEUE_LENGTH       4
+
+#define SYNC_FRAME_PREAMBLE     0xA5
+#define SYNC_FIRE_REPEATS       2     // a slave that loses one FIRE frame to noise still gets the other
+#define SYNC_ALARM_WINDOW_US    20000 // the TIM17 compare is loaded this far ahead of the lamp-on instant
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+typedef enum
+{
+    SYNC_FRAME_SYNC = 1,   //< timestamp this frame
+    SYNC_FRAME_FOLLOW_UP,  //< timeUs: master time of the SYNC frame with the same seq
+    SYNC_FRAME_FIRE,       //< timeUs: master time to switch the lamp on at
+    SYNC_REQUEST_MODE,     //< from the console, timeUs: ESyncMode_t. never on the wire
+    SYNC_REQUEST_FIRE,     //< from the console, timeUs: lead in milliseconds
+    SYNC_REQUEST_FIRED,    //< from the alarm interrupt, the instant has passed
+} ESyncFrame_t;
+
+/** @brief frame on the wire, sent as-is */
+typedef struct __attribute__((packed))
+{
+    uint8_t  preamble;
+    uint8_t  type;     //< ESyncFrame_t
+    uint8_t  seq;
+    uint32_t timeUs;
+    uint16_t crc;      //< CRC-16/CCITT over type..timeUs
+} SSyncFrame_t;
+
+/** @brief queue entry: a received frame with the time of its first byte, or a request */
+typedef struct
+{
+    SSyncFrame_t frame;
+    uint32_t     rxUs;
+} SSyncRx_t;
+
+//=====================================================================================================================
+// Globals
+//=====================================================================================================================
+
+static StaticTask_t         g_syncTaskBuf;
+static StackType_t          g_syncTaskStack[SYNC_TASK_STACK_SIZE];
+static TaskHandle_t         g_syncTask = NULL;
+
+static StaticQueue_t        g_syncQueueBuf;
+static uint8_t              g_syncQueueStorage[SYNC_QUEUE_LENGTH * sizeof(SSyncRx_t)];
+static QueueHandle_t        g_syncQueue = NULL;
+
+static SSyncRx_t            g_rx;             //< frame being collected by the receive interrupt
+static uint8_t              g_rxPos     = 0;
+
+static volatile ESyncMode_t g_mode      = SYNC_OFF;
+static SSyncClock_t         g_clock;
+static volatile bool        g_locked    = false;
+static TickType_t           g_lastSyncTick = 0; //< slave: last accepted sample. master: last broadcast
+static uint8_t              g_sampleTrim   = 0; //< slave: HSITRIM the samples in the fit were taken with
+
+static uint8_t              g_syncSeq   = 0;     //< master: seq of the last SYNC sent
+static uint8_t              g_syncRxSeq = 0;     //< SYNC frame waiting for its FOLLOW_UP
+static uint32_t             g_syncRxUs  = 0;
+static bool                 g_hasSyncRx = false;
+
+static uint8_t              g_fireSeq     = 0;   //< last FIRE seq, sent or acted on
+static bool                 g_hasFireSeq  = false;
+static bool                 g_firePending = false;
+static bool                 g_alarmLoaded = false;
+static uint32_t             g_fireLocalUs = 0;   //< lamp-on instant on the local time base
+
+// statistics, shown by the console command
+static uint32_t             g_samples   = 0;
+static uint32_t             g_rejects   = 0;
+static uint32_t             g_badFrames = 0;
+static uint32_t             g_late      = 0;     //< dropped instants: unlocked, too close, or mapped before a trim
+static volatile uint32_t    g_fired     = 0;
+static volatile uint32_t    g_unarmed   = 0;
+
+//=====================================================================================================================
+// Static protos
+//=====================================================================================================================
+
+static void syncTask(void *);
+static bool postRequest(ESyncFrame_t, uint32_t);
+static void handleFrame(const SSyncRx_t *);
+static void sendFrame(ESyncFrame_t, uint8_t, uint32_t);
+static void applyMode(ESyncMode_t);
+static void scheduleFire(uint32_t);
+static void cancelFire(void);
+static TickType_t nextWakeTicks(void);
+static void linkRxCallback(int16_t, uint32_t, void *);
+static void fireAlarmCallback(void *);
+static void syncCommand(int, char *[]);
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+/**
+ * @brief create the sync task, hook up the link receiver and the alarm, register the "sync" console command. the
+ *        link stays off until a mode is set
+ *
+ */
+void initSync(void)
+{
+    static const SConsoleCommand_t syncCmd = { "sync", "multi-unit sync, 'sync master|slave|off' or 'sync fire [ms]'",
+                                               syncCommand };
+
+    g_syncQueue = xQueueCreateStatic(SYNC_QUEUE_LENGTH, sizeof(SSyncRx_t), g_syncQueueStorage, &g_syncQueueBuf);
+    g_syncTask  = xTaskCreateStatic(syncTask, "syn", SYNC_TASK_STACK_SIZE, NULL, SYNC_TASK_PRIORITY,
+                                    &g_syncTaskStack[0], &g_syncTaskBuf);
+
+    syncClockInit(&g_clock);
+
+    setSyncLinkRxCallback(linkRxCallback, NULL);
+    registerTimerCallback(TIMER_TIME_BASE_ALARM, fireAlarmCallback, NULL);
+
+    (void)consoleRegisterCommand(&syncCmd);
+}
+
+/**
+ * @brief switch between master, slave and off. the estimate starts over and a scheduled lamp-on is dropped
+ *
+ * @param mode new mode
+ * @return false if the request queue is full
+ */
+bool syncSetMode(ESyncMode_t mode)
+{
+    return postRequest(SYNC_REQUEST_MODE, (uint32_t)mode);
+}
+
+/**
+ * @brief current mode
+ *
+ * @return ESyncMode_t mode
+ */
+ESyncMode_t syncMode(void)
+{
+    return g_mode;
+}
+
+/**
+ * @brief check whether lamp-on instants line up with the master. always true on the master itself
+ *
+ * @return true if locked
+ */
+bool syncLocked(void)
+{
+    return (g_mode == SYNC_MASTER) || ((g_mode == SYNC_SLAVE) && g_locked);
+}
+
+/**
+ * @brief master only: start the armed exposure on every unit on the link, this one included, at the same instant
+ *
+ * @param leadMs time from now to the lamp-on instant, SYNC_FIRE_MIN_LEAD_MS..SYNC_FIRE_MAX_LEAD_MS
+ * @return false if this unit isn't the master, the lead is out of range or the request queue is full
+ */
+bool syncFire(uint32_t leadMs)
+{
+    if ((g_mode != SYNC_MASTER) || (leadMs < SYNC_FIRE_MIN_LEAD_MS) || (leadMs > SYNC_FIRE_MAX_LEAD_MS)) return false;
+
+    return postRequest(SYNC_REQUEST_FIRE, leadMs);
+}
+
+//=====================================================================================================================
+// Statics
+//=====================================================================================================================
+
+/**
+ * @brief sync task: handle frames and requests, broadcast the master time and load the alarm for a lamp-on instant
+ *
+ */
+static void syncTask(void *pParam)
+{
+    SSyncRx_t rx;
+
+    while (true)
+    {
+        if (xQueueReceive(g_syncQueue, &rx, nextWakeTicks()) == pdTRUE) handleFrame(&rx);
+
+        TickType_t now = xTaskGetTickCount();
+
+        if ((g_mode == SYNC_MASTER) && ((now - g_lastSyncTick) >= pdMS_TO_TICKS(SYNC_PERIOD_MS)))
+        {
+            g_lastSyncTick = now;
+            sendFrame(SYNC_FRAME_SYNC, ++g_syncSeq, 0); // FOLLOW_UP goes out when the echo comes back
+        }
+
+        if ((g_mode == SYNC_SLAVE) && (g_clock.count > 0) &&
+            ((now - g_lastSyncTick) >= pdMS_TO_TICKS(SYNC_TIMEOUT_MS)))
+        {
+            syncClockInit(&g_clock); // master gone, its time base may have restarted by the time it's back
+            g_locked = false;
+        }
+
+        if ((g_mode == SYNC_SLAVE) && (g_clock.count > 0) && (clockGetHSITrim() != g_sampleTrim))
+        {
+            syncClockInit(&g_clock);
+            g_locked = false;
+
+            // once the compare is loaded the instant is at most SYNC_ALARM_WINDOW_US away, close enough to keep
+            if (g_firePending && !g_alarmLoaded)
+            {
+                g_late++;
+                cancelFire();
+            }
+        }
+
+        if (g_firePending && !g_alarmLoaded &&
+            ((int32_t)(g_fireLocalUs - rtosTimerGetValue()) <= SYNC_ALARM_WINDOW_US))
+        {
+            clockRequestActive(); // no level switch (notifier run, interrupts masked) near the instant
+
+            if (armTimeBaseAlarm(g_fireLocalUs))
+            {
+                g_alarmLoaded = true;
+            }
+            else
+            {
+                g_late++;
+                g_firePending = false;
+                clockReleaseActive();
+            }
+        }
+    }
+}
+
+/**
+ * @brief hand a request to the sync task
+ *
+ * @return false if the queue is full
+ */
+static bool postRequest(ESyncFrame_t type, uint32_t arg)
+{
+    SSyncRx_t req = { .frame = { .type = (uint8_t)type, .timeUs = arg } };
+
+    return xQueueSendToBack(g_syncQueue, &req, 0) == pdTRUE;
+}
+
+/**
+ * @brief act on a received frame or a request. sync task only
+ *
+ */
+static void handleFrame(const SSyncRx_t *pRx)
+{
+    const SSyncFrame_t *pFrame = &pRx->frame;
+
+    // requests are queued without a preamble and can't come from the wire
+    if ((pFrame->preamble == SYNC_FRAME_PREAMBLE) &&
+        ((crc16(&pFrame->type, offsetof(SSyncFrame_t, crc) - offsetof(SSyncFrame_t, type)) != pFrame->crc) ||
+         (pFrame->type >= SYNC_REQUEST_MODE)))
+    {
+        g_badFrames++;
+        return;
+    }
+
+    switch (pFrame->type)
+    {
+        case SYNC_FRAME_SYNC:
+        {
+            g_syncRxSeq = pFrame->seq;
+            g_syncRxUs  = pRx->rxUs;
+            g_hasSyncRx = true;
+
+            // on the master this is the echo of its own frame: the receive time is the master time of the event
+            if ((g_mode == SYNC_MASTER) && (pFrame->seq == g_syncSeq))
+            {
+                sendFrame(SYNC_FRAME_FOLLOW_UP, pFrame->seq, pRx->rxUs);
+            }
+            break;
+        }
+        case SYNC_FRAME_FOLLOW_UP:
+        {
+            if ((g_mode != SYNC_SLAVE) || !g_hasSyncRx || (pFrame->seq != g_syncRxSeq)) break;
+
+            g_hasSyncRx = false;
+
+            if (g_clock.count == 0) g_sampleTrim = clockGetHSITrim();
+
+            if (syncClockSample(&g_clock, pFrame->timeUs, g_syncRxUs))
+            {
+                g_samples++;
+                g_lastSyncTick = xTaskGetTickCount();
+            }
+            else
+            {
+                g_rejects++;
+            }
+
+            g_locked = syncClockLocked(&g_clock);
+            break;
+        }
+        case SYNC_FRAME_FIRE:
+        {
+            if ((g_mode != SYNC_SLAVE) || (g_hasFireSeq && (pFrame->seq == g_fireSeq))) break; // repeat, or own echo
+
+            g_fireSeq    = pFrame->seq;
+            g_hasFireSeq = true;
+
+            uint32_t localUs = syncClockToLocal(&g_clock, pFrame->timeUs);
+
+            if (!g_locked || ((int32_t)(localUs - rtosTimerGetValue()) < (int32_t)TIME_BASE_ALARM_MIN_US))
+            {
+                g_late++;
+                break;
+            }
+
+            scheduleFire(localUs);
+            break;
+        }
+        case SYNC_REQUEST_MODE:
+        {
+            applyMode((ESyncMode_t)pFrame->timeUs);
+            break;
+        }
+        case SYNC_REQUEST_FIRE:
+        {
+            if (g_mode != SYNC_MASTER) break;
+
+            uint32_t atUs = rtosTimerGetValue() + (pFrame->timeUs * 1000);
+
+            g_fireSeq++;
+            for (uint8_t i = 0; i < SYNC_FIRE_REPEATS; i++) sendFrame(SYNC_FRAME_FIRE, g_fireSeq, atUs);
+
+            scheduleFire(atUs); // the master's time base is the reference
+            break;
+        }
+        case SYNC_REQUEST_FIRED:
+        {
+            if (!g_alarmLoaded) break;
+
+            g_alarmLoaded = false;
+            g_firePending = false;
+            clockReleaseActive();
+            break;
+        }
+        default:
+        break;
+    }
+}
+
+/**
+ * @brief send a frame on the link. sync task only
+ *
+ */
+static void sendFrame(ESyncFrame_t type, uint8_t seq, uint32_t timeUs)
+{
+    SSyncFrame_t frame = { SYNC_FRAME_PREAMBLE, (uint8_t)type, seq, timeUs, 0 };
+
+    frame.crc = crc16(&frame.type, offsetof(SSyncFrame_t, crc) - offsetof(SSyncFrame_t, type));
+
+    syncLinkSend((const uint8_t *)&frame, sizeof(frame));
+}
+
+/**
+ * @brief switch the mode, sync task only. everything learned in the old mode is dropped
+ *
+ */
+static void applyMode(ESyncMode_t mode)
+{
+    cancelFire();
+
+    toggleSyncLinkRX(false);
+    g_rxPos = 0;
+
+    syncClockInit(&g_clock);
+    g_locked       = false;
+    g_hasSyncRx    = false;
+    g_hasFireSeq   = false;
+    g_lastSyncTick = xTaskGetTickCount() - pdMS_TO_TICKS(SYNC_PERIOD_MS); // a master broadcasts straight away
+    g_mode         = mode;
+
+    if (mode != SYNC_OFF) toggleSyncLinkRX(true);
+}
+
+/**
+ * @brief schedule the start input for a lamp-on instant, replacing one still pending. sync task only
+ *
+ * @param localUs instant on the local time base
+ */
+static void scheduleFire(uint32_t localUs)
+{
+    if (g_firePending) g_late++; // the new instant takes its place
+
+    cancelFire();
+
+    g_fireLocalUs = localUs;
+    g_firePending = true;
+}
+
+/**
+ * @brief drop a pending lamp-on instant. sync task only
+ *
+ */
+static void cancelFire(void)
+{
+    if (g_alarmLoaded)
+    {
+        disarmTimeBaseAlarm();
+        g_alarmLoaded = false;
+        clockReleaseActive();
+    }
+
+    g_firePending = false;
+}
+
+/**
+ * @brief how long the task may wait for a frame before it has something else to do
+ *
+ * @return TickType_t ticks
+ */
+static TickType_t nextWakeTicks(void)
+{
+    TickType_t wait = portMAX_DELAY;
+
+    if (g_mode == SYNC_MASTER)
+    {
+        TickType_t sinceTicks = xTaskGetTickCount() - g_lastSyncTick;
+
+        wait = (sinceTicks >= pdMS_TO_TICKS(SYNC_PERIOD_MS)) ? 0 : (pdMS_TO_TICKS(SYNC_PERIOD_MS) - sinceTicks);
+    }
+    else if (g_mode == SYNC_SLAVE)
+    {
+        wait = pdMS_TO_TICKS(SYNC_PERIOD_MS); // for the timeout
+    }
+
+    if (g_firePending && !g_alarmLoaded)
+    {
+        int32_t    untilUs = (int32_t)(g_fireLocalUs - rtosTimerGetValue()) - SYNC_ALARM_WINDOW_US;
+        TickType_t ticks   = (untilUs <= 0) ? 0 : pdMS_TO_TICKS((uint32_t)untilUs / 1000);
+
+        if (ticks < wait) wait = ticks;
+    }
+
+    return wait;
+}
+
+/**
+ * @brief sync link receive callback: collect a frame from its preamble on and queue it with the time of the
+ *        preamble. runs in ISR context
+ *
+ */
+static void linkRxCallback(int16_t data, uint32_t timeUs, void *pCtx)
+{
+    BaseType_t woken = pdFALSE;
+
+    if (data == LINK_RX_IDLE)
+    {
+        g_rxPos = 0;
+        return;
+    }
+
+    if (g_rxPos == 0)
+    {
+        if (data != SYNC_FRAME_PREAMBLE) return;
+
+        g_rx.rxUs = timeUs;
+    }
+
+    ((uint8_t *)&g_rx.frame)[g_rxPos++] = (uint8_t)data;
+
+    if (g_rxPos == sizeof(SSyncFrame_t))
+    {
+        g_rxPos = 0;
+        (void)xQueueSendToBackFromISR(g_syncQueue, &g_rx, &woken);
+        portYIELD_FROM_ISR(woken);
+    }
+}
+
+/**
+ * @brief TIM17 CC1 callback: the lamp-on instant. fires the armed exposure through the start input path. runs in ISR
+ *        context
+ *
+ */
+static void fireAlarmCallback(void *pCtx)
+{
+    BaseType_t woken = pdFALSE;
+    SSyncRx_t  req   = { .frame = { .type = SYNC_REQUEST_FIRED } };
+
+    if (exposureIsArmed() && injectStartTrigger())
+    {
+        g_fired++;
+    }
+    else
+    {
+        g_unarmed++; // nothing to start: don't release an operator wait instead
+    }
+
+    (void)xQueueSendToBackFromISR(g_syncQueue, &req, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+/**
+ * @brief "sync [master|slave|off|fire [ms]]": show the link state, set the mode or fire all units
+ *
+ */
+static void syncCommand(int argc, char *argv[])
+{
+    static const char *const modeNames[] = { "off", "master", "slave" };
+    int32_t                  leadMs      = SYNC_FIRE_LEAD_MS;
+
+    if (argc < 2)
+    {
+        consolePuts(modeNames[g_mode]);
+
+        if (g_mode == SYNC_SLAVE)
+        {
+            consolePuts(g_locked ? ", locked, " : ", unlocked, ");
+            consolePutDec(syncClockPpm(&g_clock));
+            consolePuts("ppm, spread ");
+            consolePutDec((int32_t)g_clock.spreadUs);
+            consolePuts("us, samples ");
+            consolePutDec((int32_t)g_samples);
+            consolePuts(" rejected ");
+            consolePutDec((int32_t)g_rejects);
+        }
+
+        consolePuts("\nfired ");
+        consolePutDec((int32_t)g_fired);
+        consolePuts(" unarmed ");
+        consolePutDec((int32_t)g_unarmed);
+        consolePuts(" late ");
+        consolePutDec((int32_t)g_late);
+        consolePuts(" bad frames ");
+        consolePutDec((int32_t)g_badFrames);
+        consolePuts("\n");
+        return;
+    }
+
+    if (strcmp(argv[1], "fire") == 0)
+    {
+        if ((argc > 2) && !consoleParseInt(argv[2], &leadMs)) leadMs = 0;
+
+        if ((leadMs <= 0) || !syncFire((uint32_t)leadMs)) consolePuts("not the master, or lead out of range\n");
+        return;
+    }
+
+    for (uint8_t mode = SYNC_OFF; mode <= SYNC_SLAVE; mode++)
+    {
+        if (strcmp(argv[1], modeNames[mode]) == 0)
+        {
+            if (!syncSetMode((ESyncMode_t)mode)) consolePuts("busy\n");
+            return;
+        }
+    }
+
+    consolePuts("usage: sync [master|slave|off|fire [ms]]\n");
+}
@@ -0,0 +1,216 @@
+/**
+ * @file  syncclock.c
+ * @brief offset and drift of a master time base, estimated from timestamp pairs
+ *
+ * every sample is one event seen on both time bases, e.g. a frame on the sync link timestamped by the master and by
+ * this unit. a least-squares line through the last SYNC_CLOCK_WINDOW samples gives the offset (the line through the
+ * centroid) and the drift (its slope). the common receive latency of master and unit cancels out, what's left is
+ * interrupt latency jitter, which the fit averages down
+ *
+ * both time bases wrap at 32 bits, so everything is worked on differences: x is master time and d the local minus
+ * master time, both relative to the oldest sample. d only holds the drift and the jitter, which keeps the sums well
+ * inside 64 bits for any sample period below a few minutes
+ *
+ * once locked, a sample far off the fit is rejected as a latency spike. several in a row mean the local clock stepped
+ * (the clock calibration trims the HSI in whole steps), and the fit starts over
+ */
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include "syncclock.h"
+
+#include <stdlib.h>
+
+//=====================================================================================================================
+// Static protos
+//=====================================================================================================================
+
+static void addSample(SSyncClock_t *, uint32_t, uint32_t);
+static void fit(SSyncClock_t *);
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+/**
+ * @brief reset the estimator, e.g. when the master went away
+ *
+ * @param pClock estimator state
+ */
+void syncClockInit(SSyncClock_t *pClock)
+{
+    pClock->count       = 0;
+    pClock->next        = 0;
+    pClock->rejects     = 0;
+    pClock->refMasterUs = 0;
+    pClock->refLocalUs  = 0;
+    pClock->rate        = 0;
+    pClock->spreadUs    = 0;
+}
+
+/**
+ * @brief feed one event seen on both time bases
+ *
+ * @param pClock estimator state
+ * @param masterUs time of the event on the master, 1MHz
+ * @param localUs time of the event here, 1MHz
+ * @return false if the sample was rejected
+ */
+bool syncClockSample(SSyncClock_t *pClock, uint32_t masterUs, uint32_t localUs)
+{
+    if (pClock->count > 0)
+    {
+        uint8_t newest  = (uint8_t)((pClock->next + SYNC_CLOCK_WINDOW - 1) % SYNC_CLOCK_WINDOW);
+        int32_t dxUs    = (int32_t)(masterUs - pClock->masterUs[newest]);
+        int32_t dlUs    = (int32_t)(localUs - pClock->localUs[newest]);
+        int32_t limitUs = (int32_t)(((int64_t)abs(dxUs) * SYNC_CLOCK_MAX_PPM) / 1000000) + SYNC_CLOCK_OUTLIER_US;
+
+        // the master restarted, the sample is out of order, or the two clocks can't be that far apart
+        if ((dxUs <= 0) || (abs(dlUs - dxUs) > limitUs))
+        {
+            syncClockInit(pClock);
+            addSample(pClock, masterUs, localUs);
+            return false;
+        }
+    }
+
+    if (syncClockLocked(pClock))
+    {
+        int32_t residualUs = (int32_t)(localUs - syncClockToLocal(pClock, masterUs));
+
+        if (abs(residualUs) > SYNC_CLOCK_OUTLIER_US)
+        {
+            if (++pClock->rejects > SYNC_CLOCK_MAX_REJECTS)
+            {
+                syncClockInit(pClock);
+                addSample(pClock, masterUs, localUs);
+            }
+
+            return false;
+        }
+    }
+
+    pClock->rejects = 0;
+    addSample(pClock, masterUs, localUs);
+
+    return true;
+}
+
+/**
+ * @brief check whether the estimator has a full window to fit
+ *
+ * @param pClock estimator state
+ * @return true once SYNC_CLOCK_WINDOW consistent samples were seen
+ */
+bool syncClockLocked(SSyncClock_t const *pClock)
+{
+    return pClock->count >= SYNC_CLOCK_WINDOW;
+}
+
+/**
+ * @brief map a master time onto the local time base
+ *
+ * @param pClock estimator state
+ * @param masterUs master time, within about half an hour of the samples
+ * @return uint32_t local time
+ */
+uint32_t syncClockToLocal(SSyncClock_t const *pClock, uint32_t masterUs)
+{
+    int32_t dxUs = (int32_t)(masterUs - pClock->refMasterUs);
+
+    return pClock->refLocalUs + (uint32_t)dxUs + (uint32_t)(int32_t)(((int64_t)dxUs * pClock->rate) /
+                                                                     SYNC_CLOCK_RATE_ONE);
+}
+
+/**
+ * @brief estimated drift of the local time base against the master
+ *
+ * @param pClock estimator state
+ * @return int32_t ppm, positive if the local clock runs fast
+ */
+int32_t syncClockPpm(SSyncClock_t const *pClock)
+{
+    return (int32_t)(((int64_t)pClock->rate * 1000000) / SYNC_CLOCK_RATE_ONE);
+}
+
+//=====================================================================================================================
+// Statics
+//=====================================================================================================================
+
+/**
+ * @brief put a sample into the ring, replacing the oldest one once it's full, and fit again
+ *
+ */
+static void addSample(SSyncClock_t *pClock, uint32_t masterUs, uint32_t localUs)
+{
+    pClock->masterUs[pClock->next] = masterUs;
+    pClock->localUs[pClock->next]  = localUs;
+    pClock->next                   = (uint8_t)((pClock->next + 1) % SYNC_CLOCK_WINDOW);
+
+    if (pClock->count < SYNC_CLOCK_WINDOW) pClock->count++;
+
+    fit(pClock);
+}
+
+/**
+ * @brief least-squares line through the samples in the ring
+ *
+ */
+static void fit(SSyncClock_t *pClock)
+{
+    uint8_t  n        = pClock->count;
+    uint8_t  oldest   = (n < SYNC_CLOCK_WINDOW) ? 0 : pClock->next;
+    uint32_t master0  = pClock->masterUs[oldest];
+    uint32_t local0   = pClock->localUs[oldest];
+    int32_t  x[SYNC_CLOCK_WINDOW];
+    int32_t  d[SYNC_CLOCK_WINDOW];
+    int64_t  sumX     = 0;
+    int64_t  sumD     = 0;
+    int64_t  sumXX    = 0;
+    int64_t  sumXD    = 0;
+    uint32_t spreadUs = 0;
+
+    for (uint8_t i = 0; i < n; i++)
+    {
+        uint8_t slot = (uint8_t)((oldest + i) % SYNC_CLOCK_WINDOW);
+
+        x[i]  = (int32_t)(pClock->masterUs[slot] - master0);
+        d[i]  = (int32_t)(pClock->localUs[slot] - local0) - x[i];
+        sumX += x[i];
+        sumD += d[i];
+    }
+
+    int32_t meanX = (int32_t)(sumX / n);
+    int32_t meanD = (int32_t)(sumD / n);
+
+    for (uint8_t i = 0; i < n; i++)
+    {
+        int64_t dx = x[i] - meanX;
+
+        sumXX += dx * dx;
+        sumXD += dx * (d[i] - meanD);
+    }
+
+    // slope in SYNC_CLOCK_RATE_ONE: sumXD / sumXX * 2^24, split so neither side overflows. under 65ms of spread in
+    // the samples there's nothing to fit a slope to
+    int64_t den  = sumXX >> 16;
+    int64_t rate = (den > 0) ? ((sumXD * 256) / den) : 0;
+    int64_t max  = ((int64_t)SYNC_CLOCK_MAX_PPM * SYNC_CLOCK_RATE_ONE) / 1000000;
+
+    rate = (rate > max) ? max : ((rate < -max) ? -max : rate);
+
+    pClock->rate        = (int32_t)rate;
+    pClock->refMasterUs = master0 + (uint32_t)meanX;
+    pClock->refLocalUs  = local0 + (uint32_t)meanX + (uint32_t)meanD;
+
+    for (uint8_t i = 0; i < n; i++)
+    {
+        int32_t residualUs = d[i] - meanD - (int32_t)(((int64_t)(x[i] - meanX) * rate) / SYNC_CLOCK_RATE_ONE);
+
+        if ((uint32_t)abs(residualUs) > spreadUs) spreadUs = (uint32_t)abs(residualUs);
+    }
+
+    pClock->spreadUs = spreadUs;
+}
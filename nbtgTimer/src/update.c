@@ -0,0 +1,442 @@
+/**
+ * @file  update.c
+ * @brief streaming firmware update over the console UART into the inactive image slot
+ *
+ * the host announces the image with "update <slot> <length> <crc32>". the pages it needs are erased up front: a page
+ * erase takes longer than a block takes on the wire. the console then switches to the update baudrate and DMA
+ * receives frames into a ring of three while the CPU programs the one before. the host keeps at most two frames
+ * unacknowledged, so the frame being programmed is never overwritten and a full ring never looks empty. every frame
+ * carries its index and the CRC-32 of its block; the block is checked in RAM, programmed, and checked again read back
+ * from flash before it's acknowledged
+ *
+ * a bad or missing frame gets a NAK: the device waits for the line to go quiet, restarts the ring and tells the host
+ * which frame it expects next (READY). a flash error or a read-back mismatch aborts
+ *
+ * after the last block the CRC over the whole image must match the announced one. only then is a TRIAL boot record
+ * written and the unit reset. until that record is written the bootloader keeps starting the running image, so an
+ * aborted or interrupted update leaves the unit as it was. the new image is started once and must run for
+ * UPDATE_CONFIRM_MS to mark itself good in updatePoll(), otherwise the bootloader rolls back to this one
+ *
+ * the erases and block writes stall every fetch from flash, interrupts included, so an update is refused while an
+ * exposure is running or armed. a page erase outlasts the mains-loss watchdog, so the mains tracker is suspended for
+ * the whole update and relocks afterwards. other console output during the transfer goes out at the update baudrate;
+ * the host skips it while looking for the response mark
+ */
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include "update.h"
+
+#include <FreeRTOS.h>
+#include <task.h>
+
+#include <stddef.h>
+#include <string.h>
+
+#include <stm32g0xx_ll_rcc.h> // HSI_VALUE
+
+#include "board.h"
+#include "console.h"
+#include "exposure.h"
+#include "flash.h"
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define UPDATE_RING_FRAMES   3
+#define UPDATE_RESPONSE_MARK 0xA5
+#define UPDATE_STALL_MS      500  // no complete frame for this long: resynchronise
+#define UPDATE_QUIET_MS      20   // the line must be quiet this long before the ring restarts
+#define UPDATE_SETTLE_MS     50   // for the host to follow a baudrate change
+#define UPDATE_MAX_RETRIES   8    // resynchronisations in a row before giving up
+#define UPDATE_MAX_BAUD      1000000
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+/** @brief one block on the wire, a double word multiple so it can be programmed straight from the ring */
+typedef struct
+{
+    uint8_t  data[UPDATE_BLOCK_BYTES];
+    uint16_t index;
+    uint16_t reserved;
+    uint32_t crc; //< CRC-32 of data
+} SUpdateFrame_t;
+
+_Static_assert((sizeof(SUpdateFrame_t) % 8) == 0, "frames are programmed in double words");
+
+/** @brief 4-byte response: mark, code, frame index little endian */
+typedef enum
+{
+    UPDATE_READY = 'R', //< send from this index on
+    UPDATE_ACK   = 'A', //< frame programmed and verified
+    UPDATE_NAK   = 'N', //< frame bad or missing, stop and wait for READY
+    UPDATE_DONE  = 'D', //< image verified, boot record written
+    UPDATE_ERROR = 'E', //< aborted, the running image stays
+} EUpdateResponse_t;
+
+//=====================================================================================================================
+// Globals
+//=====================================================================================================================
+
+static SUpdateFrame_t g_ring[UPDATE_RING_FRAMES];
+static volatile bool  g_confirmChecked = false; //< updatePoll() is done with the boot records, they're free to use
+
+//=====================================================================================================================
+// Static protos
+//=====================================================================================================================
+
+static void        updateCommand(int, char *[]);
+static void        printStatus(void);
+static bool        erasePages(EFlashSlot_t, uint32_t);
+static const char *receiveImage(uint32_t, uint16_t);
+static void        resync(uint16_t);
+static void        sendResponse(EUpdateResponse_t, uint16_t);
+static bool        parseHex(const char *, uint32_t *);
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+/**
+ * @brief register the "update" console command
+ *
+ */
+void initUpdate(void)
+{
+    static const SConsoleCommand_t updateCmd = { "update", "firmware update, 'update <a|b> <len> <crc32> [baud]'",
+                                                 updateCommand };
+
+    (void)consoleRegisterCommand(&updateCmd);
+}
+
+/**
+ * @brief confirm a freshly updated image once it has run for UPDATE_CONFIRM_MS, so the bootloader keeps starting it.
+ * call periodically; flash is only written once, between exposures
+ *
+ */
+void updatePoll(void)
+{
+    SBootRecord_t record;
+
+    if (g_confirmChecked || (xTaskGetTickCount() < pdMS_TO_TICKS(UPDATE_CONFIRM_MS))) return;
+    if (exposureIsBusy() || exposureIsArmed()) return; // appending a record can erase a page
+
+    if (bootRecordNewest(&record, false) && (record.state == BOOT_STATE_TRYING) &&
+        (record.slot == flashRunningSlot()))
+    {
+        record.state = BOOT_STATE_GOOD;
+
+        exposureSuspendMains(true);
+        flashUnlock();
+        bool ok = bootRecordAppend(&record);
+        flashLock();
+        exposureSuspendMains(false);
+
+        consolePuts(ok ? "update: image confirmed\n" : "update: confirm failed, the next reset rolls back\n");
+    }
+
+    g_confirmChecked = true;
+}
+
+//=====================================================================================================================
+// Statics
+//=====================================================================================================================
+
+/**
+ * @brief "update [<a|b> <len> <crc32> [baud]]": show the slots, or receive an image into the inactive slot
+ *
+ */
+static void updateCommand(int argc, char *argv[])
+{
+    int32_t       length = 0;
+    int32_t       baud   = UPDATE_DEFAULT_BAUD;
+    uint32_t      crc    = 0;
+    EFlashSlot_t  slot   = FLASH_SLOT_A;
+    SBootRecord_t record = { 0 };
+
+    if (argc < 2)
+    {
+        printStatus();
+        return;
+    }
+
+    if ((argc < 4) || ((strcmp(argv[1], "a") != 0) && (strcmp(argv[1], "b") != 0)) ||
+        !consoleParseInt(argv[2], &length) || !parseHex(argv[3], &crc) ||
+        ((argc > 4) && !consoleParseInt(argv[4], &baud)))
+    {
+        consolePuts("usage: update [<a|b> <len> <crc32> [baud]]\n");
+        return;
+    }
+
+    slot = (argv[1][0] == 'b') ? FLASH_SLOT_B : FLASH_SLOT_A;
+
+    if (!g_confirmChecked)
+    {
+        consolePuts("the running image isn't confirmed yet\n");
+        return;
+    }
+
+    if (exposureIsBusy() || exposureIsArmed())
+    {
+        consolePuts("busy\n");
+        return;
+    }
+
+    if (slot == flashRunningSlot())
+    {
+        consolePuts("that's the running slot\n");
+        return;
+    }
+
+    if ((length < (int32_t)(2 * sizeof(uint32_t))) || (length > FLASH_SLOT_BYTES))
+    {
+        consolePuts("length out of range\n");
+        return;
+    }
+
+    if ((baud <= 0) || (baud > UPDATE_MAX_BAUD) || ((HSI_VALUE % (uint32_t)baud) != 0))
+    {
+        consolePuts("the baudrate must divide 16MHz, up to 1000000\n");
+        return;
+    }
+
+    uint32_t    base   = flashSlotAddress(slot);
+    uint16_t    blocks = (uint16_t)((length + UPDATE_BLOCK_BYTES - 1) / UPDATE_BLOCK_BYTES);
+    const char *pError = NULL;
+
+    clockRequestActive();
+    exposureSuspendMains(true);
+    flashUnlock();
+
+    if (!erasePages(slot, (uint32_t)length))
+    {
+        pError = "erase failed";
+    }
+    else
+    {
+        consolePuts("go\n");
+        consoleSetBaudRate((uint32_t)baud);
+        consoleStartDMARx((uint8_t *)g_ring, sizeof(g_ring));
+        vTaskDelay(pdMS_TO_TICKS(UPDATE_SETTLE_MS));
+
+        pError = receiveImage(base, blocks);
+
+        if ((pError == NULL) && (flashCrc32((const void *)base, (size_t)length) != crc)) pError = "image CRC mismatch";
+
+        if (pError == NULL)
+        {
+            record.imageCrc = crc;
+            record.length   = (uint32_t)length;
+            record.slot     = (uint8_t)slot;
+            record.state    = BOOT_STATE_TRIAL;
+
+            if (!bootRecordAppend(&record)) pError = "boot record write failed";
+        }
+
+        sendResponse((pError == NULL) ? UPDATE_DONE : UPDATE_ERROR, blocks);
+        consoleStopDMARx();
+        consoleSetBaudRate(CONSOLE_BAUDRATE);
+        vTaskDelay(pdMS_TO_TICKS(UPDATE_SETTLE_MS));
+    }
+
+    flashLock();
+    exposureSuspendMains(false);
+    clockReleaseActive();
+
+    if (pError != NULL)
+    {
+        consolePuts("update failed: ");
+        consolePuts(pError);
+        consolePuts("\n");
+        return;
+    }
+
+    consolePuts("update done, resetting into slot ");
+    consolePuts((slot == FLASH_SLOT_B) ? "b\n" : "a\n");
+    vTaskDelay(pdMS_TO_TICKS(UPDATE_SETTLE_MS)); // let the message out
+
+    NVIC_SystemReset();
+}
+
+/**
+ * @brief print the running slot, the newest boot record and the slot an update goes to
+ *
+ */
+static void printStatus(void)
+{
+    static const char *const stateNames[] = { "trial", "trying", "good" };
+    SBootRecord_t            record;
+    EFlashSlot_t             running      = flashRunningSlot();
+
+    consolePuts("running slot ");
+    consolePuts((running == FLASH_SLOT_B) ? "b" : "a");
+
+    if (!g_confirmChecked)
+    {
+        consolePuts(", confirm pending");
+    }
+    else if (bootRecordNewest(&record, false))
+    {
+        consolePuts(", boot record ");
+        consolePutDec(record.seq);
+        consolePuts((record.slot == FLASH_SLOT_B) ? " slot b " : " slot a ");
+        consolePuts(stateNames[(record.state == BOOT_STATE_TRIAL) ? 0 : (record.state == BOOT_STATE_TRYING) ? 1 : 2]);
+    }
+    else
+    {
+        consolePuts(", no boot record");
+    }
+
+    consolePuts("\nupdate slot ");
+    consolePuts((running == FLASH_SLOT_B) ? "a\n" : "b\n");
+}
+
+/**
+ * @brief erase the pages an image of length bytes needs. each erase stalls the CPU, other tasks get to run in between
+ *
+ */
+static bool erasePages(EFlashSlot_t slot, uint32_t length)
+{
+    uint32_t first = (flashSlotAddress(slot) - FLASH_PAGE_ADDRESS(0)) / FLASH_PAGE_BYTES;
+    uint32_t pages = (length + FLASH_PAGE_BYTES - 1) / FLASH_PAGE_BYTES;
+
+    for (uint32_t i = 0; i < pages; i++)
+    {
+        if (!flashErasePage(first + i)) return false;
+        vTaskDelay(1);
+    }
+
+    return true;
+}
+
+/**
+ * @brief receive, program and verify the image blocks in order
+ *
+ * @param base slot address
+ * @param blocks number of blocks
+ * @return const char* NULL on success, what went wrong otherwise
+ */
+static const char *receiveImage(uint32_t base, uint16_t blocks)
+{
+    size_t     readPos  = 0;
+    uint16_t   index    = 0;
+    uint8_t    retries  = 0;
+    TickType_t lastTick = xTaskGetTickCount();
+
+    sendResponse(UPDATE_READY, 0);
+
+    while (index < blocks)
+    {
+        const SUpdateFrame_t *pFrame = (const SUpdateFrame_t *)((const uint8_t *)g_ring + readPos);
+        size_t                avail  = (consoleDMARxPos() + sizeof(g_ring) - readPos) % sizeof(g_ring);
+
+        if (avail < sizeof(SUpdateFrame_t))
+        {
+            if ((xTaskGetTickCount() - lastTick) < pdMS_TO_TICKS(UPDATE_STALL_MS))
+            {
+                vTaskDelay(1);
+                continue;
+            }
+
+            // a lost byte leaves a partial frame behind, a lost response leaves the host waiting
+            if (++retries > UPDATE_MAX_RETRIES) return "the host stopped sending";
+        }
+        else if ((pFrame->index != index) || (flashCrc32(pFrame->data, UPDATE_BLOCK_BYTES) != pFrame->crc))
+        {
+            if (++retries > UPDATE_MAX_RETRIES) return "too many bad frames";
+        }
+        else
+        {
+            uint32_t address = base + ((uint32_t)index * UPDATE_BLOCK_BYTES);
+
+            // DMA keeps filling the next frame while the CPU stalls on the writes
+            if (!flashProgram(address, pFrame->data, UPDATE_BLOCK_BYTES)) return "flash program error";
+            if (flashCrc32((const void *)address, UPDATE_BLOCK_BYTES) != pFrame->crc) return "flash verify error";
+
+            sendResponse(UPDATE_ACK, index);
+
+            readPos  = (readPos + sizeof(SUpdateFrame_t)) % sizeof(g_ring);
+            retries  = 0;
+            lastTick = xTaskGetTickCount();
+            index++;
+            continue;
+        }
+
+        resync(index);
+        readPos  = 0;
+        lastTick = xTaskGetTickCount();
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief NAK, wait for the host to stop, restart the ring and ask for the frame at index
+ *
+ */
+static void resync(uint16_t index)
+{
+    size_t     pos       = consoleDMARxPos();
+    TickType_t quietTick = xTaskGetTickCount();
+
+    sendResponse(UPDATE_NAK, index);
+
+    while ((xTaskGetTickCount() - quietTick) < pdMS_TO_TICKS(UPDATE_QUIET_MS))
+    {
+        vTaskDelay(1);
+
+        if (consoleDMARxPos() != pos)
+        {
+            pos       = consoleDMARxPos();
+            quietTick = xTaskGetTickCount();
+        }
+    }
+
+    consoleStartDMARx((uint8_t *)g_ring, sizeof(g_ring));
+    sendResponse(UPDATE_READY, index);
+}
+
+/**
+ * @brief send a response to the host, see EUpdateResponse_t
+ *
+ */
+static void sendResponse(EUpdateResponse_t code, uint16_t index)
+{
+    const uint8_t response[] = { UPDATE_RESPONSE_MARK, (uint8_t)code, (uint8_t)index, (uint8_t)(index >> 8) };
+
+    consoleWrite(response, sizeof(response));
+}
+
+/**
+ * @brief parse a hexadecimal argument, up to 8 digits without a prefix
+ *
+ */
+static bool parseHex(const char *pStr, uint32_t *pValue)
+{
+    uint32_t value = 0;
+    uint8_t  len   = 0;
+
+    for (; *pStr != '\0'; pStr++, len++)
+    {
+        char    c     = *pStr;
+        uint8_t digit = 0;
+
+        if ((c >= '0') && (c <= '9')) digit = (uint8_t)(c - '0');
+        else if ((c >= 'a') && (c <= 'f')) digit = (uint8_t)(c - 'a' + 10);
+        else if ((c >= 'A') && (c <= 'F')) digit = (uint8_t)(c - 'A' + 10);
+        else return false;
+
+        value = (value << 4) | digit;
+    }
+
+    if ((len == 0) || (len > 8)) return false;
+
+    *pValue = value;
+
+    return true;
+}
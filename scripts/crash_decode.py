@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+"""Decode a crash record printed by the "crash" console command.
+
+Usage: crash_decode.py <console log> [<firmware .map>]
+
+The log is scanned for the hex block between "-- crash dump --" and "-- end --".
+With the linker map file (nbtgTimer.elf.map) the PC, LR and stack addresses are
+resolved to function+offset.
+
+The record layout and the event list must match SCrashDump_t in
+nbtgTimer/src/crash.c and ETraceEvent_t in nbtgTimer/inc/crash.h.
+"""
+
+import bisect
+import re
+import struct
+import sys
+
+CRASH_MAGIC = 0x48535243
+CRASH_VERSION = 1
+CRASH_NAME_LEN = 12
+CRASH_TRACE_EVENTS = 32
+
+HEADER = struct.Struct("<IBBBBIIIIII")
+FRAME = struct.Struct("<8I")
+EVENT = struct.Struct("<IBBH")
+RECORD_SIZE = HEADER.size + FRAME.size + 2 * CRASH_NAME_LEN + CRASH_TRACE_EVENTS * EVENT.size + 2
+
+CAUSES = ["none", "hardfault", "assert", "stack overflow", "watchdog"]
+
+EVENTS = [
+    "boot",
+    "clock level",
+    "exposure start",
+    "exposure end",
+    "exposure abort",
+    "mains lost",
+    "clock cal",
+]
+
+RESET_FLAGS = [
+    (0x02, "option byte"),
+    (0x04, "pin"),
+    (0x08, "power"),
+    (0x10, "software"),
+    (0x20, "iwdg"),
+    (0x40, "wwdg"),
+    (0x80, "low power"),
+]
+
+# Cortex-M0+ exception numbers, as traced in IPSR and ICSR.VECTACTIVE
+EXCEPTIONS = {0: "thread", 2: "NMI", 3: "HardFault", 11: "SVCall", 14: "PendSV", 15: "SysTick"}
+
+
+def crc16(data):
+    """CRC-16/CCITT-FALSE, same as nbtgTimer/src/crc.c."""
+    crc = 0xFFFF
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+
+def read_record(path):
+    with open(path, errors="replace") as f:
+        text = f.read()
+
+    match = re.search(r"-- crash dump --(.*?)-- end --", text, re.S)
+    if match is None:
+        sys.exit("no crash dump in " + path)
+
+    raw = bytes.fromhex("".join(match.group(1).split()))
+    if len(raw) != RECORD_SIZE:
+        sys.exit("dump is %d bytes, expected %d" % (len(raw), RECORD_SIZE))
+
+    return raw
+
+
+def read_symbols(path):
+    """Function addresses from a GNU ld map file, sorted."""
+    symbols = {}
+    with open(path, errors="replace") as f:
+        for line in f:
+            match = re.match(r"^\s+0x([0-9a-fA-F]{8,16})\s+([A-Za-z_]\w*)\s*$", line)
+            if match:
+                addr = int(match.group(1), 16)
+                if addr >= 0x08000000 and addr < 0x20000000:
+                    symbols.setdefault(addr, match.group(2))
+
+    addrs = sorted(symbols)
+    return addrs, [symbols[a] for a in addrs]
+
+
+def resolve(symbols, addr):
+    if symbols is None:
+        return ""
+
+    addrs, names = symbols
+    index = bisect.bisect_right(addrs, addr & ~1) - 1
+    if index < 0 or not (0x08000000 <= addr < 0x20000000):
+        return ""
+
+    return "  %s+0x%x" % (names[index], (addr & ~1) - addrs[index])
+
+
+def cstr(raw):
+    return raw.split(b"\0", 1)[0].decode("ascii", "replace")
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit(__doc__)
+
+    raw = read_record(sys.argv[1])
+    symbols = read_symbols(sys.argv[2]) if len(sys.argv) > 2 else None
+
+    (magic, version, cause, newest, num_events, reset_flags, line, sp, exc_return, icsr, shcsr) = HEADER.unpack_from(
+        raw, 0
+    )
+    offset = HEADER.size
+    r0, r1, r2, r3, r12, lr, pc, xpsr = FRAME.unpack_from(raw, offset)
+    offset += FRAME.size
+    task = cstr(raw[offset : offset + CRASH_NAME_LEN])
+    offset += CRASH_NAME_LEN
+    source = cstr(raw[offset : offset + CRASH_NAME_LEN])
+    offset += CRASH_NAME_LEN
+    events = [EVENT.unpack_from(raw, offset + i * EVENT.size) for i in range(CRASH_TRACE_EVENTS)]
+    offset += CRASH_TRACE_EVENTS * EVENT.size
+    (crc,) = struct.unpack_from("<H", raw, offset)
+
+    if magic != CRASH_MAGIC or version != CRASH_VERSION:
+        sys.exit("not a crash record (magic %08x, version %d)" % (magic, version))
+    if crc != crc16(raw[:offset]):
+        print("warning: CRC mismatch, the record may be corrupt")
+
+    reset = [name for bit, name in RESET_FLAGS if (reset_flags >> 24) & bit]
+
+    print("cause:   %s" % (CAUSES[cause] if cause < len(CAUSES) else "unknown (%d)" % cause))
+    print("task:    %s" % (task or "-"))
+    print("reset:   %s" % (", ".join(reset) or "-"))
+
+    if cause == 2:
+        print("assert:  %s:%d" % (source, line))
+        print("caller:  %08x%s" % (pc, resolve(symbols, pc)))
+    elif cause == 1:
+        active = icsr & 0x3F
+        print("active:  %s, EXC_RETURN %08x (%s stack)" % (
+            EXCEPTIONS.get(active, "IRQ%d" % (active - 16)), exc_return, "process" if exc_return & 4 else "main"))
+        print("icsr:    %08x  shcsr %08x" % (icsr, shcsr))
+        print("sp:      %08x" % sp)
+        print("pc:      %08x%s" % (pc, resolve(symbols, pc)))
+        print("lr:      %08x%s" % (lr, resolve(symbols, lr)))
+        print("xpsr:    %08x" % xpsr)
+        print("r0-r3:   %08x %08x %08x %08x  r12 %08x" % (r0, r1, r2, r3, r12))
+
+    print("\ntrace, oldest first:")
+    for i in range(min(num_events, CRASH_TRACE_EVENTS)):
+        tick, event, ipsr, arg = events[(newest + 1 - num_events + i) % CRASH_TRACE_EVENTS]
+        name = EVENTS[event] if event < len(EVENTS) else "event %d" % event
+        context = EXCEPTIONS.get(ipsr, "IRQ%d" % (ipsr - 16))
+        if event == EVENTS.index("clock cal"):
+            arg = "%d ppm" % struct.unpack("<h", struct.pack("<H", arg))[0]
+        print("  %10d ms  %-9s  %-15s %s" % (tick, context, name, arg))
+
+
+if __name__ == "__main__":
+    main()
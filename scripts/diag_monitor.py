@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+"""Decode the binary diagnostics stream ("diag stream on") from the console.
+
+Usage: diag_monitor.py [<capture file or serial device>]     (default: stdin)
+
+e.g.   stty -F /dev/ttyUSB0 115200 raw && diag_monitor.py /dev/ttyUSB0
+
+Frame layout, see SDiagFrame_t in nbtgTimer/src/diag.c:
+  D1 A6 <len> <seq> <windowUs u32> <isrPermille u16> <numTasks u8> {<number u8> <cpuPermille u16> <stackFree u16>}
+  <CRC-16/CCITT-FALSE over len..payload, u16>
+Console text between frames is skipped. Task numbers map to names with the "diag" command.
+"""
+
+import struct
+import sys
+import time
+
+SYNC = b"\xd1\xa6"
+TASK = struct.Struct("<BHH")
+
+
+def crc16(data):
+    crc = 0xFFFF
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+
+def frames(stream):
+    buf = b""
+    while True:
+        chunk = stream.read(64)
+        if not chunk:
+            return
+        buf += chunk
+
+        while True:
+            start = buf.find(SYNC)
+            if start < 0:
+                buf = buf[-1:]
+                break
+            buf = buf[start:]
+            if len(buf) < 4:
+                break
+            length = buf[2]
+            end = 4 + length + 2
+            if len(buf) < end:
+                break
+            body, (crc,) = buf[2 : 4 + length], struct.unpack_from("<H", buf, 4 + length)
+            if crc != crc16(body):
+                buf = buf[1:]  # false sync in console text
+                continue
+            buf = buf[end:]
+            yield body[1], body[2:]
+
+
+def main():
+    stream = open(sys.argv[1], "rb", buffering=0) if len(sys.argv) > 1 else sys.stdin.buffer
+    last_seq = None
+
+    for seq, payload in frames(stream):
+        window_us, isr, count = struct.unpack_from("<IHB", payload)
+        tasks = [TASK.unpack_from(payload, 7 + i * TASK.size) for i in range(count)]
+
+        lost = "" if last_seq is None or seq == (last_seq + 1) & 0xFF else "  (%d lost)" % ((seq - last_seq - 1) & 0xFF)
+        last_seq = seq
+
+        cols = "  ".join("#%d %5.1f%% %4dB" % (n, cpu / 10, free) for n, cpu, free in tasks)
+        print("%s %4dms isr %4.1f%%  %s%s" % (time.strftime("%H:%M:%S"), window_us // 1000, isr / 10, cols, lost))
+        sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main()
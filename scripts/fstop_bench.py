@@ -0,0 +1,252 @@
+#!/usr/bin/env python3
+"""Accuracy and speed of the f-stop math: calculateNextFStop(), getTimeTable() and genererateTestStrip().
+
+Usage: fstop_bench.py <source dir> [--steps N] [--device <serial device>] [--out <report.json>]
+                      [--baseline <report.json>]
+
+e.g.   fstop_bench.py . --device /dev/ttyUSB0 --out before.json
+       (change the math, flash it)
+       fstop_bench.py . --device /dev/ttyUSB0 --baseline before.json
+
+nbtgTimer/src/fstop.c is built for the host with the system C compiler and called through ctypes, so the figures are
+those of the firmware's own code. Every start time from 100ms to 1h on the 100ms grid is run at each resolution and
+compared with exact t * 2^(k/N) arithmetic:
+
+  step      relative error of one calculateNextFStop() step, both directions, max and mean
+  factor    error of the Q10 multiplier itself, read from the fstop.c defines
+  drift     relative error after --steps chained steps (getTimeTable(), both directions), max and mean
+  order     tables and test strips with a step in the wrong direction (non-monotonic) or no step at all (duplicate,
+            the time rounded back onto the previous one)
+  overflow  start times whose product with the multiplier does not fit 32 bits
+
+nbtgTimer/src/meter.c is built the same way, together with fstop.c for fstopExp2()/fstopLog2() and a stand-in for the
+ADC driver. Every calibration level the probe can read (16 to 65535 ADC counts) is set through meterSetCalibration()
+and has to come back from meterReferenceLevel(), which sets the target of integrated exposures, within one count plus
+two steps of a reading (1/256 stop each, one for the reading's resolution, one for the truncation in meterLog2Q8()).
+A level that doesn't fails the run.
+
+Cycle counts per call come from the target ("diag bench", 64MHz, fastest of 16 batches) when a device is given; the
+console must be idle. With a baseline report, every figure is listed old -> new and the script exits with 1 if
+accuracy or speed got worse.
+"""
+
+import argparse
+import ctypes
+import json
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+from input_replay import Console
+
+RESOLUTIONS = (("full", 1), ("half", 2), ("third", 3), ("sixth", 6))  # EFStop_t order, steps per stop
+FACTORS = (("PLUS_FULL", "MINUS_FULL"), ("PLUS_HALF", "MINUS_HALF"), ("PLUS_ONE_THIRD", "MINUS_ONE_THIRD"),
+           ("PLUS_ONE_SIXTH", "MINUS_ONE_SIXTH"))
+SCALE = 1024
+MIN_MS = 100
+MAX_MS = 3600 * 1000
+GRID_MS = 100
+STRIP_STEPS = 6  # same as DIAG_BENCH_STEPS
+METER_LEVELS = range(16, 65536)  # METER_MIN_ADC up to full scale
+ADC_STUB = "#include <stdint.h>\nuint16_t adcGetAverage(void);\nuint16_t adcGetAverage(void) { return 0; }\n"
+
+# worse than the baseline by more than this fails: rounding moves a few grid points either way
+ERROR_TOLERANCE = 0.01  # percentage points
+CYCLES_TOLERANCE = 0.02  # relative
+
+
+def build(root, workdir):
+    """Compile fstop.c into a shared library and declare the benchmarked functions."""
+    lib = os.path.join(workdir, "libfstop.so")
+    subprocess.run([os.environ.get("CC", "cc"), "-O2", "-shared", "-fPIC", "-I", os.path.join(root, "nbtgTimer/inc"),
+                    "-o", lib, os.path.join(root, "nbtgTimer/src/fstop.c")], check=True)
+    fstop = ctypes.CDLL(lib)
+
+    fstop.calculateNextFStop.restype = ctypes.c_uint32
+    fstop.calculateNextFStop.argtypes = (ctypes.c_uint32, ctypes.c_bool, ctypes.c_int)
+    fstop.getTimeTable.restype = None
+    fstop.getTimeTable.argtypes = (ctypes.c_uint32, ctypes.c_bool, ctypes.c_size_t, ctypes.c_int,
+                                   ctypes.POINTER(ctypes.c_uint32))
+    fstop.genererateTestStrip.restype = None
+    fstop.genererateTestStrip.argtypes = (ctypes.c_uint32, ctypes.c_size_t, ctypes.c_int,
+                                          ctypes.POINTER(ctypes.c_uint32))
+    return fstop
+
+
+def build_meter(root, workdir):
+    """Compile meter.c and the fstop.c it takes its powers of two from, with a stand-in for the ADC driver, and declare
+    the calibration functions."""
+    lib = os.path.join(workdir, "libmeter.so")
+    stub = os.path.join(workdir, "adc_stub.c")
+    with open(stub, "w") as f:
+        f.write(ADC_STUB)
+    sources = [os.path.join(root, "nbtgTimer/src", f) for f in ("meter.c", "fstop.c")]
+    includes = ["nbtgTimer/inc", "sys/bsp/inc", "sys/stm32g0xx_sys", "sys/stm32g0xx_sys/CMSIS/Core/Include",
+                "sys/stm32g0xx_sys/CMSIS/Device"]
+    subprocess.run([os.environ.get("CC", "cc"), "-O2", "-shared", "-fPIC", "-w", "-DSTM32G070xx"]
+                   + ["-I" + os.path.join(root, i) for i in includes]
+                   + ["-o", lib] + sources + [stub], check=True)
+    meter = ctypes.CDLL(lib)
+
+    meter.meterLog2Q8.restype = ctypes.c_int32
+    meter.meterLog2Q8.argtypes = (ctypes.c_uint32,)
+    meter.meterSetCalibration.restype = None
+    meter.meterSetCalibration.argtypes = (ctypes.c_int32, ctypes.c_uint32)
+    meter.meterReferenceLevel.restype = ctypes.c_uint32
+    meter.meterReferenceLevel.argtypes = ()
+    return meter
+
+
+def check_meter(meter):
+    """Round-trip every calibration level through the log domain, return the worst error and the failures."""
+    worst, failed = 0.0, []
+    for level in METER_LEVELS:
+        meter.meterSetCalibration(meter.meterLog2Q8(level), 1000)
+        back = meter.meterReferenceLevel()
+        worst = max(worst, abs(back - level) / level)
+        if abs(back - level) > 1 + level * (2 ** (2 / 256) - 1):
+            failed.append((level, back))
+    return {"ref_max": 100 * worst, "ref_failed": len(failed)}, failed
+
+
+def read_factors(root):
+    with open(os.path.join(root, "nbtgTimer/src/fstop.c")) as f:
+        return {name: int(value) for name, value in re.findall(r"^#define\s+(\w+)\s+(\d+)\b", f.read(), re.M)}
+
+
+def wrong_order(times, increasing):
+    """Count steps in the wrong direction and steps that didn't move."""
+    pairs = list(zip(times, times[1:]))
+    backwards = sum(1 for a, b in pairs if (b < a if increasing else b > a))
+    return backwards, sum(1 for a, b in pairs if a == b)
+
+
+def measure(fstop, factors, index, per_stop, steps):
+    up, down = factors[FACTORS[index][0]], factors[FACTORS[index][1]]
+    table = (ctypes.c_uint32 * steps)()
+    strip = (ctypes.c_uint32 * (STRIP_STEPS * 2 + 1))()
+    step_errors, drift_errors = [], []
+    backwards = duplicates = overflows = 0
+
+    for start in range(MIN_MS, MAX_MS + 1, GRID_MS):
+        for reverse, factor in ((False, up), (True, down)):
+            sign = -1 if reverse else 1
+            if start * factor > 0xFFFFFFFF:
+                overflows += 1
+
+            result = fstop.calculateNextFStop(start, reverse, index)
+            exact = start * 2 ** (sign / per_stop)
+            step_errors.append(abs(result - exact) / exact)
+
+            fstop.getTimeTable(start, reverse, steps, index, table)
+            exact = start * 2 ** (sign * steps / per_stop)
+            drift_errors.append(abs(table[steps - 1] - exact) / exact)
+            b, d = wrong_order([start] + list(table), not reverse)
+            backwards, duplicates = backwards + b, duplicates + d
+
+        fstop.genererateTestStrip(start, STRIP_STEPS, index, strip)
+        b, d = wrong_order(list(strip), True)
+        backwards, duplicates = backwards + b, duplicates + d
+
+    return {
+        "step_max": 100 * max(step_errors),
+        "step_mean": 100 * sum(step_errors) / len(step_errors),
+        "factor_up": 100 * (up / SCALE / 2 ** (1 / per_stop) - 1),
+        "factor_down": 100 * (down / SCALE / 2 ** (-1 / per_stop) - 1),
+        "drift_max": 100 * max(drift_errors),
+        "drift_mean": 100 * sum(drift_errors) / len(drift_errors),
+        "backwards": backwards,
+        "duplicates": duplicates,
+        "overflows": overflows,
+    }
+
+
+def target_cycles(device):
+    console = Console(device)
+    console.drain()
+    rows = [l.split(",") for l in console.command("diag bench", timeout=30.0)[1:]]
+    return {r[0]: {"next": int(r[1]), "table": int(r[2]), "strip": int(r[3])} for r in rows}
+
+
+def print_report(report, steps):
+    print("%-6s %16s %17s %16s %10s %10s %9s %16s" % ("", "step max/mean %", "factor up/down %", "drift max/mean %",
+                                                         "backwards", "duplicates", "overflow", "cycles n/t/s"))
+    for name, _ in RESOLUTIONS:
+        r = report[name]
+        cycles = "%d/%d/%d" % (r["cycles"]["next"], r["cycles"]["table"], r["cycles"]["strip"]) if "cycles" in r \
+            else "-"
+        print("%-6s %8.3f/%-7.3f %8.4f/%-8.4f %8.3f/%-7.3f %10d %10d %9d %16s"
+              % (name, r["step_max"], r["step_mean"], r["factor_up"], r["factor_down"], r["drift_max"],
+                 r["drift_mean"], r["backwards"], r["duplicates"], r["overflows"], cycles))
+    print("drift after %d steps, cycles per call of next/table (%d steps)/strip (%d+%d steps)"
+          % (steps, STRIP_STEPS * 2, STRIP_STEPS, STRIP_STEPS))
+
+
+def compare(old, new):
+    """List the changes, return false if accuracy or speed got worse."""
+    ok = True
+    for name, _ in RESOLUTIONS:
+        a, b = old[name], new[name]
+        for key in ("step_max", "step_mean", "drift_max", "drift_mean"):
+            if b[key] > a[key] + ERROR_TOLERANCE:
+                ok = False
+            if abs(b[key] - a[key]) > 1e-9:
+                print("%-6s %-10s %8.3f%% -> %8.3f%%" % (name, key, a[key], b[key]))
+        for key in ("backwards", "duplicates", "overflows"):
+            if b[key] > a[key]:
+                ok = False
+            if b[key] != a[key]:
+                print("%-6s %-10s %9d -> %9d" % (name, key, a[key], b[key]))
+        for key in ("next", "table", "strip"):
+            if "cycles" not in a or "cycles" not in b:
+                continue
+            if b["cycles"][key] > a["cycles"][key] * (1 + CYCLES_TOLERANCE):
+                ok = False
+            if b["cycles"][key] != a["cycles"][key]:
+                print("%-6s %-10s %9d -> %9d cycles" % (name, key, a["cycles"][key], b["cycles"][key]))
+    return ok
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("source", help="repository root")
+    parser.add_argument("--steps", type=int, default=12, help="chained steps for the drift")
+    parser.add_argument("--device", help="console of a unit to take the cycle counts from")
+    parser.add_argument("--out")
+    parser.add_argument("--baseline")
+    args = parser.parse_args()
+
+    factors = read_factors(args.source)
+    with tempfile.TemporaryDirectory() as workdir:
+        fstop = build(args.source, workdir)
+        report = {name: measure(fstop, factors, i, per_stop, args.steps)
+                  for i, (name, per_stop) in enumerate(RESOLUTIONS)}
+        report["meter"], failed = check_meter(build_meter(args.source, workdir))
+
+    if args.device:
+        for name, cycles in target_cycles(args.device).items():
+            report[name]["cycles"] = cycles
+
+    print_report(report, args.steps)
+    print("meter reference level: max error %.3f%% over %d calibration levels"
+          % (report["meter"]["ref_max"], len(METER_LEVELS)))
+    for level, back in failed[:10]:
+        print("  calibrated at %d, reference level %d" % (level, back))
+
+    if args.out:
+        with open(args.out, "w") as f:
+            json.dump(report, f, indent=1)
+    if args.baseline:
+        with open(args.baseline) as f:
+            if not compare(json.load(f), report):
+                print("worse than the baseline")
+                sys.exit(1)
+    if failed:
+        print("%d calibration levels don't round-trip through meterReferenceLevel()" % len(failed))
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
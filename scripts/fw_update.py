@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+"""Update the timer's firmware over the console.
+
+Usage: fw_update.py <serial device> <build dir> [--baud <rate>]
+
+e.g.   fw_update.py /dev/ttyUSB0 build
+
+Asks the timer which image slot is free ("update"), sends the image linked for that slot (nbtgTimer.bin for slot A,
+nbtgTimer_b.bin for slot B) with "update <slot> <len> <crc32> <baud>" and reports the time it took. The timer
+resets into the new image when it's verified; the image marks itself good after running for 10s, until then a reset
+rolls back to the old one.
+
+The transfer runs at --baud (default 1000000, must divide 16MHz): 1K blocks with their index and CRC-32, at most two
+unacknowledged. A NAK stops the sender until the timer asks for a block again (READY).
+"""
+
+import argparse
+import os
+import struct
+import sys
+import termios
+import time
+import tty
+import zlib
+
+from input_replay import PROMPT, Console
+
+CONSOLE_BAUD = 115200
+BLOCK_BYTES = 1024  # UPDATE_BLOCK_BYTES, nbtgTimer/inc/update.h
+SLOT_BYTES = 61440  # FLASH_SLOT_BYTES, sys/bsp/inc/flash.h
+WINDOW = 2  # frames in flight, the timer's ring holds three
+MARK = 0xA5
+RESPONSE_TIMEOUT_S = 3.0
+IMAGES = {"a": "nbtgTimer.bin", "b": "nbtgTimer_b.bin"}
+
+
+class Link(Console):
+    def set_baud(self, baud):
+        tty.setraw(self.fd)
+        attrs = termios.tcgetattr(self.fd)
+        attrs[4] = attrs[5] = getattr(termios, "B%d" % baud)
+        termios.tcsetattr(self.fd, termios.TCSADRAIN, attrs)
+
+    def responses(self, timeout):
+        """Yield (code, index) responses, text in between is skipped. Stops after timeout without a response."""
+        buf = b""
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            buf += self.read(0.01)
+            while True:
+                start = buf.find(bytes([MARK]))
+                if start < 0 or len(buf) < start + 4:
+                    buf = b"" if start < 0 else buf[start:]
+                    break
+                code = chr(buf[start + 1])
+                if code not in "RANDE":
+                    buf = buf[start + 1 :]
+                    continue
+                index = buf[start + 2] | (buf[start + 3] << 8)
+                buf = buf[start + 4 :]
+                deadline = time.monotonic() + timeout
+                yield code, index
+            yield None, None
+
+
+def free_slot(link):
+    status = "\n".join(link.command("update"))
+    if "confirm pending" in status:
+        sys.exit("the running image isn't confirmed yet, try again in a few seconds")
+    for line in status.splitlines():
+        if line.startswith("update slot "):
+            return line.split()[2]
+    sys.exit("unexpected answer to 'update': %r" % status)
+
+
+def start(link, slot, image, crc, baud):
+    os.write(link.fd, b"update %s %d %08x %d\r" % (slot.encode(), len(image), crc, baud))
+    buf = b""
+    deadline = time.monotonic() + 10.0  # the slot's pages are erased first
+    while b"go\r\n" not in buf:
+        if PROMPT in buf:
+            sys.exit("timer: %s" % buf.decode(errors="replace").split("\r\n")[1])
+        if time.monotonic() > deadline:
+            sys.exit("no answer to the update command")
+        buf += link.read(0.1)
+    termios.tcdrain(link.fd)
+    link.set_baud(baud)
+
+
+def send(link, image):
+    blocks = [image[i : i + BLOCK_BYTES].ljust(BLOCK_BYTES, b"\xff") for i in range(0, len(image), BLOCK_BYTES)]
+    frames = [b + struct.pack("<HHI", i, 0, zlib.crc32(b)) for i, b in enumerate(blocks)]
+    acked = next_frame = 0
+    sending = False
+    retries = 0
+
+    for code, index in link.responses(RESPONSE_TIMEOUT_S):
+        if code == "R":
+            acked = next_frame = index
+            sending = True
+        elif code == "A" and index == acked:
+            acked += 1
+        elif code == "N":
+            sending = False
+            retries += 1
+        elif code == "D":
+            return retries
+        elif code == "E":
+            return None
+
+        while sending and next_frame < len(frames) and next_frame - acked < WINDOW:
+            os.write(link.fd, frames[next_frame])
+            next_frame += 1
+
+    sys.exit("no response from the timer, it keeps the running image")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("device")
+    parser.add_argument("build_dir")
+    parser.add_argument("--baud", type=int, default=1000000)
+    args = parser.parse_args()
+
+    link = Link(args.device)
+    link.set_baud(CONSOLE_BAUD)
+    link.drain(0.2)
+
+    slot = free_slot(link)
+    with open(os.path.join(args.build_dir, IMAGES[slot]), "rb") as f:
+        image = f.read()
+    if len(image) > SLOT_BYTES:
+        sys.exit("%s is %d bytes, a slot holds %d" % (IMAGES[slot], len(image), SLOT_BYTES))
+
+    began = time.monotonic()
+    start(link, slot, image, zlib.crc32(image), args.baud)
+    retries = send(link, image)
+    elapsed = time.monotonic() - began
+
+    termios.tcdrain(link.fd)
+    link.set_baud(CONSOLE_BAUD)
+    text = b""
+    deadline = time.monotonic() + 1.0
+    while time.monotonic() < deadline:
+        text += link.read(0.1)
+    text = text.decode(errors="replace").strip()
+
+    if retries is None:
+        sys.exit("update failed, the running image stays: %s" % text)
+
+    print("slot %s: %d bytes in %.1fs (%.1f kB/s), %d resends" % (slot, len(image), elapsed,
+                                                                   len(image) / elapsed / 1000, retries))
+    print(text)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,189 @@
+#!/usr/bin/env python3
+"""Record operator sessions on the timer and replay them, e.g. to compare two firmware builds.
+
+Usage: input_replay.py <serial device> dump <session.csv>
+       input_replay.py <serial device> play <session.csv> [--out <report.json>] [--baseline <report.json>]
+
+e.g.   stty -F /dev/ttyUSB0 115200 raw -echo
+       (on the console: "replay rec", work the session, "replay stop")
+       input_replay.py /dev/ttyUSB0 dump session.csv
+       (flash another build, restore the same profile and base time)
+       input_replay.py /dev/ttyUSB0 play session.csv --out new.json --baseline old.json
+
+dump  saves the recorded session ("replay dump") as CSV: time_ms,event,line
+play  loads the session ("replay at ..."), replays it with the diagnostics stream on and reports the exposures it
+      produced (journal) and the CPU and ISR load seen during the replay. with a baseline report, exposures that
+      differ and the change in load are listed
+
+Nothing may be typed on the console while a replay runs, the replayed lines go through the same input queue.
+"""
+
+import argparse
+import json
+import os
+import select
+import sys
+import time
+
+from diag_monitor import SYNC, TASK, crc16
+
+PROMPT = b"\r\n> "
+SETTLE_S = 3.0  # after the last event, for the last exposure to finish and the journal to catch up
+DELIVERED_TOLERANCE_MS = 2  # lamp edges are timed by TIM15, delivered times move by a tick between runs
+
+
+class Console:
+    def __init__(self, device):
+        self.fd = os.open(device, os.O_RDWR | os.O_NOCTTY)
+
+    def read(self, timeout):
+        ready, _, _ = select.select([self.fd], [], [], timeout)
+        return os.read(self.fd, 256) if ready else b""
+
+    def drain(self, quiet=0.5):
+        """Drop input until the line has been quiet for a while."""
+        while self.read(quiet):
+            pass
+
+    def command(self, line, timeout=5.0):
+        """Run a console line, return its output lines without the echo and the prompt."""
+        os.write(self.fd, line.encode() + b"\r")
+        buf = b""
+        deadline = time.monotonic() + timeout
+        while PROMPT not in buf:
+            if time.monotonic() > deadline:
+                raise TimeoutError("no prompt after %r" % line)
+            buf += self.read(0.1)
+        text = buf[: buf.index(PROMPT)].decode(errors="replace")
+        return [l for l in text.split("\r\n")[1:] if l]
+
+    def frames(self, duration):
+        """Collect diagnostics frames for duration seconds, console text in between is skipped."""
+        buf = b""
+        deadline = time.monotonic() + duration
+        while time.monotonic() < deadline:
+            buf += self.read(0.1)
+            while True:
+                start = buf.find(SYNC)
+                if start < 0 or len(buf) < start + 4:
+                    buf = buf[-1:] if start < 0 else buf[start:]
+                    break
+                buf = buf[start:]
+                end = 4 + buf[2] + 2
+                if len(buf) < end:
+                    break
+                body = buf[2 : end - 2]
+                if int.from_bytes(buf[end - 2 : end], "little") != crc16(body):
+                    buf = buf[1:]
+                    continue
+                buf = buf[end:]
+                yield body[2:]
+
+
+def load_session(path):
+    # the console line is the last field and is not quoted, it may contain commas
+    with open(path) as f:
+        rows = [l.rstrip("\r\n").split(",", 2) for l in f.readlines()[1:] if l.strip()]
+    return [(int(t), event, line) for t, event, line in rows]
+
+
+def dump(console, path):
+    lines = console.command("replay dump")
+    with open(path, "w") as f:
+        f.write("\n".join(lines) + "\n")
+    print("%d events saved" % (len(lines) - 1))
+
+
+def journal_seq(console):
+    rows = [l for l in console.command("journal 1") if l[0].isdigit()]
+    return int(rows[0].split(",")[0]) if rows else 0
+
+
+def play(console, args):
+    session = load_session(args.session)
+    if not session:
+        sys.exit("empty session")
+
+    console.command("replay clear")
+    for time_ms, event, line in session:
+        cmd = "replay at %d press" % time_ms if event == "press" else "replay at %d line %s" % (time_ms, line)
+        out = console.command(cmd)
+        if out:
+            sys.exit("%s: %s" % (cmd, out[0]))
+
+    names = {}
+    for l in console.command("diag")[2:]:
+        number, name = l.split()[:2]
+        names[int(number)] = name
+
+    first_seq = journal_seq(console) + 1
+    console.command("diag stream on")
+    os.write(console.fd, b"replay play\r")
+
+    isr, cpu = [], {}
+    for payload in console.frames(session[-1][0] / 1000 + SETTLE_S):
+        window_isr, count = int.from_bytes(payload[4:6], "little"), payload[6]
+        isr.append(window_isr / 10)
+        for i in range(count):
+            number, task_cpu, _ = TASK.unpack_from(payload, 7 + i * TASK.size)
+            cpu.setdefault(names.get(number, "#%d" % number), []).append(task_cpu / 10)
+
+    os.write(console.fd, b"diag stream off\r")
+    console.drain()
+
+    count = journal_seq(console) - first_seq + 1
+    rows = [l.split(",") for l in console.command("journal %d" % count) if l[0].isdigit()] if count > 0 else []
+    exposures = [dict(zip(("mode", "requested_ms", "delivered_ms", "stop_offset", "program", "aborted"), r[1:]))
+                 for r in reversed(rows)]
+
+    report = {
+        "exposures": exposures,
+        "isr_peak": max(isr, default=0),
+        "isr_mean": sum(isr) / len(isr) if isr else 0,
+        "cpu_peak": {name: max(v) for name, v in cpu.items()},
+    }
+    print("%d exposures, isr peak %.1f%% mean %.1f%%" % (len(exposures), report["isr_peak"], report["isr_mean"]))
+
+    if args.out:
+        with open(args.out, "w") as f:
+            json.dump(report, f, indent=1)
+    if args.baseline:
+        with open(args.baseline) as f:
+            compare(json.load(f), report)
+
+
+def compare(old, new):
+    if len(old["exposures"]) != len(new["exposures"]):
+        print("exposures: %d -> %d" % (len(old["exposures"]), len(new["exposures"])))
+
+    for i, (a, b) in enumerate(zip(old["exposures"], new["exposures"])):
+        same = all(a[k] == b[k] for k in a if k != "delivered_ms")
+        close = abs(int(a["delivered_ms"]) - int(b["delivered_ms"])) <= DELIVERED_TOLERANCE_MS
+        if not (same and close):
+            print("exposure %d: %s -> %s" % (i + 1, a, b))
+
+    print("isr peak %.1f%% -> %.1f%%, mean %.1f%% -> %.1f%%" % (old["isr_peak"], new["isr_peak"], old["isr_mean"],
+                                                               new["isr_mean"]))
+    for name in sorted(set(old["cpu_peak"]) | set(new["cpu_peak"])):
+        print("%-16s cpu peak %5.1f%% -> %5.1f%%" % (name, old["cpu_peak"].get(name, 0), new["cpu_peak"].get(name, 0)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("device")
+    parser.add_argument("action", choices=("dump", "play"))
+    parser.add_argument("session")
+    parser.add_argument("--out")
+    parser.add_argument("--baseline")
+    args = parser.parse_args()
+
+    console = Console(args.device)
+
+    if args.action == "dump":
+        dump(console, args.session)
+    else:
+        play(console, args)
+
+
+if __name__ == "__main__":
+    main()
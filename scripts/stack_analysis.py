@@ -0,0 +1,361 @@
+#!/usr/bin/env python3
+"""Worst-case stack usage per task and for the interrupt (main) stack.
+
+Usage: stack_analysis.py <build dir> <source dir> [--config <file>] [--linker-script <file>] [--skip <dir>]
+
+Combines the per-function frames from the compiler's .su files (-fstack-usage)
+with the call graph from its .ci files (-fcallgraph-info) into the deepest
+path from every task entry point and every interrupt handler:
+
+- tasks are found in the sources (xTaskCreateStatic) and compared against
+  their allocated depth, plus the exception frame and the context the kernel
+  saves on a task stack
+- handlers run on the main stack. On the Cortex-M0+ a handler is only
+  preempted by a strictly higher priority, so the worst case nests the deepest
+  handler of every priority level taken from NVIC_SetPriority(), plus a
+  HardFault on top. That is compared against _Min_Stack_Size together with
+  main(), which runs on the same stack before the scheduler starts
+
+Dynamic frames (VLAs, alloca), recursion, indirect calls without an
+annotation and functions without stack information are listed: the numbers
+are only an upper bound when that list is empty. Edges the compiler can't see
+go into stack_analysis.cfg.
+
+Objects under a --skip directory (the bootloader, a separate program) are left out.
+
+Exits with 1 if a stack is too small.
+"""
+
+import argparse
+import os
+import re
+import sys
+
+WORD = 4
+EXCEPTION_FRAME = 8 * WORD + WORD  # r0-r3, r12, lr, pc, xpsr, plus alignment padding
+TASK_CONTEXT = 8 * WORD  # r4-r11, pushed to the task stack by PendSV
+CORE_HANDLERS = ("NMI_Handler", "HardFault_Handler", "SVC_Handler", "PendSV_Handler", "SysTick_Handler")
+CORE_IRQN = {"SVCall": "SVC_Handler", "PendSV": "PendSV_Handler", "SysTick": "SysTick_Handler"}
+INDIRECT = "__indirect_call"
+
+
+class Function:
+    def __init__(self, key, name, path):
+        self.key = key
+        self.name = name
+        self.path = path
+        self.frame = None  # bytes, None if unknown
+        self.qualifier = ""
+        self.callees = set()
+        self.indirect = False
+
+
+class Graph:
+    def __init__(self):
+        self.functions = {}  # key -> Function
+        self.globals = {}  # name -> key
+        self.units = {}  # unit -> {name: key}
+
+    def define(self, unit, name, path):
+        key = name if name not in self.functions else "%s (%s)" % (name, os.path.basename(path))
+        function = self.functions.setdefault(key, Function(key, name, path))
+        self.units.setdefault(unit, {})[name] = key
+        self.globals.setdefault(name, key)
+        return function
+
+    def lookup(self, name, unit=None):
+        local = self.units.get(unit, {})
+        for candidate in (name, name.split(".")[0]):  # GCC clones: foo.constprop.0, foo.part.0
+            if candidate in local:
+                return local[candidate]
+            if candidate in self.globals:
+                return self.globals[candidate]
+        return None
+
+    def external(self, name):
+        return self.functions.setdefault(name, Function(name, name, ""))
+
+
+def find_files(root, suffix, skip=()):
+    skip = [os.path.abspath(d) for d in skip]
+    for dirpath, dirnames, files in os.walk(root):
+        dirnames[:] = [d for d in dirnames if os.path.abspath(os.path.join(dirpath, d)) not in skip]
+        for name in files:
+            if name.endswith(suffix):
+                yield os.path.join(dirpath, name)
+
+
+def read_stack_usage(build_dir, skip):
+    """.su lines: <path>:<line>:<col>:<function><TAB><bytes><TAB><qualifier>"""
+    frames = {}
+    for su in find_files(build_dir, ".su", skip):
+        with open(su) as f:
+            for line in f:
+                match = re.match(r"^(.*):\d+:\d+:(.+?)\t(\d+)\t(\S+)", line)
+                if match:
+                    path, name, size, qualifier = match.groups()
+                    name = name.split("(")[0].split()[-1]  # older GCCs print the declaration
+                    frames[(os.path.normpath(path), name)] = (int(size), qualifier)
+    return frames
+
+
+def read_call_graph(build_dir, frames, skip):
+    """.ci files are VCG: a node per function, an edge per call site."""
+    graph = Graph()
+    edges = []
+    titles = {}  # (unit, node title) -> key
+
+    for ci in find_files(build_dir, ".ci", skip):
+        unit = ci
+        with open(ci) as f:
+            text = f.read()
+
+        for match in re.finditer(r'node: \{ title: "([^"]+)" label: "([^"]*)"(.*?)\}', text):
+            title, label, rest = match.groups()
+            lines = label.split("\\n")
+            if "shape" in rest or len(lines) < 2:
+                continue  # declaration only, defined in another unit
+            name = lines[0]  # static functions are titled <path>:<name>
+            path = os.path.normpath(lines[1].rsplit(":", 2)[0])
+            function = graph.define(unit, name, path)
+            titles[(unit, title)] = function.key
+            frame = frames.get((path, name)) or frames.get((path, name.split(".")[0]))
+            if frame is not None:
+                function.frame, function.qualifier = frame
+
+        for match in re.finditer(r'edge: \{ sourcename: "([^"]+)" targetname: "([^"]+)"', text):
+            edges.append((unit, match.group(1), match.group(2)))
+
+    def resolve(unit, title):
+        return titles.get((unit, title)) or graph.lookup(title.rsplit(":", 1)[-1], unit)
+
+    for unit, source, target in edges:
+        caller = resolve(unit, source)
+        if caller is None:
+            continue
+        if target == INDIRECT:
+            graph.functions[caller].indirect = True
+            continue
+        callee = resolve(unit, target) or graph.external(target.rsplit(":", 1)[-1]).key
+        graph.functions[caller].callees.add(callee)
+
+    return graph
+
+
+def read_config(path, graph):
+    tasks, priorities = [], {}
+    annotated = set()
+    if path is None:
+        return tasks, priorities, annotated
+
+    with open(path) as f:
+        for line in f:
+            words = line.split("#", 1)[0].split()
+            if not words:
+                continue
+            kind, args = words[0], words[1:]
+            if kind == "call":
+                caller = graph.lookup(args[0]) or graph.external(args[0]).key
+                annotated.add(caller)
+                for name in args[1:]:
+                    graph.functions[caller].callees.add(graph.lookup(name) or graph.external(name).key)
+            elif kind == "task":
+                tasks.append((args[0], args[0], args[1]))
+            elif kind == "priority":
+                priorities[args[0]] = int(args[1])
+            elif kind == "size":
+                function = graph.functions.get(graph.lookup(args[0]) or graph.external(args[0]).key)
+                if function.frame is None:
+                    function.frame, function.qualifier = int(args[1]), "annotated"
+            else:
+                sys.exit("%s: unknown entry '%s'" % (path, kind))
+
+    return tasks, priorities, annotated
+
+
+def read_sources(source_dir):
+    texts = {}
+    for sub in ("nbtgTimer", os.path.join("sys", "bsp"), os.path.join("sys", "FreeRTOSConfig")):
+        for ext in (".c", ".h"):
+            for path in find_files(os.path.join(source_dir, sub), ext):
+                with open(path, errors="replace") as f:
+                    texts[path] = f.read()
+    return texts
+
+
+def evaluate(expr, defines, depth=0):
+    """Integer value of a simple #define, e.g. ((uint16_t)64) or configMINIMAL_STACK_SIZE * 2."""
+    if depth > 8:
+        raise ValueError(expr)
+    expr = re.sub(r"\(\s*(?:u?int\d+_t|StackType_t|configSTACK_DEPTH_TYPE)\s*\)", "", expr)
+    expr = re.sub(r"\b(\d+)[uUlL]+\b", r"\1", expr)
+    expr = re.sub(r"\b[A-Za-z_]\w*\b", lambda m: "(%d)" % evaluate(defines[m.group(0)], defines, depth + 1), expr)
+    if not re.fullmatch(r"[\d\s()+\-*/]+", expr):
+        raise ValueError(expr)
+    return int(eval(expr))  # digits and operators only
+
+
+def find_tasks(texts):
+    defines, tasks = {}, []
+    for text in texts.values():
+        for match in re.finditer(r"^\s*#define\s+(\w+)\s+([^\n/]+)", text, re.M):
+            defines.setdefault(match.group(1), match.group(2).strip())
+    for text in texts.values():
+        for match in re.finditer(r'xTaskCreateStatic\(\s*(\w+)\s*,\s*"([^"]*)"\s*,\s*([^,]+),', text):
+            tasks.append((match.group(1), match.group(2), match.group(3).strip()))
+    return tasks, defines
+
+
+def find_priorities(texts):
+    priorities = {}
+    for text in texts.values():
+        for match in re.finditer(r"NVIC_SetPriority\(\s*(\w+)_IRQn\s*,\s*(\d+)\s*\)", text):
+            irq = match.group(1)
+            handler = CORE_IRQN.get(irq, irq + "_IRQHandler")
+            priorities[handler] = min(priorities.get(handler, 3), int(match.group(2)))
+    return priorities
+
+
+def min_stack_size(path):
+    if path is None:
+        return None
+    with open(path) as f:
+        match = re.search(r"_Min_Stack_Size\s*=\s*(0x[0-9a-fA-F]+|\d+)", f.read())
+    return int(match.group(1), 0) if match else None
+
+
+class Analysis:
+    def __init__(self, graph, annotated):
+        self.graph = graph
+        self.annotated = annotated
+        self.memo = {}
+        self.issues = {}  # function key -> set of notes
+
+    def note(self, key, text):
+        self.issues.setdefault(key, set()).add(text)
+
+    def worst(self, key, stack=()):
+        """(bytes, path) of the deepest call chain from key."""
+        if key in self.memo:
+            return self.memo[key]
+        if key in stack:
+            self.note(key, "recursion")
+            return 0, []
+
+        function = self.graph.functions[key]
+        own = function.frame or 0
+        if function.frame is None:
+            self.note(key, "no stack information")
+        if function.qualifier.startswith("dynamic"):
+            self.note(key, "dynamic frame" + (" (bounded)" if "bounded" in function.qualifier else ""))
+        if function.indirect and key not in self.annotated:
+            self.note(key, "unresolved indirect call")
+
+        deepest, path = 0, []
+        for callee in sorted(function.callees):
+            depth, sub = self.worst(callee, stack + (key,))
+            if depth > deepest:
+                deepest, path = depth, sub
+
+        self.memo[key] = (own + deepest, [key] + path)
+        return self.memo[key]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("build_dir")
+    parser.add_argument("source_dir")
+    parser.add_argument("--config")
+    parser.add_argument("--linker-script")
+    parser.add_argument("--skip", action="append", default=[], help="build directory to leave out")
+    parser.add_argument("--path", action="store_true", help="print the deepest call chain of every entry")
+    args = parser.parse_args()
+
+    frames = read_stack_usage(args.build_dir, args.skip)
+    if not frames:
+        sys.exit("no .su files in %s: build the Debug configuration first" % args.build_dir)
+
+    graph = read_call_graph(args.build_dir, frames, args.skip)
+    if not graph.functions:
+        sys.exit("no .ci files in %s: the compiler needs -fcallgraph-info" % args.build_dir)
+
+    extra_tasks, extra_priorities, annotated = read_config(args.config, graph)
+    texts = read_sources(args.source_dir)
+    tasks, defines = find_tasks(texts)
+    priorities = find_priorities(texts)
+    priorities.update(extra_priorities)
+    analysis = Analysis(graph, annotated)
+    failed = False
+
+    def show_path(path):
+        if args.path:
+            chain = " > ".join("%s(%s)" % (k, graph.functions[k].frame or "?") for k in path)
+            print("      " + chain)
+
+    print("task stacks (bytes):")
+    print("  %-12s %-24s %9s %9s %9s" % ("task", "entry", "allocated", "needed", "margin"))
+    for entry, name, depth in tasks + extra_tasks:
+        key = graph.lookup(entry)
+        if key is None:
+            print("  %-12s %-24s not in the call graph" % (name, entry))
+            continue
+        try:
+            allocated = evaluate(depth, defines) * WORD
+        except (KeyError, ValueError, SyntaxError):
+            allocated = None
+        need, path = analysis.worst(key)
+        need += EXCEPTION_FRAME + TASK_CONTEXT
+        margin = "" if allocated is None else "%d" % (allocated - need)
+        flag = ""
+        if allocated is not None and allocated < need:
+            flag, failed = "  TOO SMALL", True
+        print("  %-12s %-24s %9s %9d %9s%s" % (name, entry, allocated or "?", need, margin, flag))
+        show_path(path)
+
+    print("\ninterrupt handlers (bytes, main stack):")
+    print("  %-36s %8s %9s" % ("handler", "priority", "needed"))
+    handlers = sorted(
+        k for k, f in graph.functions.items() if f.name.endswith("_IRQHandler") or f.name in CORE_HANDLERS
+    )
+    levels = {}
+    fault = 0
+    for key in handlers:
+        name = graph.functions[key].name
+        need, path = analysis.worst(key)
+        need += EXCEPTION_FRAME
+        if name in ("HardFault_Handler", "NMI_Handler"):
+            fault = max(fault, need)
+            priority = "fixed"
+        else:
+            level = priorities.get(name, 0)  # NVIC reset value: the highest level
+            levels[level] = max(levels.get(level, (0, "")), (need, name))
+            priority = "%d" % level
+        print("  %-36s %8s %9d" % (name, priority, need))
+        show_path(path)
+
+    nesting = sum(need for need, _ in levels.values()) + fault
+    chain = " + ".join("%s(%d)" % (name, need) for _, (need, name) in sorted(levels.items(), reverse=True))
+    print("\n  worst nesting: %d = %s + fault(%d)" % (nesting, chain or "-", fault))
+
+    main_key = graph.lookup("main")
+    main_need = analysis.worst(main_key)[0] if main_key else 0
+    total = main_need + nesting
+    reserved = min_stack_size(args.linker_script)
+    print("  main(): %d, main stack: %d" % (main_need, total), end="")
+    if reserved is not None:
+        print(" of %d reserved (_Min_Stack_Size), margin %d" % (reserved, reserved - total), end="")
+        if reserved < total:
+            print("  TOO SMALL", end="")
+            failed = True
+    print()
+
+    if analysis.issues:
+        print("\nnot covered, the figures above are a lower bound for paths through these:")
+        for key in sorted(analysis.issues):
+            print("  %-36s %s" % (key, ", ".join(sorted(analysis.issues[key]))))
+
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
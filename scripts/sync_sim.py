@@ -0,0 +1,357 @@
+#!/usr/bin/env python3
+"""Host simulation of several units on the sync link: time base lock and the spread of lockstep lamp-on instants.
+
+Usage: sync_sim.py <source dir> [--units N] [--hours H] [--interval S] [--lead MS] [--hsi-ppm PPM] [--wander-ppm PPM]
+                   [--trims N] [--trim-step-ppm PPM] [--level-switch-hz HZ] [--max-mask-us US] [--mask-prob P]
+                   [--loss P] [--seed N] [--budget-us US]
+
+e.g.   sync_sim.py . --units 4 --hours 2 --hsi-ppm 10000 --wander-ppm 2000
+       sync_sim.py . --units 3 --trims 2 --trim-step-ppm 3000
+
+nbtgTimer/src/syncclock.c is built for the host with the system C compiler and called through ctypes, so every slave
+runs the firmware's own estimator. Unit 0 is the master, the others are slaves. Each unit has its own time base: the
+1MHz TIM17 count of an HSI that is off by up to --hsi-ppm and wanders by up to --wander-ppm per hour. With --trims,
+the slaves' HSIs step by --trim-step-ppm at random times like the clock calibration trims them; a trim on the master
+isn't modelled, sync.c relies on its calibration having settled. Clock level switches
+(--level-switch-hz) lose the fraction of a microsecond the prescaler had counted and change the core clock the
+interrupt handlers run at.
+
+The link side is a port of the sync task (nbtgTimer/src/sync.c): the master broadcasts SYNC every SYNC_PERIOD_MS,
+timestamps its own echo and sends that time in a FOLLOW_UP; a slave pairs it with its own SYNC receive time, times
+out after SYNC_TIMEOUT_MS without a sample and starts over on a trim change, dropping an instant whose compare isn't
+loaded yet. Receive timestamps are taken in the link interrupt after the stop bit of
+the preamble has been sampled by the receiver's own baud clock. Every --interval seconds the master fires with
+--lead ms; FIRE goes out SYNC_FIRE_REPEATS times and every unit, the master included, switches the lamp on when its
+TIM17 compare matches, through the alarm interrupt and the start trigger. Frames are lost with probability --loss per
+receiver and interrupts are delayed by up to --max-mask-us with probability --mask-prob. keep the port in sync when
+sync.c changes.
+
+The spread of a fire is the true time from the first to the last lamp-on over the units that fired. Units that
+dropped the FIRE (unlocked, or too close to the instant) are counted as late. Constants are read from the sources.
+Exits with 1 if a spread exceeds --budget-us.
+"""
+
+import argparse
+import bisect
+import ctypes
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+
+PS_PER_US = 1000000
+PS_PER_MS = 1000000000
+PS_PER_S = 1000000000000
+
+ENTRY_CYCLES = 16  # Cortex-M0+ exception entry, zero wait-state flash
+TAIL_CHAIN_CYCLES = 6  # exception return straight into the next pending one
+LINK_ISR_CYCLES = 30  # USART2_IRQHandler up to rtosTimerGetValue()
+ALARM_ISR_CYCLES = 70  # TIM17_IRQHandler, fireAlarmCallback(), exposureIsArmed() and injectStartTrigger()
+TRIGGER_ISR_CYCLES = 140  # EXTI handler, handleStartTrigger(), holdoff check, triggerEnlargerTimer() up to CEN
+FOLLOW_UP_DELAY_US = 300  # echo interrupt to the FOLLOW_UP start bit: queue, task switch, sendFrame()
+FRAME_BYTES = 9  # SSyncFrame_t
+BIT_SAMPLES = 16  # USART oversampling, the start bit is found to 1/16 bit
+
+
+def read_defines(root):
+    """Collect the integer #defines of the firmware sources the models depend on."""
+    values = {}
+    for path in ("sys/bsp/inc/timer.h", "sys/bsp/inc/clock.h", "sys/bsp/src/board.c", "nbtgTimer/inc/sync.h",
+                 "nbtgTimer/src/sync.c", "nbtgTimer/inc/syncclock.h"):
+        with open(os.path.join(root, path)) as f:
+            for name, value in re.findall(r"^#define\s+(\w+)\s+(0x[0-9a-fA-F]+|\d+)\b", f.read(), re.M):
+                values[name] = int(value, 0)
+    return values
+
+
+def build(root, workdir, window):
+    """Compile syncclock.c into a shared library and declare the estimator functions."""
+    lib = os.path.join(workdir, "libsyncclock.so")
+    subprocess.run([os.environ.get("CC", "cc"), "-O2", "-shared", "-fPIC", "-I", os.path.join(root, "nbtgTimer/inc"),
+                    "-o", lib, os.path.join(root, "nbtgTimer/src/syncclock.c")], check=True)
+    syncclock = ctypes.CDLL(lib)
+
+    class SyncClock(ctypes.Structure):
+        _fields_ = [("masterUs", ctypes.c_uint32 * window), ("localUs", ctypes.c_uint32 * window),
+                    ("count", ctypes.c_uint8), ("next", ctypes.c_uint8), ("rejects", ctypes.c_uint8),
+                    ("refMasterUs", ctypes.c_uint32), ("refLocalUs", ctypes.c_uint32), ("rate", ctypes.c_int32),
+                    ("spreadUs", ctypes.c_uint32)]
+
+    ptr = ctypes.POINTER(SyncClock)
+    syncclock.syncClockInit.restype = None
+    syncclock.syncClockInit.argtypes = (ptr,)
+    syncclock.syncClockSample.restype = ctypes.c_bool
+    syncclock.syncClockSample.argtypes = (ptr, ctypes.c_uint32, ctypes.c_uint32)
+    syncclock.syncClockLocked.restype = ctypes.c_bool
+    syncclock.syncClockLocked.argtypes = (ptr,)
+    syncclock.syncClockToLocal.restype = ctypes.c_uint32
+    syncclock.syncClockToLocal.argtypes = (ptr, ctypes.c_uint32)
+    syncclock.syncClockPpm.restype = ctypes.c_int32
+    syncclock.syncClockPpm.argtypes = (ptr,)
+    return syncclock, SyncClock
+
+
+class TimeBase:
+    """TIM17 of one unit: piecewise-linear in true time, a segment per rate change or clock level switch."""
+
+    def __init__(self, rng, defs, args, end_ps, trims):
+        self.starts = [0]  # true time ps
+        self.counts = [rng.uniform(0, 1 << 32)]  # exact count, not wrapped
+        self.rates = [1 + rng.uniform(-args.hsi_ppm, args.hsi_ppm) / 1e6]  # counts per true us
+        self.active = [rng.random() < 0.5]  # clock level of the segment
+        self.core_hz = (defs["CLOCK_IDLE_HZ"], defs["CLOCK_ACTIVE_HZ"])
+
+        changes = []  # (true time, rate factor, level switch)
+        wander = rng.uniform(-args.wander_ppm, args.wander_ppm) / 1e6 / 3600  # per second
+        changes += [(s * PS_PER_S, 1 + wander, False) for s in range(1, int(end_ps // PS_PER_S) + 1)]
+        self.trims = sorted(rng.uniform(0, end_ps) for _ in range(trims))
+        changes += [(t, 1 + rng.choice((-1, 1)) * args.trim_step_ppm / 1e6, False) for t in self.trims]
+        if args.level_switch_hz > 0:
+            t = rng.expovariate(args.level_switch_hz) * PS_PER_S
+            while t < end_ps:
+                changes.append((t, 1, True))
+                t += rng.expovariate(args.level_switch_hz) * PS_PER_S
+
+        for t, factor, switch in sorted(changes):
+            count = self.exact(t)
+            self.starts.append(t)
+            self.counts.append(float(int(count)) if switch else count)  # the prescaler restarts from zero
+            self.rates.append(self.rates[-1] * factor)
+            self.active.append(not self.active[-1] if switch else self.active[-1])
+
+    def segment(self, t):
+        return bisect.bisect_right(self.starts, t) - 1
+
+    def exact(self, t):
+        i = self.segment(t)
+        return self.counts[i] + (t - self.starts[i]) / PS_PER_US * self.rates[i]
+
+    def value(self, t):
+        """Unwrapped TIM17 count at true time t."""
+        return int(self.exact(t))
+
+    def when(self, count):
+        """True time the unwrapped count is reached."""
+        i = max(bisect.bisect_right(self.counts, count) - 1, 0)
+        return self.starts[i] + (count - self.counts[i]) / self.rates[i] * PS_PER_US
+
+    def cycles_ps(self, t, cycles, active=False):
+        """Run time of handler cycles at the clock level of the moment, or at the active level if it's held."""
+        return cycles * PS_PER_S / self.core_hz[1 if active or self.active[self.segment(t)] else 0]
+
+
+class Unit:
+    def __init__(self, index, rng, defs, args, end_ps, syncclock, clock_type):
+        self.index = index
+        self.rng = rng
+        self.args = args
+        self.base = TimeBase(rng, defs, args, end_ps, args.trims if index > 0 else 0)
+        self.trims_seen = 0
+        self.lib = syncclock
+        self.clock = clock_type()
+        self.lib.syncClockInit(ctypes.byref(self.clock))
+        self.sync_rx = None  # (seq, local us) of the last SYNC
+        self.last_sample = None
+        self.samples = self.rejects = self.relocks = self.late = 0
+        self.locked_at = None
+
+    def mask_ps(self):
+        if self.rng.random() < self.args.mask_prob:
+            return self.rng.uniform(0, self.args.max_mask_us) * PS_PER_US
+        return 0
+
+    def receive(self, start_ps, baud):
+        """Timestamp of a frame whose start bit went out at start_ps, None if lost. 32-bit wrapped."""
+        if self.rng.random() < self.args.loss:
+            return None
+        bit_ps = PS_PER_S / (baud * self.base.rates[self.base.segment(start_ps)])  # own baud clock
+        t = start_ps + self.rng.uniform(0, bit_ps / BIT_SAMPLES) + 9.5 * bit_ps  # RXNE mid stop bit
+        t += self.mask_ps()
+        t += self.base.cycles_ps(t, ENTRY_CYCLES + LINK_ISR_CYCLES)
+        return self.base.value(t) & 0xFFFFFFFF
+
+    def sample(self, t, master_us, local_us):
+        was_locked = self.lib.syncClockLocked(ctypes.byref(self.clock))
+        if self.lib.syncClockSample(ctypes.byref(self.clock), master_us, local_us):
+            self.samples += 1
+            self.last_sample = t
+        else:
+            self.rejects += 1
+        locked = self.lib.syncClockLocked(ctypes.byref(self.clock))
+        if was_locked and not locked:
+            self.relocks += 1
+        if locked and self.locked_at is None:
+            self.locked_at = t
+
+    def check_timeout(self, t, timeout_ps):
+        if self.clock.count > 0 and self.last_sample is not None and t - self.last_sample >= timeout_ps:
+            self.lib.syncClockInit(ctypes.byref(self.clock))
+            self.last_sample = None
+
+    def check_trim(self, t):
+        """The sync task sees a trim change on its next pass, i.e. at the next frame."""
+        seen = bisect.bisect_right(self.base.trims, t)
+        if seen != self.trims_seen:
+            self.trims_seen = seen
+            if self.clock.count > 0:
+                self.lib.syncClockInit(ctypes.byref(self.clock))
+                self.relocks += 1
+
+    def trimmed_before(self, t_from, t_to):
+        """A trim after t_from that the task notices before t_to."""
+        i = bisect.bisect_right(self.base.trims, t_from)
+        return i < len(self.base.trims) and self.base.trims[i] < t_to
+
+    def fire(self, at_local):
+        """True lamp-on time for a TIM17 compare on the unwrapped local count."""
+        t = self.base.when(at_local)
+        t += self.mask_ps()
+        t += self.base.cycles_ps(t, ENTRY_CYCLES + ALARM_ISR_CYCLES + TAIL_CHAIN_CYCLES + TRIGGER_ISR_CYCLES, True)
+        return t
+
+    def unwrap(self, t, wrapped):
+        """Unwrapped count for a 32-bit time near true time t."""
+        now = self.base.value(t)
+        diff = (wrapped - now) & 0xFFFFFFFF
+        return now + (diff - (1 << 32) if diff & 0x80000000 else diff)
+
+
+def simulate(defs, args, syncclock, clock_type):
+    rng = random.Random(args.seed)
+    end_ps = int(args.hours * 3600 * PS_PER_S)
+    units = [Unit(i, rng, defs, args, end_ps, syncclock, clock_type) for i in range(args.units)]
+    master, slaves = units[0], units[1:]
+    baud = defs["SYNC_LINK_BAUDRATE"]
+    frame_ps = FRAME_BYTES * 10 * PS_PER_S / baud
+    timeout_ps = defs["SYNC_TIMEOUT_MS"] * PS_PER_MS
+    settle_ps = 2 * defs["SYNC_CLOCK_WINDOW"] * defs["SYNC_PERIOD_MS"] * PS_PER_MS
+
+    events = [(k * defs["SYNC_PERIOD_MS"] * PS_PER_MS, "sync") for k in range(1, end_ps // (
+        defs["SYNC_PERIOD_MS"] * PS_PER_MS))]
+    t = settle_ps
+    while t < end_ps:
+        events.append((t + rng.uniform(0, defs["SYNC_PERIOD_MS"] * PS_PER_MS), "fire"))
+        t += args.interval * PS_PER_S
+    events.sort()
+
+    spreads, errors = [], []  # per fire, per slave lamp-on against the master's
+    worst = None
+    seq = 0
+    for t, kind in events:
+        for s in slaves:
+            s.check_timeout(t, timeout_ps)
+            s.check_trim(t)
+
+        if kind == "sync":
+            seq = (seq + 1) & 0xFF
+            echo = master.receive(t, baud)
+            follow_ps = t + frame_ps + FOLLOW_UP_DELAY_US * PS_PER_US
+            for s in slaves:
+                rx = s.receive(t, baud)
+                s.sync_rx = (seq, rx) if rx is not None else None
+            if echo is None:
+                continue  # no FOLLOW_UP without the echo
+            for s in slaves:
+                if s.sync_rx is None or s.rng.random() < args.loss:
+                    continue
+                s.sample(follow_ps, echo, s.sync_rx[1])
+                s.sync_rx = None
+            continue
+
+        at_master = master.base.value(t) + args.lead * 1000  # rtosTimerGetValue() + lead
+        lamp_on = [master.fire(at_master)]
+        for s in slaves:
+            rx_local = None
+            for r in range(defs["SYNC_FIRE_REPEATS"]):
+                rx = s.receive(t + r * frame_ps, baud)
+                if rx is not None:
+                    rx_local = s.unwrap(t, rx)
+                    break
+            if rx_local is None:
+                s.late += 1  # both copies lost
+                continue
+            local = syncclock.syncClockToLocal(ctypes.byref(s.clock), at_master & 0xFFFFFFFF)
+            at_local = s.unwrap(t, local)
+            if not syncclock.syncClockLocked(ctypes.byref(s.clock)) or at_local - rx_local < defs[
+                    "TIME_BASE_ALARM_MIN_US"]:
+                s.late += 1
+                continue
+            load = s.base.when(at_local - defs["SYNC_ALARM_WINDOW_US"]) - defs["SYNC_PERIOD_MS"] * PS_PER_MS
+            if s.trimmed_before(t, load):
+                s.late += 1  # noticed before the compare was loaded
+                continue
+            on = s.fire(at_local)
+            lamp_on.append(on)
+            errors.append((on - lamp_on[0]) / PS_PER_US)
+
+        if len(lamp_on) > 1:
+            spread = (max(lamp_on) - min(lamp_on)) / PS_PER_US
+            spreads.append(spread)
+            if worst is None or spread > worst[0]:
+                worst = (spread, t)
+
+    return units, spreads, errors, worst
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("source", help="repository root")
+    parser.add_argument("--units", type=int, default=4, help="units on the link, the master included")
+    parser.add_argument("--hours", type=float, default=1.0)
+    parser.add_argument("--interval", type=float, default=10.0, help="seconds between fires")
+    parser.add_argument("--lead", type=int, default=None, help="fire lead in ms, default SYNC_FIRE_LEAD_MS")
+    parser.add_argument("--hsi-ppm", type=float, default=10000.0, help="largest HSI frequency error of a unit")
+    parser.add_argument("--wander-ppm", type=float, default=1000.0, help="largest HSI drift per hour")
+    parser.add_argument("--trims", type=int, default=0, help="HSITRIM steps per unit over the run")
+    parser.add_argument("--trim-step-ppm", type=float, default=3000.0)
+    parser.add_argument("--level-switch-hz", type=float, default=0.5, help="clock level switches per second")
+    parser.add_argument("--max-mask-us", type=float, default=20.0, help="longest interval interrupts are masked")
+    parser.add_argument("--mask-prob", type=float, default=0.05, help="chance an interrupt hits a masked interval")
+    parser.add_argument("--loss", type=float, default=0.01, help="chance a receiver loses a frame")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--budget-us", type=float, default=100.0, help="largest acceptable lamp-on spread")
+    args = parser.parse_args()
+
+    if args.units < 2:
+        parser.error("at least a master and a slave")
+
+    defs = read_defines(args.source)
+    if args.lead is None:
+        args.lead = defs["SYNC_FIRE_LEAD_MS"]
+    if not defs["SYNC_FIRE_MIN_LEAD_MS"] <= args.lead <= defs["SYNC_FIRE_MAX_LEAD_MS"]:
+        parser.error("lead out of the range syncFire() accepts")
+
+    with tempfile.TemporaryDirectory() as workdir:
+        syncclock, clock_type = build(args.source, workdir, defs["SYNC_CLOCK_WINDOW"])
+        units, spreads, errors, worst = simulate(defs, args, syncclock, clock_type)
+
+    print("%-5s %10s %10s %9s %8s %8s %7s %9s" % ("unit", "true ppm", "est ppm", "lock s", "samples", "rejects",
+                                                   "relocks", "late"))
+    for u in units:
+        if u.index == 0:
+            print("%-5s %10s %10s %9s %8s %8s %7s %9s" % ("0 m", "-", "-", "-", "-", "-", "-", "-"))
+            continue
+        true_ppm = (u.base.rates[-1] / units[0].base.rates[-1] - 1) * 1e6  # against the master, at the end
+        print("%-5d %10.0f %10d %9s %8d %8d %7d %9d"
+              % (u.index, true_ppm, syncclock.syncClockPpm(ctypes.byref(u.clock)),
+                 "%.2f" % (u.locked_at / PS_PER_S) if u.locked_at is not None else "never", u.samples, u.rejects,
+                 u.relocks, u.late))
+
+    if not spreads:
+        print("no fire reached two units")
+        sys.exit(1)
+
+    errors.sort(key=abs)
+    print("fires %d, lead %dms, spread max %.1fus mean %.1fus, slave error p99 %.1fus max %.1fus"
+          % (len(spreads), args.lead, max(spreads), sum(spreads) / len(spreads),
+             abs(errors[int(len(errors) * 0.99) - 1 if len(errors) > 1 else 0]), abs(errors[-1])))
+
+    if worst[0] > args.budget_us:
+        print("spread %.1fus at %.1fs over the %.0fus budget" % (worst[0], worst[1] / PS_PER_S, args.budget_us))
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
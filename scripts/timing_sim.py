@@ -0,0 +1,901 @@
+#!/usr/bin/env python3
+"""Virtual-time simulation of the lamp timing: TIM15 segments, the start trigger, clock levels, zero-cross switching and
+the TIM1 lamp channels.
+
+Usage: timing_sim.py <source dir> [--hours H] [--interval S] [--durations MS,MS,...] [--lead MS] [--hsi-ppm PPM]
+                     [--cal-ppm PPM] [--mains HZ] [--mains-ppm PPM] [--zero-cross] [--armed] [--render-hz HZ]
+                     [--render-us US] [--max-mask-us US] [--shorten PCT] [--channels]
+
+e.g.   timing_sim.py . --hours 4 --durations 800,12000,65536,200000 --hsi-ppm 3000 --cal-ppm 2990
+       timing_sim.py . --hours 4 --armed --render-hz 30
+       timing_sim.py . --hours 4 --zero-cross --mains 60
+       timing_sim.py . --hours 4 --shorten 40
+       timing_sim.py . --hours 4 --channels --render-hz 30
+
+A discrete-event scheduler with integer picosecond time runs register-level models of the hardware the lamp timing
+depends on. The firmware side is the firmware's own code where it can run on a host: sys/bsp/src/timer.c is built
+with the system C compiler against host copies of the TIM1/TIM15/TIM17/RCC registers and a stand-in for the CMSIS
+core, nbtgTimer/src/mains.c as it is, and both are called through ctypes. Register writes with side effects go through
+hooks: the update event (UG) latches PSC and ARR and restarts the prescaler, writes to SR clear flags (rc_w0), a
+counter write keeps the prescaler phase. The TIM15 model counts the core clock through the latched prescaler, chains
+segments through the ARR preload, stops in one-pulse mode and raises CC1 and update interrupts, which call
+TIM15_IRQHandler() after the exception entry and handler cycles given below.
+
+SYSCLK switches between the active and the idle level the way clock.c does: requests are counted and every switch
+runs the timer clock notifier, which rescales a loaded or counting TIM15. A lamp step holds the active level; an armed
+step waits at idle and the press freezes the level until the step has ended, so the requests of --render-hz display
+bursts (--render-us each) meanwhile only take effect after it. Idle time between events costs nothing, so a 4-hour session runs in seconds.
+
+--shorten ends every TIM15 exposure at PCT% of its on-time with shortenEnlargerTimer(), the way the integrated mode's
+ADC block ISR does. The call is placed, in turn, halfway to the new end, on the last tick before a segment boundary
+and between a boundary and its update interrupt, so ends in the counting segment, in a later one and a call with the
+boundary still pending are all exercised.
+
+--channels runs every exposure on the four TIM1 lamp outputs instead, the way exposureRunChannels() does: CH1 for the
+duration, CH2-CH4 for 3/4, 1/2 and 1/4 of it, capped so the corrected times fit LAMP_CHANNEL_MAX_MS. The TIM1 model
+latches PSC, ARR and the CCRs on UG, drives every output while the count is below its latched CCR and MOE is set, and
+stops on the update at the overflow, which calls TIM1_BRK_UP_TRG_COM_IRQHandler(). Each output must be on for exactly
+its corrected number of ticks, all from the same start, and the completion must come after the last one is off.
+
+Ports, because their files need FreeRTOS: clockCalCorrectMs() (clockcal.c), the zero-cross state machine of
+zeroCrossCallback()/runLampZeroCross() and the clock notifier of exposure.c, and the task flow between the steps.
+TIM3 is reduced to its 1MHz capture timestamp, restarted at every level switch. Not modelled at all: the TIM1 dimming
+PWM, TIM6 and the ADC (integrated mode), TIM14 (display framerate), TIM16 (LSE measurement), TIM17 beyond the time
+base read in the ISR hooks, the SPI2 display DMA, the I2C EEPROM (only the page writes of the journal are counted)
+and the USART console.
+
+Every lamp edge is checked: the lead ends on its CC1 match, a segmented exposure is exactly the corrected number of
+TIM15 ticks with no gap between segments, a zero-cross exposure spans exactly the quantised number of half-cycles. A
+level switch restarts the prescaler, so the edge after one may come up to one tick late; a switch during the lead
+only delays the lamp-on edge, the on-time stays exact. With --armed the exposures start from a footswitch press and
+the press to counter start latency is bounded from the handler path at the current level plus the longest interval
+interrupts may be masked (--max-mask-us, taskENTER_CRITICAL() masks the start trigger too on the M0+), and no level
+switch may come between the press and the lamp-off edge. The journal
+writes of the session give the EEPROM wear.
+
+Constants are read from the sources. Exits with 1 if a check fails.
+"""
+
+import argparse
+import bisect
+import ctypes
+import heapq
+import math
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+PS_PER_US = 1000000
+PS_PER_MS = 1000000000
+PS_PER_S = 1000000000000
+
+ENTRY_CYCLES = 16  # Cortex-M0+ exception entry, zero wait-state flash
+TIM15_ISR_CYCLES = 90  # TIM15_IRQHandler up to the optocoupler write
+TIM1_ISR_CYCLES = 60  # TIM1_BRK_UP_TRG_COM_IRQHandler up to the completion callback
+TRIGGER_ISR_CYCLES = 140  # EXTI handler, handleStartTrigger(), holdoff check, triggerEnlargerTimer() up to CEN
+ZERO_CROSS_ISR_CYCLES = 260  # EXTI4_15 handler, mainsEdge() and the state machine up to the optocoupler write
+TASK_START_US = 50  # exposure task: request or lamp-off notification to its next register write
+EEPROM_ENDURANCE = 1000000  # write cycles per page, 24C32 class
+
+# stands in for core_cm0plus.h: no NVIC, interrupts are masked by a flag
+HOST_CORE = """#include <stdint.h>
+#define __I     volatile const
+#define __O     volatile
+#define __IO    volatile
+#define __IM    volatile const
+#define __OM    volatile
+#define __IOM   volatile
+#define __STATIC_INLINE static inline
+extern uint32_t hostPrimask;
+static inline uint32_t __get_PRIMASK(void) { return hostPrimask; }
+static inline void __set_PRIMASK(uint32_t primask) { hostPrimask = primask; }
+static inline void __disable_irq(void) { hostPrimask = 1; }
+static inline void __enable_irq(void) { hostPrimask = 0; }
+static inline void NVIC_SetPriority(int irq, uint32_t priority) { (void)irq; (void)priority; }
+static inline void NVIC_EnableIRQ(int irq) { (void)irq; }
+"""
+
+# timer.c on host registers. UG, SR and CNT writes are forwarded to the model, see the docstring. TIM1 is mapped below
+# 2GB: the LL channel functions cast register addresses to uint32_t
+HOST_TIMER = """#define _GNU_SOURCE
+#include <sys/mman.h>
+#include "stm32g0xx.h"
+
+TIM_TypeDef hostTim15, hostTim17, *hostTim1;
+RCC_TypeDef hostRcc;
+
+#undef TIM1
+#undef TIM15
+#undef TIM17
+#undef RCC
+#define TIM1  (hostTim1)
+#define TIM15 (&hostTim15)
+#define TIM17 (&hostTim17)
+#define RCC   (&hostRcc)
+
+void (*hostUpdateEvent)(void);
+void (*hostCounterWrite)(uint32_t);
+void (*hostTim1UpdateEvent)(void);
+
+static void hostWriteReg(volatile uint32_t *pReg, uint32_t value)
+{
+    if ((pReg == &hostTim15.SR) || (pReg == &hostTim1->SR)) *pReg &= value;
+    else if ((pReg == &hostTim15.CNT) && hostCounterWrite) hostCounterWrite(value);
+    else *pReg = value;
+}
+
+static void hostGenerateUpdate(TIM_TypeDef *pTimer)
+{
+    if ((pTimer == &hostTim15) && hostUpdateEvent) hostUpdateEvent();
+    if ((pTimer == hostTim1) && hostTim1UpdateEvent) hostTim1UpdateEvent();
+}
+
+#undef WRITE_REG
+#define WRITE_REG(REG, VAL) hostWriteReg(&(REG), (VAL))
+#define LL_TIM_GenerateEvent_UPDATE LL_TIM_GenerateEvent_UPDATE_unused
+#include <stm32g0xx_ll_tim.h>
+#undef LL_TIM_GenerateEvent_UPDATE
+#define LL_TIM_GenerateEvent_UPDATE(t) hostGenerateUpdate(t)
+
+uint32_t hostPrimask;
+uint32_t SystemCoreClock;
+
+#include "clock.h"
+
+static fnClockNotifier g_hostNotifiers[4];
+static int             g_hostNumNotifiers;
+
+bool clockRegisterNotifier(fnClockNotifier fnCb, void *pUserCtx)
+{
+    g_hostNotifiers[g_hostNumNotifiers++] = fnCb;
+    return true;
+}
+
+#include "timer.c"
+
+volatile uint32_t *const hostTim15Regs[] = { &hostTim15.CR1, &hostTim15.DIER, &hostTim15.SR, &hostTim15.CNT,
+                                             &hostTim15.PSC, &hostTim15.ARR, &hostTim15.CCR1 };
+const uint32_t hostTim15Bits[] = { TIM_CR1_CEN, TIM_CR1_URS, TIM_CR1_OPM, TIM_CR1_ARPE, TIM_DIER_UIE,
+                                   TIM_DIER_CC1IE, TIM_SR_UIF, TIM_SR_CC1IF };
+volatile uint32_t *hostTim1Regs[10];
+const uint32_t hostTim1Bits[] = { TIM_CR1_CEN, TIM_CR1_OPM, TIM_DIER_UIE, TIM_SR_UIF, TIM_BDTR_MOE };
+
+__attribute__((constructor)) static void hostMapTim1(void)
+{
+    hostTim1 = mmap(NULL, sizeof(TIM_TypeDef), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+
+    volatile uint32_t *regs[] = { &hostTim1->CR1, &hostTim1->DIER, &hostTim1->SR, &hostTim1->BDTR, &hostTim1->PSC,
+                                  &hostTim1->ARR, &hostTim1->CCR1, &hostTim1->CCR2, &hostTim1->CCR3, &hostTim1->CCR4 };
+    for (int i = 0; i < 10; i++) hostTim1Regs[i] = regs[i];
+}
+
+void hostInit(uint32_t coreHz, fnTimCallback fnLampOn, fnTimCallback fnLampOff)
+{
+    static const STimerDef_t enlarger = { TIMER_ENLARGER_LAMP_ENABLE, TIM15, 1000 };
+
+    SystemCoreClock = coreHz;
+    initRtosTimer();
+    initTimer(&enlarger);
+    registerTimerCallback(TIMER_ENLARGER_LAMP_ON, fnLampOn, NULL);
+    registerTimerCallback(TIMER_ENLARGER_LAMP_ENABLE, fnLampOff, NULL);
+}
+
+void hostInitChannels(fnTimCallback fnDone)
+{
+    STimerDef_t channels = { TIMER_LAMP_CHANNELS, TIM1, 1000 };
+
+    initTimer(&channels);
+    registerTimerCallback(TIMER_LAMP_CHANNELS, fnDone, NULL);
+}
+
+void hostSwitchLevel(uint32_t coreHz)
+{
+    SystemCoreClock = coreHz;
+    hostPrimask     = 1;
+    for (int i = 0; i < g_hostNumNotifiers; i++) g_hostNotifiers[i](coreHz, NULL);
+    hostPrimask = 0;
+}
+"""
+
+REGS = ("CR1", "DIER", "SR", "CNT", "PSC", "ARR", "CCR1")
+BITS = ("CEN", "URS", "OPM", "ARPE", "UIE", "CC1IE", "UIF", "CC1IF")
+TIM1_REGS = ("CR1", "DIER", "SR", "BDTR", "PSC", "ARR", "CCR1", "CCR2", "CCR3", "CCR4")
+TIM1_BITS = ("CEN", "OPM", "UIE", "UIF", "MOE")
+CALLBACK = ctypes.CFUNCTYPE(None, ctypes.c_void_p)
+
+
+class MainsTracker(ctypes.Structure):
+    _fields_ = [("halfCycleUs", ctypes.c_uint32), ("lastCapture", ctypes.c_uint16), ("goodEdges", ctypes.c_uint8),
+                ("hasEdge", ctypes.c_bool), ("sumUs", ctypes.c_uint32), ("sumHalfCycles", ctypes.c_uint32)]
+
+
+def read_defines(root):
+    """Collect the integer #defines of the firmware sources the models depend on."""
+    values = {}
+    for path in ("sys/bsp/inc/timer.h", "sys/bsp/src/timer.c", "sys/bsp/inc/clock.h", "sys/bsp/inc/eeprom.h",
+                 "nbtgTimer/inc/exposure.h", "nbtgTimer/src/exposure.c", "nbtgTimer/inc/mains.h",
+                 "nbtgTimer/src/mains.c", "nbtgTimer/inc/journal.h"):
+        with open(os.path.join(root, path)) as f:
+            for name, value in re.findall(r"^#define\s+(\w+)\s+(0x[0-9a-fA-F]+|\d+)\b", f.read(), re.M):
+                values[name] = int(value, 0)
+    return values
+
+
+def build(root, workdir):
+    """Compile timer.c on host registers together with mains.c and declare the functions the simulation calls."""
+    lib = os.path.join(workdir, "libtiming.so")
+    shim = os.path.join(workdir, "shim")
+    os.makedirs(shim)
+    with open(os.path.join(shim, "core_cm0plus.h"), "w") as f:
+        f.write(HOST_CORE)
+    with open(os.path.join(workdir, "host_timer.c"), "w") as f:
+        f.write(HOST_TIMER)
+    includes = ["sys/stm32g0xx_sys/CMSIS/Device", "sys/stm32g0xx_hal_driver/Inc", "sys/bsp/inc", "sys/bsp/src",
+                "nbtgTimer/inc"]
+    subprocess.run([os.environ.get("CC", "cc"), "-O2", "-shared", "-fPIC", "-w", "-DSTM32G070xx",
+                    "-DUSE_FULL_LL_DRIVER", "-I" + shim] + ["-I" + os.path.join(root, i) for i in includes]
+                   + ["-o", lib, os.path.join(workdir, "host_timer.c"), os.path.join(root, "nbtgTimer/src/mains.c")],
+                   check=True)
+    timing = ctypes.CDLL(lib)
+
+    u32 = ctypes.c_uint32
+    tracker = ctypes.POINTER(MainsTracker)
+    for name, restype, argtypes in (("hostInit", None, (u32, CALLBACK, CALLBACK)),
+                                    ("hostSwitchLevel", None, (u32,)),
+                                    ("hostInitChannels", None, (CALLBACK,)),
+                                    ("armLampChannels", ctypes.c_bool, (ctypes.POINTER(u32), ctypes.c_uint8)),
+                                    ("startLampChannels", None, ()),
+                                    ("TIM1_BRK_UP_TRG_COM_IRQHandler", None, ()),
+                                    ("startEnlargerTimer", None, (u32, u32)),
+                                    ("armEnlargerTimer", None, (u32, u32)),
+                                    ("triggerEnlargerTimer", None, ()),
+                                    ("shortenEnlargerTimer", None, (u32,)),
+                                    ("TIM15_IRQHandler", None, ()),
+                                    ("mainsInit", None, (tracker,)),
+                                    ("mainsEdge", ctypes.c_uint8, (tracker, ctypes.c_uint16)),
+                                    ("mainsLocked", ctypes.c_bool, (tracker,)),
+                                    ("mainsQuantise", u32, (u32, u32, ctypes.c_void_p))):
+        getattr(timing, name).restype = restype
+        getattr(timing, name).argtypes = argtypes
+    return timing
+
+
+class Scheduler:
+    """Events in time order; time jumps straight to the next one."""
+
+    def __init__(self):
+        self.now = 0
+        self.queue = []
+        self.seq = 0
+
+    def at(self, time, fn, *args):
+        self.seq += 1
+        heapq.heappush(self.queue, (time, self.seq, fn, args))
+
+    def run(self, until):
+        while self.queue and self.queue[0][0] <= until:
+            self.now, _, fn, args = heapq.heappop(self.queue)
+            fn(*args)
+        self.now = until
+
+
+class Tim15:
+    """TIM15 at register level, behind the host copy of its registers that timer.c writes.
+
+    The count is kept as (count, time of the next increment), the increments follow every tick of the latched
+    prescaler. Every call into the firmware goes through call(): CNT is brought up to date before, the state written
+    by the firmware is picked up after.
+    """
+
+    def __init__(self, sched, lib, cycle_ps):
+        self.sched = sched
+        self.lib = lib
+        self.cycle = cycle_ps
+        regs = (ctypes.POINTER(ctypes.c_uint32) * len(REGS)).in_dll(lib, "hostTim15Regs")
+        self.reg = {name: regs[i] for i, name in enumerate(REGS)}
+        bits = (ctypes.c_uint32 * len(BITS)).in_dll(lib, "hostTim15Bits")
+        self.bit = {name: bits[i] for i, name in enumerate(BITS)}
+        self.running = False
+        self.count = 0
+        self.next_inc = 0
+        self.psc = 0
+        self.arr = 0
+        self.gen = 0  # cancels the events of an outdated schedule
+        self.updates = 0
+        self.irq = None
+        self.faults = []
+        # keep the ctypes thunks alive
+        self.hooks = (ctypes.CFUNCTYPE(None)(self.update_event),
+                      ctypes.CFUNCTYPE(None, ctypes.c_uint32)(self.cnt_write))
+        ctypes.c_void_p.in_dll(lib, "hostUpdateEvent").value = ctypes.cast(self.hooks[0], ctypes.c_void_p).value
+        ctypes.c_void_p.in_dll(lib, "hostCounterWrite").value = ctypes.cast(self.hooks[1], ctypes.c_void_p).value
+
+    def get(self, name):
+        return self.reg[name][0]
+
+    def put(self, name, value):
+        self.reg[name][0] = value
+
+    def has(self, name, bit):
+        return (self.get(name) & self.bit[bit]) != 0
+
+    def tick(self):
+        return round((self.psc + 1) * self.cycle)
+
+    def advance(self):
+        """Bring count and next_inc up to now."""
+        now = self.sched.now
+        if self.running and now >= self.next_inc:
+            incs = (now - self.next_inc) // self.tick() + 1
+            self.count += incs
+            self.next_inc += incs * self.tick()
+
+    def call(self, fn, *args):
+        self.advance()
+        self.put("CNT", self.count)
+        fn(*args)
+        self.sync()
+
+    def sync(self):
+        cen = self.has("CR1", "CEN")
+        if not self.has("CR1", "ARPE"):
+            self.arr = self.get("ARR")
+        if cen and not self.running:
+            self.running = True
+            self.count = self.get("CNT")
+            self.next_inc = self.sched.now + self.tick()
+        elif self.running and not cen:
+            self.running = False
+        self.schedule()
+
+    def update_event(self):
+        """UG: latch PSC and ARR, restart prescaler and counter."""
+        self.psc = self.get("PSC")
+        self.arr = self.get("ARR")
+        self.count = 0
+        self.next_inc = self.sched.now + self.tick()
+        self.put("CNT", 0)
+        if not self.has("CR1", "URS"):
+            self.put("SR", self.get("SR") | self.bit["UIF"])
+        if self.running and self.has("CR1", "OPM"):
+            self.faults.append("%d ps: UG in one-pulse mode while counting" % self.sched.now)
+            self.put("CR1", self.get("CR1") & ~self.bit["CEN"])
+
+    def cnt_write(self, value):
+        """A counter write leaves the prescaler phase alone."""
+        self.advance()
+        self.count = value
+        self.put("CNT", value)
+
+    def switch_clock(self, cycle_ps):
+        """SYSCLK changed: the prescaler cycles left in the current tick run at the new rate."""
+        self.advance()
+        if self.running:
+            cycles_left = math.ceil((self.next_inc - self.sched.now) / self.cycle)
+            self.next_inc = self.sched.now + round(cycles_left * cycle_ps)
+        self.cycle = cycle_ps
+        self.schedule()
+
+    def schedule(self):
+        self.gen += 1
+        if not self.running:
+            return
+        if self.count > self.arr:
+            self.faults.append("%d ps: counter %d past ARR %d" % (self.sched.now, self.count, self.arr))
+            return
+        self.sched.at(self.next_inc + (self.arr - self.count) * self.tick(), self.overflow, self.gen)
+        ccr1 = self.get("CCR1")
+        if self.count < ccr1 <= self.arr:
+            self.sched.at(self.next_inc + (ccr1 - self.count - 1) * self.tick(), self.compare, self.gen)
+
+    def compare(self, gen):
+        if gen != self.gen:
+            return
+        self.put("SR", self.get("SR") | self.bit["CC1IF"])
+        if self.has("DIER", "CC1IE"):
+            self.irq()
+
+    def overflow(self, gen):
+        if gen != self.gen:
+            return
+        self.updates += 1
+        self.psc = self.get("PSC")
+        self.arr = self.get("ARR")
+        self.count = 0
+        self.next_inc = self.sched.now + self.tick()
+        self.put("CNT", 0)
+        self.put("SR", self.get("SR") | self.bit["UIF"])
+        if self.has("CR1", "OPM"):
+            self.running = False
+            self.put("CR1", self.get("CR1") & ~self.bit["CEN"])
+        self.schedule()
+        if self.has("DIER", "UIE"):
+            self.irq()
+
+
+class Tim1:
+    """TIM1 in one-pulse mode with its four PWM1 lamp outputs, behind the host copy of its registers.
+
+    UG latches PSC, ARR and the CCRs and restarts the prescaler. Once CEN is set the counter runs from 0 to the latched
+    ARR; every output is active from the start until the count reaches its latched CCR, if MOE is set. The update at
+    the overflow latches the preloads again, stops the counter and raises the update interrupt.
+    """
+
+    def __init__(self, sched, lib, cycle_ps):
+        self.sched = sched
+        self.cycle = cycle_ps
+        regs = (ctypes.POINTER(ctypes.c_uint32) * len(TIM1_REGS)).in_dll(lib, "hostTim1Regs")
+        self.reg = {name: regs[i] for i, name in enumerate(TIM1_REGS)}
+        bits = (ctypes.c_uint32 * len(TIM1_BITS)).in_dll(lib, "hostTim1Bits")
+        self.bit = {name: bits[i] for i, name in enumerate(TIM1_BITS)}
+        self.running = False
+        self.psc = 0
+        self.arr = 0
+        self.ccr = [0, 0, 0, 0]
+        self.outputs = []  # (on ps, off ps) per channel of the last start, None for an output left off
+        self.start_tick = 0  # tick of the last start
+        self.gen = 0
+        self.irq = None
+        self.faults = []
+        self.hook = ctypes.CFUNCTYPE(None)(self.update_event)
+        ctypes.c_void_p.in_dll(lib, "hostTim1UpdateEvent").value = ctypes.cast(self.hook, ctypes.c_void_p).value
+
+    def get(self, name):
+        return self.reg[name][0]
+
+    def has(self, name, bit):
+        return (self.get(name) & self.bit[bit]) != 0
+
+    def tick(self):
+        return round((self.psc + 1) * self.cycle)
+
+    def latch(self):
+        self.psc = self.get("PSC")
+        self.arr = self.get("ARR")
+        self.ccr = [self.get("CCR%d" % (i + 1)) for i in range(4)]
+
+    def update_event(self):
+        """UG: the update source is the counter only, so no UIF."""
+        if self.running:
+            self.faults.append("%d ps: UG while the lamp channels count" % self.sched.now)
+        self.latch()
+
+    def call(self, fn, *args):
+        result = fn(*args)
+        self.sync()
+        return result
+
+    def sync(self):
+        cen = self.has("CR1", "CEN")
+        if cen and not self.running:
+            self.running = True
+            now = self.sched.now
+            moe = self.has("BDTR", "MOE")
+            self.start_tick = self.tick()
+            # a CCR past ARR keeps its output on until the update latches the parked zero
+            self.outputs = [(now, now + min(ccr, self.arr + 1) * self.tick()) if (moe and ccr) else None
+                            for ccr in self.ccr]
+            self.gen += 1
+            self.sched.at(now + (self.arr + 1) * self.tick(), self.overflow, self.gen)
+        elif self.running and not cen:
+            self.running = False
+            self.gen += 1
+            self.outputs = [o and (o[0], min(o[1], self.sched.now)) for o in self.outputs]
+
+    def switch_clock(self, cycle_ps):
+        if self.running:
+            self.faults.append("%d ps: clock level switch while the lamp channels count" % self.sched.now)
+        self.cycle = cycle_ps
+
+    def overflow(self, gen):
+        if gen != self.gen:
+            return
+        self.latch()
+        self.running = False
+        self.reg["CR1"][0] = self.get("CR1") & ~self.bit["CEN"]
+        self.reg["SR"][0] = self.get("SR") | self.bit["UIF"]
+        if self.has("DIER", "UIE"):
+            self.irq()
+
+
+class Firmware:
+    """Drives timer.c and mains.c like the exposure task and its ISRs do. Lamp edges are recorded with their true
+    times and the latency of the handler that switched them."""
+
+    def __init__(self, sched, defs, args, lib):
+        self.sched = sched
+        self.defs = defs
+        self.args = args
+        self.lib = lib
+        self.levels = {"active": defs["CLOCK_ACTIVE_HZ"], "idle": defs["CLOCK_IDLE_HZ"]}
+        self.level = "active"
+        self.requests = 1  # initClock() counts as the first request
+        self.holds = 0
+        self.held = False  # exposure.c g_levelHeld
+        self.switches = []  # times of level switches
+        self.tim = Tim15(sched, lib, self.cycle_ps("active"))
+        self.tim.irq = self.tim15_irq
+        self.tim1 = Tim1(sched, lib, self.cycle_ps("active"))
+        self.tim1.irq = self.tim1_irq
+        self.lamp = False
+        self.edges = []  # (time ps, on, handler latency ps)
+        self.edge_latency = 0
+        self.done = None
+        self.mains = MainsTracker()
+        self.capture_epoch = 0  # TIM3 restarts at every level switch
+        self.zc_state = "idle"
+        self.zc_left = 0
+        self.zc_half_cycles = 0
+        self.callbacks = (CALLBACK(self.lamp_on), CALLBACK(self.lamp_off), CALLBACK(self.channels_done))
+        lib.mainsInit(ctypes.byref(self.mains))
+        self.tim.call(lib.hostInit, self.levels["active"], *self.callbacks[:2])
+        self.tim1.call(lib.hostInitChannels, self.callbacks[2])
+        self.release()
+
+    def cycle_ps(self, level):
+        return PS_PER_S / (self.levels[level] * (1 + self.args.hsi_ppm / 1e6))
+
+    def cycles(self, n):
+        return round(n * self.cycle_ps(self.level))
+
+    def latency(self):
+        return self.cycles(ENTRY_CYCLES + TIM15_ISR_CYCLES)
+
+    # clock.c: the level follows the request count
+
+    def request(self):
+        self.requests += 1
+        if self.requests == 1 and not self.holds:
+            self.switch("active")
+
+    def release(self):
+        self.requests -= 1
+        if self.requests == 0 and not self.holds:
+            self.switch("idle")
+
+    def hold_level(self):
+        self.holds += 1
+
+    def release_level(self):
+        self.holds -= 1
+        level = "active" if self.requests else "idle"
+        if not self.holds and level != self.level:
+            self.switch(level)
+
+    def switch(self, level):
+        self.level = level
+        self.switches.append(self.sched.now)
+        self.tim.switch_clock(self.cycle_ps(level))
+        self.tim1.switch_clock(self.cycle_ps(level))
+        self.tim.call(self.lib.hostSwitchLevel, self.levels[level])
+        # exposure.c clockChangedCallback(): TIM3 restarted, the last edge timestamp is stale
+        self.capture_epoch = self.sched.now
+        self.mains.hasEdge = False
+
+    def render_burst(self, period_ps, end_ps):
+        self.request()
+        self.sched.at(self.sched.now + self.args.render_us * PS_PER_US, self.release)
+        if self.sched.now + period_ps < end_ps:
+            self.sched.at(self.sched.now + period_ps, self.render_burst, period_ps, end_ps)
+
+    # timer.c callbacks
+
+    def tim15_irq(self):
+        # the handler reaches the optocoupler write after the entry and its own cycles
+        self.sched.at(self.sched.now + self.latency(), self.tim15_handler, self.latency())
+
+    def tim15_handler(self, latency):
+        self.edge_latency = latency
+        self.tim.call(self.lib.TIM15_IRQHandler)
+
+    def tim1_irq(self):
+        latency = self.cycles(ENTRY_CYCLES + TIM1_ISR_CYCLES)
+        self.sched.at(self.sched.now + latency, self.tim1_handler, latency)
+
+    def tim1_handler(self, latency):
+        self.edge_latency = latency
+        self.tim1.call(self.lib.TIM1_BRK_UP_TRG_COM_IRQHandler)
+
+    def channels_done(self, ctx):
+        """exposure.c channelsDoneCallback(): the completion, the outputs are already off."""
+        self.lamp_edge(False)
+        self.sched.at(self.sched.now + TASK_START_US * PS_PER_US, self.lamp_done)
+
+    def lamp_on(self, ctx):
+        self.lamp_edge(True)
+
+    def lamp_off(self, ctx):
+        self.lamp_edge(False)
+        self.sched.at(self.sched.now + TASK_START_US * PS_PER_US, self.lamp_done)
+
+    def lamp_edge(self, on):
+        self.lamp = on
+        self.edges.append((self.sched.now, on, self.edge_latency))
+
+    def lamp_done(self):
+        if self.held:
+            self.held = False  # runArmed(): releaseLevelHold()
+            self.release_level()
+        else:
+            self.release()
+        self.done()
+
+    # exposure.c
+
+    def correct_ms(self, ms):
+        ppm = self.args.cal_ppm
+        return (ms * (1000000 + ppm) + 500000) // 1000000  # clockCalCorrectMs()
+
+    def run_lamp(self, duration_ms):
+        """runLamp(): holds the active level until the lamp-off edge has been handled."""
+        self.request()
+        lead_ms = self.args.lead
+        if self.args.zero_cross and self.lib.mainsLocked(ctypes.byref(self.mains)):
+            half = self.mains.halfCycleUs
+            self.zc_half_cycles = self.lib.mainsQuantise(duration_ms, half, None)
+            self.zc_left = max(1, (lead_ms * 1000 + half - 1) // half)
+            self.zc_state = "lead"
+            return ("zc", self.zc_half_cycles)
+        corrected = self.correct_ms(duration_ms)
+        self.edge_latency = 0
+        self.tim.call(self.lib.startEnlargerTimer, corrected, lead_ms)
+        return ("tim15", corrected, lead_ms)
+
+    def run_channels(self, durations_ms):
+        """runChannels(): holds the active level, the lead is a task delay, the update handler reports the end."""
+        self.request()
+        corrected = [self.correct_ms(ms) for ms in durations_ms]
+        if not self.tim1.call(self.lib.armLampChannels, (ctypes.c_uint32 * len(corrected))(*corrected),
+                              len(corrected)):
+            self.tim1.faults.append("%d ps: armLampChannels() refused %s" % (self.sched.now, corrected))
+        self.sched.at(self.sched.now + self.args.lead * PS_PER_MS, self.start_channels)
+        return ("tim1", corrected, durations_ms[0])
+
+    def start_channels(self):
+        self.edge_latency = 0
+        self.lamp_edge(True)  # lampEdge(true) right before startLampChannels()
+        self.tim1.call(self.lib.startLampChannels)
+
+    def arm(self, duration_ms):
+        """armTimer(): loads the step at whatever level is current."""
+        corrected = self.correct_ms(duration_ms)
+        self.tim.call(self.lib.armEnlargerTimer, corrected, self.args.lead)
+        return ("tim15", corrected, self.args.lead)
+
+    def trigger(self):
+        """startTriggerCallback(): freezes the level before the counter starts, runArmed() releases it."""
+        self.hold_level()
+        self.held = True
+        self.edge_latency = 0  # without a lead the lamp goes on in the trigger handler
+        self.tim.call(self.lib.triggerEnlargerTimer)
+
+    def zero_cross(self, capture):
+        halves = self.lib.mainsEdge(ctypes.byref(self.mains), capture)
+        if halves == 0 or self.zc_state == "idle":
+            return
+        self.zc_left = 0 if halves >= self.zc_left else self.zc_left - halves
+        if self.zc_left:
+            return
+        self.edge_latency = self.cycles(ENTRY_CYCLES + ZERO_CROSS_ISR_CYCLES)
+        if self.zc_state == "lead":
+            self.lamp_edge(True)
+            self.zc_left = self.zc_half_cycles
+            self.zc_state = "on"
+        else:
+            self.lamp_edge(False)
+            self.zc_state = "idle"
+            self.sched.at(self.sched.now + TASK_START_US * PS_PER_US, self.lamp_done)
+
+
+class Mains:
+    """Zero-cross detector pulses at every true crossing, timestamped by the 1MHz TIM3 capture on the HSI clock."""
+
+    def __init__(self, sched, fw, hz, ppm, hsi_ppm):
+        self.sched = sched
+        self.fw = fw
+        self.half_ps = round(PS_PER_S / (2 * hz * (1 + ppm / 1e6)))
+        self.capture_ps = PS_PER_US / (1 + hsi_ppm / 1e6)  # TIM3 tick on the real HSI
+        self.crossings = []
+        sched.at(self.half_ps, self.crossing)
+
+    def crossing(self):
+        now = self.sched.now
+        self.crossings.append(now)
+        capture = int((now - self.fw.capture_epoch) / self.capture_ps) & 0xFFFF
+        latency = self.fw.cycles(ENTRY_CYCLES + ZERO_CROSS_ISR_CYCLES)
+        self.sched.at(now + latency, self.fw.zero_cross, capture)
+        self.sched.at(now + self.half_ps, self.crossing)
+
+
+def simulate(defs, args, lib):
+    sched = Scheduler()
+    fw = Firmware(sched, defs, args, lib)
+    mains = Mains(sched, fw, args.mains, args.mains_ppm, args.hsi_ppm) if args.zero_cross else None
+    durations = [int(d) for d in args.durations.split(",")]
+    end = int(args.hours * 3600 * PS_PER_S)
+    failures = []
+    results = []
+    latencies = []
+    state = {"index": 0, "request": None, "start": 0, "shorten": None}
+    tick = round(defs["CLOCK_ACTIVE_HZ"] // 1000 * fw.cycle_ps("active"))  # __LL_TIM_CALC_PSC(), 1kHz
+    segment = defs["ENLARGER_MAX_SEGMENT_MS"]
+
+    def check(request, start):
+        (on, _, on_latency), (off, _, off_latency) = fw.edges[-2], fw.edges[-1]
+        shortened, state["shorten"] = state["shorten"], None
+        if request[0] == "tim1":
+            _, corrected, nominal = request
+            outputs, tick1 = fw.tim1.outputs, fw.tim1.start_tick
+            for channel, (ms, output) in enumerate(zip(corrected, outputs)):
+                if (output is None) != (ms == 0) or (output and not
+                                                     ms * (tick1 - 1) <= output[1] - output[0] <= ms * (tick1 + 1)):
+                    failures.append("exposure %d: CH%d on %s, expected %d ticks of %d ps" % (
+                        len(results), channel + 1, output and output[1] - output[0], ms, tick1))
+            if off - off_latency < max(o[1] for o in outputs if o):
+                failures.append("exposure %d: completion before the last output was off" % len(results))
+            results.append((nominal, max(o[1] - o[0] for o in outputs if o)))
+            return
+        if request[0] == "tim15":
+            _, corrected, lead = request
+            if args.armed and bisect.bisect_right(fw.switches, off) != bisect.bisect_right(fw.switches, start):
+                failures.append("exposure %d: level switch while the armed step counted" % len(results))
+            # a level switch restarts the prescaler: every one before an edge may delay it by up to a tick
+            slip_on = (bisect.bisect_right(fw.switches, on) - bisect.bisect_right(fw.switches, start)) * tick
+            slip_off = (bisect.bisect_right(fw.switches, off) - bisect.bisect_right(fw.switches, on)) * tick
+            on_event, off_event = on - on_latency, off - off_latency
+            expect_on = start + lead * tick
+            # the tick is rounded to the ps at each level, allow 1ps per tick
+            if not expect_on - lead <= on_event <= expect_on + slip_on + lead:
+                failures.append("exposure %d: lamp-on %d ps after the start, expected %d" % (
+                    len(results), on_event - start, expect_on - start))
+            if shortened:
+                # the call lands somewhere in a tick, so the end comes remaining to remaining + 1 ticks later
+                call, remaining = shortened
+                slip = (bisect.bisect_right(fw.switches, off) - bisect.bisect_right(fw.switches, call)) * tick
+                if not call + remaining * (tick - 1) <= off_event <= call + (remaining + 1) * (tick + 1) + slip:
+                    failures.append("exposure %d: shortened to %d ms, lamp-off %d ps after the call" % (
+                        len(results), remaining, off_event - call))
+                results.append(((call + remaining * tick - on_event) / tick, off - on))
+                return
+            if not corrected * (tick - 1) <= off_event - on_event <= corrected * (tick + 1) + slip_off:
+                failures.append("exposure %d: on for %d ps, expected %d" % (len(results), off_event - on_event,
+                                                                            corrected * tick))
+        else:
+            half_cycles = request[1]
+            crossings = mains.crossings
+            spanned = bisect.bisect_left(crossings, off - off_latency) - bisect.bisect_left(crossings, on - on_latency)
+            if spanned != half_cycles:
+                failures.append("exposure %d: %d half-cycles, expected %d" % (len(results), spanned, half_cycles))
+        duration = durations[(state["index"] - 1) % len(durations)]
+        results.append((duration, off - on))
+
+    def finished():
+        check(state["request"], state["start"])
+        next_start = max(sched.now + PS_PER_MS, state["start"] + int(args.interval * PS_PER_S))
+        if next_start >= end:
+            return
+        if args.armed:
+            arm(next_start)  # the task reloads the armed step as soon as the run has ended
+        else:
+            sched.at(next_start, start_exposure)
+
+    def shorten(remaining):
+        state["shorten"] = (sched.now, remaining)
+        fw.tim.call(fw.lib.shortenEnlargerTimer, remaining)
+
+    def plan_shorten(request, start):
+        """Pick the call and the remaining time for --shorten, like integrateBlockCallback() would pass it."""
+        if not args.shorten or request[0] != "tim15":
+            return
+        _, corrected, lead = request
+        on = start + lead * tick
+        target = on + corrected * args.shorten // 100 * tick
+        calls = (on + (target - on) // 2,
+                 start + segment * tick - tick // 2,  # counter on the last tick of the first segment
+                 start + segment * tick + fw.latency() // 2)  # boundary passed, its update interrupt not yet in
+        call = calls[state["index"] % len(calls)]
+        if not on < call < target - 2 * tick:
+            call = calls[0]
+        if call < target - 2 * tick:
+            sched.at(call, shorten, (target - call) // tick)
+
+    def press():
+        # the trigger handler runs at the level of the moment, the counter starts at its end
+        latency = fw.cycles(ENTRY_CYCLES + TRIGGER_ISR_CYCLES)
+        latencies.append(latency)
+        sched.now += latency
+        state["start"] = sched.now
+        fw.trigger()
+        plan_shorten(state["request"], state["start"])
+
+    def arm(press_at):
+        duration = durations[state["index"] % len(durations)]
+        state["index"] += 1
+        state["request"] = fw.arm(duration)
+        sched.at(press_at, press)
+
+    def start_exposure():
+        duration = durations[state["index"] % len(durations)]
+        state["index"] += 1
+        sched.now += TASK_START_US * PS_PER_US
+        state["start"] = sched.now
+        if args.channels:
+            limit = min(duration, defs["LAMP_CHANNEL_MAX_MS"] * 1000000 // (1000000 + max(args.cal_ppm, 0)))
+            state["request"] = fw.run_channels([limit * k // 4 for k in (4, 3, 2, 1)])
+            return
+        state["request"] = fw.run_lamp(duration)
+        plan_shorten(state["request"], state["start"])
+
+    fw.done = finished
+    if args.armed:
+        sched.at(PS_PER_S, arm, 2 * PS_PER_S)
+    else:
+        sched.at(PS_PER_S, start_exposure)
+    if args.render_hz:
+        sched.at(PS_PER_S // 2, fw.render_burst, round(PS_PER_S / args.render_hz), end)
+    sched.run(end + 600 * PS_PER_S)  # let the last exposure finish
+
+    failures[:0] = fw.tim.faults + fw.tim1.faults
+    return fw, results, failures, latencies
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("source", help="repository root")
+    parser.add_argument("--hours", type=float, default=4.0, help="session length")
+    parser.add_argument("--interval", type=float, default=90.0, help="seconds from one exposure start to the next")
+    parser.add_argument("--durations", default="800,12000,65536,200000", help="exposure times in ms, cycled")
+    parser.add_argument("--lead", type=int, help="safelight lead in ms, default EXPOSURE_SAFELIGHT_LEAD_MS")
+    parser.add_argument("--hsi-ppm", type=int, default=0, help="HSI frequency error")
+    parser.add_argument("--cal-ppm", type=int, default=0, help="measured HSI error, applied by clockCalCorrectMs()")
+    parser.add_argument("--mains", type=float, default=50.0, help="mains frequency in Hz")
+    parser.add_argument("--mains-ppm", type=int, default=0, help="mains frequency error")
+    parser.add_argument("--zero-cross", action="store_true", help="switch on mains zero crossings")
+    parser.add_argument("--armed", action="store_true", help="start every exposure from a pre-armed footswitch press")
+    parser.add_argument("--render-hz", type=float, default=0.0, help="display bursts holding the active level")
+    parser.add_argument("--render-us", type=float, default=2000.0, help="length of a display burst")
+    parser.add_argument("--max-mask-us", type=float, default=20.0, help="longest interval interrupts are masked")
+    parser.add_argument("--shorten", type=int, help="end every TIM15 exposure early, at this percentage of its on-time")
+    parser.add_argument("--channels", action="store_true", help="run every exposure on the four TIM1 lamp outputs")
+    args = parser.parse_args()
+
+    if args.armed and args.zero_cross:
+        parser.error("armed exposures run on TIM15, not on zero crossings")
+    if args.channels and (args.armed or args.zero_cross or args.shorten):
+        parser.error("multi-channel exposures run on TIM1 from the task, without arming, zero crossings or shortening")
+
+    defs = read_defines(args.source)
+    if args.lead is None:
+        args.lead = defs["EXPOSURE_SAFELIGHT_LEAD_MS"]
+
+    with tempfile.TemporaryDirectory() as workdir:
+        lib = build(args.source, workdir)
+        fw, results, failures, latencies = simulate(defs, args, lib)
+
+    worst = max(results, key=lambda r: abs(r[1] - r[0] * PS_PER_MS), default=None)
+    print("%d exposures, %d lamp edges, %d TIM15 updates, %d clock level switches"
+          % (len(results), len(fw.edges), fw.tim.updates, len(fw.switches)))
+    if worst:
+        print("largest on-time error %+.3f ms (%d ms requested)" % ((worst[1] - worst[0] * PS_PER_MS) / PS_PER_MS,
+                                                                    worst[0]))
+    if latencies:
+        print("press to counter start %.2f..%.2f us" % (min(latencies) / PS_PER_US,
+                                                        (max(latencies) + args.max_mask_us * PS_PER_US) / PS_PER_US))
+
+    # journalPoll() rewrites the open page after every exposure, the ring spreads that over all pages
+    pages = (defs["EEPROM_SIZE"] - defs["JOURNAL_EEPROM_ADDR"]) // defs["EEPROM_PAGE_SIZE"]
+    per_page = -(-len(results) // pages)
+    print("eeprom: %d journal page writes over %d pages, %d per page, %d sessions to %d cycles"
+          % (len(results), pages, per_page, EEPROM_ENDURANCE // max(per_page, 1), EEPROM_ENDURANCE))
+
+    for failure in failures[:20]:
+        print("FAIL " + failure)
+    if failures:
+        print("%d checks failed" % len(failures))
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -386,12 +386,16 @@ extern uint32_t SystemCoreClock;
  * number of the failing assert (for example, "vAssertCalled( __FILE__, __LINE__ )"
  * or it can simple disable interrupts and sit in a loop to halt all execution
  * on the failing line for viewing in a debugger. */
-#define configASSERT( x )         \
-    if( ( x ) == 0 )              \
-    {                             \
-        taskDISABLE_INTERRUPTS(); \
-        for( ; ; )                \
-        ;                         \
+#ifndef __ASSEMBLER__
+void vAssertCalled( unsigned long ulLine, const char * const pcFileName );
+#endif
+
+/* vAssertCalled() records the failing assert for post-mortem analysis and resets
+ * (or halts in the debugger in DEBUG builds). */
+#define configASSERT( x )                         \
+    if( ( x ) == 0 )                              \
+    {                                             \
+        vAssertCalled( __LINE__, __FILE__ );      \
     }
 
 /******************************************************************************/
@@ -625,16 +629,19 @@ extern uint32_t SystemCoreClock;
 #define INCLUDE_xTaskGetHandle                 0
 #define INCLUDE_xTaskResumeFromISR             1
 
-// Debug stuff
-#ifdef DEBUG
+// Run-time stats: in all builds, read by the diagnostics service
 #include <../bsp/inc/timer.h>
-#define configRECORD_STACK_HIGH_ADDRESS  1
-#define configCHECK_FOR_STACK_OVERFLOW   2 // fast, but not guaranteed to catch all overflows. 2 catches more but is slower
 #define configUSE_TRACE_FACILITY         1
 #define configGENERATE_RUN_TIME_STATS    1
 
 #define portCONFIGURE_TIMER_FOR_RUN_TIME_STATS() initRtosTimer() /* Define this to initialize your timer/counter */
 #define portGET_RUN_TIME_COUNTER_VALUE()         rtosTimerGetValue()     /* Define this to sample the timer/counter */
+#define traceTASK_INCREMENT_TICK( xTickCount )   (void)rtosTimerGetValue() /* keeps the 32-bit extension of the 16-bit TIM17 */
+
+// Debug stuff
+#ifdef DEBUG
+#define configRECORD_STACK_HIGH_ADDRESS  1
+#define configCHECK_FOR_STACK_OVERFLOW   2 // fast, but not guaranteed to catch all overflows. 2 catches more but is slower
 #endif
 
 // Cortex-M specific definitions
@@ -0,0 +1,56 @@
+/**
+ * @file adc.h
+ *
+ * @brief adc routines
+ */
+
+#ifndef _ADC_H_
+#define _ADC_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "stm32g070xx.h"
+#include "gpio.h"
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define ADC_SAMPLE_RATE_HZ 1000   // TIM6 trigger rate
+#define ADC_RING_SAMPLES   16     // DMA ring depth, one entry per TIM6 trigger
+#define ADC_BLOCK_SAMPLES  (ADC_RING_SAMPLES / 2) // samples per half-ring callback
+#define ADC_FULL_SCALE     0xFFFF // 12 bit, 256x oversampled, >> 4
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+typedef void (*fnAdcBlockCallback)(const volatile uint16_t *pBlock, void *userCtx);
+typedef void (*fnAdcWatchdogCallback)(void *userCtx);
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+void     adcInit(SAnalogPinDef_t const *);
+uint16_t adcGetLatest(void);
+uint16_t adcGetAverage(void);
+
+void     adcSetBlockCallback(fnAdcBlockCallback, void *);
+void     adcSetWatchdog(uint16_t, fnAdcWatchdogCallback, void *);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //!_ADC_H_
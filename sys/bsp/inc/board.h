@@ -16,10 +16,21 @@ extern "C"
 // Includes
 //=====================================================================================================================
 
+#include "adc.h"
+#include "clock.h"
+#include "eeprom.h"
 #include "i2c.h"
 #include "spi.h"
 #include "gpio.h"
+#include "pool.h"
 #include "timer.h"
+#include "uart.h"
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define CONSOLE_BAUDRATE 115200
 
 //=====================================================================================================================
 // Functions
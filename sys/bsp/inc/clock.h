@@ -0,0 +1,72 @@
+/**
+ * @file clock.h
+ *
+ * @brief clock tree: SYSCLK levels, HSI trimming and HSI measurement against the LSE
+ */
+
+#ifndef _CLOCK_H_
+#define _CLOCK_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+/** @brief SYSCLK levels */
+typedef enum
+{
+    CLOCK_LEVEL_IDLE,   //< HSI16 direct, PLL off
+    CLOCK_LEVEL_ACTIVE, //< 64MHz PLL
+} EClockLevel_t;
+
+/** @brief called after every SYSCLK change with interrupts masked. must only reprogram registers */
+typedef void (*fnClockNotifier)(uint32_t coreHz, void *userCtx);
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define CLOCK_ACTIVE_HZ            64000000
+#define CLOCK_IDLE_HZ              16000000
+#define CLOCK_MAX_NOTIFIERS        6
+
+#define CLOCK_LSE_HZ               32768
+#define CLOCK_LSE_MEASURE_PERIODS  2048  // LSE periods per measurement: 62.5ms
+#define CLOCK_HSI_TRIM_MAX         127   // HSITRIM is 7 bits wide, higher is faster
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+void          initClock(void);
+EClockLevel_t clockGetLevel(void);
+void          clockRequestActive(void);
+void          clockReleaseActive(void);
+void          clockHoldLevel(void);
+void          clockReleaseLevel(void);
+bool          clockRegisterNotifier(fnClockNotifier, void *);
+
+void          clockStartLSE(void);
+bool          clockLSEReady(void);
+
+bool          clockMeasureLSE(void);
+bool          clockLSEMeasurement(uint32_t *, uint32_t *);
+
+uint8_t       clockGetHSITrim(void);
+void          clockSetHSITrim(uint8_t);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //!_CLOCK_H_
@@ -0,0 +1,44 @@
+/**
+ * @file eeprom.h
+ *
+ * @brief settings EEPROM on I2C1
+ */
+
+#ifndef _EEPROM_H_
+#define _EEPROM_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+// 24C32/24C64 class: 16-bit memory address
+#define EEPROM_I2C_ADDR  (0xA0)
+#define EEPROM_SIZE      4096 // 24C32, the smallest part fitted
+#define EEPROM_PAGE_SIZE 32 // a single write must not cross a page boundary
+#define EEPROM_WRITE_MS  5  // internal write cycle after the STOP, the device NACKs meanwhile
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+void initEeprom(void);
+bool eepromRead(uint16_t, uint8_t *, size_t);
+bool eepromWrite(uint16_t, const uint8_t *, size_t);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //!_EEPROM_H_
@@ -0,0 +1,97 @@
+/**
+ * @file flash.h
+ *
+ * @brief flash layout, page erase and programming, hardware CRC-32 and the boot records of the A/B image slots
+ *
+ *        shared by the application and the bootloader (nbtgBoot), so no RTOS calls. the layout must match
+ *        sys/stm32g0xx_sys/nbtgBoot.ld and nbtgTimer_a.ld/nbtgTimer_b.ld:
+ *
+ *        page  0-1   bootloader, 4K
+ *        page  2-3   boot records, used in turn
+ *        page  4-33  slot A, 60K
+ *        page 34-63  slot B, 60K
+ */
+
+#ifndef _FLASH_H_
+#define _FLASH_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+typedef enum
+{
+    FLASH_SLOT_A,
+    FLASH_SLOT_B,
+} EFlashSlot_t;
+
+/** @brief where an image is in its life. values are neither erased nor zeroed flash */
+typedef enum
+{
+    BOOT_STATE_TRIAL  = 0x5A, //< written and verified by the updater, not started yet
+    BOOT_STATE_TRYING = 0x3C, //< started once by the bootloader, the application hasn't confirmed it
+    BOOT_STATE_GOOD   = 0x69, //< confirmed by the application
+} EBootState_t;
+
+/** @brief boot record, two flash double words. the newest valid one decides what the bootloader starts */
+typedef struct
+{
+    uint32_t imageCrc; //< CRC-32 of the image
+    uint32_t length;   //< image length in bytes
+    uint16_t seq;      //< newer records have a higher seq, wrapping
+    uint8_t  slot;     //< EFlashSlot_t
+    uint8_t  state;    //< EBootState_t
+    uint32_t crc;      //< CRC-32 of the fields above; a record torn by a power loss fails it
+} SBootRecord_t;
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define FLASH_PAGE_BYTES        2048
+#define FLASH_PAGE_ADDRESS(p)   (0x08000000UL + ((uint32_t)(p) * FLASH_PAGE_BYTES))
+
+#define FLASH_BOOT_RECORD_PAGE  2  // and the one after it
+#define FLASH_SLOT_A_PAGE       4
+#define FLASH_SLOT_B_PAGE       34
+#define FLASH_SLOT_PAGES        30
+#define FLASH_SLOT_BYTES        (FLASH_SLOT_PAGES * FLASH_PAGE_BYTES)
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+void         flashUnlock(void);
+void         flashLock(void);
+bool         flashErasePage(uint32_t);
+bool         flashProgram(uint32_t, const void *, size_t);
+uint32_t     flashCrc32(const void *, size_t);
+
+uint32_t     flashSlotAddress(EFlashSlot_t);
+EFlashSlot_t flashRunningSlot(void);
+bool         flashImageValid(const SBootRecord_t *);
+
+bool         bootRecordNewest(SBootRecord_t *, bool);
+bool         bootRecordAppend(SBootRecord_t *);
+bool         bootRecordCompact(void);
+
+bool         flashHandleEccNmi(void);
+uint32_t     flashEccErrors(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //!_FLASH_H_
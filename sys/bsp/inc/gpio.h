@@ -45,6 +45,7 @@ typedef struct
     SGPIOPin_t gpio;
     uint32_t extiLine;
     uint32_t extiPort;
+    uint32_t extiConfigLine; // LL_EXTI_CONFIG_LINEx, selects the port mux for extiLine
 } SEXTIGPIOType_t;
 
 /** @brief pin definitions for SPI */
@@ -80,6 +81,39 @@ typedef struct
     uint32_t       pinAFMode;
 } SUSARTPinDef_t;
 
+/** @brief pin definitions for timer-driven lamp outputs */
+typedef struct
+{
+    TIM_TypeDef *pPeripheral;
+    SGPIOPin_t   channelPins[4]; // CH1-CH4
+    uint32_t     pinAFMode;
+} SLampChannelPinDef_t;
+
+/** @brief pin definition for the mains zero-cross detector: timer capture input that also raises an EXTI */
+typedef struct
+{
+    TIM_TypeDef    *pPeripheral;
+    SEXTIGPIOType_t input;
+    uint32_t        pinAFMode;
+} SZeroCrossPinDef_t;
+
+/** @brief start inputs that fire a pre-armed exposure. both switches pull to ground, the falling edge is used */
+typedef struct
+{
+    SEXTIGPIOType_t footswitch;
+    SEXTIGPIOType_t startButton;
+} SStartTriggerPinDef_t;
+
+/** @brief pin definition for an analog sensor input */
+typedef struct
+{
+    ADC_TypeDef *pPeripheral;
+    SGPIOPin_t   pin;
+    uint32_t     channel; // LL_ADC_CHANNEL_x
+} SAnalogPinDef_t;
+
+typedef void (*fnGpioCallback)(void *userCtx);
+
 /** @brief struct to specify peripheral pin definitions */
 typedef struct
 {
@@ -89,6 +123,20 @@ typedef struct
 
     // SPI
     SSPIPinDef_t *pSpiDisplayDef;
+
+    // timer outputs
+    SLampChannelPinDef_t  *pLampChannelDef;
+    SZeroCrossPinDef_t    *pZeroCrossDef;    // optional, NULL if not fitted
+
+    // EXTI inputs
+    SStartTriggerPinDef_t *pStartTriggerDef; // optional, NULL if not fitted
+
+    // analog
+    SAnalogPinDef_t       *pPhotometerDef;
+
+    // USART
+    SUSARTPinDef_t        *pConsoleDef;      // optional, NULL if not fitted
+    SUSARTPinDef_t        *pSyncLinkDef;     // optional, NULL if not fitted. single wire, TX pin only
 } STimerPeriphPinDef_t;
 
 /** @brief struct to specify generic pin definitions */
@@ -105,9 +153,12 @@ typedef struct
     SGenericGPIOPin_t *pButtonMode;
 
     SGenericGPIOPin_t *pPinOptocoupler;
+    SGenericGPIOPin_t *pPinSafelight;
 
     SGenericGPIOPin_t *pFootswitchDetect;
     SGenericGPIOPin_t *pFootswitchInput;
+
+    SGenericGPIOPin_t *pPinBuzzer;
 } STimerGenericPinDef_t;
 
 //=====================================================================================================================
@@ -123,10 +174,16 @@ void initGPIO_generic(STimerGenericPinDef_t *);
 
 void toggleEepromWP(bool);
 void toggleOptocoupler(bool);
+void toggleSafelight(bool);
+void toggleBuzzer(bool);
 void toggleDisplayDataCommand(bool);
 void resetDisplay(bool);
 void selectDisplay(bool);
 
+void registerZeroCrossCallback(fnGpioCallback, void *);
+void registerStartTriggerCallback(fnGpioCallback, void *);
+bool injectStartTrigger(void);
+
 #ifdef __cplusplus
 }
 #endif
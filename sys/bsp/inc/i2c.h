@@ -40,11 +40,16 @@ typedef struct
 // Defines
 //=====================================================================================================================
 
-// only valid for 64MHz PCLK + analog filter enable!!
+// only valid for 64MHz PCLK + analog filter enable!! I2C2 has no kernel clock mux: display over I2C needs the active
+// clock level
 #define I2C_100KHZ (0x10B17DB5)
 #define I2C_400KHZ (0x00C12166)
 #define I2C_1MHZ (0x00910B1C)
 
+// I2C1 runs from the HSI16 kernel clock so it doesn't follow the SYSCLK level. analog filter enabled
+#define I2C_HSI16_100KHZ (0x00303D5B)
+#define I2C_HSI16_400KHZ (0x0010061A)
+
 //=====================================================================================================================
 // Functions
 //=====================================================================================================================
@@ -53,6 +58,12 @@ void i2cInit(I2C_TypeDef *, uint32_t, bool);
 void i2cRegisterCallback(i2cStatusCallback);
 
 void i2cTransmit(I2C_TypeDef *, SI2CTransfer_t *);
+bool i2cReadMemory(I2C_TypeDef *, uint8_t, uint16_t, uint8_t *, size_t);
+bool i2cWriteMemory(I2C_TypeDef *, uint8_t, uint16_t, const uint8_t *, size_t);
+bool i2cProbe(I2C_TypeDef *, uint8_t);
+
+void i2cInitEepromDMA(void);
+void i2cTransferEepromDMA(SI2CTransfer_t *);
 
 void i2cInitDisplayDMA(i2cStatusCallback);
 void i2cTransferDisplayDMA(SI2CTransfer_t *);
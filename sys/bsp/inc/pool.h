@@ -0,0 +1,92 @@
+/**
+ * @file pool.h
+ *
+ * @brief fixed-block memory pools
+ *
+ * pools are declared at compile time with POOL_DEFINE() and need no init call. allocation and release are O(1) and
+ * safe from any context, ISRs included, so a block can be filled in one context and handed to another by pointer
+ */
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+/** @brief free block, the link lives in the block itself */
+typedef struct SPoolBlock
+{
+    struct SPoolBlock *pNext;
+} SPoolBlock_t;
+
+/** @brief pool control block, only touch through the pool functions */
+typedef struct
+{
+    const char   *pName;
+    uint8_t      *pStorage;
+    uint16_t      blockSize;  //< rounded up to POOL_BLOCK_ALIGN
+    uint16_t      numBlocks;
+    SPoolBlock_t *pFree;      //< blocks returned by poolFree()
+    uint16_t      numCarved;  //< blocks taken from storage so far, saves building the free list up front
+    uint16_t      numUsed;
+    uint16_t      highWater;  //< most blocks in use at once
+    uint16_t      numFailed;  //< allocations refused because the pool was empty, saturates
+} SPool_t;
+
+/** @brief pool usage, see poolGetStats() */
+typedef struct
+{
+    const char *pName;
+    uint16_t    blockSize;
+    uint16_t    numBlocks;
+    uint16_t    numUsed;
+    uint16_t    highWater;
+    uint16_t    numFailed;
+} SPoolStats_t;
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define POOL_BLOCK_ALIGN       8 // enough for any type on this core, including 64-bit members
+
+#define POOL_BLOCK_SIZE(type)  ((sizeof(type) + POOL_BLOCK_ALIGN - 1) & ~(size_t)(POOL_BLOCK_ALIGN - 1))
+
+/**
+ * @brief define a pool of count blocks of type. the pool is listed in the .pools section so poolGetStats() finds it
+ *        without registration. use POOL_DECLARE() in a header to share it
+ */
+#define POOL_DEFINE(pool, type, count)                                                                                \
+    static uint64_t pool##Storage[(POOL_BLOCK_SIZE(type) * (count)) / sizeof(uint64_t)];                               \
+    SPool_t pool = { #pool, (uint8_t *)pool##Storage, POOL_BLOCK_SIZE(type), (count), NULL, 0, 0, 0, 0 };             \
+    static SPool_t *const pool##Entry __attribute__((section(".pools"), used)) = &pool
+
+#define POOL_DECLARE(pool)     extern SPool_t pool
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+void *poolAlloc(SPool_t *);
+void  poolFree(SPool_t *, void *);
+bool  poolContains(const SPool_t *, const void *);
+bool  poolGetStats(uint8_t, SPoolStats_t *);
+
+#ifdef __cplusplus
+}
+#endif
+#endif //!_POOL_H_
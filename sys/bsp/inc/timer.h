@@ -31,6 +31,12 @@ typedef enum
     TIMER_SYS_DELAY,
     TIMER_FRAMERATE,
     TIMER_ENLARGER_LAMP_ENABLE,
+    TIMER_ENLARGER_LAMP_ON, //< TIM15 CC1: lamp-on edge after the safelight lead time
+    TIMER_LAMP_CHANNELS,
+    TIMER_ZERO_CROSS,
+    TIMER_MAINS_LOST,       //< TIM3 CC1: no zero-cross edge before the watchdog deadline
+    TIMER_ADC_TRIGGER,
+    TIMER_TIME_BASE_ALARM,  //< TIM17 CC1: the time base reached the alarm time
 } ETimerType_t;
 
 typedef void (*fnTimCallback)(void *userCtx);
@@ -47,6 +53,18 @@ typedef struct
 // Defines
 //=====================================================================================================================
 
+#define LAMP_CHANNEL_COUNT     4      // TIM1 CH1-CH4
+#define LAMP_CHANNEL_MAX_MS    0xFFFF // TIM1 is 16 bits wide at a 1ms tick
+
+#define ENLARGER_MAX_LEAD_MS   10000  // lamp-on edge must fall in the first TIM15 segment
+
+#define LAMP_PWM_HZ            20000  // TIM1 CH1 dimming output for LED heads, above flicker and hearing
+#define LAMP_PWM_DITHER        16     // duty values cycled by DMA: the level resolves to 1/16 of a timer count
+#define LAMP_PWM_FULL          65536  // lamp level scale, Q16 of full power
+
+#define TIME_BASE_ALARM_MIN_US 20     // an alarm closer than this could be passed before the compare is loaded
+#define TIME_BASE_ALARM_MAX_US 60000  // TIM17 is 16 bits wide, leave a margin below the wrap
+
 //=====================================================================================================================
 // Functions
 //=====================================================================================================================
@@ -54,12 +72,37 @@ typedef struct
 void initTimer(STimerDef_t const *);
 void timerDelay(STimerDef_t const *, const uint32_t);
 
-void startEnlargerTimer(uint32_t);
+void startEnlargerTimer(uint32_t, uint32_t);
+void armEnlargerTimer(uint32_t, uint32_t);
+void triggerEnlargerTimer(void);
+void stopEnlargerTimer(void);
+void shortenEnlargerTimer(uint32_t);
+bool enlargerTimerIsRunning(void);
 uint32_t timerGetValue(STimerDef_t const *);
 
+// multi-channel lamp outputs
+bool armLampChannels(const uint32_t *, uint8_t);
+void startLampChannels(void);
+void stopLampChannels(void);
+
+// PWM dimming output, shares TIM1 with the multi-channel outputs
+void     setLampPwmMode(bool);
+uint32_t startLampPwm(uint32_t);
+void     stopLampPwm(void);
+
+// mains zero-cross capture
+uint16_t zeroCrossCaptureValue(void);
+void     armMainsWatchdog(uint16_t);
+void     disarmMainsWatchdog(void);
+
 // freertos system timers
 void initRtosTimer(void);
 uint32_t rtosTimerGetValue(void);
+void rtosIsrEnter(void);
+void rtosIsrExit(void);
+uint32_t rtosIsrTimeUs(void);
+bool armTimeBaseAlarm(uint32_t);
+void disarmTimeBaseAlarm(void);
 
 void registerTimerCallback(ETimerType_t, fnTimCallback, void *);
 
@@ -29,10 +29,15 @@ extern "C"
 // Types
 //=====================================================================================================================
 
+/** @brief sync link receive callback: a byte, or LINK_RX_IDLE, and the TIM17 time base value it was received at */
+typedef void (*fnLinkRxCallback)(int16_t data, uint32_t timeUs, void *userCtx);
+
 //=====================================================================================================================
 // Defines
 //=====================================================================================================================
 
+#define LINK_RX_IDLE -1 // the line went idle after a frame, or a byte was lost to a receive error
+
 //=====================================================================================================================
 // Functions
 //=====================================================================================================================
@@ -45,6 +50,16 @@ void setConsoleInputQueue(QueueHandle_t *);
 
 void consolePutchar(char);
 
+void   consoleSetBaudRate(uint32_t);
+void   consoleStartDMARx(uint8_t *, size_t);
+size_t consoleDMARxPos(void);
+void   consoleStopDMARx(void);
+
+void initSyncLinkUsart(USART_TypeDef *, uint32_t);
+void toggleSyncLinkRX(bool);
+void setSyncLinkRxCallback(fnLinkRxCallback, void *);
+void syncLinkSend(const uint8_t *, size_t);
+
 #ifdef __cplusplus
 }
 #endif
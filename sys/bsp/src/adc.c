@@ -0,0 +1,233 @@
+/**
+ * @file adc.c
+ *
+ * @brief adc functionality
+ *
+ * a single sensor channel is converted on every TIM6 TRGO. each trigger runs a full 256x hardware oversampling burst,
+ * so the data register holds a 16-bit average; DMA1 channel 4 copies it into a circular ring without CPU involvement.
+ * readers only ever look at the ring
+ *
+ * consumers that need every sample (light integration) register a block callback: the DMA half/full-transfer IRQs
+ * then hand over each completed half of the ring from ISR context. AWD1 watches the same channel for a high threshold
+ */
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include "adc.h"
+#include "timer.h"
+
+#include <stm32g0xx_ll_adc.h>
+#include <stm32g0xx_ll_bus.h>
+#include <stm32g0xx_ll_dma.h>
+#include <stm32g0xx_ll_rcc.h>
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define ADC_DMA_CHANNEL LL_DMA_CHANNEL_4
+
+//=====================================================================================================================
+// Globals
+//=====================================================================================================================
+
+static volatile uint16_t g_adcRing[ADC_RING_SAMPLES] = {0};
+
+static ADC_TypeDef          *g_pADCPeripheral     = NULL;
+static fnAdcBlockCallback    g_fnBlockCallback    = NULL;
+static void                 *g_pBlockCtx          = NULL;
+static fnAdcWatchdogCallback g_fnWatchdogCallback = NULL;
+static void                 *g_pWatchdogCtx       = NULL;
+
+//=====================================================================================================================
+// External functions
+//=====================================================================================================================
+
+/**
+ * @brief initialize ADC1 for timer-triggered, oversampled conversions of one channel into the DMA ring
+ *
+ * @param pAnalogDef sensor pin + channel
+ *
+ * @note conversions only start once TIM6 is running
+ */
+void adcInit(SAnalogPinDef_t const *pAnalogDef)
+{
+    LL_APB2_GRP1_EnableClock(LL_APB2_GRP1_PERIPH_ADC);
+    LL_AHB1_GRP1_EnableClock(LL_AHB1_GRP1_PERIPH_DMA1);
+
+    // DMA: ADC data register -> ring, circular
+    LL_DMA_SetPeriphRequest(DMA1, ADC_DMA_CHANNEL, LL_DMAMUX_REQ_ADC1);
+    LL_DMA_SetDataTransferDirection(DMA1, ADC_DMA_CHANNEL, LL_DMA_DIRECTION_PERIPH_TO_MEMORY);
+    LL_DMA_SetChannelPriorityLevel(DMA1, ADC_DMA_CHANNEL, LL_DMA_PRIORITY_MEDIUM);
+    LL_DMA_SetMode(DMA1, ADC_DMA_CHANNEL, LL_DMA_MODE_CIRCULAR);
+    LL_DMA_SetPeriphIncMode(DMA1, ADC_DMA_CHANNEL, LL_DMA_PERIPH_NOINCREMENT);
+    LL_DMA_SetMemoryIncMode(DMA1, ADC_DMA_CHANNEL, LL_DMA_MEMORY_INCREMENT);
+    LL_DMA_SetPeriphSize(DMA1, ADC_DMA_CHANNEL, LL_DMA_PDATAALIGN_HALFWORD);
+    LL_DMA_SetMemorySize(DMA1, ADC_DMA_CHANNEL, LL_DMA_MDATAALIGN_HALFWORD);
+    LL_DMA_ConfigAddresses(DMA1, ADC_DMA_CHANNEL,
+        LL_ADC_DMA_GetRegAddr(pAnalogDef->pPeripheral, LL_ADC_DMA_REG_REGULAR_DATA),
+        (uint32_t)&g_adcRing[0],
+        LL_DMA_DIRECTION_PERIPH_TO_MEMORY
+    );
+    LL_DMA_SetDataLength(DMA1, ADC_DMA_CHANNEL, ADC_RING_SAMPLES);
+    LL_DMA_EnableChannel(DMA1, ADC_DMA_CHANNEL);
+
+    // ADC: asynchronous HSI16 clock, so the conversion time doesn't follow the SYSCLK level. one channel, external
+    // trigger, 256x oversampling >> 4 = 16 bit result: 256 * (39.5 + 12.5) cycles = 832us, inside one TIM6 period
+    LL_RCC_SetADCClockSource(LL_RCC_ADC_CLKSOURCE_HSI);
+    LL_ADC_SetClock(pAnalogDef->pPeripheral, LL_ADC_CLOCK_ASYNC);
+    LL_ADC_SetResolution(pAnalogDef->pPeripheral, LL_ADC_RESOLUTION_12B);
+    LL_ADC_SetDataAlignment(pAnalogDef->pPeripheral, LL_ADC_DATA_ALIGN_RIGHT);
+    LL_ADC_SetSamplingTimeCommonChannels(pAnalogDef->pPeripheral, LL_ADC_SAMPLINGTIME_COMMON_1,
+                                         LL_ADC_SAMPLINGTIME_39CYCLES_5);
+    LL_ADC_SetOverSamplingScope(pAnalogDef->pPeripheral, LL_ADC_OVS_GRP_REGULAR_CONTINUED);
+    LL_ADC_ConfigOverSamplingRatioShift(pAnalogDef->pPeripheral, LL_ADC_OVS_RATIO_256, LL_ADC_OVS_SHIFT_RIGHT_4);
+    LL_ADC_SetOverSamplingDiscont(pAnalogDef->pPeripheral, LL_ADC_OVS_REG_CONT); // whole burst per trigger
+
+    LL_ADC_REG_SetSequencerConfigurable(pAnalogDef->pPeripheral, LL_ADC_REG_SEQ_CONFIGURABLE);
+    LL_ADC_REG_SetSequencerLength(pAnalogDef->pPeripheral, LL_ADC_REG_SEQ_SCAN_DISABLE);
+    LL_ADC_REG_SetSequencerRanks(pAnalogDef->pPeripheral, LL_ADC_REG_RANK_1, pAnalogDef->channel);
+    while (!LL_ADC_IsActiveFlag_CCRDY(pAnalogDef->pPeripheral));
+    LL_ADC_ClearFlag_CCRDY(pAnalogDef->pPeripheral);
+    LL_ADC_SetChannelSamplingTime(pAnalogDef->pPeripheral, pAnalogDef->channel, LL_ADC_SAMPLINGTIME_COMMON_1);
+
+    LL_ADC_REG_SetTriggerSource(pAnalogDef->pPeripheral, LL_ADC_REG_TRIG_EXT_TIM6_TRGO);
+    LL_ADC_REG_SetTriggerEdge(pAnalogDef->pPeripheral, LL_ADC_REG_TRIG_EXT_RISING);
+    LL_ADC_REG_SetContinuousMode(pAnalogDef->pPeripheral, LL_ADC_REG_CONV_SINGLE);
+    LL_ADC_REG_SetDMATransfer(pAnalogDef->pPeripheral, LL_ADC_REG_DMA_TRANSFER_UNLIMITED);
+    LL_ADC_REG_SetOverrun(pAnalogDef->pPeripheral, LL_ADC_REG_OVR_DATA_OVERWRITTEN);
+
+    // AWD1 on the sensor channel; thresholds + IRQ are set by adcSetWatchdog()
+    LL_ADC_SetAnalogWDMonitChannels(pAnalogDef->pPeripheral, LL_ADC_AWD1,
+                                    __LL_ADC_ANALOGWD_CHANNEL_GROUP(pAnalogDef->channel, LL_ADC_GROUP_REGULAR));
+    LL_ADC_ConfigAnalogWDThresholds(pAnalogDef->pPeripheral, LL_ADC_AWD1, 0xFFF, 0x000);
+    NVIC_SetPriority(ADC1_IRQn, 0);
+    NVIC_EnableIRQ(ADC1_IRQn);
+
+    NVIC_SetPriority(DMA1_Ch4_7_DMAMUX1_OVR_IRQn, 0);
+    NVIC_EnableIRQ(DMA1_Ch4_7_DMAMUX1_OVR_IRQn);
+
+    g_pADCPeripheral = pAnalogDef->pPeripheral;
+
+    // regulator startup + calibration, then enable
+    LL_ADC_EnableInternalRegulator(pAnalogDef->pPeripheral);
+    for (volatile uint32_t wait = (LL_ADC_DELAY_INTERNAL_REGUL_STAB_US * (SystemCoreClock / 1000000)); wait; wait--);
+
+    LL_ADC_StartCalibration(pAnalogDef->pPeripheral);
+    while (LL_ADC_IsCalibrationOnGoing(pAnalogDef->pPeripheral));
+    for (volatile uint32_t wait = LL_ADC_DELAY_CALIB_ENABLE_ADC_CYCLES; wait; wait--);
+
+    LL_ADC_Enable(pAnalogDef->pPeripheral);
+    while (!LL_ADC_IsActiveFlag_ADRDY(pAnalogDef->pPeripheral));
+
+    LL_ADC_REG_StartConversion(pAnalogDef->pPeripheral); // armed; TIM6 TRGO starts each burst
+}
+
+/**
+ * @brief most recent oversampled conversion
+ *
+ * @return uint16_t reading, 0..ADC_FULL_SCALE
+ */
+uint16_t adcGetLatest(void)
+{
+    uint32_t remaining = LL_DMA_GetDataLength(DMA1, ADC_DMA_CHANNEL);
+    uint32_t idx       = (2 * ADC_RING_SAMPLES - remaining - 1) % ADC_RING_SAMPLES;
+
+    return g_adcRing[idx];
+}
+
+/**
+ * @brief mean over the whole DMA ring, i.e. the last ADC_RING_SAMPLES triggers
+ *
+ * @return uint16_t reading, 0..ADC_FULL_SCALE
+ */
+uint16_t adcGetAverage(void)
+{
+    uint32_t sum = 0;
+
+    for (uint8_t i = 0; i < ADC_RING_SAMPLES; i++)
+    {
+        sum += g_adcRing[i];
+    }
+
+    return (uint16_t)(sum / ADC_RING_SAMPLES);
+}
+
+/**
+ * @brief hand every completed half of the DMA ring to a consumer. runs in ISR context every ADC_BLOCK_SAMPLES triggers
+ *
+ * @param fnCb block handler, NULL to stop the half/full-transfer IRQs
+ * @param pUserCtx handler context
+ */
+void adcSetBlockCallback(fnAdcBlockCallback fnCb, void *pUserCtx)
+{
+    LL_DMA_DisableIT_HT(DMA1, ADC_DMA_CHANNEL);
+    LL_DMA_DisableIT_TC(DMA1, ADC_DMA_CHANNEL);
+
+    g_pBlockCtx       = pUserCtx;
+    g_fnBlockCallback = fnCb;
+
+    if (fnCb != NULL)
+    {
+        LL_DMA_ClearFlag_HT4(DMA1);
+        LL_DMA_ClearFlag_TC4(DMA1);
+        LL_DMA_EnableIT_HT(DMA1, ADC_DMA_CHANNEL);
+        LL_DMA_EnableIT_TC(DMA1, ADC_DMA_CHANNEL);
+    }
+}
+
+/**
+ * @brief raise a callback as soon as a single conversion exceeds a threshold
+ *
+ * @param highThreshold 12 bit threshold, compared with the top 12 bits of the oversampled result
+ * @param fnCb handler, runs in ISR context. NULL disables the watchdog
+ * @param pUserCtx handler context
+ */
+void adcSetWatchdog(uint16_t highThreshold, fnAdcWatchdogCallback fnCb, void *pUserCtx)
+{
+    LL_ADC_DisableIT_AWD1(g_pADCPeripheral);
+
+    g_pWatchdogCtx       = pUserCtx;
+    g_fnWatchdogCallback = fnCb;
+
+    if (fnCb != NULL)
+    {
+        LL_ADC_SetAnalogWDThresholds(g_pADCPeripheral, LL_ADC_AWD1, LL_ADC_AWD_THRESHOLD_HIGH, highThreshold);
+        LL_ADC_ClearFlag_AWD1(g_pADCPeripheral);
+        LL_ADC_EnableIT_AWD1(g_pADCPeripheral);
+    }
+}
+
+void DMA1_Ch4_7_DMAMUX1_OVR_IRQHandler(void)
+{
+    rtosIsrEnter();
+
+    if (LL_DMA_IsActiveFlag_HT4(DMA1))
+    {
+        LL_DMA_ClearFlag_HT4(DMA1);
+        if (g_fnBlockCallback) g_fnBlockCallback(&g_adcRing[0], g_pBlockCtx);
+    }
+
+    if (LL_DMA_IsActiveFlag_TC4(DMA1))
+    {
+        LL_DMA_ClearFlag_TC4(DMA1);
+        if (g_fnBlockCallback) g_fnBlockCallback(&g_adcRing[ADC_BLOCK_SAMPLES], g_pBlockCtx);
+    }
+
+    rtosIsrExit();
+}
+
+void ADC1_IRQHandler(void)
+{
+    rtosIsrEnter();
+
+    if (LL_ADC_IsActiveFlag_AWD1(g_pADCPeripheral))
+    {
+        LL_ADC_ClearFlag_AWD1(g_pADCPeripheral);
+        if (g_fnWatchdogCallback) g_fnWatchdogCallback(g_pWatchdogCtx);
+    }
+
+    rtosIsrExit();
+}
@@ -30,15 +30,17 @@
 // Defines
 //=====================================================================================================================
 
-#define SYS_CLK_FREQ_HZ (SystemCoreClock)
+#define SYNC_LINK_BAUDRATE 115200
 
 //=====================================================================================================================
 // Globals
 //=====================================================================================================================
 
-STimerDef_t delayTimer     = {TIMER_SYS_DELAY, TIM1, 1000, nullptr, nullptr};
+STimerDef_t lampChannelTimer = {TIMER_LAMP_CHANNELS, TIM1, 1000};
 STimerDef_t framerateTimer = {TIMER_FRAMERATE, TIM14, 1000, nullptr, nullptr};
 STimerDef_t enlargerTimer  = {TIMER_ENLARGER_LAMP_ENABLE, TIM15, 1000, nullptr, nullptr};
+STimerDef_t zeroCrossTimer = {TIMER_ZERO_CROSS, TIM3, 1000000};
+STimerDef_t adcTimer       = {TIMER_ADC_TRIGGER, TIM6, ADC_SAMPLE_RATE_HZ};
 
 // I2C:                      periph, SDA                     , SCL                     , WP                      , AFMODE
 SI2CPinDef_t g_R1_eepromI2C = {I2C1, { LL_GPIO_PIN_7, GPIOB }, { LL_GPIO_PIN_6, GPIOB }, { LL_GPIO_PIN_5, GPIOB }, LL_GPIO_AF_6 };
@@ -47,6 +49,23 @@ SI2CPinDef_t g_R1_dispI2C   = {I2C2, { LL_GPIO_PIN_11, GPIOB }, { LL_GPIO_PIN_10
 // SPI:                      periph,  CS,                       SCLK,                    , MISO                     ,  MOSI                    , D/C                      ,  RST                     , AFMODE
 SSPIPinDef_t g_R1_dispSPI   = {SPI2, { LL_GPIO_PIN_12, GPIOB }, { LL_GPIO_PIN_13, GPIOB }, { LL_GPIO_PIN_14, GPIOB }, { LL_GPIO_PIN_15, GPIOB }, { LL_GPIO_PIN_11, GPIOB }, { LL_GPIO_PIN_10, GPIOB }, LL_GPIO_AF_0};
 
+// lamp channels:               timer, CH1                    , CH2                    , CH3                     , CH4                     , AFMODE
+SLampChannelPinDef_t g_R1_lampChannels = {TIM1, {{ LL_GPIO_PIN_8, GPIOA }, { LL_GPIO_PIN_9, GPIOA }, { LL_GPIO_PIN_10, GPIOA }, { LL_GPIO_PIN_11, GPIOA }}, LL_GPIO_AF_2}; // expansion header
+
+// zero-cross:                 timer, input                                                                    , AFMODE
+SZeroCrossPinDef_t g_R1_zeroCross = {TIM3, {{ LL_GPIO_PIN_7, GPIOC }, LL_EXTI_LINE_7, LL_EXTI_CONFIG_PORTC, LL_EXTI_CONFIG_LINE7 }, LL_GPIO_AF_1}; // expansion header, TIM3_CH2
+
+// EXTI inputs:                               footswitch, start button (SW2)
+SStartTriggerPinDef_t g_R1_startTrigger = {{{ LL_GPIO_PIN_0, GPIOB }, LL_EXTI_LINE_0, LL_EXTI_CONFIG_PORTB, LL_EXTI_CONFIG_LINE0 },
+                                           {{ LL_GPIO_PIN_3, GPIOC }, LL_EXTI_LINE_3, LL_EXTI_CONFIG_PORTC, LL_EXTI_CONFIG_LINE3 }};
+
+// analog:                          periph, pin                    , channel
+SAnalogPinDef_t g_R1_photometer = {ADC1, { LL_GPIO_PIN_0, GPIOA }, LL_ADC_CHANNEL_0}; // expansion header, easel probe
+
+// USART:                          periph, TX                     , RX                     , DE    , AFMODE
+SUSARTPinDef_t g_R1_consoleUSART = {USART1, { LL_GPIO_PIN_4, GPIOC }, { LL_GPIO_PIN_5, GPIOC }, {0, 0}, LL_GPIO_AF_1}; // expansion header, 3V3 TTL
+SUSARTPinDef_t g_R1_syncUSART    = {USART2, { LL_GPIO_PIN_5, GPIOD }, {0, 0}                , {0, 0}, LL_GPIO_AF_0}; // multi-unit sync, single wire + GND
+
 // Generic
 SGenericGPIOPin_t    g_R1_button10SecPlus       = {{ LL_GPIO_PIN_7, GPIOA }, false }; // SW4
 SGenericGPIOPin_t    g_R1_button10SecMinus      = {{ LL_GPIO_PIN_6, GPIOA }, false }; // SW7
@@ -58,6 +77,7 @@ SGenericGPIOPin_t    g_R1_buttonToggleLamp      = {{ LL_GPIO_PIN_2, GPIOC }, fal
 SGenericGPIOPin_t    g_R1_buttonStartTimer      = {{ LL_GPIO_PIN_3, GPIOC }, false }; // SW2
 SGenericGPIOPin_t    g_R1_buttonMode            = {{ LL_GPIO_PIN_1, GPIOC }, false }; // SW3
 SGenericGPIOPin_t    g_R1_pinOptocoupler        = {{ LL_GPIO_PIN_2, GPIOB }, true };
+SGenericGPIOPin_t    g_R1_pinSafelight          = {{ LL_GPIO_PIN_6, GPIOC }, true };  // expansion header, safelight relay
 SGenericGPIOPin_t    g_R1_footswitchDetect      = {{ LL_GPIO_PIN_1, GPIOB }, false };
 SGenericGPIOPin_t    g_R1_footswitchInput       = {{ LL_GPIO_PIN_0, GPIOB }, false };
 SGenericGPIOPin_t    g_R1_pinBuzzer             = {{ LL_GPIO_PIN_8, GPIOB }, true };  // SW18
@@ -65,21 +85,22 @@ SGenericGPIOPin_t    g_R1_pinBuzzer             = {{ LL_GPIO_PIN_8, GPIOB }, tru
 STimerPeriphPinDef_t g_timerRev1PeriphPins      = {
          &g_R1_eepromI2C,
          &g_R1_dispI2C,
-         &g_R1_dispSPI
+         &g_R1_dispSPI,
+         &g_R1_lampChannels,
+         &g_R1_zeroCross,
+         &g_R1_startTrigger,
+         &g_R1_photometer,
+         &g_R1_consoleUSART,
+         &g_R1_syncUSART
 };
 
 STimerGenericPinDef_t g_timerRev1GenericPins = {
     &g_R1_button10SecPlus,   &g_R1_button10SecMinus,   &g_R1_button1SecPlus,   &g_R1_button1SecMinus,
     &g_R1_button100MsecPlus, &g_R1_button100MsecMinus, &g_R1_buttonToggleLamp, &g_R1_buttonStartTimer,
-    &g_R1_buttonMode,        &g_R1_pinOptocoupler,     &g_R1_footswitchDetect, &g_R1_footswitchInput
+    &g_R1_buttonMode,        &g_R1_pinOptocoupler,     &g_R1_pinSafelight,     &g_R1_footswitchDetect,
+    &g_R1_footswitchInput,   &g_R1_pinBuzzer
 };
 
-//=====================================================================================================================
-// Protos
-//=====================================================================================================================
-
-static void initSysclock(void);
-
 //=====================================================================================================================
 // Functions
 //=====================================================================================================================
@@ -99,9 +120,9 @@ void initBoard(void)
     LL_SYSCFG_DisableDBATT(LL_SYSCFG_UCPD1_STROBE | LL_SYSCFG_UCPD2_STROBE);
 
     NVIC_SetPriority(SysTick_IRQn, 3);
-    initSysclock();
+    initClock(); // active level, released by the application once start-up is done
 
-    initTimer(&delayTimer);
+    initRtosTimer(); // time base for hwDelayMs
 
     NVIC_SetPriority(DMA1_Channel1_IRQn, 0);
     NVIC_EnableIRQ(DMA1_Channel1_IRQn);
@@ -109,49 +130,37 @@ void initBoard(void)
     LL_IOP_GRP1_EnableClock(LL_IOP_GRP1_PERIPH_GPIOA);
     LL_IOP_GRP1_EnableClock(LL_IOP_GRP1_PERIPH_GPIOB);
     LL_IOP_GRP1_EnableClock(LL_IOP_GRP1_PERIPH_GPIOC);
+    LL_IOP_GRP1_EnableClock(LL_IOP_GRP1_PERIPH_GPIOD);
 
     initGPIO_peripherals(&g_timerRev1PeriphPins);
     initGPIO_generic(&g_timerRev1GenericPins);
 
-    i2cInit(g_R1_eepromI2C.pPeripheral, I2C_100KHZ, false);
+    i2cInit(g_R1_eepromI2C.pPeripheral, I2C_HSI16_100KHZ, false);
+    initEeprom();
     //i2cInit(g_R1_dispI2C.pPeripheral, I2C_1MHZ, true);
     spiInit(g_R1_dispSPI.pPeripheral);
+    adcInit(&g_R1_photometer);
+    initUsart(g_R1_consoleUSART.pPeripheral, CONSOLE_BAUDRATE);
+    initSyncLinkUsart(g_R1_syncUSART.pPeripheral, SYNC_LINK_BAUDRATE);
+    clockStartLSE(); // optional crystal, checked for later by the clock calibration
 
     initTimer(&framerateTimer);
     initTimer(&enlargerTimer);
+    initTimer(&lampChannelTimer);
+    initTimer(&zeroCrossTimer);
+    initTimer(&adcTimer); // starts the photometer sampling
 }
 
-void hwDelayMs(uint32_t ms)
-{
-    timerDelay(&delayTimer, ms);
-}
-
-//=====================================================================================================================
-// Statics
-//=====================================================================================================================
-
 /**
- * @brief basic sysclock init + prescalers
- * 
- * @note  system is clocked at 16MHz; this includes all periphs on APB/AHB
+ * @brief blocking delay on the 1MHz TIM17 time base
  * 
+ * @param ms milliseconds to wait
  */
-static void initSysclock(void)
+void hwDelayMs(uint32_t ms)
 {
-    LL_FLASH_SetLatency(LL_FLASH_LATENCY_2);
-    LL_RCC_SetAHBPrescaler(LL_RCC_SYSCLK_DIV_1);
-    LL_RCC_SetAPB1Prescaler(LL_RCC_APB1_DIV_1);
-
-    // clock PLL at 64MHz: (16MHz / 1) * (16 / 2)
-    LL_RCC_PLL_ConfigDomain_SYS(LL_RCC_PLLSOURCE_HSI, LL_RCC_PLLM_DIV_1, 8, LL_RCC_PLLR_DIV_2);
-    LL_RCC_PLL_Enable();
-    LL_RCC_PLL_EnableDomain_SYS();
-    while (LL_RCC_PLL_IsReady() != 1);
-
-    // sysclk uses HSI: max = 16MHz. if you want to go higher use main PLL
-    LL_RCC_SetSysClkSource(LL_RCC_SYS_CLKSOURCE_PLL);
-    while (LL_RCC_GetSysClkSource() != LL_RCC_SYS_CLKSOURCE_STATUS_PLL);
-
-    LL_Init1msTick(SYS_CLK_FREQ_HZ);
-    LL_SetSystemCoreClock(SYS_CLK_FREQ_HZ);
-}
\ No newline at end of file
+    while (ms--)
+    {
+        uint16_t start = (uint16_t)rtosTimerGetValue();
+        while ((uint16_t)(rtosTimerGetValue() - start) < 1000);
+    }
+}
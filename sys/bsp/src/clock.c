@@ -0,0 +1,394 @@
+/**
+ * @file clock.c
+ *
+ * @brief clock tree functionality
+ *
+ * SYSCLK runs at one of two levels: 64MHz from the PLL while anything holds an active request, HSI16 direct (PLL
+ * off) otherwise. callers bracket timing-critical or CPU-heavy work (exposures, rendering bursts) with
+ * clockRequestActive()/clockReleaseActive(); initClock() counts as the first request so start-up runs at full speed.
+ * clockHoldLevel()/clockReleaseLevel() freeze whatever level is current, for a timer that must not be rescaled while
+ * it counts; requests made meanwhile are only counted and take effect once the last hold is released
+ *
+ * the switch itself runs with interrupts masked. peripherals that can take the HSI16 kernel clock (USART, I2C1, ADC)
+ * are put on it so they don't care; everything else reprograms its prescalers from a notifier right after SYSCLK has
+ * changed, before any interrupt can observe the new rate. SysTick is reloaded here
+ *
+ * the PLL runs from the HSI, so every timer in the system inherits its error (±1% over temperature). the LSE, when
+ * fitted, is the only accurate clock on board: TIM16 TI1 can be remapped to it internally, so no pin is involved.
+ * with the capture prescaler at /8 each CC1 event spans 8 LSE periods, which keeps the capture rate low and the
+ * per-event delta well inside 16 bits at 64MHz
+ *
+ * TIM16 is owned by this file
+ */
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include "clock.h"
+#include "timer.h"
+
+#include <stm32g0xx_ll_bus.h>
+#include <stm32g0xx_ll_pwr.h>
+#include <stm32g0xx_ll_rcc.h>
+#include <stm32g0xx_ll_system.h>
+#include <stm32g0xx_ll_tim.h>
+#include <stm32g0xx_ll_utils.h>
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define SYSTICK_HZ              1000 // LL_mDelay before the scheduler starts, configTICK_RATE_HZ after
+
+#define LSE_PERIODS_PER_CAPTURE 8
+#define LSE_CAPTURES            (CLOCK_LSE_MEASURE_PERIODS / LSE_PERIODS_PER_CAPTURE)
+
+//=====================================================================================================================
+// Types
+//=====================================================================================================================
+
+typedef struct
+{
+    fnClockNotifier fnCb;
+    void           *pUserCtx;
+} SClockNotifier_t;
+
+//=====================================================================================================================
+// Globals
+//=====================================================================================================================
+
+static EClockLevel_t     g_level          = CLOCK_LEVEL_ACTIVE;
+static uint32_t          g_activeRequests = 0;
+static volatile uint32_t g_levelHolds     = 0;
+static SClockNotifier_t  g_notifiers[CLOCK_MAX_NOTIFIERS] = {0};
+static uint8_t           g_numNotifiers   = 0;
+
+
+static volatile bool     g_lseMeasuring  = false;
+static volatile bool     g_lseDone       = false;
+static volatile uint32_t g_lseTicks      = 0;   //< HSI-derived timer ticks over the measurement
+static volatile uint32_t g_lseCaptures   = 0;   //< captures so far, the first one only sets the start stamp
+static volatile uint16_t g_lseLastStamp  = 0;
+static uint32_t          g_lseExpected   = 0;   //< ticks a perfect HSI would have counted
+
+//=====================================================================================================================
+// Function prototypes
+//=====================================================================================================================
+
+static void switchLevel(EClockLevel_t);
+
+//=====================================================================================================================
+// External functions
+//=====================================================================================================================
+
+/**
+ * @brief bring SYSCLK up at the active level: PLL at 64MHz from HSI16, AHB + APB undivided. the caller holds the
+ *        resulting active request until clockReleaseActive()
+ *
+ */
+void initClock(void)
+{
+    LL_FLASH_SetLatency(LL_FLASH_LATENCY_2);
+    LL_RCC_SetAHBPrescaler(LL_RCC_SYSCLK_DIV_1);
+    LL_RCC_SetAPB1Prescaler(LL_RCC_APB1_DIV_1);
+
+    // clock PLL at 64MHz: (16MHz / 1) * (16 / 2)
+    LL_RCC_PLL_ConfigDomain_SYS(LL_RCC_PLLSOURCE_HSI, LL_RCC_PLLM_DIV_1, 8, LL_RCC_PLLR_DIV_2);
+    LL_RCC_PLL_Enable();
+    LL_RCC_PLL_EnableDomain_SYS();
+    while (LL_RCC_PLL_IsReady() != 1);
+
+    LL_RCC_SetSysClkSource(LL_RCC_SYS_CLKSOURCE_PLL);
+    while (LL_RCC_GetSysClkSource() != LL_RCC_SYS_CLKSOURCE_STATUS_PLL);
+
+    LL_Init1msTick(CLOCK_ACTIVE_HZ);
+    LL_SetSystemCoreClock(CLOCK_ACTIVE_HZ);
+
+    g_level          = CLOCK_LEVEL_ACTIVE;
+    g_activeRequests = 1;
+}
+
+/**
+ * @brief current SYSCLK level
+ *
+ * @return EClockLevel_t level
+ */
+EClockLevel_t clockGetLevel(void)
+{
+    return g_level;
+}
+
+/**
+ * @brief hold SYSCLK at the active level. switches up straight away if it was idle and no level hold is taken; every
+ *        call needs a matching clockReleaseActive(). task context or before the scheduler starts, never from an ISR
+ *        (waits for PLL lock)
+ *
+ */
+void clockRequestActive(void)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    if ((g_activeRequests++ == 0) && (g_levelHolds == 0)) switchLevel(CLOCK_LEVEL_ACTIVE);
+
+    __set_PRIMASK(primask);
+}
+
+/**
+ * @brief drop an active request. SYSCLK falls back to idle once the last one is released, unless a level hold is taken
+ *
+ */
+void clockReleaseActive(void)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    if ((g_activeRequests != 0) && (--g_activeRequests == 0) && (g_levelHolds == 0)) switchLevel(CLOCK_LEVEL_IDLE);
+
+    __set_PRIMASK(primask);
+}
+
+/**
+ * @brief freeze SYSCLK at its current level until the matching clockReleaseLevel(). never switches, so it is safe
+ *        from any context including ISRs
+ *
+ */
+void clockHoldLevel(void)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    g_levelHolds++;
+
+    __set_PRIMASK(primask);
+}
+
+/**
+ * @brief drop a level hold. once the last one is gone SYSCLK moves to the level the active requests ask for. task
+ *        context only, like clockRequestActive()
+ *
+ */
+void clockReleaseLevel(void)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    if ((g_levelHolds != 0) && (--g_levelHolds == 0))
+    {
+        EClockLevel_t level = (g_activeRequests != 0) ? CLOCK_LEVEL_ACTIVE : CLOCK_LEVEL_IDLE;
+
+        if (level != g_level) switchLevel(level);
+    }
+
+    __set_PRIMASK(primask);
+}
+
+/**
+ * @brief register a callback that reprograms clock-derived settings after a SYSCLK change
+ *
+ * @param fnCb callback, runs with interrupts masked
+ * @param pUserCtx passed to the callback
+ * @return false if CLOCK_MAX_NOTIFIERS are registered already
+ */
+bool clockRegisterNotifier(fnClockNotifier fnCb, void *pUserCtx)
+{
+    if (g_numNotifiers >= CLOCK_MAX_NOTIFIERS) return false;
+
+    g_notifiers[g_numNotifiers].pUserCtx = pUserCtx;
+    g_notifiers[g_numNotifiers].fnCb     = fnCb;
+    g_numNotifiers++;
+
+    return true;
+}
+
+/**
+ * @brief switch the LSE oscillator on. doesn't wait: a crystal can take up to 2s to start, and boards without one
+ *        simply never report ready
+ *
+ */
+void clockStartLSE(void)
+{
+    LL_APB1_GRP1_EnableClock(LL_APB1_GRP1_PERIPH_PWR);
+    LL_PWR_EnableBkUpAccess();
+    LL_RCC_LSE_SetDriveCapability(LL_RCC_LSEDRIVE_MEDIUMHIGH);
+    LL_RCC_LSE_Enable();
+}
+
+/**
+ * @brief check whether the LSE has started
+ *
+ * @return true if the LSE is running and can be used as reference
+ */
+bool clockLSEReady(void)
+{
+    return LL_RCC_LSE_IsReady() == 1;
+}
+
+/**
+ * @brief start measuring the HSI against CLOCK_LSE_MEASURE_PERIODS LSE periods on TIM16
+ *
+ * @return false if the LSE isn't running or a measurement is already in progress
+ */
+bool clockMeasureLSE(void)
+{
+    if (!clockLSEReady() || g_lseMeasuring) return false;
+
+    LL_APB2_GRP1_EnableClock(LL_APB2_GRP1_PERIPH_TIM16);
+
+    LL_TIM_DisableCounter(TIM16);
+    LL_TIM_SetPrescaler(TIM16, 0); // count the timer clock directly
+    LL_TIM_SetAutoReload(TIM16, 0xFFFF);
+    LL_TIM_SetRemap(TIM16, LL_TIM_TIM16_TI1_RMP_LSE);
+    LL_TIM_IC_Config(TIM16, LL_TIM_CHANNEL_CH1,
+                     LL_TIM_ACTIVEINPUT_DIRECTTI | LL_TIM_ICPSC_DIV8 | LL_TIM_IC_FILTER_FDIV1 |
+                         LL_TIM_IC_POLARITY_RISING);
+    LL_TIM_CC_EnableChannel(TIM16, LL_TIM_CHANNEL_CH1);
+
+    g_lseExpected  = (uint32_t)(((uint64_t)SystemCoreClock * CLOCK_LSE_MEASURE_PERIODS) / CLOCK_LSE_HZ);
+    g_lseTicks     = 0;
+    g_lseCaptures  = 0;
+    g_lseDone      = false;
+    g_lseMeasuring = true;
+
+    LL_TIM_ClearFlag_CC1(TIM16);
+    LL_TIM_ClearFlag_CC1OVR(TIM16);
+    LL_TIM_EnableIT_CC1(TIM16);
+
+    NVIC_SetPriority(TIM16_IRQn, 3);
+    NVIC_EnableIRQ(TIM16_IRQn);
+
+    LL_TIM_EnableCounter(TIM16);
+
+    return true;
+}
+
+/**
+ * @brief fetch the result of the last LSE measurement. the result is consumed
+ *
+ * @param[out] pTicks HSI-derived timer ticks counted over CLOCK_LSE_MEASURE_PERIODS LSE periods
+ * @param[out] pExpected ticks for an exact HSI at the current SystemCoreClock
+ * @return true if a new result was available
+ */
+bool clockLSEMeasurement(uint32_t *pTicks, uint32_t *pExpected)
+{
+    if (!g_lseDone) return false;
+
+    *pTicks    = g_lseTicks;
+    *pExpected = g_lseExpected;
+    g_lseDone  = false;
+
+    return true;
+}
+
+/**
+ * @brief read the HSI trimming value
+ *
+ * @return uint8_t current HSITRIM, 0..CLOCK_HSI_TRIM_MAX
+ */
+uint8_t clockGetHSITrim(void)
+{
+    return (uint8_t)LL_RCC_HSI_GetCalibTrimming();
+}
+
+/**
+ * @brief write the HSI trimming value. the PLL follows the HSI, so this shifts every clock in the system
+ *
+ * @param trim new HSITRIM, clamped to CLOCK_HSI_TRIM_MAX
+ */
+void clockSetHSITrim(uint8_t trim)
+{
+    LL_RCC_HSI_SetCalibTrimming((trim > CLOCK_HSI_TRIM_MAX) ? CLOCK_HSI_TRIM_MAX : trim);
+}
+
+/**
+ * @brief TIM16 capture: accumulate HSI ticks per 8 LSE periods until the measurement window is complete
+ *
+ */
+void TIM16_IRQHandler(void)
+{
+    if (!LL_TIM_IsActiveFlag_CC1(TIM16)) return;
+
+    rtosIsrEnter();
+
+    uint16_t stamp = (uint16_t)LL_TIM_IC_GetCaptureCH1(TIM16); // clears CC1IF
+
+    if (LL_TIM_IsActiveFlag_CC1OVR(TIM16))
+    {
+        // a capture was lost behind a higher priority ISR: the window is no longer contiguous, start over
+        LL_TIM_ClearFlag_CC1OVR(TIM16);
+        g_lseTicks    = 0;
+        g_lseCaptures = 0;
+    }
+
+    if (g_lseCaptures != 0) g_lseTicks += (uint16_t)(stamp - g_lseLastStamp);
+
+    g_lseLastStamp = stamp;
+
+    if (++g_lseCaptures > LSE_CAPTURES)
+    {
+        LL_TIM_DisableIT_CC1(TIM16);
+        LL_TIM_DisableCounter(TIM16);
+        g_lseMeasuring = false;
+        g_lseDone      = true;
+    }
+
+    rtosIsrExit();
+}
+
+//=====================================================================================================================
+// Statics
+//=====================================================================================================================
+
+/**
+ * @brief move SYSCLK to a new level and let every notifier catch up. call with interrupts masked
+ *
+ * @param level new level
+ *
+ * @note flash latency goes up before the switch to 64MHz and down after the switch to 16MHz (0WS is fine to 24MHz)
+ */
+static void switchLevel(EClockLevel_t level)
+{
+    if (level == CLOCK_LEVEL_ACTIVE)
+    {
+        LL_RCC_PLL_Enable();
+        while (LL_RCC_PLL_IsReady() != 1);
+
+        LL_FLASH_SetLatency(LL_FLASH_LATENCY_2);
+        while (LL_FLASH_GetLatency() != LL_FLASH_LATENCY_2);
+
+        LL_RCC_SetSysClkSource(LL_RCC_SYS_CLKSOURCE_PLL);
+        while (LL_RCC_GetSysClkSource() != LL_RCC_SYS_CLKSOURCE_STATUS_PLL);
+
+        LL_SetSystemCoreClock(CLOCK_ACTIVE_HZ);
+    }
+    else
+    {
+        LL_RCC_SetSysClkSource(LL_RCC_SYS_CLKSOURCE_HSI);
+        while (LL_RCC_GetSysClkSource() != LL_RCC_SYS_CLKSOURCE_STATUS_HSI);
+
+        LL_RCC_PLL_Disable();
+        LL_FLASH_SetLatency(LL_FLASH_LATENCY_0);
+
+        LL_SetSystemCoreClock(CLOCK_IDLE_HZ);
+    }
+
+    g_level = level;
+
+    // restart the tick period at the new rate; the tick in progress is stretched by at most one period
+    SysTick->LOAD = (SystemCoreClock / SYSTICK_HZ) - 1;
+    SysTick->VAL  = 0;
+
+    // an LSE window counted partly at the old rate is meaningless
+    if (g_lseMeasuring)
+    {
+        LL_TIM_DisableIT_CC1(TIM16);
+        LL_TIM_DisableCounter(TIM16);
+        g_lseMeasuring = false;
+    }
+
+    for (uint8_t i = 0; i < g_numNotifiers; i++)
+    {
+        g_notifiers[i].fnCb(SystemCoreClock, g_notifiers[i].pUserCtx);
+    }
+}
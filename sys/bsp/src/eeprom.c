@@ -0,0 +1,155 @@
+/**
+ * @file eeprom.c
+ *
+ * @brief settings EEPROM on I2C1
+ *
+ * blocking, polled accesses: fine at start-up and from low priority tasks. writes are split on page boundaries and
+ * each page is waited out by polling the device address. WP is only released for the duration of a write. once the
+ * scheduler runs, accesses from different tasks are serialised with a mutex
+ *
+ * the power-fail snapshot bypasses this and goes straight to the I2C1 DMA, see i2cTransferEepromDMA()
+ */
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include "eeprom.h"
+
+#include <FreeRTOS.h>
+#include <semphr.h>
+#include <task.h>
+
+#include "gpio.h"
+#include "i2c.h"
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define EEPROM_MAX_READ   255 // NBYTES is 8 bits wide
+#define EEPROM_ACK_POLLS  200 // address polls while a write cycle runs, ~20ms at 100kHz
+
+//=====================================================================================================================
+// Globals
+//=====================================================================================================================
+
+static StaticSemaphore_t g_eepromLockBuf;
+static SemaphoreHandle_t g_eepromLock = NULL;
+
+//=====================================================================================================================
+// Static protos
+//=====================================================================================================================
+
+static bool lockEeprom(void);
+static void unlockEeprom(bool);
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+/**
+ * @brief create the access lock. call before the first access
+ *
+ */
+void initEeprom(void)
+{
+    g_eepromLock = xSemaphoreCreateMutexStatic(&g_eepromLockBuf);
+}
+
+/**
+ * @brief read from the EEPROM
+ *
+ * @param addr memory address
+ * @param[out] pData read data
+ * @param len number of bytes
+ * @return false if the EEPROM didn't respond
+ */
+bool eepromRead(uint16_t addr, uint8_t *pData, size_t len)
+{
+    bool ok     = true;
+    bool locked = lockEeprom();
+
+    while (ok && (len > 0))
+    {
+        size_t chunk = (len > EEPROM_MAX_READ) ? EEPROM_MAX_READ : len;
+
+        ok = i2cReadMemory(I2C1, EEPROM_I2C_ADDR, addr, pData, chunk);
+
+        addr  += (uint16_t)chunk;
+        pData += chunk;
+        len   -= chunk;
+    }
+
+    unlockEeprom(locked);
+
+    return ok;
+}
+
+/**
+ * @brief write to the EEPROM and wait for the last write cycle to finish
+ *
+ * @param addr memory address
+ * @param pData data to write
+ * @param len number of bytes
+ * @return false if the EEPROM didn't respond or didn't finish a write cycle in time
+ */
+bool eepromWrite(uint16_t addr, const uint8_t *pData, size_t len)
+{
+    bool ok     = true;
+    bool locked = lockEeprom();
+
+    toggleEepromWP(true);
+
+    while (ok && (len > 0))
+    {
+        size_t pageLeft = EEPROM_PAGE_SIZE - (addr % EEPROM_PAGE_SIZE);
+        size_t chunk    = (len > pageLeft) ? pageLeft : len;
+
+        ok = i2cWriteMemory(I2C1, EEPROM_I2C_ADDR, addr, pData, chunk);
+
+        if (ok)
+        {
+            uint16_t polls = 0;
+
+            while (!i2cProbe(I2C1, EEPROM_I2C_ADDR) && (++polls < EEPROM_ACK_POLLS));
+
+            ok = (polls < EEPROM_ACK_POLLS);
+        }
+
+        addr  += (uint16_t)chunk;
+        pData += chunk;
+        len   -= chunk;
+    }
+
+    toggleEepromWP(false);
+    unlockEeprom(locked);
+
+    return ok;
+}
+
+//=====================================================================================================================
+// Statics
+//=====================================================================================================================
+
+/**
+ * @brief take the access lock if the scheduler runs. before that there is only one caller
+ *
+ * @return true if the lock was taken
+ */
+static bool lockEeprom(void)
+{
+    if ((g_eepromLock == NULL) || (xTaskGetSchedulerState() != taskSCHEDULER_RUNNING)) return false;
+
+    return xSemaphoreTake(g_eepromLock, portMAX_DELAY) == pdTRUE;
+}
+
+/**
+ * @brief release the access lock
+ *
+ * @param locked result of lockEeprom()
+ */
+static void unlockEeprom(bool locked)
+{
+    if (locked) (void)xSemaphoreGive(g_eepromLock);
+}
@@ -0,0 +1,419 @@
+/**
+ * @file flash.c
+ *
+ * @brief flash erase and programming, hardware CRC-32 and the boot records of the A/B image slots
+ *
+ * the G070 has a single flash bank: while a page is erased or a double word programmed, every fetch from flash stalls
+ * until the operation is done. nothing here runs from RAM, so the CPU just waits; DMA into RAM carries on, which is
+ * what lets the updater stream the next block in while the current one is programmed
+ *
+ * the CRC unit is set up for the common CRC-32 (zlib, Ethernet): reflected in and out and a final inversion, so host
+ * tools can use their stock implementation. it isn't shared, the updater and the boot records are its only users
+ *
+ * boot records are appended to one of two pages. switching slots is a single record write: a record torn by a power
+ * loss fails its CRC and the one before it still stands. when a page is full the other one is erased and used; the
+ * newest record stays in the full page until then. a torn double word can also carry a double ECC error, which raises
+ * an NMI on read: the bootloader's NMI handler hands it to flashHandleEccNmi() and bootRecordCompact() rewrites the
+ * pages, so the application never reads one
+ */
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include "flash.h"
+
+#include <stm32g0xx.h>
+#include <stm32g0xx_ll_bus.h>
+#include <stm32g0xx_ll_crc.h>
+
+//=====================================================================================================================
+// Defines
+//=====================================================================================================================
+
+#define FLASH_KEY_1           0x45670123UL
+#define FLASH_KEY_2           0xCDEF89ABUL
+#define FLASH_SR_ERRORS       (FLASH_SR_OPERR | FLASH_SR_PROGERR | FLASH_SR_WRPERR | FLASH_SR_PGAERR | \
+                               FLASH_SR_SIZERR | FLASH_SR_PGSERR | FLASH_SR_MISERR | FLASH_SR_FASTERR | \
+                               FLASH_SR_OPTVERR)
+
+#define RAM_START             0x20000000UL
+#define RAM_END               (RAM_START + (36 * 1024))
+
+#define BOOT_RECORD_PAGES     2
+#define RECORDS_PER_PAGE      (FLASH_PAGE_BYTES / sizeof(SBootRecord_t))
+
+_Static_assert((sizeof(SBootRecord_t) % 8) == 0, "boot records are programmed in double words");
+
+//=====================================================================================================================
+// Globals
+//=====================================================================================================================
+
+static volatile uint32_t g_eccErrors = 0;
+
+//=====================================================================================================================
+// Static protos
+//=====================================================================================================================
+
+static bool waitReady(void);
+static bool recordErased(const SBootRecord_t *);
+static bool recordValid(const SBootRecord_t *);
+static bool scanRecords(SBootRecord_t *, bool, uint32_t *, uint32_t *);
+static bool writeRecord(uint32_t, SBootRecord_t *, uint16_t);
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+/**
+ * @brief allow erasing and programming
+ *
+ */
+void flashUnlock(void)
+{
+    if (FLASH->CR & FLASH_CR_LOCK)
+    {
+        FLASH->KEYR = FLASH_KEY_1;
+        FLASH->KEYR = FLASH_KEY_2;
+    }
+}
+
+/**
+ * @brief lock the flash again
+ *
+ */
+void flashLock(void)
+{
+    FLASH->CR |= FLASH_CR_LOCK;
+}
+
+/**
+ * @brief erase a page. the flash must be unlocked. stalls every fetch from flash for up to 40ms
+ *
+ * @param page page number, 0-63
+ * @return false on a flash error
+ */
+bool flashErasePage(uint32_t page)
+{
+    if (!waitReady()) return false;
+
+    FLASH->CR = (FLASH->CR & ~FLASH_CR_PNB) | (page << FLASH_CR_PNB_Pos) | FLASH_CR_PER;
+    FLASH->CR |= FLASH_CR_STRT;
+
+    bool ok = waitReady();
+
+    FLASH->CR &= ~(FLASH_CR_PER | FLASH_CR_PNB);
+
+    return ok;
+}
+
+/**
+ * @brief program erased flash, a double word at a time. double words that are all ones are skipped, they already read
+ * as such. the flash must be unlocked
+ *
+ * @param address destination, 8-byte aligned
+ * @param pData source, 4-byte aligned
+ * @param len bytes, a multiple of 8
+ * @return false on a flash error
+ */
+bool flashProgram(uint32_t address, const void *pData, size_t len)
+{
+    const uint32_t *pWords = pData;
+
+    for (size_t i = 0; i < (len / sizeof(uint32_t)); i += 2)
+    {
+        if ((pWords[i] & pWords[i + 1]) == 0xFFFFFFFF) continue;
+
+        if (!waitReady()) return false;
+
+        FLASH->CR |= FLASH_CR_PG;
+
+        // the second word starts the operation, nothing else may write flash in between
+        uint32_t primask = __get_PRIMASK();
+
+        __disable_irq();
+        *(volatile uint32_t *)(address + (i * sizeof(uint32_t)))       = pWords[i];
+        __ISB();
+        *(volatile uint32_t *)(address + ((i + 1) * sizeof(uint32_t))) = pWords[i + 1];
+        __set_PRIMASK(primask);
+
+        bool ok = waitReady();
+
+        FLASH->CR &= ~FLASH_CR_PG;
+
+        if (!ok) return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief CRC-32 (zlib) with the CRC unit. not reentrant
+ *
+ * @param pData data, any alignment
+ * @param len bytes
+ * @return uint32_t CRC
+ */
+uint32_t flashCrc32(const void *pData, size_t len)
+{
+    const uint8_t *pBytes = pData;
+
+    LL_AHB1_GRP1_EnableClock(LL_AHB1_GRP1_PERIPH_CRC);
+    LL_CRC_SetPolynomialSize(CRC, LL_CRC_POLYLENGTH_32B);
+    LL_CRC_SetPolynomialCoef(CRC, LL_CRC_DEFAULT_CRC32_POLY);
+    LL_CRC_SetInitialData(CRC, LL_CRC_DEFAULT_CRC_INITVALUE);
+    LL_CRC_SetInputDataReverseMode(CRC, LL_CRC_INDATA_REVERSE_BYTE);
+    LL_CRC_SetOutputDataReverseMode(CRC, LL_CRC_OUTDATA_REVERSE_BIT);
+    LL_CRC_ResetCRCCalculationUnit(CRC);
+
+    for (; (len > 0) && ((uintptr_t)pBytes & 3); len--) LL_CRC_FeedData8(CRC, *pBytes++);
+
+    // the unit takes a word MSB first, the bytes are reflected one by one: swap so the first byte in memory goes first
+    for (; len >= sizeof(uint32_t); len -= sizeof(uint32_t), pBytes += sizeof(uint32_t))
+    {
+        LL_CRC_FeedData32(CRC, __REV(*(const uint32_t *)pBytes));
+    }
+
+    for (; len > 0; len--) LL_CRC_FeedData8(CRC, *pBytes++);
+
+    return ~LL_CRC_ReadData32(CRC);
+}
+
+/**
+ * @brief start address of an image slot
+ *
+ * @param slot slot
+ * @return uint32_t address of its vector table
+ */
+uint32_t flashSlotAddress(EFlashSlot_t slot)
+{
+    return FLASH_PAGE_ADDRESS((slot == FLASH_SLOT_B) ? FLASH_SLOT_B_PAGE : FLASH_SLOT_A_PAGE);
+}
+
+/**
+ * @brief the slot this code runs from, taken from the vector table the bootloader set up
+ *
+ * @return EFlashSlot_t slot
+ */
+EFlashSlot_t flashRunningSlot(void)
+{
+    return (SCB->VTOR >= flashSlotAddress(FLASH_SLOT_B)) ? FLASH_SLOT_B : FLASH_SLOT_A;
+}
+
+/**
+ * @brief check the image a boot record points to: plausible vectors and the CRC over its whole length
+ *
+ * @param pRecord boot record
+ * @return true if the image can be started
+ */
+bool flashImageValid(const SBootRecord_t *pRecord)
+{
+    uint32_t        start    = flashSlotAddress((EFlashSlot_t)pRecord->slot);
+    const uint32_t *pVectors = (const uint32_t *)start;
+
+    if ((pRecord->length < (2 * sizeof(uint32_t))) || (pRecord->length > FLASH_SLOT_BYTES)) return false;
+
+    uint32_t eccErrors = g_eccErrors;
+
+    if ((pVectors[0] <= RAM_START) || (pVectors[0] > RAM_END)) return false;
+    if ((pVectors[1] < start) || (pVectors[1] >= (start + pRecord->length))) return false;
+
+    return (flashCrc32(pVectors, pRecord->length) == pRecord->imageCrc) && (g_eccErrors == eccErrors);
+}
+
+/**
+ * @brief find the newest valid boot record
+ *
+ * @param pRecord filled in with the record
+ * @param goodOnly only look at records of confirmed images
+ * @return false if there is none
+ */
+bool bootRecordNewest(SBootRecord_t *pRecord, bool goodOnly)
+{
+    uint32_t page;
+    uint32_t freeAddress;
+
+    return scanRecords(pRecord, goodOnly, &page, &freeAddress);
+}
+
+/**
+ * @brief append a boot record, newer than all the others. the flash must be unlocked
+ *
+ * @param pRecord record to write, seq and crc are filled in
+ * @return false on a flash error
+ */
+bool bootRecordAppend(SBootRecord_t *pRecord)
+{
+    SBootRecord_t newest;
+    uint32_t      page;
+    uint32_t      freeAddress;
+    uint16_t      seq = scanRecords(&newest, false, &page, &freeAddress) ? (uint16_t)(newest.seq + 1) : 0;
+
+    if (freeAddress == 0)
+    {
+        // full: the other page only holds older records
+        uint32_t other = (page == FLASH_BOOT_RECORD_PAGE) ? (FLASH_BOOT_RECORD_PAGE + 1) : FLASH_BOOT_RECORD_PAGE;
+
+        if (!flashErasePage(other)) return false;
+        freeAddress = FLASH_PAGE_ADDRESS(other);
+    }
+
+    return writeRecord(freeAddress, pRecord, seq);
+}
+
+/**
+ * @brief rewrite the boot record pages with just the newest record, dropping torn ones. bootloader only, after an ECC
+ * error in a record. the flash must be unlocked
+ *
+ * @return false on a flash error
+ */
+bool bootRecordCompact(void)
+{
+    SBootRecord_t newest;
+    uint32_t      page;
+    uint32_t      freeAddress;
+    bool          found = scanRecords(&newest, false, &page, &freeAddress);
+    uint32_t      other = (page == FLASH_BOOT_RECORD_PAGE) ? (FLASH_BOOT_RECORD_PAGE + 1) : FLASH_BOOT_RECORD_PAGE;
+
+    // the newest record lives on in its page until the copy is written
+    if (!flashErasePage(other)) return false;
+    if (found && !writeRecord(FLASH_PAGE_ADDRESS(other), &newest, (uint16_t)(newest.seq + 1))) return false;
+
+    return flashErasePage(page);
+}
+
+/**
+ * @brief NMI hook: acknowledge a double ECC error on a flash read, so the read completes and the caller can tell
+ *
+ * @return false if the NMI has another cause
+ */
+bool flashHandleEccNmi(void)
+{
+    if (!(FLASH->ECCR & FLASH_ECCR_ECCD)) return false;
+
+    FLASH->ECCR |= FLASH_ECCR_ECCD; // write 1 to clear
+    g_eccErrors++;
+
+    return true;
+}
+
+/**
+ * @brief double ECC errors seen since reset
+ *
+ * @return uint32_t count
+ */
+uint32_t flashEccErrors(void)
+{
+    return g_eccErrors;
+}
+
+//=====================================================================================================================
+// Statics
+//=====================================================================================================================
+
+/**
+ * @brief wait for the flash to finish, then collect and clear the error flags
+ *
+ * @return false if the last operation failed
+ */
+static bool waitReady(void)
+{
+    while (FLASH->SR & (FLASH_SR_BSY1 | FLASH_SR_CFGBSY)) { /* stalls anyway */ }
+
+    uint32_t errors = FLASH->SR & FLASH_SR_ERRORS;
+
+    FLASH->SR = errors | FLASH_SR_EOP; // write 1 to clear
+
+    return errors == 0;
+}
+
+/**
+ * @brief check whether a record slot was never written
+ *
+ */
+static bool recordErased(const SBootRecord_t *pRecord)
+{
+    const uint32_t *pWords = (const uint32_t *)pRecord;
+
+    for (size_t i = 0; i < (sizeof(SBootRecord_t) / sizeof(uint32_t)); i++)
+    {
+        if (pWords[i] != 0xFFFFFFFF) return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief check a record's CRC and fields
+ *
+ */
+static bool recordValid(const SBootRecord_t *pRecord)
+{
+    return (flashCrc32(pRecord, offsetof(SBootRecord_t, crc)) == pRecord->crc) &&
+           ((pRecord->slot == FLASH_SLOT_A) || (pRecord->slot == FLASH_SLOT_B)) &&
+           ((pRecord->state == BOOT_STATE_TRIAL) || (pRecord->state == BOOT_STATE_TRYING) ||
+            (pRecord->state == BOOT_STATE_GOOD));
+}
+
+/**
+ * @brief walk both record pages
+ *
+ * @param pNewest newest valid record
+ * @param goodOnly skip records of unconfirmed images
+ * @param pPage page of the newest record, the first record page if there is none
+ * @param pFreeAddress first unwritten record slot in that page, 0 if it's full
+ * @return false if no valid record was found
+ */
+static bool scanRecords(SBootRecord_t *pNewest, bool goodOnly, uint32_t *pPage, uint32_t *pFreeAddress)
+{
+    uint32_t freeAddress[BOOT_RECORD_PAGES] = { 0 };
+    bool     found                          = false;
+
+    *pPage = FLASH_BOOT_RECORD_PAGE;
+
+    for (uint32_t i = 0; i < BOOT_RECORD_PAGES; i++)
+    {
+        uint32_t page = FLASH_BOOT_RECORD_PAGE + i;
+
+        for (uint32_t n = 0; n < RECORDS_PER_PAGE; n++)
+        {
+            uint32_t      address   = FLASH_PAGE_ADDRESS(page) + (n * sizeof(SBootRecord_t));
+            uint32_t      eccErrors = g_eccErrors;
+            SBootRecord_t record    = *(const SBootRecord_t *)address;
+
+            if (g_eccErrors != eccErrors) continue; // torn, see bootRecordCompact()
+
+            // records are appended in order, everything after the first unwritten slot is unwritten too
+            if (recordErased(&record))
+            {
+                freeAddress[i] = address;
+                break;
+            }
+
+            if (!recordValid(&record) || (goodOnly && (record.state != BOOT_STATE_GOOD))) continue;
+
+            if (!found || ((int16_t)(record.seq - pNewest->seq) > 0))
+            {
+                *pNewest = record;
+                *pPage   = page;
+                found    = true;
+            }
+        }
+    }
+
+    *pFreeAddress = freeAddress[*pPage - FLASH_BOOT_RECORD_PAGE];
+
+    return found;
+}
+
+/**
+ * @brief seal a record with its seq and CRC and program it
+ *
+ */
+static bool writeRecord(uint32_t address, SBootRecord_t *pRecord, uint16_t seq)
+{
+    pRecord->seq = seq;
+    pRecord->crc = flashCrc32(pRecord, offsetof(SBootRecord_t, crc));
+
+    return flashProgram(address, pRecord, sizeof(SBootRecord_t));
+}
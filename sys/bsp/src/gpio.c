@@ -10,6 +10,7 @@
 //=====================================================================================================================
 
 #include "gpio.h"
+#include "timer.h"
 
 #include <stdbool.h>
 #include <stddef.h>
@@ -36,13 +37,25 @@
 static STimerPeriphPinDef_t  *g_pCurrentPeriphPinDefs  = NULL;
 static STimerGenericPinDef_t *g_pCurrentGenericPinDefs = NULL;
 
+static fnGpioCallback         g_fnZeroCrossCallback    = NULL;
+static void                  *g_pZeroCrossCtx          = NULL;
+
+static fnGpioCallback         g_fnStartTriggerCallback = NULL;
+static void                  *g_pStartTriggerCtx       = NULL;
+
 //=====================================================================================================================
 // Function prototypes
 //=====================================================================================================================
 
 static void initGPIO_RS232(SUSARTPinDef_t *);
+static void initGPIO_SyncLink(SUSARTPinDef_t *);
 static void initGPIO_I2C(SI2CPinDef_t *);
 static void initGPIO_SPI(SSPIPinDef_t *);
+static void initGPIO_LampChannels(SLampChannelPinDef_t *);
+static void initGPIO_ZeroCross(SZeroCrossPinDef_t *);
+static void initGPIO_StartTrigger(SEXTIGPIOType_t *);
+static void handleStartTrigger(void);
+static void initGPIO_Analog(SAnalogPinDef_t *);
 static void initGPIO_Generic(SGenericGPIOPin_t *);
 
 //=====================================================================================================================
@@ -59,6 +72,30 @@ void initGPIO_peripherals(STimerPeriphPinDef_t *pPinDefs)
     //initGPIO_I2C(g_pCurrentPeriphPinDefs->pI2cDispPinDef);
     initGPIO_I2C(g_pCurrentPeriphPinDefs->pI2cEepromPinDef);
     initGPIO_SPI(g_pCurrentPeriphPinDefs->pSpiDisplayDef);
+    initGPIO_LampChannels(g_pCurrentPeriphPinDefs->pLampChannelDef);
+
+    if (g_pCurrentPeriphPinDefs->pZeroCrossDef != NULL)
+    {
+        initGPIO_ZeroCross(g_pCurrentPeriphPinDefs->pZeroCrossDef);
+    }
+
+    if (g_pCurrentPeriphPinDefs->pStartTriggerDef != NULL)
+    {
+        initGPIO_StartTrigger(&g_pCurrentPeriphPinDefs->pStartTriggerDef->footswitch);
+        initGPIO_StartTrigger(&g_pCurrentPeriphPinDefs->pStartTriggerDef->startButton);
+    }
+
+    initGPIO_Analog(g_pCurrentPeriphPinDefs->pPhotometerDef);
+
+    if (g_pCurrentPeriphPinDefs->pConsoleDef != NULL)
+    {
+        initGPIO_RS232(g_pCurrentPeriphPinDefs->pConsoleDef);
+    }
+
+    if (g_pCurrentPeriphPinDefs->pSyncLinkDef != NULL)
+    {
+        initGPIO_SyncLink(g_pCurrentPeriphPinDefs->pSyncLinkDef);
+    }
 }
 
 void initGPIO_generic(STimerGenericPinDef_t *pPinDefs)
@@ -75,8 +112,10 @@ void initGPIO_generic(STimerGenericPinDef_t *pPinDefs)
     initGPIO_Generic(g_pCurrentGenericPinDefs->pButtonStartTimer);
     initGPIO_Generic(g_pCurrentGenericPinDefs->pButtonMode);
     initGPIO_Generic(g_pCurrentGenericPinDefs->pPinOptocoupler);
+    initGPIO_Generic(g_pCurrentGenericPinDefs->pPinSafelight);
     initGPIO_Generic(g_pCurrentGenericPinDefs->pFootswitchDetect);
     initGPIO_Generic(g_pCurrentGenericPinDefs->pFootswitchInput);
+    initGPIO_Generic(g_pCurrentGenericPinDefs->pPinBuzzer);
 }
 
 void toggleEepromWP(bool disableWP)
@@ -95,6 +134,22 @@ void toggleOptocoupler(bool enableOutput)
                                           g_pCurrentGenericPinDefs->pPinOptocoupler->pinPort.pin);
 }
 
+void toggleSafelight(bool enableOutput)
+{
+    enableOutput ? LL_GPIO_SetOutputPin(g_pCurrentGenericPinDefs->pPinSafelight->pinPort.port,
+                                        g_pCurrentGenericPinDefs->pPinSafelight->pinPort.pin) :
+                   LL_GPIO_ResetOutputPin(g_pCurrentGenericPinDefs->pPinSafelight->pinPort.port,
+                                          g_pCurrentGenericPinDefs->pPinSafelight->pinPort.pin);
+}
+
+void toggleBuzzer(bool enableOutput)
+{
+    enableOutput ? LL_GPIO_SetOutputPin(g_pCurrentGenericPinDefs->pPinBuzzer->pinPort.port,
+                                        g_pCurrentGenericPinDefs->pPinBuzzer->pinPort.pin) :
+                   LL_GPIO_ResetOutputPin(g_pCurrentGenericPinDefs->pPinBuzzer->pinPort.port,
+                                          g_pCurrentGenericPinDefs->pPinBuzzer->pinPort.pin);
+}
+
 void toggleDisplayDataCommand(bool isCommand)
 {
     isCommand ? LL_GPIO_ResetOutputPin(g_pCurrentPeriphPinDefs->pSpiDisplayDef->dcPin.port,
@@ -119,6 +174,75 @@ void selectDisplay(bool select)
                                      g_pCurrentPeriphPinDefs->pSpiDisplayDef->csPin.pin);
 }
 
+/**
+ * @brief register the handler for zero-cross edges. runs in ISR context; the edge timestamp is in the timer capture
+ *
+ */
+void registerZeroCrossCallback(fnGpioCallback fnCb, void *pUserCtx)
+{
+    g_pZeroCrossCtx       = pUserCtx;
+    g_fnZeroCrossCallback = fnCb;
+}
+
+/**
+ * @brief register the handler for footswitch and start button presses. runs in ISR context on every falling edge,
+ *        contact bounce included
+ *
+ */
+void registerStartTriggerCallback(fnGpioCallback fnCb, void *pUserCtx)
+{
+    g_pStartTriggerCtx       = pUserCtx;
+    g_fnStartTriggerCallback = fnCb;
+}
+
+/**
+ * @brief simulate a start input press: raise the footswitch EXTI line in software, so the press takes the same path
+ *        through the EXTI handler as a real one. used to replay recorded sessions
+ *
+ * @return false if no start inputs are fitted
+ */
+bool injectStartTrigger(void)
+{
+    SStartTriggerPinDef_t *pTrigger = g_pCurrentPeriphPinDefs->pStartTriggerDef;
+
+    if (pTrigger == NULL) return false;
+
+    LL_EXTI_GenerateSWI_0_31(pTrigger->footswitch.extiLine); // sets the rising pending flag
+
+    return true;
+}
+
+void EXTI0_1_IRQHandler(void)
+{
+    rtosIsrEnter();
+    handleStartTrigger();
+    rtosIsrExit();
+}
+
+void EXTI2_3_IRQHandler(void)
+{
+    rtosIsrEnter();
+    handleStartTrigger();
+    rtosIsrExit();
+}
+
+void EXTI4_15_IRQHandler(void)
+{
+    rtosIsrEnter();
+
+    SZeroCrossPinDef_t *pZeroCross = g_pCurrentPeriphPinDefs->pZeroCrossDef;
+
+    handleStartTrigger();
+
+    if ((pZeroCross != NULL) && LL_EXTI_IsActiveRisingFlag_0_31(pZeroCross->input.extiLine))
+    {
+        LL_EXTI_ClearRisingFlag_0_31(pZeroCross->input.extiLine);
+        if (g_fnZeroCrossCallback) g_fnZeroCrossCallback(g_pZeroCrossCtx);
+    }
+
+    rtosIsrExit();
+}
+
 //=====================================================================================================================
 // Statics
 //=====================================================================================================================
@@ -143,6 +267,24 @@ static void initGPIO_RS232(SUSARTPinDef_t *pUSARTDef)
     LL_GPIO_Init(pUSARTDef->rxPin.port, &consoleGpio);
 }
 
+/**
+ * @brief initialize the multi-unit sync link: the TX pin of a half-duplex USART, open-drain so every unit can share
+ *        one wire
+ */
+static void initGPIO_SyncLink(SUSARTPinDef_t *pUSARTDef)
+{
+    LL_GPIO_InitTypeDef linkGpio = {
+        .Pin        = pUSARTDef->txPin.pin,
+        .Mode       = LL_GPIO_MODE_ALTERNATE,
+        .Speed      = LL_GPIO_SPEED_FREQ_HIGH,
+        .OutputType = LL_GPIO_OUTPUT_OPENDRAIN,
+        .Pull       = LL_GPIO_PULL_UP, // keeps an unconnected link idle, the wire itself needs a stronger pullup
+        .Alternate  = pUSARTDef->pinAFMode,
+    };
+
+    LL_GPIO_Init(pUSARTDef->txPin.port, &linkGpio);
+}
+
 /**
  * @brief initialize I2C GPIOs
  *
@@ -211,6 +353,108 @@ static void initGPIO_SPI(SSPIPinDef_t *pSPIDef)
     LL_GPIO_Init(pSPIDef->rstPin.port, &spiGpio);
 }
 
+/**
+ * @brief initialize timer-driven lamp outputs. pulled down so the lamps stay off while the timer is unclocked
+ *
+ */
+static void initGPIO_LampChannels(SLampChannelPinDef_t *pLampDef)
+{
+    LL_GPIO_InitTypeDef lampGpio = {
+        .Mode       = LL_GPIO_MODE_ALTERNATE,
+        .Speed      = LL_GPIO_SPEED_FREQ_HIGH,
+        .OutputType = LL_GPIO_OUTPUT_PUSHPULL,
+        .Pull       = LL_GPIO_PULL_DOWN,
+        .Alternate  = pLampDef->pinAFMode,
+    };
+
+    for (size_t i = 0; i < sizeof(pLampDef->channelPins) / sizeof(pLampDef->channelPins[0]); i++)
+    {
+        lampGpio.Pin = pLampDef->channelPins[i].pin;
+        LL_GPIO_Init(pLampDef->channelPins[i].port, &lampGpio);
+    }
+}
+
+/**
+ * @brief initialize the zero-cross detector input. the pin stays in AF mode for the timer capture; the EXTI taps the
+ *        same input so the edge also raises an interrupt
+ *
+ */
+static void initGPIO_ZeroCross(SZeroCrossPinDef_t *pZeroCrossDef)
+{
+    LL_GPIO_InitTypeDef zcGpio = {
+        .Pin        = pZeroCrossDef->input.gpio.pin,
+        .Mode       = LL_GPIO_MODE_ALTERNATE,
+        .Speed      = LL_GPIO_SPEED_FREQ_LOW,
+        .OutputType = LL_GPIO_OUTPUT_PUSHPULL,
+        .Pull       = LL_GPIO_PULL_DOWN, // detector absent -> no edges
+        .Alternate  = pZeroCrossDef->pinAFMode,
+    };
+
+    LL_GPIO_Init(pZeroCrossDef->input.gpio.port, &zcGpio);
+
+    LL_EXTI_SetEXTISource(pZeroCrossDef->input.extiPort, pZeroCrossDef->input.extiConfigLine);
+    LL_EXTI_EnableRisingTrig_0_31(pZeroCrossDef->input.extiLine);
+    LL_EXTI_EnableIT_0_31(pZeroCrossDef->input.extiLine);
+
+    NVIC_SetPriority(EXTI4_15_IRQn, 0);
+    NVIC_EnableIRQ(EXTI4_15_IRQn);
+}
+
+/**
+ * @brief route a start input to its EXTI line, falling edge. the pin itself is set up as a generic input
+ *
+ */
+static void initGPIO_StartTrigger(SEXTIGPIOType_t *pInput)
+{
+    IRQn_Type irq = (pInput->extiLine <= LL_EXTI_LINE_1) ? EXTI0_1_IRQn :
+                    (pInput->extiLine <= LL_EXTI_LINE_3) ? EXTI2_3_IRQn : EXTI4_15_IRQn;
+
+    LL_EXTI_SetEXTISource(pInput->extiPort, pInput->extiConfigLine);
+    LL_EXTI_EnableFallingTrig_0_31(pInput->extiLine);
+    LL_EXTI_EnableIT_0_31(pInput->extiLine);
+
+    NVIC_SetPriority(irq, 0); // the press starts the lamp timer, keep it ahead of everything else
+    NVIC_EnableIRQ(irq);
+}
+
+/**
+ * @brief dispatch pending start input edges, from whichever EXTI handler they share
+ *
+ */
+static void handleStartTrigger(void)
+{
+    SStartTriggerPinDef_t *pTrigger = g_pCurrentPeriphPinDefs->pStartTriggerDef;
+
+    if (pTrigger == NULL) return;
+
+    // LL_EXTI_IsActiveFallingFlag_0_31() wants every line of the mask pending, either one is enough here. the rising
+    // edge is not enabled on these lines, a rising flag comes from injectStartTrigger()
+    uint32_t lines   = pTrigger->footswitch.extiLine | pTrigger->startButton.extiLine;
+    uint32_t pending = (EXTI->FPR1 | EXTI->RPR1) & lines;
+
+    if (pending != 0)
+    {
+        LL_EXTI_ClearFallingFlag_0_31(pending);
+        LL_EXTI_ClearRisingFlag_0_31(pending);
+        if (g_fnStartTriggerCallback) g_fnStartTriggerCallback(g_pStartTriggerCtx);
+    }
+}
+
+/**
+ * @brief initialize an analog sensor input
+ *
+ */
+static void initGPIO_Analog(SAnalogPinDef_t *pAnalogDef)
+{
+    LL_GPIO_InitTypeDef analogGpio = {
+        .Pin  = pAnalogDef->pin.pin,
+        .Mode = LL_GPIO_MODE_ANALOG,
+        .Pull = LL_GPIO_PULL_NO,
+    };
+
+    LL_GPIO_Init(pAnalogDef->pin.port, &analogGpio);
+}
+
 static void initGPIO_Generic(SGenericGPIOPin_t *pGenericPinDef)
 {
     LL_GPIO_InitTypeDef gpio = {
@@ -10,6 +10,7 @@
 //=====================================================================================================================
 
 #include "i2c.h"
+#include "timer.h"
 
 #include <stm32g0xx_ll_bus.h>
 #include <stm32g0xx_ll_gpio.h>
@@ -25,6 +26,8 @@
 
 #define GET_BIT_POS(num) (((num) == 0) ? 0 : __builtin_ctzl(num)) // builtin_ctzl counts trailing zeroes
 
+#define I2C_POLL_TIMEOUT 100000 // flag polls before a blocking transfer gives up, ~10ms at the idle clock
+
 //=====================================================================================================================
 // Types
 //=====================================================================================================================
@@ -43,6 +46,8 @@ static SI2CTransfer_t *g_pCurrentTransfer_I2C2 = NULL;
 // Function prototypes
 //=====================================================================================================================
 
+static bool i2cWaitFlag(I2C_TypeDef *, uint32_t);
+
 //=====================================================================================================================
 // External functions
 //=====================================================================================================================
@@ -53,7 +58,7 @@ static SI2CTransfer_t *g_pCurrentTransfer_I2C2 = NULL;
  * Initializes an I2C peripheral given its timing and whether it runs at 1MHz.
  *
  * @param[in] pI2CPeriph Pointer to the I2C peripheral to be initialized, either I2C1 or I2C2.
- * @param[in] timing The value to be written to the I2C_TIMINGR register.
+ * @param[in] timing The value to be written to the I2C_TIMINGR register. I2C1 is clocked from HSI16, I2C2 from PCLK.
  * @param[in] isDisplay Whether the I2C peripheral is used for display. If true, fast mode plus + DMA is enabled.
  */
 void i2cInit(I2C_TypeDef *pI2CPeriph, uint32_t timing, bool isDisplay)
@@ -61,6 +66,7 @@ void i2cInit(I2C_TypeDef *pI2CPeriph, uint32_t timing, bool isDisplay)
     if (pI2CPeriph == I2C1)
     {
         LL_APB1_GRP1_EnableClock(LL_APB1_GRP1_PERIPH_I2C1);
+        LL_RCC_SetI2CClockSource(LL_RCC_I2C1_CLKSOURCE_HSI);
         NVIC_SetPriority(I2C1_IRQn, 0);
         NVIC_EnableIRQ(I2C1_IRQn);
     }
@@ -100,7 +106,7 @@ void i2cTransmit(I2C_TypeDef *pI2CPeriph, SI2CTransfer_t *pI2CTransferCtx)
     pI2CPeriph->TXDR = *(pI2CTransferCtx->pBuffer++); // fix for erratum 2.8.6
     pI2CTransferCtx->transferred = 0;
 
-    if (pI2CPeriph == I2C1) { g_pCurrentTransfer_I2C1 = pI2CTransferCtx; }
+    if (pI2CPeriph == I2C1) { LL_I2C_DisableDMAReq_TX(I2C1); LL_I2C_EnableIT_TX(I2C1); g_pCurrentTransfer_I2C1 = pI2CTransferCtx; }
     else { LL_I2C_DisableDMAReq_TX(I2C2); g_pCurrentTransfer_I2C2 = pI2CTransferCtx; }
 
     uint16_t chunkSize = (pI2CTransferCtx->len > 255) ? 255 : pI2CTransferCtx->len;
@@ -108,6 +114,189 @@ void i2cTransmit(I2C_TypeDef *pI2CPeriph, SI2CTransfer_t *pI2CTransferCtx)
     LL_I2C_HandleTransfer(pI2CPeriph, pI2CTransferCtx->address, LL_I2C_ADDRSLAVE_7BIT, chunkSize, LL_I2C_MODE_AUTOEND, LL_I2C_GENERATE_START_WRITE);
 }
 
+/**
+ * @brief blocking read from a device with a 16-bit register/memory address, e.g. the EEPROM
+ *
+ * polls with the peripheral's IRQ masked: don't use it while an interrupt-driven transfer is running on the same bus
+ *
+ * @param pI2CPeriph I2C1 or I2C2
+ * @param address 8-bit device address
+ * @param memAddr memory address, sent MSB first
+ * @param[out] pData read data
+ * @param len number of bytes, 1..255
+ * @return false on NACK or timeout
+ */
+bool i2cReadMemory(I2C_TypeDef *pI2CPeriph, uint8_t address, uint16_t memAddr, uint8_t *pData, size_t len)
+{
+    IRQn_Type irq = (pI2CPeriph == I2C1) ? I2C1_IRQn : I2C2_IRQn;
+    bool      ok  = false;
+
+    if ((len == 0) || (len > 255)) return false;
+
+    NVIC_DisableIRQ(irq);
+
+    LL_I2C_ClearFlag_TXE(pI2CPeriph); // flush a stale TXDR byte
+    LL_I2C_HandleTransfer(pI2CPeriph, address, LL_I2C_ADDRSLAVE_7BIT, 2, LL_I2C_MODE_SOFTEND,
+                          LL_I2C_GENERATE_START_WRITE);
+
+    if (i2cWaitFlag(pI2CPeriph, I2C_ISR_TXIS))
+    {
+        LL_I2C_TransmitData8(pI2CPeriph, (uint8_t)(memAddr >> 8));
+
+        if (i2cWaitFlag(pI2CPeriph, I2C_ISR_TXIS))
+        {
+            LL_I2C_TransmitData8(pI2CPeriph, (uint8_t)memAddr);
+            ok = i2cWaitFlag(pI2CPeriph, I2C_ISR_TC);
+        }
+    }
+
+    if (ok)
+    {
+        LL_I2C_HandleTransfer(pI2CPeriph, address, LL_I2C_ADDRSLAVE_7BIT, len, LL_I2C_MODE_AUTOEND,
+                              LL_I2C_GENERATE_RESTART_7BIT_READ);
+
+        for (size_t i = 0; ok && (i < len); i++)
+        {
+            ok = i2cWaitFlag(pI2CPeriph, I2C_ISR_RXNE);
+            if (ok) pData[i] = LL_I2C_ReceiveData8(pI2CPeriph);
+        }
+    }
+    else if (!LL_I2C_IsActiveFlag_STOP(pI2CPeriph))
+    {
+        LL_I2C_GenerateStopCondition(pI2CPeriph);
+    }
+
+    // a NACK ends with an automatic STOP as well
+    (void)i2cWaitFlag(pI2CPeriph, I2C_ISR_STOPF);
+    LL_I2C_ClearFlag_STOP(pI2CPeriph);
+    LL_I2C_ClearFlag_NACK(pI2CPeriph);
+
+    NVIC_ClearPendingIRQ(irq);
+    NVIC_EnableIRQ(irq);
+
+    return ok;
+}
+
+/**
+ * @brief blocking write to a device with a 16-bit register/memory address. same restrictions as i2cReadMemory()
+ *
+ * @param pI2CPeriph I2C1 or I2C2
+ * @param address 8-bit device address
+ * @param memAddr memory address, sent MSB first
+ * @param pData data to write
+ * @param len number of bytes, 1..253
+ * @return false on NACK or timeout
+ */
+bool i2cWriteMemory(I2C_TypeDef *pI2CPeriph, uint8_t address, uint16_t memAddr, const uint8_t *pData, size_t len)
+{
+    IRQn_Type irq = (pI2CPeriph == I2C1) ? I2C1_IRQn : I2C2_IRQn;
+    bool      ok  = true;
+
+    if ((len == 0) || (len > 253)) return false;
+
+    NVIC_DisableIRQ(irq);
+
+    LL_I2C_ClearFlag_TXE(pI2CPeriph);
+    LL_I2C_HandleTransfer(pI2CPeriph, address, LL_I2C_ADDRSLAVE_7BIT, len + 2, LL_I2C_MODE_AUTOEND,
+                          LL_I2C_GENERATE_START_WRITE);
+
+    for (size_t i = 0; ok && (i < (len + 2)); i++)
+    {
+        uint8_t byte = (i == 0) ? (uint8_t)(memAddr >> 8) : ((i == 1) ? (uint8_t)memAddr : pData[i - 2]);
+
+        ok = i2cWaitFlag(pI2CPeriph, I2C_ISR_TXIS);
+        if (ok) LL_I2C_TransmitData8(pI2CPeriph, byte);
+    }
+
+    if (!ok && !LL_I2C_IsActiveFlag_STOP(pI2CPeriph) && !LL_I2C_IsActiveFlag_NACK(pI2CPeriph))
+    {
+        LL_I2C_GenerateStopCondition(pI2CPeriph);
+    }
+
+    ok = i2cWaitFlag(pI2CPeriph, I2C_ISR_STOPF) && ok && !LL_I2C_IsActiveFlag_NACK(pI2CPeriph);
+    LL_I2C_ClearFlag_STOP(pI2CPeriph);
+    LL_I2C_ClearFlag_NACK(pI2CPeriph);
+
+    NVIC_ClearPendingIRQ(irq);
+    NVIC_EnableIRQ(irq);
+
+    return ok;
+}
+
+/**
+ * @brief check whether a device acknowledges its address, e.g. to poll for the end of an EEPROM write cycle. same
+ *        restrictions as i2cReadMemory()
+ *
+ * @param pI2CPeriph I2C1 or I2C2
+ * @param address 8-bit device address
+ * @return true if the device ACKed
+ */
+bool i2cProbe(I2C_TypeDef *pI2CPeriph, uint8_t address)
+{
+    IRQn_Type irq = (pI2CPeriph == I2C1) ? I2C1_IRQn : I2C2_IRQn;
+    bool      ack;
+
+    NVIC_DisableIRQ(irq);
+
+    LL_I2C_HandleTransfer(pI2CPeriph, address, LL_I2C_ADDRSLAVE_7BIT, 0, LL_I2C_MODE_AUTOEND,
+                          LL_I2C_GENERATE_START_WRITE);
+
+    ack = i2cWaitFlag(pI2CPeriph, I2C_ISR_STOPF) && !LL_I2C_IsActiveFlag_NACK(pI2CPeriph);
+    LL_I2C_ClearFlag_STOP(pI2CPeriph);
+    LL_I2C_ClearFlag_NACK(pI2CPeriph);
+
+    NVIC_ClearPendingIRQ(irq);
+    NVIC_EnableIRQ(irq);
+
+    return ack;
+}
+
+/**
+ * @brief set up I2C1 TX on DMA channel 3 for the EEPROM emergency write. no DMA IRQ: the transfer is fired and left
+ *        to complete on its own
+ *
+ */
+void i2cInitEepromDMA(void)
+{
+    LL_AHB1_GRP1_EnableClock(LL_AHB1_GRP1_PERIPH_DMA1);
+    LL_DMA_SetPeriphRequest(DMA1, LL_DMA_CHANNEL_3, LL_DMAMUX_REQ_I2C1_TX);
+    LL_DMA_SetDataTransferDirection(DMA1, LL_DMA_CHANNEL_3, LL_DMA_DIRECTION_MEMORY_TO_PERIPH);
+    LL_DMA_SetChannelPriorityLevel(DMA1, LL_DMA_CHANNEL_3, LL_DMA_PRIORITY_VERYHIGH);
+    LL_DMA_SetMode(DMA1, LL_DMA_CHANNEL_3, LL_DMA_MODE_NORMAL);
+    LL_DMA_SetPeriphIncMode(DMA1, LL_DMA_CHANNEL_3, LL_DMA_PERIPH_NOINCREMENT);
+    LL_DMA_SetMemoryIncMode(DMA1, LL_DMA_CHANNEL_3, LL_DMA_MEMORY_INCREMENT);
+    LL_DMA_SetPeriphSize(DMA1, LL_DMA_CHANNEL_3, LL_DMA_PDATAALIGN_BYTE);
+    LL_DMA_SetMemorySize(DMA1, LL_DMA_CHANNEL_3, LL_DMA_MDATAALIGN_BYTE);
+    LL_DMA_ConfigAddresses(DMA1, LL_DMA_CHANNEL_3, 0,
+        (uint32_t)LL_I2C_DMA_GetRegAddr(I2C1, LL_I2C_DMA_REG_DATA_TRANSMIT), LL_DMA_DIRECTION_MEMORY_TO_PERIPH);
+}
+
+/**
+ * @brief write a single buffer to I2C1 in one DMA burst, taking the bus over from whatever transfer is in flight
+ *
+ * safe from ISR context. the interrupt-driven transfer on I2C1 is dropped: its buffer pointer is left as it was
+ *
+ * @param pTransfer address + buffer, at most 255 bytes
+ */
+void i2cTransferEepromDMA(SI2CTransfer_t *pTransfer)
+{
+    // PE reset: aborts a transfer in progress and releases the lines
+    LL_I2C_Disable(I2C1);
+    while (LL_I2C_IsEnabled(I2C1));
+    LL_I2C_Enable(I2C1);
+
+    LL_I2C_DisableIT_TX(I2C1);
+    LL_I2C_EnableDMAReq_TX(I2C1);
+
+    LL_DMA_DisableChannel(DMA1, LL_DMA_CHANNEL_3);
+    LL_DMA_SetMemoryAddress(DMA1, LL_DMA_CHANNEL_3, (uint32_t)pTransfer->pBuffer);
+    LL_DMA_SetDataLength(DMA1, LL_DMA_CHANNEL_3, pTransfer->len);
+    LL_DMA_EnableChannel(DMA1, LL_DMA_CHANNEL_3);
+
+    LL_I2C_HandleTransfer(I2C1, pTransfer->address, LL_I2C_ADDRSLAVE_7BIT, pTransfer->len, LL_I2C_MODE_AUTOEND,
+                          LL_I2C_GENERATE_START_WRITE);
+}
+
 /**
  * @brief Initializes the DMA for I2C display transfer.
  *
@@ -170,7 +359,9 @@ void i2cTransferDisplayDMA(SI2CTransfer_t *pDisplayDMATransferCtx)
 }
 
 __attribute__((interrupt)) void DMA1_Channel1_IRQHandler(void)
-{ 
+{
+    rtosIsrEnter();
+
     if (LL_DMA_IsActiveFlag_TC1(DMA1))
     {
         LL_DMA_DisableChannel(DMA1, LL_DMA_CHANNEL_1);
@@ -206,10 +397,14 @@ __attribute__((interrupt)) void DMA1_Channel1_IRQHandler(void)
         LL_I2C_ClearFlag_STOP(I2C2);
         if (g_fnI2cDMACallback != NULL) g_fnI2cDMACallback(false);
     }
+
+    rtosIsrExit();
 }
 
 __attribute((interrupt)) void I2C1_IRQHandler(void)
 {
+    rtosIsrEnter();
+
   /* Check RXNE flag value in ISR register */
     if (LL_I2C_IsActiveFlag_TXIS(I2C1))
     {
@@ -227,10 +422,14 @@ __attribute((interrupt)) void I2C1_IRQHandler(void)
     {
         if (g_fnI2cRegularCallback != NULL) g_fnI2cRegularCallback(false);
     }
+
+    rtosIsrExit();
 }
 
 __attribute((interrupt)) void I2C2_IRQHandler(void)
 {
+    rtosIsrEnter();
+
     if (LL_I2C_IsActiveFlag_NACK(I2C2))
     {
         LL_I2C_ClearFlag_NACK(I2C2);
@@ -261,4 +460,27 @@ __attribute((interrupt)) void I2C2_IRQHandler(void)
     {
         if (g_fnI2cRegularCallback != NULL) g_fnI2cRegularCallback(false);
     }
-}
\ No newline at end of file
+
+    rtosIsrExit();
+}
+//=====================================================================================================================
+// Statics
+//=====================================================================================================================
+
+/**
+ * @brief busy-wait for an ISR flag
+ *
+ * @return false on NACK or after I2C_POLL_TIMEOUT polls
+ */
+static bool i2cWaitFlag(I2C_TypeDef *pI2CPeriph, uint32_t flag)
+{
+    for (uint32_t i = 0; i < I2C_POLL_TIMEOUT; i++)
+    {
+        uint32_t isr = pI2CPeriph->ISR;
+
+        if ((isr & flag) != 0) return true;
+        if (((isr & I2C_ISR_NACKF) != 0) && (flag != I2C_ISR_STOPF)) return false;
+    }
+
+    return false;
+}
@@ -0,0 +1,131 @@
+/**
+ * @file pool.c
+ *
+ * @brief fixed-block memory pools
+ *
+ * a pool hands out blocks from its storage in order until every block has been used once; after that it recycles
+ * the blocks on its free list. both paths are a handful of instructions under PRIMASK, so the pools can be used
+ * from ISRs and don't add measurable interrupt latency
+ */
+
+//=====================================================================================================================
+// Includes
+//=====================================================================================================================
+
+#include "pool.h"
+
+#include "stm32g070xx.h"
+
+//=====================================================================================================================
+// Globals
+//=====================================================================================================================
+
+// bounds of the .pools section, one entry per POOL_DEFINE(), see the linker script
+extern SPool_t *const __pools_start[];
+extern SPool_t *const __pools_end[];
+
+//=====================================================================================================================
+// Functions
+//=====================================================================================================================
+
+/**
+ * @brief take a block from a pool
+ *
+ * @param pPool pool
+ * @return block, or NULL if the pool is empty
+ */
+void *poolAlloc(SPool_t *pPool)
+{
+    void    *pBlock  = NULL;
+    uint32_t primask = __get_PRIMASK();
+
+    __disable_irq();
+
+    if (pPool->pFree != NULL)
+    {
+        pBlock       = pPool->pFree;
+        pPool->pFree = pPool->pFree->pNext;
+    }
+    else if (pPool->numCarved < pPool->numBlocks)
+    {
+        pBlock = &pPool->pStorage[(size_t)pPool->numCarved * pPool->blockSize];
+        pPool->numCarved++;
+    }
+
+    if (pBlock != NULL)
+    {
+        pPool->numUsed++;
+        if (pPool->numUsed > pPool->highWater) pPool->highWater = pPool->numUsed;
+    }
+    else if (pPool->numFailed < UINT16_MAX)
+    {
+        pPool->numFailed++;
+    }
+
+    __set_PRIMASK(primask);
+
+    return pBlock;
+}
+
+/**
+ * @brief return a block to its pool
+ *
+ * @param pPool pool the block was taken from
+ * @param pBlock block, NULL is ignored
+ */
+void poolFree(SPool_t *pPool, void *pBlock)
+{
+    if (pBlock == NULL) return;
+
+    uint32_t primask = __get_PRIMASK();
+
+    __disable_irq();
+
+    ((SPoolBlock_t *)pBlock)->pNext = pPool->pFree;
+    pPool->pFree                    = (SPoolBlock_t *)pBlock;
+    pPool->numUsed--;
+
+    __set_PRIMASK(primask);
+}
+
+/**
+ * @brief check whether a pointer is a block of a pool, for code that accepts both pooled and static objects
+ *
+ * @param pPool pool
+ * @param pBlock pointer to check
+ * @return true if pBlock lies in the pool's storage
+ */
+bool poolContains(const SPool_t *pPool, const void *pBlock)
+{
+    const uint8_t *p = (const uint8_t *)pBlock;
+
+    return (p >= pPool->pStorage) && (p < &pPool->pStorage[(size_t)pPool->numBlocks * pPool->blockSize]);
+}
+
+/**
+ * @brief read the usage of a pool
+ *
+ * @param index pool number, 0 up to the number of POOL_DEFINE()s in the image
+ * @param[out] pStats usage
+ * @return false if there's no pool with this number
+ */
+bool poolGetStats(uint8_t index, SPoolStats_t *pStats)
+{
+    if (&__pools_start[index] >= __pools_end) return false;
+
+    const SPool_t *pPool   = __pools_start[index];
+    uint32_t       primask = __get_PRIMASK();
+
+    __disable_irq();
+
+    pStats->pName     = pPool->pName;
+    pStats->blockSize = pPool->blockSize;
+    pStats->numBlocks = pPool->numBlocks;
+    pStats->numUsed   = pPool->numUsed;
+    pStats->highWater = pPool->highWater;
+    pStats->numFailed = pPool->numFailed;
+
+    __set_PRIMASK(primask);
+
+    return true;
+}
@@ -4,6 +4,9 @@
  * @brief spi functionality
  * 
  * NOTE: only SPI1 is currently supported. if more buses should be supported this driver will need a rework
+ *
+ * SCK is kept at SPI_SCK_HZ across SYSCLK level changes. a change that lands during a DMA frame is applied once the
+ * frame has completed, the baudrate must not change mid-transfer
  * TODO: add timeouts (RTOS-proof)
  */
 
@@ -12,7 +15,9 @@
 //=====================================================================================================================
 
 #include "spi.h"
+#include "clock.h"
 #include "gpio.h"
+#include "timer.h"
 
 #include <stm32g0xx_ll_bus.h>
 #include <stm32g0xx_ll_gpio.h>
@@ -28,6 +33,8 @@
 
 #define SPI_DUMMY_BYTE 0x00
 
+#define SPI_SCK_HZ     4000000 // fastest SCK at or below this, from PCLK
+
 //=====================================================================================================================
 // Types
 //=====================================================================================================================
@@ -41,11 +48,16 @@ static spiStatusCallback g_fnSpiDMACallback = NULL;
 
 static SSPITransfer_t *g_pCurrentTransfer = NULL;
 
+static volatile bool     g_baudRatePending = false; //< g_pendingBaudRate waits for the running DMA frame to end
+static volatile uint32_t g_pendingBaudRate = 0;
+
 //=====================================================================================================================
 // Function prototypes
 //=====================================================================================================================
 
-static uint8_t spiRxTx(uint8_t);
+static uint8_t  spiRxTx(uint8_t);
+static uint32_t spiBaudRatePrescaler(uint32_t);
+static void     spiClockNotifier(uint32_t, void *);
 
 //=====================================================================================================================
 // External functions
@@ -78,7 +90,7 @@ void spiInit(SPI_TypeDef *pSPIPeripheral)
     SPI_InitStruct.ClockPolarity     = LL_SPI_POLARITY_HIGH;
     SPI_InitStruct.ClockPhase        = LL_SPI_PHASE_2EDGE;
     SPI_InitStruct.NSS               = LL_SPI_NSS_SOFT;
-    SPI_InitStruct.BaudRate          = LL_SPI_BAUDRATEPRESCALER_DIV16;
+    SPI_InitStruct.BaudRate          = spiBaudRatePrescaler(SystemCoreClock);
     SPI_InitStruct.BitOrder          = LL_SPI_MSB_FIRST;
     SPI_InitStruct.CRCCalculation    = LL_SPI_CRCCALCULATION_DISABLE;
     SPI_InitStruct.CRCPoly           = CRC16_POLY_CCITT;
@@ -90,6 +102,8 @@ void spiInit(SPI_TypeDef *pSPIPeripheral)
     LL_SPI_Enable(pSPIPeripheral);
 
     g_pSPIPeripheral = pSPIPeripheral;
+
+    (void)clockRegisterNotifier(spiClockNotifier, NULL);
 }
 
 /**
@@ -181,11 +195,18 @@ __attribute__((interrupt)) void SPI1_IRQHandler(void)
 
 __attribute__((interrupt)) void DMA1_Channel2_3_IRQHandler(void)
 {
+    rtosIsrEnter();
+
     if (LL_DMA_IsActiveFlag_TC2(DMA1))
     {
         LL_DMA_DisableChannel(DMA1, LL_DMA_CHANNEL_2);
         LL_DMA_ClearFlag_TC2(DMA1);
         LL_SPI_Disable(g_pSPIPeripheral);
+        if (g_baudRatePending)
+        {
+            LL_SPI_SetBaudRatePrescaler(g_pSPIPeripheral, g_pendingBaudRate);
+            g_baudRatePending = false;
+        }
         selectDisplay(false);
         if (g_fnSpiDMACallback != NULL) g_fnSpiDMACallback(true);
     }
@@ -193,9 +214,16 @@ __attribute__((interrupt)) void DMA1_Channel2_3_IRQHandler(void)
     {
         LL_DMA_ClearFlag_TE2(DMA1);
         LL_SPI_Disable(g_pSPIPeripheral);
+        if (g_baudRatePending)
+        {
+            LL_SPI_SetBaudRatePrescaler(g_pSPIPeripheral, g_pendingBaudRate);
+            g_baudRatePending = false;
+        }
         selectDisplay(false);
         if (g_fnSpiDMACallback != NULL) g_fnSpiDMACallback(false);
     }
+
+    rtosIsrExit();
 }
 
 
@@ -215,4 +243,42 @@ static uint8_t spiRxTx(uint8_t tx)
     LL_SPI_TransmitData8(g_pSPIPeripheral, tx);
     while (!LL_SPI_IsActiveFlag_RXNE(g_pSPIPeripheral)) { /* infinite wait */ }
     return LL_SPI_ReceiveData8(g_pSPIPeripheral);
-}
\ No newline at end of file
+}
+
+/**
+ * @brief SPI baudrate prescaler for the fastest SCK that doesn't exceed SPI_SCK_HZ
+ * 
+ * @param pclkHz bus clock
+ * @return uint32_t LL_SPI_BAUDRATEPRESCALER_x value
+ */
+static uint32_t spiBaudRatePrescaler(uint32_t pclkHz)
+{
+    uint32_t shift = 0; // prescaler = 2 << shift
+
+    while (((pclkHz >> (shift + 1)) > SPI_SCK_HZ) && (shift < 7)) shift++;
+
+    return shift << SPI_CR1_BR_Pos;
+}
+
+/**
+ * @brief SYSCLK changed: keep SCK at SPI_SCK_HZ. runs with interrupts masked
+ * 
+ */
+static void spiClockNotifier(uint32_t coreHz, void *pCtx)
+{
+    uint32_t prescaler = spiBaudRatePrescaler(coreHz);
+
+    if (LL_DMA_IsEnabledChannel(DMA1, LL_DMA_CHANNEL_2))
+    {
+        g_pendingBaudRate = prescaler;
+        g_baudRatePending = true;
+        return;
+    }
+
+    bool wasEnabled = LL_SPI_IsEnabled(g_pSPIPeripheral);
+
+    while (LL_SPI_IsActiveFlag_BSY(g_pSPIPeripheral));
+    LL_SPI_Disable(g_pSPIPeripheral);
+    LL_SPI_SetBaudRatePrescaler(g_pSPIPeripheral, prescaler);
+    if (wasEnabled) LL_SPI_Enable(g_pSPIPeripheral);
+}
@@ -3,7 +3,26 @@
  *
  * @brief timer functionality
  * 
- * TODO: just TIM1 for now: add possible timers as enum
+ * TIM1:  multi-channel lamp outputs (CH1-CH4), or the PWM dimming output of an LED head (CH1, duty by DMA1 CH5)
+ * TIM3:  mains zero-cross input capture (CH2), 1MHz. CC1 is the mains-loss watchdog
+ * TIM6:  ADC trigger (TRGO), sets the photometer sample rate
+ * TIM14: display framerate
+ * TIM15: enlarger lamp + safelight interlock (CC1 schedules the lamp-on edge)
+ * TIM16: HSI vs LSE measurement, see clock.c
+ * TIM17: freertos runtime stats + hwDelayMs. CC1 is a one-shot alarm on the time base (multi-unit sync)
+ *
+ * every timer runs at a fixed tick rate. the prescalers are recomputed from a clock notifier whenever the SYSCLK level
+ * changes; free-running timers get an update event so the new prescaler applies at once. TIM1's channel outputs only
+ * run while an exposure holds the active level and latch their prescaler when they're started. TIM15 follows a level
+ * change with an exposure loaded or counting: the new prescaler is latched and the count put back, see
+ * rescaleEnlargerTimer(). the exposure code keeps the level fixed while a lamp phase counts, so in practice only a
+ * loaded step is rescaled
+ *
+ * in PWM mode TIM1 counts the core clock directly, so the PWM period in counts depends on the level; the notifier
+ * reloads it for the level that was set. the duty is written to the CCR1 preload by DMA on every update event,
+ * cycling through LAMP_PWM_DITHER values that differ by at most one count, so the average duty resolves finer than a
+ * count without CPU involvement. while stopped, CH1 sits at its high idle level: the head runs at full power whenever
+ * it isn't dimmed
  */
 
 //=====================================================================================================================
@@ -11,8 +30,10 @@
 //=====================================================================================================================
 
 #include "timer.h"
+#include "clock.h"
 
 #include <stm32g0xx_ll_bus.h>
+#include <stm32g0xx_ll_dma.h>
 #include <stm32g0xx_ll_tim.h>
 #include <stm32g0xx_ll_rcc.h>
 
@@ -20,6 +41,14 @@
 // Defines
 //=====================================================================================================================
 
+#define ENLARGER_MAX_SEGMENT_MS 0x10000 // TIM15 is 16 bits wide: at a 1ms tick one segment spans at most 65.536s
+
+#define MAX_CLOCKED_TIMERS      8
+
+#define LAMP_CHANNELS_ALL       (LL_TIM_CHANNEL_CH1 | LL_TIM_CHANNEL_CH2 | LL_TIM_CHANNEL_CH3 | LL_TIM_CHANNEL_CH4)
+
+#define LAMP_PWM_DMA_CHANNEL    LL_DMA_CHANNEL_5
+
 //=====================================================================================================================
 // Types
 //=====================================================================================================================
@@ -30,17 +59,55 @@ typedef struct
     void *        pUserCtx;
 } STimerIRQCallback_t;
 
+/** @brief tick rate a timer's prescaler is derived from */
+typedef struct
+{
+    TIM_TypeDef *pTimer;
+    uint32_t     tickHz;
+} STimerTick_t;
+
 //=====================================================================================================================
 // Globals
 //=====================================================================================================================
 
 static STimerIRQCallback_t g_framerateCallback = {0};
 static STimerIRQCallback_t g_enlargerCallback = {0};
+static STimerIRQCallback_t g_lampOnCallback = {0};
+static STimerIRQCallback_t g_lampChannelsCallback = {0};
+static STimerIRQCallback_t g_mainsLostCallback = {0};
+static STimerIRQCallback_t g_timeBaseAlarmCallback = {0};
+
+static volatile uint32_t   g_enlargerRemainingMs = 0; //< exposure time left after the segment currently counting
+static volatile uint32_t   g_enlargerSegmentMs   = 0; //< length of the segment currently counting (or loaded)
+static volatile bool       g_enlargerArmed       = false; //< loaded by armEnlargerTimer(), not yet triggered
+static volatile bool       g_enlargerLampOnStart = false; //< armed without a lead, the trigger turns the lamp on
+
+static volatile uint16_t   g_lampPwmDuty[LAMP_PWM_DITHER]; //< CCR1 values, one per PWM period
+static bool                g_lampPwmMode    = false;     //< TIM1 drives the dimming output instead of the channels
+static volatile bool       g_lampPwmRunning = false;
+static uint32_t            g_lampPwmLevel   = 0;         //< level the running PWM was started with, Q16
+
+static STimerTick_t        g_timerTicks[MAX_CLOCKED_TIMERS] = {0};
+static uint8_t             g_numTimerTicks                  = 0;
+
+static uint32_t            g_rtosTimeUs    = 0; //< TIM17 extended to 32 bits, advanced by every read
+static uint16_t            g_rtosLastCount = 0; //< TIM17 count at the last read
+static volatile uint32_t   g_isrTimeUs     = 0; //< time spent in instrumented handlers
+static volatile uint8_t    g_isrNesting    = 0;
+static uint16_t            g_isrEntryCount = 0; //< TIM17 count at entry of the outermost handler
 
 //=====================================================================================================================
 // Function prototypes
 //=====================================================================================================================
 
+static inline uint32_t nextEnlargerSegment(uint32_t);
+static void            advanceEnlargerSegment(void);
+static void            setTimerTick(TIM_TypeDef *, uint32_t);
+static void            restoreTimerTick(TIM_TypeDef *);
+static uint32_t        loadLampPwm(uint32_t);
+static void            rescaleEnlargerTimer(void);
+static void            timerClockNotifier(uint32_t, void *);
+
 //=====================================================================================================================
 // External functions
 //=====================================================================================================================
@@ -53,16 +120,61 @@ void initTimer(STimerDef_t const *pTimerDef)
 {
     if (pTimerDef->pHWTimer == TIM1)
     {
+        // multi-channel lamp outputs: one-pulse, all four channels in PWM1 so each output is active from the start
+        // until its own compare match. outputs sit at their (low) idle level while MOE is cleared
         LL_APB2_GRP1_EnableClock(LL_APB2_GRP1_PERIPH_TIM1);
-        LL_TIM_SetPrescaler(pTimerDef->pHWTimer, __LL_TIM_CALC_PSC(SystemCoreClock, pTimerDef->period));
-        TIM1->ARR = 0xFFFFFFFF;
-        LL_TIM_EnableCounter(pTimerDef->pHWTimer);
+        setTimerTick(TIM1, pTimerDef->period); // 1ms tick
+        LL_TIM_SetOnePulseMode(TIM1, LL_TIM_ONEPULSEMODE_SINGLE);
+        LL_TIM_SetUpdateSource(TIM1, LL_TIM_UPDATESOURCE_COUNTER);
+        LL_TIM_EnableARRPreload(TIM1);
+        LL_TIM_SetOffStates(TIM1, LL_TIM_OSSI_ENABLE, LL_TIM_OSSR_ENABLE);
+
+        for (uint32_t channel = LL_TIM_CHANNEL_CH1; channel <= LL_TIM_CHANNEL_CH4; channel <<= 4)
+        {
+            LL_TIM_OC_SetMode(TIM1, channel, LL_TIM_OCMODE_PWM1);
+            LL_TIM_OC_SetPolarity(TIM1, channel, LL_TIM_OCPOLARITY_HIGH);
+            LL_TIM_OC_SetIdleState(TIM1, channel, LL_TIM_OCIDLESTATE_LOW);
+            LL_TIM_OC_EnablePreload(TIM1, channel);
+        }
+
+        stopLampChannels();
+        LL_TIM_CC_EnableChannel(TIM1, LAMP_CHANNELS_ALL);
+
+        LL_TIM_EnableIT_UPDATE(TIM1);
+        NVIC_SetPriority(TIM1_BRK_UP_TRG_COM_IRQn, 0);
+        NVIC_EnableIRQ(TIM1_BRK_UP_TRG_COM_IRQn);
+    }
+    else if (pTimerDef->pHWTimer == TIM3)
+    {
+        // free-running 1MHz capture of the zero-cross detector. the EXTI on the same pin reports the edge and reads the
+        // timestamp latched here; the only IRQ is the CC1 mains-loss watchdog
+        LL_APB1_GRP1_EnableClock(LL_APB1_GRP1_PERIPH_TIM3);
+        setTimerTick(TIM3, pTimerDef->period);
+        LL_TIM_SetAutoReload(TIM3, 0xFFFF);
+        LL_TIM_IC_SetActiveInput(TIM3, LL_TIM_CHANNEL_CH2, LL_TIM_ACTIVEINPUT_DIRECTTI);
+        LL_TIM_IC_SetPrescaler(TIM3, LL_TIM_CHANNEL_CH2, LL_TIM_ICPSC_DIV1);
+        LL_TIM_IC_SetFilter(TIM3, LL_TIM_CHANNEL_CH2, LL_TIM_IC_FILTER_FDIV1_N8);
+        LL_TIM_IC_SetPolarity(TIM3, LL_TIM_CHANNEL_CH2, LL_TIM_IC_POLARITY_RISING);
+        LL_TIM_CC_EnableChannel(TIM3, LL_TIM_CHANNEL_CH2);
+        LL_TIM_OC_SetMode(TIM3, LL_TIM_CHANNEL_CH1, LL_TIM_OCMODE_FROZEN); // compare only, no output
+        NVIC_SetPriority(TIM3_IRQn, 0);
+        NVIC_EnableIRQ(TIM3_IRQn);
+        LL_TIM_EnableCounter(TIM3);
+    }
+    else if (pTimerDef->pHWTimer == TIM6)
+    {
+        // ADC sample cadence: TRGO on every update, period is the sample rate in Hz
+        LL_APB1_GRP1_EnableClock(LL_APB1_GRP1_PERIPH_TIM6);
+        setTimerTick(TIM6, 1000000);
+        LL_TIM_SetAutoReload(TIM6, (1000000 / pTimerDef->period) - 1);
+        LL_TIM_SetTriggerOutput(TIM6, LL_TIM_TRGO_UPDATE);
+        LL_TIM_EnableCounter(TIM6);
     }
     else if (pTimerDef->pHWTimer == TIM14)
     {
         LL_APB2_GRP1_EnableClock(LL_APB2_GRP1_PERIPH_TIM14);
-        LL_TIM_SetPrescaler(pTimerDef->pHWTimer, __LL_TIM_CALC_PSC(SystemCoreClock, pTimerDef->period));
-        LL_TIM_SetAutoReload(TIM14, __LL_TIM_CALC_ARR(SystemCoreClock, LL_TIM_GetPrescaler(TIM14), 33)); // 30hz tick for a 30fps refresh
+        setTimerTick(TIM14, pTimerDef->period);
+        LL_TIM_SetAutoReload(TIM14, (pTimerDef->period / 33) - 1); // 30hz tick for a 30fps refresh
         LL_TIM_EnableIT_UPDATE(TIM14);
         NVIC_SetPriority(TIM14_IRQn, 0);
         LL_TIM_EnableCounter(pTimerDef->pHWTimer);
@@ -70,22 +182,346 @@ void initTimer(STimerDef_t const *pTimerDef)
     else if (pTimerDef->pHWTimer == TIM15)
     {
         LL_APB2_GRP1_EnableClock(LL_APB2_GRP1_PERIPH_TIM15);
-        LL_TIM_SetPrescaler(pTimerDef->pHWTimer, __LL_TIM_CALC_PSC(SystemCoreClock, pTimerDef->period));
-        LL_TIM_SetAutoReload(TIM14, __LL_TIM_CALC_ARR(SystemCoreClock, LL_TIM_GetPrescaler(TIM14), 100)); // 10hz for .1 second resolution
+        setTimerTick(TIM15, pTimerDef->period); // 1ms tick
+        LL_TIM_EnableARRPreload(TIM15);                          // next segment length is latched on update
+        LL_TIM_SetUpdateSource(TIM15, LL_TIM_UPDATESOURCE_COUNTER); // UG (re)loads registers without firing the IRQ
         LL_TIM_EnableIT_UPDATE(TIM15);
         NVIC_SetPriority(TIM15_IRQn, 0);
+        NVIC_EnableIRQ(TIM15_IRQn);
     }
 }
 
 /**
- * @brief start enlarger timer
+ * @brief start enlarger timer. the registered TIMER_ENLARGER_LAMP_ON callback fires leadMs after the start, the
+ *        TIMER_ENLARGER_LAMP_ENABLE callback once the duration has elapsed after that
  * 
  * @param duration in milliseconds, for lamp to remain on
+ * @param leadMs delay before the lamp-on edge (safelight lead time), at most ENLARGER_MAX_LEAD_MS
+ * 
+ * @note exposures longer than one 16-bit period are split into segments. the next segment length is preloaded into
+ *       the ARR shadow register so consecutive segments chain without a gap; the final segment runs in one-pulse mode.
+ *       the lead is counted as part of the first segment and the lamp-on edge comes from the CC1 match, so the
+ *       lead -> lamp-on interval does not depend on when the caller gets scheduled
  */
-void startEnlargerTimer(uint32_t duration)
+void startEnlargerTimer(uint32_t duration, uint32_t leadMs)
 {
-    LL_TIM_SetAutoReload(TIM15, __LL_TIM_CALC_ARR(SystemCoreClock, LL_TIM_GetPrescaler(TIM15), duration));
-    LL_TIM_EnableCounter(TIM15);
+    armEnlargerTimer(duration, leadMs);
+    triggerEnlargerTimer();
+}
+
+/**
+ * @brief load an exposure into the enlarger timer without starting it, see startEnlargerTimer(). every register is
+ *        written here, so triggerEnlargerTimer() only has to set the counter enable
+ * 
+ * @param duration in milliseconds, for lamp to remain on
+ * @param leadMs delay before the lamp-on edge (safelight lead time), at most ENLARGER_MAX_LEAD_MS
+ * 
+ * @note the prescaler is latched here too; a later clock level change latches the new one, so the step can stay
+ *       loaded at any level
+ */
+void armEnlargerTimer(uint32_t duration, uint32_t leadMs)
+{
+    LL_TIM_DisableCounter(TIM15);
+    LL_TIM_DisableIT_CC1(TIM15);
+    LL_TIM_EnableARRPreload(TIM15); // may have been cleared by shortenEnlargerTimer()
+
+    g_enlargerArmed       = false;
+    g_enlargerLampOnStart = false;
+    g_enlargerRemainingMs = 0;
+
+    if (duration == 0) return;
+
+    leadMs = (leadMs > ENLARGER_MAX_LEAD_MS) ? ENLARGER_MAX_LEAD_MS : leadMs;
+
+    uint32_t total        = duration + leadMs;
+    g_enlargerSegmentMs   = nextEnlargerSegment(total);
+    g_enlargerRemainingMs = total - g_enlargerSegmentMs;
+
+    LL_TIM_SetAutoReload(TIM15, g_enlargerSegmentMs - 1);
+    LL_TIM_GenerateEvent_UPDATE(TIM15); // latch ARR + prescaler, reset counter
+
+    if (g_enlargerRemainingMs != 0)
+    {
+        LL_TIM_SetOnePulseMode(TIM15, LL_TIM_ONEPULSEMODE_REPETITIVE);
+        LL_TIM_SetAutoReload(TIM15, nextEnlargerSegment(g_enlargerRemainingMs) - 1);
+    }
+    else
+    {
+        LL_TIM_SetOnePulseMode(TIM15, LL_TIM_ONEPULSEMODE_SINGLE);
+    }
+
+    LL_TIM_ClearFlag_UPDATE(TIM15);
+    LL_TIM_ClearFlag_CC1(TIM15);
+
+    if (leadMs != 0)
+    {
+        LL_TIM_OC_SetCompareCH1(TIM15, leadMs);
+        LL_TIM_EnableIT_CC1(TIM15);
+    }
+    else
+    {
+        g_enlargerLampOnStart = true;
+    }
+
+    g_enlargerArmed = true;
+}
+
+/**
+ * @brief start an exposure loaded by armEnlargerTimer(). safe from any context, including ISRs above the TIM15
+ *        priority; does nothing if nothing is armed
+ * 
+ */
+void triggerEnlargerTimer(void)
+{
+    if (!g_enlargerArmed) return;
+
+    g_enlargerArmed = false;
+
+    if (g_enlargerLampOnStart && g_lampOnCallback.fnCb) g_lampOnCallback.fnCb(g_lampOnCallback.pUserCtx);
+
+    TIM15->CR1 |= TIM_CR1_CEN;
+}
+
+/**
+ * @brief stop a running enlarger timer without firing the callback
+ * 
+ */
+void stopEnlargerTimer(void)
+{
+    LL_TIM_DisableCounter(TIM15);
+    LL_TIM_DisableIT_CC1(TIM15);
+    LL_TIM_ClearFlag_UPDATE(TIM15);
+    LL_TIM_ClearFlag_CC1(TIM15);
+    g_enlargerRemainingMs = 0;
+    g_enlargerArmed       = false;
+}
+
+/**
+ * @brief end a running enlarger exposure early, remainingMs from now. the TIMER_ENLARGER_LAMP_ENABLE callback fires as
+ *        usual. call with TIM15 interrupts masked or from an ISR of the same priority
+ * 
+ * @param remainingMs time left in milliseconds, at least 1
+ * 
+ * @note an end inside the segment that is counting goes straight into ARR, with ARR preload switched off. an end in a
+ *       later segment only shortens the time left after this one, the update ISR chains on to it as usual. either
+ *       way the exposure can only ever get shorter
+ */
+void shortenEnlargerTimer(uint32_t remainingMs)
+{
+    uint32_t count;
+
+    if (!LL_TIM_IsEnabledCounter(TIM15)) return;
+
+    // a segment boundary whose interrupt is still pending (masked, or this is its priority): catch the chain up, so
+    // the count and the segment bookkeeping belong together
+    do
+    {
+        if (LL_TIM_IsActiveFlag_UPDATE(TIM15))
+        {
+            if (g_enlargerRemainingMs == 0) return; // the final segment is over, the update ISR switches the lamp off
+            LL_TIM_ClearFlag_UPDATE(TIM15);
+            advanceEnlargerSegment();
+        }
+        count = LL_TIM_GetCounter(TIM15);
+    } while (LL_TIM_IsActiveFlag_UPDATE(TIM15));
+
+    uint32_t end = count + ((remainingMs == 0) ? 1 : remainingMs);
+
+    if (end < g_enlargerSegmentMs)
+    {
+        if ((g_enlargerRemainingMs == 0) && (end >= LL_TIM_GetAutoReload(TIM15))) return; // ends sooner anyway
+
+        g_enlargerRemainingMs = 0;
+        LL_TIM_DisableARRPreload(TIM15);
+        LL_TIM_SetOnePulseMode(TIM15, LL_TIM_ONEPULSEMODE_SINGLE);
+        LL_TIM_SetAutoReload(TIM15, end);
+        return;
+    }
+
+    uint32_t afterMs = end + 1 - g_enlargerSegmentMs; // same rounding as above: ARR = end
+
+    if (afterMs >= g_enlargerRemainingMs) return; // ends sooner anyway, also in the final segment
+
+    g_enlargerRemainingMs = afterMs;
+    LL_TIM_SetAutoReload(TIM15, nextEnlargerSegment(afterMs) - 1); // preload for the next segment
+
+    if (LL_TIM_IsActiveFlag_UPDATE(TIM15))
+    {
+        // the counter was on the segment's last tick and the boundary may have latched the old preload: set the
+        // segment that just started directly, the pending update ISR accounts for it
+        LL_TIM_DisableARRPreload(TIM15);
+        LL_TIM_SetAutoReload(TIM15, nextEnlargerSegment(afterMs) - 1);
+        LL_TIM_EnableARRPreload(TIM15);
+    }
+}
+
+/**
+ * @brief check whether an enlarger exposure is still counting
+ * 
+ * @return true if TIM15 is running
+ */
+bool enlargerTimerIsRunning(void)
+{
+    return LL_TIM_IsEnabledCounter(TIM15);
+}
+
+/**
+ * @brief load per-channel on-times into TIM1. outputs stay off until startLampChannels()
+ * 
+ * @param pDurationsMs on-time per channel in milliseconds, 0 leaves a channel off
+ * @param numChannels number of entries in pDurationsMs, at most LAMP_CHANNEL_COUNT
+ * @return false if a duration exceeds LAMP_CHANNEL_MAX_MS, all durations are 0 or TIM1 is in PWM mode
+ */
+bool armLampChannels(const uint32_t *pDurationsMs, uint8_t numChannels)
+{
+    uint32_t ticks[LAMP_CHANNEL_COUNT] = {0};
+    uint32_t longest                   = 0;
+
+    if ((numChannels > LAMP_CHANNEL_COUNT) || g_lampPwmMode) return false;
+
+    for (uint8_t i = 0; i < numChannels; i++)
+    {
+        if (pDurationsMs[i] > LAMP_CHANNEL_MAX_MS) return false;
+        ticks[i] = pDurationsMs[i];
+        longest  = (ticks[i] > longest) ? ticks[i] : longest;
+    }
+
+    if (longest == 0) return false;
+
+    stopLampChannels();
+
+    LL_TIM_SetAutoReload(TIM1, longest);
+    LL_TIM_OC_SetCompareCH1(TIM1, ticks[0]);
+    LL_TIM_OC_SetCompareCH2(TIM1, ticks[1]);
+    LL_TIM_OC_SetCompareCH3(TIM1, ticks[2]);
+    LL_TIM_OC_SetCompareCH4(TIM1, ticks[3]);
+    LL_TIM_GenerateEvent_UPDATE(TIM1); // latch ARR + CCRx into the shadow registers, reset counter
+
+    return true;
+}
+
+/**
+ * @brief start an armed multi-channel exposure. all outputs switch on together when MOE is set; each switches off on
+ *        its own compare match without software involvement
+ * 
+ * @note  the CCR preload registers are parked at 0 straight after the start. the update event that ends the pulse
+ *        latches those zeros, so the PWM1 outputs stay inactive once the counter has stopped
+ */
+void startLampChannels(void)
+{
+    LL_TIM_EnableAllOutputs(TIM1);
+    LL_TIM_EnableCounter(TIM1);
+
+    LL_TIM_OC_SetCompareCH1(TIM1, 0);
+    LL_TIM_OC_SetCompareCH2(TIM1, 0);
+    LL_TIM_OC_SetCompareCH3(TIM1, 0);
+    LL_TIM_OC_SetCompareCH4(TIM1, 0);
+}
+
+/**
+ * @brief force all multi-channel lamp outputs off
+ * 
+ */
+void stopLampChannels(void)
+{
+    LL_TIM_DisableAllOutputs(TIM1);
+    LL_TIM_DisableCounter(TIM1);
+
+    LL_TIM_OC_SetCompareCH1(TIM1, 0);
+    LL_TIM_OC_SetCompareCH2(TIM1, 0);
+    LL_TIM_OC_SetCompareCH3(TIM1, 0);
+    LL_TIM_OC_SetCompareCH4(TIM1, 0);
+    LL_TIM_GenerateEvent_UPDATE(TIM1);
+    LL_TIM_ClearFlag_UPDATE(TIM1);
+}
+
+/**
+ * @brief switch TIM1 between the multi-channel lamp outputs and the PWM dimming output on CH1. the channel functions
+ *        fail in PWM mode. call while TIM1 is idle
+ *
+ * @param enable true for the dimming output
+ */
+void setLampPwmMode(bool enable)
+{
+    if (enable == g_lampPwmMode) return;
+
+    stopLampChannels();
+    LL_TIM_CC_DisableChannel(TIM1, LAMP_CHANNELS_ALL);
+
+    if (enable)
+    {
+        // repeating PWM1 on CH1 only, the update IRQ would fire every period. CH1 idles high (full power)
+        LL_TIM_DisableIT_UPDATE(TIM1);
+        LL_TIM_SetOnePulseMode(TIM1, LL_TIM_ONEPULSEMODE_REPETITIVE);
+        LL_TIM_OC_SetIdleState(TIM1, LL_TIM_CHANNEL_CH1, LL_TIM_OCIDLESTATE_HIGH);
+        LL_TIM_CC_EnableChannel(TIM1, LL_TIM_CHANNEL_CH1);
+
+        // DMA: duty table -> CCR1 preload, circular, one transfer per update event
+        LL_AHB1_GRP1_EnableClock(LL_AHB1_GRP1_PERIPH_DMA1);
+        LL_DMA_DisableChannel(DMA1, LAMP_PWM_DMA_CHANNEL);
+        LL_DMA_SetPeriphRequest(DMA1, LAMP_PWM_DMA_CHANNEL, LL_DMAMUX_REQ_TIM1_UP);
+        LL_DMA_SetDataTransferDirection(DMA1, LAMP_PWM_DMA_CHANNEL, LL_DMA_DIRECTION_MEMORY_TO_PERIPH);
+        LL_DMA_SetChannelPriorityLevel(DMA1, LAMP_PWM_DMA_CHANNEL, LL_DMA_PRIORITY_HIGH);
+        LL_DMA_SetMode(DMA1, LAMP_PWM_DMA_CHANNEL, LL_DMA_MODE_CIRCULAR);
+        LL_DMA_SetPeriphIncMode(DMA1, LAMP_PWM_DMA_CHANNEL, LL_DMA_PERIPH_NOINCREMENT);
+        LL_DMA_SetMemoryIncMode(DMA1, LAMP_PWM_DMA_CHANNEL, LL_DMA_MEMORY_INCREMENT);
+        LL_DMA_SetPeriphSize(DMA1, LAMP_PWM_DMA_CHANNEL, LL_DMA_PDATAALIGN_HALFWORD);
+        LL_DMA_SetMemorySize(DMA1, LAMP_PWM_DMA_CHANNEL, LL_DMA_MDATAALIGN_HALFWORD);
+        LL_DMA_ConfigAddresses(DMA1, LAMP_PWM_DMA_CHANNEL, (uint32_t)&g_lampPwmDuty[0], (uint32_t)&TIM1->CCR1,
+                               LL_DMA_DIRECTION_MEMORY_TO_PERIPH);
+    }
+    else
+    {
+        LL_TIM_SetOnePulseMode(TIM1, LL_TIM_ONEPULSEMODE_SINGLE);
+        LL_TIM_OC_SetIdleState(TIM1, LL_TIM_CHANNEL_CH1, LL_TIM_OCIDLESTATE_LOW);
+        LL_TIM_CC_EnableChannel(TIM1, LAMP_CHANNELS_ALL);
+        LL_TIM_ClearFlag_UPDATE(TIM1);
+        LL_TIM_EnableIT_UPDATE(TIM1);
+    }
+
+    g_lampPwmMode = enable;
+}
+
+/**
+ * @brief dim the head: start the PWM output at a level. the optocoupler still switches the lamp, this only sets how
+ *        bright it is while on. runs at either clock level and follows a level change until stopLampPwm()
+ *
+ * @param level fraction of full power, Q16 (LAMP_PWM_FULL)
+ * @return uint32_t level actually set, Q16. LAMP_PWM_FULL if not in PWM mode or level isn't below full power
+ */
+uint32_t startLampPwm(uint32_t level)
+{
+    stopLampPwm();
+
+    if (!g_lampPwmMode || (level >= LAMP_PWM_FULL)) return LAMP_PWM_FULL;
+
+    g_lampPwmLevel = loadLampPwm(level);
+
+    LL_DMA_SetDataLength(DMA1, LAMP_PWM_DMA_CHANNEL, LAMP_PWM_DITHER);
+    LL_DMA_EnableChannel(DMA1, LAMP_PWM_DMA_CHANNEL);
+    LL_TIM_EnableDMAReq_UPDATE(TIM1);
+
+    g_lampPwmRunning = true;
+    LL_TIM_EnableAllOutputs(TIM1);
+    LL_TIM_EnableCounter(TIM1);
+
+    return g_lampPwmLevel;
+}
+
+/**
+ * @brief back to full power: stop the PWM, CH1 returns to its high idle level
+ *
+ */
+void stopLampPwm(void)
+{
+    if (!g_lampPwmRunning) return;
+
+    LL_TIM_DisableAllOutputs(TIM1);
+    LL_TIM_DisableCounter(TIM1);
+    LL_TIM_DisableDMAReq_UPDATE(TIM1);
+    LL_DMA_DisableChannel(DMA1, LAMP_PWM_DMA_CHANNEL);
+    restoreTimerTick(TIM1);
+    g_lampPwmRunning = false;
 }
 
 /**
@@ -113,28 +549,145 @@ void timerDelay(STimerDef_t const *pTimer, const uint32_t delay)
 }
 
 /**
- * @brief freertos runtime stats timer, 1MHz
+ * @brief timestamp of the last zero-cross edge
+ * 
+ * @return uint16_t TIM3 CH2 capture, 1MHz
+ */
+uint16_t zeroCrossCaptureValue(void)
+{
+    return (uint16_t)LL_TIM_IC_GetCaptureCH2(TIM3);
+}
+
+/**
+ * @brief (re)start the mains-loss watchdog. TIMER_MAINS_LOST fires once unless it's rearmed before the deadline
+ * 
+ * @param deadline TIM3 timestamp (1MHz, wrapping) to fire at, e.g. an edge capture plus the timeout
+ */
+void armMainsWatchdog(uint16_t deadline)
+{
+    LL_TIM_OC_SetCompareCH1(TIM3, deadline);
+    LL_TIM_ClearFlag_CC1(TIM3);
+    LL_TIM_EnableIT_CC1(TIM3);
+}
+
+/**
+ * @brief stop the mains-loss watchdog, e.g. while the tracker isn't locked
+ * 
+ */
+void disarmMainsWatchdog(void)
+{
+    LL_TIM_DisableIT_CC1(TIM3);
+}
+
+/**
+ * @brief freertos runtime stats timer, 1MHz. also the time base for hwDelayMs(), so it is started from initBoard()
  * 
- * @note uses TIM17: don't use for other timers
+ * @note uses TIM17: don't use for other timers. also hooks all timer prescalers up to SYSCLK level changes
  * 
  */
 void initRtosTimer(void)
 {
     LL_APB2_GRP1_EnableClock(LL_APB2_GRP1_PERIPH_TIM17);
 
-    LL_TIM_SetPrescaler(TIM17, __LL_TIM_CALC_PSC(SystemCoreClock, 1000000));
+    (void)clockRegisterNotifier(timerClockNotifier, NULL);
+
+    setTimerTick(TIM17, 1000000);
     TIM17->ARR = 0xFFFFFFFF;
     LL_TIM_EnableCounter(TIM17);
+
+    // CC1 stays a frozen output compare: the flag is all the alarm needs
+    NVIC_SetPriority(TIM17_IRQn, 0);
+    NVIC_EnableIRQ(TIM17_IRQn);
 }
 
 /**
- * @brief fetch timer value for freertos runtime stats 
+ * @brief fetch timer value for freertos runtime stats. TIM17 is 16 bits wide: every read folds the elapsed count into
+ *        a 32-bit total, so it must be read at least every 65ms. the tick hook does that (traceTASK_INCREMENT_TICK)
  * 
- * @return uint32_t timer value
+ * @return uint32_t microseconds since initRtosTimer(), wraps after ~71 minutes
  */
 uint32_t rtosTimerGetValue(void)
 {
-    return TIM17->CNT;
+    uint32_t primask = __get_PRIMASK();
+    uint32_t timeUs;
+
+    __disable_irq();
+
+    uint16_t count = (uint16_t)TIM17->CNT;
+
+    g_rtosTimeUs   += (uint16_t)(count - g_rtosLastCount);
+    g_rtosLastCount = count;
+    timeUs          = g_rtosTimeUs;
+
+    __set_PRIMASK(primask);
+
+    return timeUs;
+}
+
+/**
+ * @brief mark the entry of an interrupt handler for the ISR load figure. only the outermost handler is timed
+ * 
+ */
+void rtosIsrEnter(void)
+{
+    if (g_isrNesting++ == 0) g_isrEntryCount = (uint16_t)TIM17->CNT;
+}
+
+/**
+ * @brief mark the exit of an interrupt handler, pairs with rtosIsrEnter()
+ * 
+ */
+void rtosIsrExit(void)
+{
+    if (--g_isrNesting == 0) g_isrTimeUs += (uint16_t)((uint16_t)TIM17->CNT - g_isrEntryCount);
+}
+
+/**
+ * @brief total time spent in instrumented interrupt handlers. the kernel's SysTick and PendSV are not included
+ * 
+ * @return uint32_t microseconds, wraps
+ */
+uint32_t rtosIsrTimeUs(void)
+{
+    return g_isrTimeUs;
+}
+
+/**
+ * @brief fire TIMER_TIME_BASE_ALARM once, when rtosTimerGetValue() reaches a given time. SYSCLK level changes while
+ *        armed are followed, at the cost of the sub-microsecond part of the count
+ * 
+ * @param atUs time base value to fire at, TIME_BASE_ALARM_MIN_US..TIME_BASE_ALARM_MAX_US ahead
+ * @return false if it's too close or too far ahead, nothing is armed then
+ */
+bool armTimeBaseAlarm(uint32_t atUs)
+{
+    uint32_t primask = __get_PRIMASK();
+    bool     armed   = false;
+
+    __disable_irq();
+
+    uint32_t aheadUs = atUs - rtosTimerGetValue(); // also brings g_rtosLastCount up to the current count
+
+    if ((aheadUs >= TIME_BASE_ALARM_MIN_US) && (aheadUs <= TIME_BASE_ALARM_MAX_US))
+    {
+        LL_TIM_OC_SetCompareCH1(TIM17, (uint16_t)(g_rtosLastCount + aheadUs));
+        LL_TIM_ClearFlag_CC1(TIM17);
+        LL_TIM_EnableIT_CC1(TIM17);
+        armed = true;
+    }
+
+    __set_PRIMASK(primask);
+
+    return armed;
+}
+
+/**
+ * @brief cancel the time base alarm
+ * 
+ */
+void disarmTimeBaseAlarm(void)
+{
+    LL_TIM_DisableIT_CC1(TIM17);
 }
 
 void registerTimerCallback(ETimerType_t timerType, fnTimCallback fnCb, void *pUserData)
@@ -147,35 +700,313 @@ void registerTimerCallback(ETimerType_t timerType, fnTimCallback fnCb, void *pUs
             g_enlargerCallback.pUserCtx = pUserData;
             break;
         }
+        case TIMER_ENLARGER_LAMP_ON:
+        {
+            g_lampOnCallback.fnCb = fnCb;
+            g_lampOnCallback.pUserCtx = pUserData;
+            break;
+        }
         case TIMER_FRAMERATE:
         {
             g_framerateCallback.fnCb = fnCb;
             g_framerateCallback.pUserCtx = pUserData;
             break;
         }
+        case TIMER_LAMP_CHANNELS:
+        {
+            g_lampChannelsCallback.fnCb = fnCb;
+            g_lampChannelsCallback.pUserCtx = pUserData;
+            break;
+        }
+        case TIMER_MAINS_LOST:
+        {
+            g_mainsLostCallback.fnCb = fnCb;
+            g_mainsLostCallback.pUserCtx = pUserData;
+            break;
+        }
+        case TIMER_TIME_BASE_ALARM:
+        {
+            g_timeBaseAlarmCallback.fnCb = fnCb;
+            g_timeBaseAlarmCallback.pUserCtx = pUserData;
+            break;
+        }
         default:
         break;
     }
 }
 
+void TIM1_BRK_UP_TRG_COM_IRQHandler(void)
+{
+    rtosIsrEnter();
+
+    if (LL_TIM_IsActiveFlag_UPDATE(TIM1))
+    {
+        // all channels have already switched off in hardware; this only reports completion
+        LL_TIM_ClearFlag_UPDATE(TIM1);
+        LL_TIM_DisableAllOutputs(TIM1);
+        if (g_lampChannelsCallback.fnCb) g_lampChannelsCallback.fnCb(g_lampChannelsCallback.pUserCtx);
+    }
+
+    rtosIsrExit();
+}
+
+void TIM3_IRQHandler(void)
+{
+    rtosIsrEnter();
+
+    if (LL_TIM_IsActiveFlag_CC1(TIM3) && LL_TIM_IsEnabledIT_CC1(TIM3))
+    {
+        // no zero-cross edge before the deadline: one-shot until the next edge rearms it
+        LL_TIM_ClearFlag_CC1(TIM3);
+        LL_TIM_DisableIT_CC1(TIM3);
+        if (g_mainsLostCallback.fnCb) g_mainsLostCallback.fnCb(g_mainsLostCallback.pUserCtx);
+    }
+
+    rtosIsrExit();
+}
+
 void TIM14_IRQHandler(void)
 {
+    rtosIsrEnter();
+
     if (LL_TIM_IsActiveFlag_UPDATE(TIM14))
     {
         LL_TIM_ClearFlag_UPDATE(TIM14);
         if (g_framerateCallback.fnCb) g_framerateCallback.fnCb(g_framerateCallback.pUserCtx);
     }
+
+    rtosIsrExit();
 }
 
 void TIM15_IRQHandler(void)
 {
+    rtosIsrEnter();
+
+    if (LL_TIM_IsActiveFlag_CC1(TIM15) && LL_TIM_IsEnabledIT_CC1(TIM15))
+    {
+        // lead time elapsed: one-shot, CC1 matches again in later segments
+        LL_TIM_ClearFlag_CC1(TIM15);
+        LL_TIM_DisableIT_CC1(TIM15);
+        if (g_lampOnCallback.fnCb) g_lampOnCallback.fnCb(g_lampOnCallback.pUserCtx);
+    }
+
     if (LL_TIM_IsActiveFlag_UPDATE(TIM15))
     {
         LL_TIM_ClearFlag_UPDATE(TIM15);
-        if (g_enlargerCallback.fnCb) g_enlargerCallback.fnCb(g_enlargerCallback.pUserCtx);
+
+        if (g_enlargerRemainingMs == 0)
+        {
+            // final segment elapsed; OPM has already stopped the counter
+            if (g_enlargerCallback.fnCb) g_enlargerCallback.fnCb(g_enlargerCallback.pUserCtx);
+            rtosIsrExit();
+            return;
+        }
+
+        advanceEnlargerSegment();
     }
+
+    rtosIsrExit();
+}
+
+void TIM17_IRQHandler(void)
+{
+    rtosIsrEnter();
+
+    if (LL_TIM_IsActiveFlag_CC1(TIM17) && LL_TIM_IsEnabledIT_CC1(TIM17))
+    {
+        // one-shot, the compare matches again on every wrap
+        LL_TIM_ClearFlag_CC1(TIM17);
+        LL_TIM_DisableIT_CC1(TIM17);
+        if (g_timeBaseAlarmCallback.fnCb) g_timeBaseAlarmCallback.fnCb(g_timeBaseAlarmCallback.pUserCtx);
+    }
+
+    rtosIsrExit();
 }
 
 //=====================================================================================================================
 // Statics
-//=====================================================================================================================
\ No newline at end of file
+//=====================================================================================================================
+
+/**
+ * @brief length of the next enlarger timer segment
+ * 
+ * @param remaining exposure time left in milliseconds
+ * @return uint32_t segment length in milliseconds, at most one full 16-bit period
+ */
+static inline uint32_t nextEnlargerSegment(uint32_t remaining)
+{
+    return (remaining > ENLARGER_MAX_SEGMENT_MS) ? ENLARGER_MAX_SEGMENT_MS : remaining;
+}
+
+/**
+ * @brief the preloaded segment is counting now: account for it and preload the one after, or let the counter stop at
+ *        the end of it if it's the final one. call on the update event of a chained segment
+ * 
+ */
+static void advanceEnlargerSegment(void)
+{
+    g_enlargerSegmentMs    = nextEnlargerSegment(g_enlargerRemainingMs);
+    g_enlargerRemainingMs -= g_enlargerSegmentMs;
+
+    if (g_enlargerRemainingMs != 0)
+    {
+        LL_TIM_SetAutoReload(TIM15, nextEnlargerSegment(g_enlargerRemainingMs) - 1);
+    }
+    else
+    {
+        LL_TIM_SetOnePulseMode(TIM15, LL_TIM_ONEPULSEMODE_SINGLE);
+    }
+}
+/**
+ * @brief program a timer's prescaler for a tick rate at the current SYSCLK and remember it for level changes
+ * 
+ * @param pTimer hardware timer
+ * @param tickHz counter rate in Hz
+ */
+static void setTimerTick(TIM_TypeDef *pTimer, uint32_t tickHz)
+{
+    LL_TIM_SetPrescaler(pTimer, __LL_TIM_CALC_PSC(SystemCoreClock, tickHz));
+
+    for (uint8_t i = 0; i < g_numTimerTicks; i++)
+    {
+        if (g_timerTicks[i].pTimer == pTimer)
+        {
+            g_timerTicks[i].tickHz = tickHz;
+            return;
+        }
+    }
+
+    if (g_numTimerTicks < MAX_CLOCKED_TIMERS)
+    {
+        g_timerTicks[g_numTimerTicks++] = (STimerTick_t){ pTimer, tickHz };
+    }
+}
+
+/**
+ * @brief program a timer's prescaler for its remembered tick rate at the current SYSCLK
+ * 
+ * @param pTimer hardware timer, set up with setTimerTick() before
+ */
+static void restoreTimerTick(TIM_TypeDef *pTimer)
+{
+    for (uint8_t i = 0; i < g_numTimerTicks; i++)
+    {
+        if (g_timerTicks[i].pTimer == pTimer)
+        {
+            LL_TIM_SetPrescaler(pTimer, __LL_TIM_CALC_PSC(SystemCoreClock, g_timerTicks[i].tickHz));
+            return;
+        }
+    }
+}
+
+/**
+ * @brief load the PWM duty table and period for a level at the current SYSCLK. TIM1 and the DMA channel are stopped
+ *
+ * @param level fraction of full power, Q16, below LAMP_PWM_FULL
+ * @return uint32_t level the table resolves to, Q16
+ */
+static uint32_t loadLampPwm(uint32_t level)
+{
+    uint32_t period = SystemCoreClock / LAMP_PWM_HZ;
+    uint32_t steps  = (uint32_t)((((uint64_t)level * period * LAMP_PWM_DITHER) + (LAMP_PWM_FULL / 2)) / LAMP_PWM_FULL);
+    uint32_t error  = 0;
+
+    steps = (steps == 0) ? 1 : steps;
+
+    // spread the fraction of a count over the table, error diffusion keeps neighbouring values within one count
+    for (uint8_t i = 0; i < LAMP_PWM_DITHER; i++)
+    {
+        error += steps % LAMP_PWM_DITHER;
+        g_lampPwmDuty[i] = (uint16_t)(steps / LAMP_PWM_DITHER);
+
+        if (error >= LAMP_PWM_DITHER)
+        {
+            error -= LAMP_PWM_DITHER;
+            g_lampPwmDuty[i]++;
+        }
+    }
+
+    LL_TIM_SetPrescaler(TIM1, 0);
+    LL_TIM_SetAutoReload(TIM1, period - 1);
+    LL_TIM_OC_SetCompareCH1(TIM1, g_lampPwmDuty[0]);
+    LL_TIM_GenerateEvent_UPDATE(TIM1); // latch PSC, ARR and CCR1, before the DMA request is enabled
+
+    return (uint32_t)(((uint64_t)steps * LAMP_PWM_FULL) / (period * LAMP_PWM_DITHER));
+}
+
+/**
+ * @brief latch a new TIM15 prescaler into a loaded or counting exposure without losing its place. runs with interrupts
+ *        masked, from the clock notifier
+ *
+ * @note the update event that latches the prescaler also resets the counter, reloads ARR from its preload (which
+ *       holds the next segment while chaining) and would stop a one-pulse counter. so the current segment goes into ARR
+ *       first, the counter runs repetitive across the event and the count is put back afterwards. the prescaler phase
+ *       is lost, less than one tick, so a counting lamp phase is kept clear of level changes (clockHoldLevel())
+ */
+static void rescaleEnlargerTimer(void)
+{
+    if (!g_enlargerArmed && !LL_TIM_IsEnabledCounter(TIM15)) return; // latched by the next armEnlargerTimer()
+
+    uint32_t count   = LL_TIM_GetCounter(TIM15);
+    uint32_t next    = LL_TIM_GetAutoReload(TIM15);
+    uint32_t mode    = LL_TIM_GetOnePulseMode(TIM15);
+    bool     preload = LL_TIM_IsEnabledARRPreload(TIM15);
+
+    if (preload) LL_TIM_SetAutoReload(TIM15, g_enlargerSegmentMs - 1);
+    LL_TIM_SetOnePulseMode(TIM15, LL_TIM_ONEPULSEMODE_REPETITIVE);
+    LL_TIM_GenerateEvent_UPDATE(TIM15); // update source is the counter only, no IRQ
+    LL_TIM_SetCounter(TIM15, count);
+    if (preload) LL_TIM_SetAutoReload(TIM15, next);
+    LL_TIM_SetOnePulseMode(TIM15, mode);
+}
+
+/**
+ * @brief SYSCLK changed: recompute every prescaler. runs with interrupts masked
+ * 
+ * @note the update event resets the counter. the 32-bit TIM17 time base carries over the reset, TIM3 timestamps restart
+ *       (the zero-cross tracker and the mains-loss watchdog are reset by the exposure notifier)
+ */
+static void timerClockNotifier(uint32_t coreHz, void *pCtx)
+{
+    for (uint8_t i = 0; i < g_numTimerTicks; i++)
+    {
+        TIM_TypeDef *pTimer = g_timerTicks[i].pTimer;
+
+        if ((pTimer == TIM1) && g_lampPwmRunning)
+        {
+            // core clock: same level, period in counts for the new rate. the prescaler is restored by stopLampPwm()
+            LL_DMA_DisableChannel(DMA1, LAMP_PWM_DMA_CHANNEL);
+            (void)loadLampPwm(g_lampPwmLevel);
+            LL_DMA_SetDataLength(DMA1, LAMP_PWM_DMA_CHANNEL, LAMP_PWM_DITHER);
+            LL_DMA_EnableChannel(DMA1, LAMP_PWM_DMA_CHANNEL);
+            continue;
+        }
+
+        LL_TIM_SetPrescaler(pTimer, __LL_TIM_CALC_PSC(coreHz, g_timerTicks[i].tickHz));
+
+        if (pTimer == TIM15)
+        {
+            rescaleEnlargerTimer();
+            continue;
+        }
+
+        if (LL_TIM_IsEnabledCounter(pTimer) && (LL_TIM_GetOnePulseMode(pTimer) == LL_TIM_ONEPULSEMODE_REPETITIVE))
+        {
+            uint32_t updateSource = LL_TIM_GetUpdateSource(pTimer);
+
+            if (pTimer == TIM17) (void)rtosTimerGetValue(); // account for the count up to the reset
+
+            LL_TIM_SetUpdateSource(pTimer, LL_TIM_UPDATESOURCE_COUNTER); // latch without firing the update IRQ
+            LL_TIM_GenerateEvent_UPDATE(pTimer);
+            LL_TIM_SetUpdateSource(pTimer, updateSource);
+
+            if (pTimer == TIM17)
+            {
+                // the count restarts at 0: move an armed alarm along with it
+                LL_TIM_OC_SetCompareCH1(TIM17, (uint16_t)(LL_TIM_OC_GetCompareCH1(TIM17) - g_rtosLastCount));
+                g_rtosLastCount = 0;
+                g_isrEntryCount = 0;
+            }
+        }
+    }
+}
@@ -6,6 +6,9 @@
  * TODO: verify ISR execution time with dual ifs
  * TODO: add DMA when the above TODO is done
  * TODO: timeouts on transmission (when TXNE stays high e.g. data is not flushed out)
+ *
+ * USART1 is the console. USART2 is the multi-unit sync link: single-wire half-duplex on its open-drain TX pin, shared
+ * by every unit on the wire. a half-duplex receiver also hears its own transmissions, the link user gets those too
  */
 
 //=====================================================================================================================
@@ -13,6 +16,7 @@
 //=====================================================================================================================
 
 #include "uart.h"
+#include "timer.h"
 
 #include <stm32g0xx_ll_bus.h>
 #include <stm32g0xx_ll_gpio.h>
@@ -24,6 +28,8 @@
 // Defines
 //=====================================================================================================================
 
+#define CONSOLE_DMA_CHANNEL LL_DMA_CHANNEL_6 // console bulk receive, polled: no DMA interrupt
+
 //=====================================================================================================================
 // Types
 //=====================================================================================================================
@@ -35,11 +41,17 @@
 static QueueHandle_t const *pConsoleRXQueue = NULL;
 
 static USART_TypeDef *g_pConsoleUsart = NULL;
+static size_t         g_consoleRingLen = 0;
+
+static USART_TypeDef   *g_pSyncLinkUsart = NULL;
+static fnLinkRxCallback g_fnSyncLinkRx   = NULL;
+static void            *g_pSyncLinkCtx   = NULL;
 
 //=====================================================================================================================
 // Function prototypes
 //=====================================================================================================================
 
+static void configureUsart(USART_TypeDef *, uint32_t, bool);
 
 //=====================================================================================================================
 // External functions
@@ -51,50 +63,57 @@ static USART_TypeDef *g_pConsoleUsart = NULL;
  * @param pPeripheral USART peripheral (USART1/USART2/USART3)
  * @param baudrate baudrate to use (modbus recommended 9600, console 115200)
  * 
+ * @note the kernel clock is HSI16, so the baudrate holds across SYSCLK level changes
+
  * @note USARTs have their RX channel disabled on startup to prevent firing RX interrupts
  */
 void initUsart(USART_TypeDef *pPeripheral, uint32_t baudrate)
 {
-    if (pPeripheral == USART1)
-    {
-        NVIC_EnableIRQ(USART1_IRQn);
-        LL_APB2_GRP1_EnableClock(LL_APB2_GRP1_PERIPH_USART1);
-        LL_RCC_SetUSARTClockSource(LL_RCC_USART1_CLKSOURCE_SYSCLK);
-    }
-    else if (pPeripheral == USART2)
-    {
-        NVIC_EnableIRQ(USART2_IRQn);
-        LL_APB1_GRP1_EnableClock(LL_APB1_GRP1_PERIPH_USART2);
-        LL_RCC_SetUSARTClockSource(LL_RCC_USART2_CLKSOURCE_SYSCLK);
-    }
-
-    LL_USART_SetTransferDirection(pPeripheral, LL_USART_DIRECTION_TX_RX);
-    LL_USART_ConfigCharacter(pPeripheral, LL_USART_DATAWIDTH_8B, LL_USART_PARITY_NONE, LL_USART_STOPBITS_1); // 8 bits, no parity, 1 start & stop bit
-    LL_USART_SetBaudRate(pPeripheral, SystemCoreClock, LL_USART_PRESCALER_DIV1, LL_USART_OVERSAMPLING_16, baudrate);
-
-    LL_USART_Enable(pPeripheral);
+    g_pConsoleUsart = pPeripheral;
 
-    // wait for usart3 to come up, tx + rx enable ack flags should be set
-    while ((!(LL_USART_IsActiveFlag_TEACK(pPeripheral))) || (!(LL_USART_IsActiveFlag_REACK(pPeripheral))));
-
-    LL_USART_DisableDirectionRx(pPeripheral);
+    configureUsart(pPeripheral, baudrate, false);
+}
 
-    LL_USART_ClearFlag_ORE(pPeripheral);
-    LL_USART_EnableIT_RXNE_RXFNE(pPeripheral);
-    LL_USART_EnableIT_ERROR(pPeripheral);
+/**
+ * @brief initialize the multi-unit sync link, half-duplex on the TX pin. the line-idle interrupt marks frame ends
+ *
+ * @param pPeripheral USART peripheral with an HSI kernel clock (USART1/USART2), so bit timing holds across SYSCLK
+ *        level changes
+ * @param baudrate baudrate to use, the same on every unit
+ *
+ * @note RX is disabled until toggleSyncLinkRX()
+ */
+void initSyncLinkUsart(USART_TypeDef *pPeripheral, uint32_t baudrate)
+{
+    g_pSyncLinkUsart = pPeripheral;
 
-    LL_USART_SetTXFIFOThreshold(pPeripheral, LL_USART_FIFOTHRESHOLD_1_8);
-    LL_USART_SetRXFIFOThreshold(pPeripheral, LL_USART_FIFOTHRESHOLD_1_8);
+    configureUsart(pPeripheral, baudrate, true);
 
-    LL_USART_DisableFIFO(pPeripheral);
+    LL_USART_ClearFlag_IDLE(pPeripheral);
+    LL_USART_EnableIT_IDLE(pPeripheral);
 }
 
+/**
+ * @brief enable or disable the console receiver. RX is off after initUsart() until a consumer is ready
+ *
+ * @param enable true to start receiving
+ */
 void toggleUsartRX(bool enable)
 {
     enable ? LL_USART_EnableDirectionRx(g_pConsoleUsart) : LL_USART_DisableDirectionRx(g_pConsoleUsart);
     while (g_pConsoleUsart->ISR & USART_ISR_RXNE_RXFNE) { (void)g_pConsoleUsart->RDR; } // flush FIFO
 }
 
+/**
+ * @brief set the queue received console characters are posted to from the USART ISR
+ *
+ * @param pQueue queue handle, must be created before RX is enabled
+ */
+void setConsoleInputQueue(QueueHandle_t *pQueue)
+{
+    pConsoleRXQueue = pQueue;
+}
+
 /**
  * @brief blocking sendchar function for console; waits for TXE flag to be set
  * 
@@ -106,6 +125,132 @@ void consolePutchar(char c)
     LL_USART_TransmitData8(g_pConsoleUsart, c);
 }
 
+/**
+ * @brief change the console baudrate once the last byte has gone out. the new rate must divide HSI16 evenly to be
+ *        exact, e.g. 1000000 or 500000
+ *
+ * @param baudrate baudrate to use
+ */
+void consoleSetBaudRate(uint32_t baudrate)
+{
+    while (!LL_USART_IsActiveFlag_TC(g_pConsoleUsart)) { /* infinite wait */ }
+
+    LL_USART_Disable(g_pConsoleUsart); // BRR is only writable while the USART is disabled
+    LL_USART_SetBaudRate(g_pConsoleUsart, HSI_VALUE, LL_USART_PRESCALER_DIV1, LL_USART_OVERSAMPLING_16, baudrate);
+    LL_USART_Enable(g_pConsoleUsart);
+
+    while (!LL_USART_IsActiveFlag_TEACK(g_pConsoleUsart)) { /* infinite wait */ }
+}
+
+/**
+ * @brief receive console bytes into a circular ring with DMA instead of the input queue. the ring keeps filling while
+ *        the CPU stalls on flash operations; the consumer polls consoleDMARxPos(). a restart begins at the ring start
+ *
+ * @param pRing ring buffer
+ * @param len ring length in bytes
+ */
+void consoleStartDMARx(uint8_t *pRing, size_t len)
+{
+    LL_USART_DisableIT_RXNE_RXFNE(g_pConsoleUsart);
+    LL_USART_DisableIT_ERROR(g_pConsoleUsart); // errors show up as corrupted data, the ISR mustn't steal a byte
+    LL_USART_DisableDMAReq_RX(g_pConsoleUsart);
+    LL_USART_DisableDirectionRx(g_pConsoleUsart);
+
+    LL_AHB1_GRP1_EnableClock(LL_AHB1_GRP1_PERIPH_DMA1);
+    LL_DMA_DisableChannel(DMA1, CONSOLE_DMA_CHANNEL);
+
+    LL_DMA_SetPeriphRequest(DMA1, CONSOLE_DMA_CHANNEL, LL_DMAMUX_REQ_USART1_RX);
+    LL_DMA_SetDataTransferDirection(DMA1, CONSOLE_DMA_CHANNEL, LL_DMA_DIRECTION_PERIPH_TO_MEMORY);
+    LL_DMA_SetChannelPriorityLevel(DMA1, CONSOLE_DMA_CHANNEL, LL_DMA_PRIORITY_HIGH);
+    LL_DMA_SetMode(DMA1, CONSOLE_DMA_CHANNEL, LL_DMA_MODE_CIRCULAR);
+    LL_DMA_SetPeriphIncMode(DMA1, CONSOLE_DMA_CHANNEL, LL_DMA_PERIPH_NOINCREMENT);
+    LL_DMA_SetMemoryIncMode(DMA1, CONSOLE_DMA_CHANNEL, LL_DMA_MEMORY_INCREMENT);
+    LL_DMA_SetPeriphSize(DMA1, CONSOLE_DMA_CHANNEL, LL_DMA_PDATAALIGN_BYTE);
+    LL_DMA_SetMemorySize(DMA1, CONSOLE_DMA_CHANNEL, LL_DMA_MDATAALIGN_BYTE);
+    LL_DMA_ConfigAddresses(DMA1, CONSOLE_DMA_CHANNEL,
+        LL_USART_DMA_GetRegAddr(g_pConsoleUsart, LL_USART_DMA_REG_DATA_RECEIVE),
+        (uint32_t)pRing,
+        LL_DMA_DIRECTION_PERIPH_TO_MEMORY
+    );
+    LL_DMA_SetDataLength(DMA1, CONSOLE_DMA_CHANNEL, len);
+    LL_DMA_EnableChannel(DMA1, CONSOLE_DMA_CHANNEL);
+
+    g_consoleRingLen = len;
+
+    LL_USART_ClearFlag_ORE(g_pConsoleUsart);
+    LL_USART_ClearFlag_FE(g_pConsoleUsart);
+    LL_USART_ClearFlag_NE(g_pConsoleUsart);
+    LL_USART_EnableDMAReq_RX(g_pConsoleUsart);
+    toggleUsartRX(true);
+}
+
+/**
+ * @brief ring position of the next byte the DMA will write, see consoleStartDMARx()
+ *
+ * @return size_t offset into the ring
+ */
+size_t consoleDMARxPos(void)
+{
+    return (g_consoleRingLen - LL_DMA_GetDataLength(DMA1, CONSOLE_DMA_CHANNEL)) % g_consoleRingLen;
+}
+
+/**
+ * @brief stop the DMA receive, received bytes go to the input queue again
+ *
+ */
+void consoleStopDMARx(void)
+{
+    LL_USART_DisableDMAReq_RX(g_pConsoleUsart);
+    LL_DMA_DisableChannel(DMA1, CONSOLE_DMA_CHANNEL);
+
+    toggleUsartRX(true);
+    LL_USART_ClearFlag_ORE(g_pConsoleUsart);
+    LL_USART_ClearFlag_FE(g_pConsoleUsart);
+    LL_USART_ClearFlag_NE(g_pConsoleUsart);
+    LL_USART_EnableIT_RXNE_RXFNE(g_pConsoleUsart);
+    LL_USART_EnableIT_ERROR(g_pConsoleUsart);
+}
+
+/**
+ * @brief enable or disable the sync link receiver
+ *
+ * @param enable true to start receiving
+ */
+void toggleSyncLinkRX(bool enable)
+{
+    enable ? LL_USART_EnableDirectionRx(g_pSyncLinkUsart) : LL_USART_DisableDirectionRx(g_pSyncLinkUsart);
+    while (g_pSyncLinkUsart->ISR & USART_ISR_RXNE_RXFNE) { (void)g_pSyncLinkUsart->RDR; } // flush FIFO
+}
+
+/**
+ * @brief set the callback that gets the received sync link bytes, with the time each was received
+ *
+ * @param fnCb callback, runs in ISR context. set before RX is enabled
+ * @param pUserCtx passed to the callback
+ */
+void setSyncLinkRxCallback(fnLinkRxCallback fnCb, void *pUserCtx)
+{
+    g_fnSyncLinkRx = fnCb;
+    g_pSyncLinkCtx = pUserCtx;
+}
+
+/**
+ * @brief blocking send on the sync link, returns once the last stop bit is on the wire
+ *
+ * @param pData bytes to send
+ * @param len number of bytes
+ */
+void syncLinkSend(const uint8_t *pData, size_t len)
+{
+    while (len--)
+    {
+        while (!LL_USART_IsActiveFlag_TXE_TXFNF(g_pSyncLinkUsart)) { /* infinite wait */ }
+        LL_USART_TransmitData8(g_pSyncLinkUsart, *pData++);
+    }
+
+    while (!LL_USART_IsActiveFlag_TC(g_pSyncLinkUsart)) { /* infinite wait */ }
+}
+
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wmissing-prototypes" // ignored: no proto, but spawned in startup file
@@ -116,19 +261,102 @@ void consolePutchar(char c)
  */
 __attribute__((interrupt)) void USART1_IRQHandler(void)
 {
+    rtosIsrEnter();
+
     uint8_t val = 0;
     LL_USART_ClearFlag_FE(USART1);
     LL_USART_ClearFlag_ORE(USART1);
     LL_USART_ClearFlag_NE(USART1);
     if (LL_USART_IsActiveFlag_RXNE_RXFNE(USART1))
     {
+        BaseType_t woken = pdFALSE;
+
         val = LL_USART_ReceiveData8(USART1); // inlined
-        xQueueSendToBackFromISR(*pConsoleRXQueue, &val, NULL);
+        if (pConsoleRXQueue != NULL) xQueueSendToBackFromISR(*pConsoleRXQueue, &val, &woken);
+        portYIELD_FROM_ISR(woken);
     }
+
+    rtosIsrExit();
+}
+
+/**
+ * @brief ST-named irq handler for usart2, the sync link. hands every byte to the link callback with the time it was
+ *        received; a receive error or the line going idle is passed on as LINK_RX_IDLE
+ */
+__attribute__((interrupt)) void USART2_IRQHandler(void)
+{
+    rtosIsrEnter();
+
+    uint32_t nowUs = rtosTimerGetValue(); // first thing, so the timestamp doesn't depend on the path below
+    uint32_t isr   = USART2->ISR;
+
+    if (isr & USART_ISR_RXNE_RXFNE)
+    {
+        int16_t val = LL_USART_ReceiveData8(USART2);
+
+        if (g_fnSyncLinkRx) g_fnSyncLinkRx(val, nowUs, g_pSyncLinkCtx);
+    }
+
+    // after the byte: a late handler can see the last byte of a frame and the idle line together
+    if (isr & (USART_ISR_FE | USART_ISR_ORE | USART_ISR_NE | USART_ISR_IDLE))
+    {
+        LL_USART_ClearFlag_FE(USART2);
+        LL_USART_ClearFlag_ORE(USART2);
+        LL_USART_ClearFlag_NE(USART2);
+        LL_USART_ClearFlag_IDLE(USART2);
+        if (g_fnSyncLinkRx) g_fnSyncLinkRx(LINK_RX_IDLE, nowUs, g_pSyncLinkCtx);
+    }
+
+    rtosIsrExit();
 }
 
 #pragma GCC diagnostic pop
 
 //=====================================================================================================================
 // Statics
-//=====================================================================================================================
\ No newline at end of file
+//=====================================================================================================================
+
+/**
+ * @brief common USART setup, see initUsart()
+ *
+ * @param pPeripheral USART peripheral (USART1/USART2)
+ * @param baudrate baudrate to use
+ * @param halfDuplex single-wire mode on the TX pin
+ */
+static void configureUsart(USART_TypeDef *pPeripheral, uint32_t baudrate, bool halfDuplex)
+{
+    if (pPeripheral == USART1)
+    {
+        NVIC_EnableIRQ(USART1_IRQn);
+        LL_APB2_GRP1_EnableClock(LL_APB2_GRP1_PERIPH_USART1);
+        LL_RCC_SetUSARTClockSource(LL_RCC_USART1_CLKSOURCE_HSI);
+    }
+    else if (pPeripheral == USART2)
+    {
+        NVIC_EnableIRQ(USART2_IRQn);
+        LL_APB1_GRP1_EnableClock(LL_APB1_GRP1_PERIPH_USART2);
+        LL_RCC_SetUSARTClockSource(LL_RCC_USART2_CLKSOURCE_HSI);
+    }
+
+    LL_USART_SetTransferDirection(pPeripheral, LL_USART_DIRECTION_TX_RX);
+    LL_USART_ConfigCharacter(pPeripheral, LL_USART_DATAWIDTH_8B, LL_USART_PARITY_NONE, LL_USART_STOPBITS_1); // 8 bits, no parity, 1 start & stop bit
+    LL_USART_SetBaudRate(pPeripheral, HSI_VALUE, LL_USART_PRESCALER_DIV1, LL_USART_OVERSAMPLING_16, baudrate);
+
+    if (halfDuplex) LL_USART_EnableHalfDuplex(pPeripheral); // HDSEL is only writable while the USART is disabled
+
+    LL_USART_Enable(pPeripheral);
+
+    // wait for usart3 to come up, tx + rx enable ack flags should be set
+    while ((!(LL_USART_IsActiveFlag_TEACK(pPeripheral))) || (!(LL_USART_IsActiveFlag_REACK(pPeripheral))));
+
+    LL_USART_DisableDirectionRx(pPeripheral);
+
+    LL_USART_ClearFlag_ORE(pPeripheral);
+    LL_USART_EnableIT_RXNE_RXFNE(pPeripheral);
+    LL_USART_EnableIT_ERROR(pPeripheral);
+
+    LL_USART_SetTXFIFOThreshold(pPeripheral, LL_USART_FIFOTHRESHOLD_1_8);
+    LL_USART_SetRXFIFOThreshold(pPeripheral, LL_USART_FIFOTHRESHOLD_1_8);
+
+    LL_USART_DisableFIFO(pPeripheral);
+}